@@ -23,8 +23,390 @@
 #include "ppport.h"
 
 #include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
 #include <store.h>
 
+#define F_STORE(a) hv_store(fhash, a, strlen(a), field, 0)
+
+/* Build a hash of a flow's fields */
+static SV *
+flow_to_hash(struct store_flow_complete *flow)
+{
+	char addr_buf[128];
+	HV *fhash;
+	SV *field, *ret;
+	u_int32_t fields;
+	u_int64_t tmp;
+
+	fields = ntohl(flow->hdr.fields);
+
+	fhash = newHV();
+	ret = newRV_noinc((SV*)fhash);
+
+	field = newSVuv(fields);
+	F_STORE("fields");
+	field = newSVuv(flow->hdr.version);
+	F_STORE("flow_ver");
+
+	if (fields & STORE_FIELD_TAG) {
+		field = newSVuv(ntohl(flow->tag.tag));
+		F_STORE("tag");
+	}
+	if (fields & STORE_FIELD_RECV_TIME) {
+		field = newSVuv(ntohl(flow->recv_time.recv_sec));
+		F_STORE("recv_sec");
+		field = newSVuv(ntohl(flow->recv_time.recv_usec));
+		F_STORE("recv_usec");
+	}
+	if (fields & STORE_FIELD_PROTO_FLAGS_TOS) {
+		field = newSViv(flow->pft.tcp_flags);
+		F_STORE("tcp_flags");
+		field = newSViv(flow->pft.protocol);
+		F_STORE("protocol");
+		field = newSViv(flow->pft.tos);
+		F_STORE("tos");
+	}
+	if (fields & (STORE_FIELD_AGENT_ADDR4|STORE_FIELD_AGENT_ADDR6)) {
+		addr_ntop(&flow->agent_addr, addr_buf, sizeof(addr_buf));
+		field = newSVpv(addr_buf, 0);
+		F_STORE("agent_addr");
+		field = newSViv(flow->agent_addr.af);
+		F_STORE("agent_addr_af");
+	}
+	if (fields & (STORE_FIELD_SRC_ADDR4|STORE_FIELD_SRC_ADDR6)) {
+		addr_ntop(&flow->src_addr, addr_buf, sizeof(addr_buf));
+		field = newSVpv(addr_buf, 0);
+		F_STORE("src_addr");
+		field = newSViv(flow->src_addr.af);
+		F_STORE("src_addr_af");
+	}
+	if (fields & (STORE_FIELD_DST_ADDR4|STORE_FIELD_DST_ADDR6)) {
+		addr_ntop(&flow->dst_addr, addr_buf, sizeof(addr_buf));
+		field = newSVpv(addr_buf, 0);
+		F_STORE("dst_addr");
+		field = newSViv(flow->dst_addr.af);
+		F_STORE("dst_addr_af");
+	}
+	if (fields & (STORE_FIELD_GATEWAY_ADDR4|STORE_FIELD_GATEWAY_ADDR6)) {
+		addr_ntop(&flow->gateway_addr, addr_buf,
+		    sizeof(addr_buf));
+		field = newSVpv(addr_buf, 0);
+		F_STORE("gateway_addr");
+		field = newSViv(flow->gateway_addr.af);
+		F_STORE("gateway_addr_af");
+	}
+	if (fields & STORE_FIELD_SRCDST_PORT) {
+		field = newSViv(ntohs(flow->ports.src_port));
+		F_STORE("src_port");
+		field = newSViv(ntohs(flow->ports.dst_port));
+		F_STORE("dst_port");
+	}
+	if (fields & STORE_FIELD_PACKETS) {
+		tmp = store_ntohll(flow->packets.flow_packets);
+		if (tmp < (1ULL << 32))
+			field = newSVuv(tmp);
+		else
+			field = newSVnv(tmp * 1.0);
+		F_STORE("flow_packets");
+	}
+	if (fields & STORE_FIELD_OCTETS) {
+		tmp = store_ntohll(flow->octets.flow_octets);
+		if (tmp < (1ULL << 32))
+			field = newSVuv(tmp);
+		else
+			field = newSVnv(tmp * 1.0);
+		F_STORE("flow_octets");
+	}
+	if (fields & STORE_FIELD_IF_INDICES) {
+		field = newSVuv(ntohl(flow->ifndx.if_index_in));
+		F_STORE("if_index_in");
+		field = newSVuv(ntohl(flow->ifndx.if_index_out));
+		F_STORE("if_index_out");
+	}
+	if (fields & STORE_FIELD_AGENT_INFO) {
+		field = newSVuv(
+		    ntohl(flow->ainfo.sys_uptime_ms));
+		F_STORE("sys_uptime_ms");
+		field = newSVuv(ntohl(flow->ainfo.time_sec));
+		F_STORE("time_sec");
+		field = newSVuv(ntohl(flow->ainfo.time_nanosec));
+		F_STORE("time_nanosec");
+		field = newSViv(ntohs(flow->ainfo.netflow_version));
+		F_STORE("netflow_version");
+	}
+	if (fields & STORE_FIELD_FLOW_TIMES) {
+		field = newSVuv(ntohl(flow->ftimes.flow_start));
+		F_STORE("flow_start");
+		field = newSVuv(ntohl(flow->ftimes.flow_finish));
+		F_STORE("flow_finish");
+	}
+	if (fields & STORE_FIELD_AS_INFO) {
+		field = newSVuv(ntohl(flow->asinf.src_as));
+		F_STORE("src_as");
+		field = newSVuv(ntohl(flow->asinf.dst_as));
+		F_STORE("dst_as");
+		field = newSViv(flow->asinf.src_mask);
+		F_STORE("src_mask");
+		field = newSViv(flow->asinf.dst_mask);
+		F_STORE("dst_mask");
+	}
+	if (fields & STORE_FIELD_FLOW_ENGINE_INFO) {
+		field = newSViv(ntohs(flow->finf.engine_type));
+		F_STORE("engine_type");
+		field = newSViv(ntohs(flow->finf.engine_id));
+		F_STORE("engine_id");
+		field = newSVuv(htonl(flow->finf.flow_sequence));
+		F_STORE("flow_sequence");
+		field = newSVuv(htonl(flow->finf.source_id));
+		F_STORE("source_id");
+	}
+	if (fields & STORE_FIELD_CRC32) {
+		field = newSVuv(ntohl(flow->crc32.crc32));
+		F_STORE("crc");
+	}
+
+	return (ret);
+}
+
+/* Fields available to iter_read_columns() and iter_sum() */
+#define COL_U8		0
+#define COL_U16		1
+#define COL_U32		2
+#define COL_U64		3
+#define COL_AF		4	/* of an xaddr */
+#define COL_ADDR	5	/* 16 bytes, IPv4 in the first four */
+
+#define COL(name, kind, pack, field, member) { name, kind, pack, \
+	STORE_FIELD_##field, offsetof(struct store_flow_complete, member) }
+static const struct flow_column {
+	const char *name;	/* as used by flow_to_hash() */
+	int kind;
+	const char *pack;	/* template for unpack() */
+	u_int32_t fields;	/* zero unless the flow has one of these */
+	size_t offset;
+} flow_columns[] = {
+	{ "fields", COL_U32, "L", 0xffffffff, 0 },
+	COL("tag",		COL_U32, "L",	 TAG,		tag.tag),
+	COL("recv_sec",		COL_U32, "L",	 RECV_TIME,	recv_time.recv_sec),
+	COL("recv_usec",	COL_U32, "L",	 RECV_TIME,	recv_time.recv_usec),
+	COL("tcp_flags",	COL_U8,	 "C",	 PROTO_FLAGS_TOS, pft.tcp_flags),
+	COL("protocol",		COL_U8,	 "C",	 PROTO_FLAGS_TOS, pft.protocol),
+	COL("tos",		COL_U8,	 "C",	 PROTO_FLAGS_TOS, pft.tos),
+	/* Each address must be followed by its family */
+	COL("agent_addr",	COL_ADDR, "a16", AGENT_ADDR,	agent_addr),
+	COL("agent_addr_af",	COL_AF,	 "C",	 AGENT_ADDR,	agent_addr),
+	COL("src_addr",		COL_ADDR, "a16", SRC_ADDR,	src_addr),
+	COL("src_addr_af",	COL_AF,	 "C",	 SRC_ADDR,	src_addr),
+	COL("dst_addr",		COL_ADDR, "a16", DST_ADDR,	dst_addr),
+	COL("dst_addr_af",	COL_AF,	 "C",	 DST_ADDR,	dst_addr),
+	COL("gateway_addr",	COL_ADDR, "a16", GATEWAY_ADDR,	gateway_addr),
+	COL("gateway_addr_af",	COL_AF,	 "C",	 GATEWAY_ADDR,	gateway_addr),
+	COL("src_port",		COL_U16, "S",	 SRCDST_PORT,	ports.src_port),
+	COL("dst_port",		COL_U16, "S",	 SRCDST_PORT,	ports.dst_port),
+	COL("flow_packets",	COL_U64, "Q",	 PACKETS,	packets.flow_packets),
+	COL("flow_octets",	COL_U64, "Q",	 OCTETS,	octets.flow_octets),
+	COL("if_index_in",	COL_U32, "L",	 IF_INDICES,	ifndx.if_index_in),
+	COL("if_index_out",	COL_U32, "L",	 IF_INDICES,	ifndx.if_index_out),
+	COL("sys_uptime_ms",	COL_U32, "L",	 AGENT_INFO,	ainfo.sys_uptime_ms),
+	COL("time_sec",		COL_U32, "L",	 AGENT_INFO,	ainfo.time_sec),
+	COL("time_nanosec",	COL_U32, "L",	 AGENT_INFO,	ainfo.time_nanosec),
+	COL("netflow_version",	COL_U16, "S",	 AGENT_INFO,	ainfo.netflow_version),
+	COL("flow_start",	COL_U32, "L",	 FLOW_TIMES,	ftimes.flow_start),
+	COL("flow_finish",	COL_U32, "L",	 FLOW_TIMES,	ftimes.flow_finish),
+	COL("src_as",		COL_U32, "L",	 AS_INFO,	asinf.src_as),
+	COL("dst_as",		COL_U32, "L",	 AS_INFO,	asinf.dst_as),
+	COL("src_mask",		COL_U8,	 "C",	 AS_INFO,	asinf.src_mask),
+	COL("dst_mask",		COL_U8,	 "C",	 AS_INFO,	asinf.dst_mask),
+	COL("engine_type",	COL_U16, "S",	 FLOW_ENGINE_INFO, finf.engine_type),
+	COL("engine_id",	COL_U16, "S",	 FLOW_ENGINE_INFO, finf.engine_id),
+	COL("flow_sequence",	COL_U32, "L",	 FLOW_ENGINE_INFO, finf.flow_sequence),
+	COL("source_id",	COL_U32, "L",	 FLOW_ENGINE_INFO, finf.source_id),
+	{ NULL }
+};
+#undef COL
+#define MAX_COLUMNS	64
+
+static const struct flow_column *
+column_lookup(const char *name)
+{
+	const struct flow_column *c;
+
+	for (c = flow_columns; c->name != NULL; c++) {
+		if (strcmp(c->name, name) == 0)
+			return (c);
+	}
+	croak("Unknown flow field \"%s\"", name);
+	return (NULL);
+}
+
+/* Look up the fields named in an array reference */
+static int
+column_list(SV *ref, const struct flow_column **cols)
+{
+	AV *av;
+	SV **name;
+	int i, n;
+
+	if (!SvROK(ref) || SvTYPE(SvRV(ref)) != SVt_PVAV)
+		croak("Field list must be an array reference");
+	av = (AV *)SvRV(ref);
+	if ((n = av_len(av) + 1) > MAX_COLUMNS)
+		croak("Too many fields");
+	for (i = 0; i < n; i++) {
+		if ((name = av_fetch(av, i, 0)) == NULL)
+			croak("Undefined field name");
+		cols[i] = column_lookup(SvPV_nolen(*name));
+	}
+	return (n);
+}
+
+static size_t
+column_width(const struct flow_column *c)
+{
+	switch (c->kind) {
+	case COL_U16:
+		return (2);
+	case COL_U32:
+		return (4);
+	case COL_U64:
+		return (8);
+	case COL_ADDR:
+		return (16);
+	default:
+		return (1);
+	}
+}
+
+/*
+ * Store a flow's value for a field at p, in host byte order. Fields the
+ * flow lacks are zero.
+ */
+static void
+column_put(const struct flow_column *c, struct store_flow_complete *flow,
+    u_int8_t *p)
+{
+	const u_int8_t *v = (const u_int8_t *)flow + c->offset;
+	struct xaddr addr;
+	u_int16_t v16;
+	u_int32_t v32;
+	u_int64_t v64;
+
+	if ((ntohl(flow->hdr.fields) & c->fields) == 0) {
+		memset(p, 0, column_width(c));
+		return;
+	}
+	switch (c->kind) {
+	case COL_U8:
+		*p = *v;
+		break;
+	case COL_U16:
+		memcpy(&v16, v, sizeof(v16));
+		v16 = ntohs(v16);
+		memcpy(p, &v16, sizeof(v16));
+		break;
+	case COL_U32:
+		memcpy(&v32, v, sizeof(v32));
+		v32 = ntohl(v32);
+		memcpy(p, &v32, sizeof(v32));
+		break;
+	case COL_U64:
+		memcpy(&v64, v, sizeof(v64));
+		v64 = store_ntohll(v64);
+		memcpy(p, &v64, sizeof(v64));
+		break;
+	default:
+		memcpy(&addr, v, sizeof(addr));
+		if (c->kind == COL_AF)
+			*p = addr.af;
+		else {
+			memset(p, 0, 16);
+			memcpy(p, &addr.v6, addr.af == AF_INET ? 4 : 16);
+		}
+		break;
+	}
+}
+
+/* Fetch a numeric value stored by column_put() */
+static u_int64_t
+column_value(const struct flow_column *c, const u_int8_t *p)
+{
+	u_int16_t v16;
+	u_int32_t v32;
+	u_int64_t v64;
+
+	switch (c->kind) {
+	case COL_U16:
+		memcpy(&v16, p, sizeof(v16));
+		return (v16);
+	case COL_U32:
+		memcpy(&v32, p, sizeof(v32));
+		return (v32);
+	case COL_U64:
+		memcpy(&v64, p, sizeof(v64));
+		return (v64);
+	default:
+		return (*p);
+	}
+}
+
+/* Format a value stored by column_put() as it appears in flow_to_hash() */
+static void
+column_format(const struct flow_column *c, const u_int8_t *p, int af,
+    char *buf, size_t len)
+{
+	struct xaddr addr;
+
+	if (c->kind != COL_ADDR) {
+		snprintf(buf, len, "%llu",
+		    (unsigned long long)column_value(c, p));
+		return;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.af = af;
+	memcpy(&addr.v6, p, af == AF_INET ? 4 : 16);
+	if (af == 0 || addr_ntop(&addr, buf, len) == -1)
+		*buf = '\0';
+}
+
+static SV *
+newSVu64(u_int64_t v)
+{
+	if (v < (1ULL << 32))
+		return (newSVuv(v));
+	return (newSVnv(v * 1.0));
+}
+
+/*
+ * Read the next flow from an iterator, skipping those outside [from, to]
+ * when timed before they are decoded. Returns 0 at the end of the log.
+ */
+static int
+iter_read_flow(struct store_iter *it, struct store_flow_complete *flow,
+    int timed, u_int32_t from, u_int32_t to)
+{
+	char ebuf[512];
+	u_int8_t *rec;
+	u_int32_t recv_sec;
+	int r, len;
+
+	for (;;) {
+		r = store_iter_next_raw(it, &rec, &len, ebuf, sizeof(ebuf));
+		if (r == STORE_ERR_EOF)
+			return (0);
+		if (r != STORE_ERR_OK)
+			croak("%s", ebuf);
+		if (!timed || (store_raw_recv_time(rec, &recv_sec) &&
+		    recv_sec >= from && recv_sec <= to))
+			break;
+	}
+	if (store_flow_deserialise(rec, len, flow, ebuf,
+	    sizeof(ebuf)) != STORE_ERR_OK)
+		croak("%s", ebuf);
+	return (1);
+}
+
 MODULE = Flowd		PACKAGE = Flowd		
 
 int
@@ -51,19 +433,36 @@ int flow_length(...)
 	OUTPUT:
 		RETVAL
 
-#define F_STORE(a) hv_store(fhash, a, strlen(a), field, 0)
+void index_find(...)
+	PROTOTYPE: $$$$
+	INIT:
+		char ipath[1024], ebuf[512], *path;
+		off_t start, end;
+		int ifd, r;
+	PPCODE:
+		if (items != 4)
+			croak("Usage: index_find(path, log_size, from, to)");
+		path = (char *)SvPV_nolen(ST(0));
+		if (snprintf(ipath, sizeof(ipath), "%s%s", path,
+		    STORE_INDEX_SUFFIX) >= (int)sizeof(ipath) ||
+		    (ifd = open(ipath, O_RDONLY)) == -1)
+			XSRETURN_EMPTY;
+		r = store_index_find(ifd, (off_t)SvNV(ST(1)),
+		    (u_int32_t)SvUV(ST(2)), (u_int32_t)SvUV(ST(3)),
+		    &start, &end, ebuf, sizeof(ebuf));
+		close(ifd);
+		if (r != STORE_ERR_OK)
+			croak("%s: %s", ipath, ebuf);
+		XPUSHs(sv_2mortal(newSVnv((NV)start)));
+		XPUSHs(sv_2mortal(newSVnv((NV)end)));
 
 void deserialise(...)
 	PROTOTYPE: $
 	INIT:
 		int r;
 		struct store_flow_complete flow;
-		char ebuf[512], addr_buf[128], *buf;
-		HV *fhash;
+		char ebuf[512], *buf;
 		STRLEN len;
-		SV *field, *ret;
-		u_int32_t fields;
-		u_int64_t tmp;
 	PPCODE:
 		if (items != 1)
 			croak("Usage: desearialise(buffer)");
@@ -72,132 +471,220 @@ void deserialise(...)
 		if (r != STORE_ERR_OK)
 			croak(ebuf);
 
-		fields = ntohl(flow.hdr.fields);
-		
-		fhash = newHV();
-		ret = newRV_noinc((SV*)fhash);
+		XPUSHs(sv_2mortal(flow_to_hash(&flow)));
 
-		field = newSVuv(fields);
-		F_STORE("fields");
-		field = newSVuv(flow.hdr.version);
-		F_STORE("flow_ver");
 
-		if (fields & STORE_FIELD_TAG) {
-			field = newSVuv(ntohl(flow.tag.tag));
-			F_STORE("tag");
-		}
-		if (fields & STORE_FIELD_RECV_TIME) {
-			field = newSVuv(ntohl(flow.recv_time.recv_sec));
-			F_STORE("recv_sec");
-			field = newSVuv(ntohl(flow.recv_time.recv_usec));
-			F_STORE("recv_usec");
-		}
-		if (fields & STORE_FIELD_PROTO_FLAGS_TOS) {
-			field = newSViv(flow.pft.tcp_flags);
-			F_STORE("tcp_flags");
-			field = newSViv(flow.pft.protocol);
-			F_STORE("protocol");
-			field = newSViv(flow.pft.tos);
-			F_STORE("tos");
-		}
-		if (fields & (STORE_FIELD_AGENT_ADDR4|STORE_FIELD_AGENT_ADDR6)) {
-			addr_ntop(&flow.agent_addr, addr_buf, sizeof(addr_buf));
-			field = newSVpv(addr_buf, 0);
-			F_STORE("agent_addr");
-			field = newSViv(flow.agent_addr.af);
-			F_STORE("agent_addr_af");
-		}
-		if (fields & (STORE_FIELD_SRC_ADDR4|STORE_FIELD_SRC_ADDR6)) {
-			addr_ntop(&flow.src_addr, addr_buf, sizeof(addr_buf));
-			field = newSVpv(addr_buf, 0);
-			F_STORE("src_addr");
-			field = newSViv(flow.src_addr.af);
-			F_STORE("src_addr_af");
-		}
-		if (fields & (STORE_FIELD_DST_ADDR4|STORE_FIELD_DST_ADDR6)) {
-			addr_ntop(&flow.dst_addr, addr_buf, sizeof(addr_buf));
-			field = newSVpv(addr_buf, 0);
-			F_STORE("dst_addr");
-			field = newSViv(flow.dst_addr.af);
-			F_STORE("dst_addr_af");
+IV iter_open(...)
+	PROTOTYPE: $
+	INIT:
+		struct store_iter *it;
+		char ebuf[512];
+	CODE:
+		if (items != 1)
+			croak("Usage: iter_open(fd)");
+		Newxz(it, 1, struct store_iter);
+		if (store_iter_open(it, SvIV(ST(0)), ebuf,
+		    sizeof(ebuf)) != STORE_ERR_OK) {
+			Safefree(it);
+			croak("%s", ebuf);
 		}
-		if (fields & (STORE_FIELD_GATEWAY_ADDR4|STORE_FIELD_GATEWAY_ADDR6)) {
-			addr_ntop(&flow.gateway_addr, addr_buf,
-			    sizeof(addr_buf));
-			field = newSVpv(addr_buf, 0);
-			F_STORE("gateway_addr");
-			field = newSViv(flow.gateway_addr.af);
-			F_STORE("gateway_addr_af");
+		RETVAL = PTR2IV(it);
+	OUTPUT:
+		RETVAL
+
+void iter_seek(...)
+	PROTOTYPE: $$$
+	INIT:
+		struct store_iter *it;
+		char ebuf[512];
+	CODE:
+		if (items != 3)
+			croak("Usage: iter_seek(iter, start, end)");
+		it = INT2PTR(struct store_iter *, SvIV(ST(0)));
+		if (store_iter_seek(it, (off_t)SvNV(ST(1)), (off_t)SvNV(ST(2)),
+		    ebuf, sizeof(ebuf)) != STORE_ERR_OK)
+			croak("%s", ebuf);
+
+void iter_next(...)
+	PROTOTYPE: $;$$
+	INIT:
+		struct store_iter *it;
+		struct store_flow_complete flow;
+		char ebuf[512];
+		u_int8_t *rec;
+		u_int32_t from, to, recv_sec;
+		int r, len, timed;
+	PPCODE:
+		if (items != 1 && items != 3)
+			croak("Usage: iter_next(iter [, from, to])");
+		it = INT2PTR(struct store_iter *, SvIV(ST(0)));
+		if ((timed = (items == 3))) {
+			from = SvUV(ST(1));
+			to = SvUV(ST(2));
 		}
-		if (fields & STORE_FIELD_SRCDST_PORT) {
-			field = newSViv(ntohs(flow.ports.src_port));
-			F_STORE("src_port");
-			field = newSViv(ntohs(flow.ports.dst_port));
-			F_STORE("dst_port");
+		for (;;) {
+			r = store_iter_next_raw(it, &rec, &len,
+			    ebuf, sizeof(ebuf));
+			if (r == STORE_ERR_EOF)
+				XSRETURN_EMPTY;
+			if (r != STORE_ERR_OK)
+				croak("%s", ebuf);
+			/* Skip flows out of range before decoding */
+			if (!timed || (store_raw_recv_time(rec, &recv_sec) &&
+			    recv_sec >= from && recv_sec <= to))
+				break;
 		}
-		if (fields & STORE_FIELD_PACKETS) {
-			tmp = store_ntohll(flow.packets.flow_packets);
-			if (tmp < (1ULL << 32))
-				field = newSVuv(tmp);
-			else
-				field = newSVnv(tmp * 1.0);
-			F_STORE("flow_packets");
+		if (store_flow_deserialise(rec, len, &flow, ebuf,
+		    sizeof(ebuf)) != STORE_ERR_OK)
+			croak("%s", ebuf);
+		XPUSHs(sv_2mortal(flow_to_hash(&flow)));
+
+void columns()
+	INIT:
+		const struct flow_column *c;
+	PPCODE:
+		for (c = flow_columns; c->name != NULL; c++) {
+			XPUSHs(sv_2mortal(newSVpv(c->name, 0)));
+			XPUSHs(sv_2mortal(newSVpv(c->pack, 0)));
 		}
-		if (fields & STORE_FIELD_OCTETS) {
-			tmp = store_ntohll(flow.octets.flow_octets);
-			if (tmp < (1ULL << 32))
-				field = newSVuv(tmp);
-			else
-				field = newSVnv(tmp * 1.0);
-			F_STORE("flow_octets");
+
+void iter_read_columns(...)
+	PROTOTYPE: $$$;$$
+	INIT:
+		const struct flow_column *cols[MAX_COLUMNS];
+		struct store_iter *it;
+		struct store_flow_complete flow;
+		size_t width[MAX_COLUMNS];
+		SV *bufs[MAX_COLUMNS];
+		u_int32_t from = 0, to = 0;
+		UV count, n;
+		int i, ncols;
+	PPCODE:
+		if (items != 3 && items != 5)
+			croak("Usage: iter_read_columns(iter, count, fields "
+			    "[, from, to])");
+		it = INT2PTR(struct store_iter *, SvIV(ST(0)));
+		if ((count = SvUV(ST(1))) == 0 || count > 1024 * 1024 * 16)
+			croak("Invalid count");
+		ncols = column_list(ST(2), cols);
+		if (items == 5) {
+			from = SvUV(ST(3));
+			to = SvUV(ST(4));
 		}
-		if (fields & STORE_FIELD_IF_INDICES) {
-			field = newSVuv(ntohl(flow.ifndx.if_index_in));
-			F_STORE("if_index_in");
-			field = newSVuv(ntohl(flow.ifndx.if_index_out));
-			F_STORE("if_index_out");
+		for (i = 0; i < ncols; i++) {
+			width[i] = column_width(cols[i]);
+			bufs[i] = sv_2mortal(newSV(count * width[i]));
+			SvPOK_only(bufs[i]);
 		}
-		if (fields & STORE_FIELD_AGENT_INFO) {
-			field = newSVuv(
-			    ntohl(flow.ainfo.sys_uptime_ms));
-			F_STORE("sys_uptime_ms");
-			field = newSVuv(ntohl(flow.ainfo.time_sec));
-			F_STORE("time_sec");
-			field = newSVuv(ntohl(flow.ainfo.time_nanosec));
-			F_STORE("time_nanosec");
-			field = newSViv(ntohs(flow.ainfo.netflow_version));
-			F_STORE("netflow_version");
+		for (n = 0; n < count && iter_read_flow(it, &flow, items == 5,
+		    from, to); n++) {
+			for (i = 0; i < ncols; i++) {
+				column_put(cols[i], &flow,
+				    (u_int8_t *)SvPVX(bufs[i]) + n * width[i]);
+			}
 		}
-		if (fields & STORE_FIELD_FLOW_TIMES) {
-			field = newSVuv(ntohl(flow.ftimes.flow_start));
-			F_STORE("flow_start");
-			field = newSVuv(ntohl(flow.ftimes.flow_finish));
-			F_STORE("flow_finish");
+		if (n == 0)
+			XSRETURN_EMPTY;
+		XPUSHs(sv_2mortal(newSVuv(n)));
+		for (i = 0; i < ncols; i++) {
+			SvCUR_set(bufs[i], n * width[i]);
+			*SvEND(bufs[i]) = '\0';
+			XPUSHs(bufs[i]);
 		}
-		if (fields & STORE_FIELD_AS_INFO) {
-			field = newSVuv(ntohl(flow.asinf.src_as));
-			F_STORE("src_as");
-			field = newSVuv(ntohl(flow.asinf.dst_as));
-			F_STORE("dst_as");
-			field = newSViv(flow.asinf.src_mask);
-			F_STORE("src_mask");
-			field = newSViv(flow.asinf.dst_mask);
-			F_STORE("dst_mask");
+
+void iter_sum(...)
+	PROTOTYPE: $$$;$$
+	INIT:
+		const struct flow_column *keys[MAX_COLUMNS];
+		const struct flow_column *vals[MAX_COLUMNS], *af;
+		struct store_iter *it;
+		struct store_flow_complete flow;
+		u_int8_t key[MAX_COLUMNS * 17], *kp, vbuf[16];
+		u_int64_t *sums;
+		u_int32_t from = 0, to = 0;
+		char buf[128];
+		HV *groups, *ret;
+		AV *row;
+		SV **slot, *k, *val, *name;
+		int i, nkeys, nvals;
+		I32 klen;
+		STRLEN len;
+	PPCODE:
+		if (items != 3 && items != 5)
+			croak("Usage: iter_sum(iter, keys, values [, from, to])");
+		it = INT2PTR(struct store_iter *, SvIV(ST(0)));
+		nkeys = column_list(ST(1), keys);
+		nvals = column_list(ST(2), vals);
+		for (i = 0; i < nvals; i++) {
+			if (vals[i]->kind == COL_ADDR)
+				croak("Cannot sum \"%s\"", vals[i]->name);
 		}
-		if (fields & STORE_FIELD_FLOW_ENGINE_INFO) {
-			field = newSViv(ntohs(flow.finf.engine_type));
-			F_STORE("engine_type");
-			field = newSViv(ntohs(flow.finf.engine_id));
-			F_STORE("engine_id");
-			field = newSVuv(htonl(flow.finf.flow_sequence));
-			F_STORE("flow_sequence");
-			field = newSVuv(htonl(flow.finf.source_id));
-			F_STORE("source_id");
+		if (items == 5) {
+			from = SvUV(ST(3));
+			to = SvUV(ST(4));
 		}
-		if (fields & STORE_FIELD_CRC32) {
-			field = newSVuv(ntohl(flow.crc32.crc32));
-			F_STORE("crc");
+
+		/* Accumulate flows and sums under the binary key */
+		groups = (HV *)sv_2mortal((SV *)newHV());
+		while (iter_read_flow(it, &flow, items == 5, from, to)) {
+			for (kp = key, i = 0; i < nkeys; i++) {
+				column_put(keys[i], &flow, kp);
+				kp += column_width(keys[i]);
+				/* Addresses are followed by their family */
+				if (keys[i]->kind == COL_ADDR) {
+					af = keys[i] + 1;
+					column_put(af, &flow, kp++);
+				}
+			}
+			slot = hv_fetch(groups, (char *)key, kp - key, 1);
+			if (!SvPOK(*slot)) {
+				sv_setpvn(*slot, "", 0);
+				SvGROW(*slot, (nvals + 1) * sizeof(*sums));
+				memset(SvPVX(*slot), 0,
+				    (nvals + 1) * sizeof(*sums));
+			}
+			sums = (u_int64_t *)SvPVX(*slot);
+			sums[0]++;
+			for (i = 0; i < nvals; i++) {
+				column_put(vals[i], &flow, vbuf);
+				sums[i + 1] += column_value(vals[i], vbuf);
+			}
 		}
 
-		XPUSHs(sv_2mortal(ret));
+		/* Return the groups keyed by their fields joined with "|" */
+		ret = newHV();
+		hv_iterinit(groups);
+		while ((val = hv_iternextsv(groups, (char **)&kp,
+		    &klen)) != NULL) {
+			name = sv_2mortal(newSVpvn("", 0));
+			for (i = 0; i < nkeys; i++) {
+				if (i > 0)
+					sv_catpvn(name, "|", 1);
+				column_format(keys[i], kp,
+				    keys[i]->kind == COL_ADDR ? kp[16] : 0,
+				    buf, sizeof(buf));
+				sv_catpv(name, buf);
+				kp += column_width(keys[i]) +
+				    (keys[i]->kind == COL_ADDR);
+			}
+			sums = (u_int64_t *)SvPVX(val);
+			row = newAV();
+			for (i = 0; i <= nvals; i++)
+				av_push(row, newSVu64(sums[i]));
+			k = newRV_noinc((SV *)row);
+			(void)SvPV(name, len);
+			if (hv_store(ret, SvPVX(name), len, k, 0) == NULL)
+				SvREFCNT_dec(k);
+		}
+		XPUSHs(sv_2mortal(newRV_noinc((SV *)ret)));
 
+void iter_close(...)
+	PROTOTYPE: $
+	INIT:
+		struct store_iter *it;
+	CODE:
+		if (items != 1)
+			croak("Usage: iter_close(iter)");
+		it = INT2PTR(struct store_iter *, SvIV(ST(0)));
+		store_iter_close(it);
+		Safefree(it);
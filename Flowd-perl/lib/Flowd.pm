@@ -80,6 +80,9 @@ our $VERSION = '0.9.1';
 require XSLoader;
 XSLoader::load('Flowd', $VERSION);
 
+# unpack() templates for the fields returned by read_columns
+our %COLUMNS = Flowd::columns();
+
 # Preloaded methods go here.
 sub iso_time {
 	my $timet = shift;
@@ -143,36 +146,88 @@ sub init {
 	$self->{filename} = $filename;
 	open($fhandle, "<$filename") or die "open($filename): $!";
 	$self->{handle} = $fhandle;
+	$self->{iter} = Flowd::iter_open(fileno($fhandle));
 }
 
 sub finish {
 	my $self = shift;
 
+	Flowd::iter_close($self->{iter}) if defined $self->{iter};
+	$self->{iter} = undef;
 	close($self->{handle});
 	$self->{handle} = undef;
 }
 
+sub DESTROY {
+	my $self = shift;
+
+	$self->finish() if defined $self->{handle};
+}
+
+# Only return flows received between $from and $to (inclusive), using the
+# log's index to skip to them if it has one
+sub seek_time {
+	my $self = shift;
+	my $from = shift;
+	my $to = shift;
+	my @range;
+
+	$from = 0 if not defined $from;
+	$to = 0xffffffff if not defined $to;
+	$self->{from} = $from;
+	$self->{to} = $to;
+
+	@range = Flowd::index_find($self->{filename}, -s $self->{handle},
+	    $from, $to);
+	Flowd::iter_seek($self->{iter}, @range) if @range;
+}
+
 sub read_flow {
 	my $self = shift;
-	my $hdr;
-	my $fdata;
-	my $r;
-	my $need;
-
-	# Read initial flow header
-	$need = Flowd::header_length();
-	$r = read($self->{handle}, $hdr, $need);
-	die "read($self->{filename}): $!" if not defined $r;
-	return 0 if $r == 0;
-	die "early EOF reading header on $self->{filename}" if $r < $need;
-
-	# Calculate length of flow and read it in
-	$need = Flowd::flow_length($hdr);
-	$r = read($self->{handle}, $fdata, $need);
-	die "read($self->{filename}): $!" if not defined $r;
-	die "early EOF reading flow on $self->{filename}" if $r < $need;
-
-	return Flowd::deserialise($hdr . $fdata);
+	my $flow;
+
+	if (defined $self->{from}) {
+		$flow = Flowd::iter_next($self->{iter}, $self->{from},
+		    $self->{to});
+	} else {
+		$flow = Flowd::iter_next($self->{iter});
+	}
+	return 0 if not defined $flow;
+	return $flow;
+}
+
+# Read up to $count flows, returning the number read and a hash of packed
+# strings holding each named field for every flow
+sub read_columns {
+	my $self = shift;
+	my $count = shift;
+	my @fields = @_;
+	my ($n, @cols);
+	my %ret;
+
+	if (defined $self->{from}) {
+		($n, @cols) = Flowd::iter_read_columns($self->{iter}, $count,
+		    \@fields, $self->{from}, $self->{to});
+	} else {
+		($n, @cols) = Flowd::iter_read_columns($self->{iter}, $count,
+		    \@fields);
+	}
+	return () if not defined $n;
+	@ret{@fields} = @cols;
+	return ($n, \%ret);
+}
+
+# Read the rest of the log, counting flows and summing the @$values fields
+# for each distinct combination of the @$keys fields
+sub sum_by {
+	my $self = shift;
+	my $keys = shift;
+	my $values = shift;
+
+	$values = [] if not defined $values;
+	return Flowd::iter_sum($self->{iter}, $keys, $values,
+	    $self->{from}, $self->{to}) if defined $self->{from};
+	return Flowd::iter_sum($self->{iter}, $keys, $values);
 }
 
 sub format
@@ -288,6 +343,25 @@ This module isn't really intended for public consumption. It is just a thin
 wrapper over the flowd C library. If you are really curious, have a look at
 Flowd.pm to see how it uses it (it is very simple).
 
+After seek_time($from, $to), read_flow only returns flows received
+between those times (in seconds since the epoch, inclusive). If the log
+has an index, it is used to skip straight to the part holding them.
+
+read_columns($count, @fields) reads up to $count flows in one call and
+returns the number read and a reference to a hash of packed strings, one
+per field named (using the same names as read_flow), which may be
+decoded with unpack() and the templates in %Flowd::COLUMNS. Fields a flow
+lacks are zero. Addresses are packed as 16 bytes, the first four of
+which hold an IPv4 address; the *_addr_af fields give their family. It
+returns an empty list at the end of the log.
+
+sum_by(\@keys, \@values) reads the rest of the log and returns a
+reference to a hash keyed by the @keys fields of each flow, joined with
+"|", whose values are references to arrays holding the number of flows
+in the group followed by the sum of each of @values for them. For
+example, $log->sum_by([ "src_addr", "dst_port" ], [ "flow_octets" ])
+gives the flows and octets sent by each source address to each port.
+
 =head2 EXPORT
 
 None by default.
@@ -465,10 +465,17 @@ addr_netmatch(const struct xaddr *host, const struct xaddr *net, u_int masklen)
 	return (addr_cmp(&tmp_result, net));
 }
 
+/* Per thread, as flowd's workers log peer addresses concurrently */
+#ifdef HAVE___THREAD
+# define ADDR_TLS	__thread
+#else
+# define ADDR_TLS
+#endif
+
 const char *
 addr_ntop_buf(const struct xaddr *a)
 {
-	static char hbuf[64];
+	static ADDR_TLS char hbuf[64];
 
 	if (addr_ntop(a, hbuf, sizeof(hbuf)) == -1)
 		return NULL;
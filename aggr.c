@@ -0,0 +1,353 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Flow pre-aggregation, see aggr.h for details */
+
+#include "flowd-common.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <stdlib.h>
+#include <syslog.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "sys-queue.h"
+#include "flowd.h"
+#include "aggr.h"
+
+RCSID("$Id$");
+
+/* Fields that can't be combined, or mean nothing without the agent */
+#define AGGR_DROP_FIELDS	(STORE_FIELD_GATEWAY_ADDR | \
+	STORE_FIELD_AS_INFO | STORE_FIELD_FLOW_ENGINE_INFO)
+#define AGGR_AGENT_FIELDS	(STORE_FIELD_AGENT_ADDR | \
+	STORE_FIELD_AGENT_INFO | STORE_FIELD_FLOW_TIMES)
+
+/* Copy an address, keeping the first len4 or len6 bits */
+static void
+aggr_addr_copy(struct xaddr *dst, const struct xaddr *src, u_int len4,
+    u_int len6)
+{
+	u_int i, len;
+
+	dst->af = src->af;
+	switch (src->af) {
+	case AF_INET:
+		if (len4 != 0) {
+			dst->v4.s_addr = src->v4.s_addr & (len4 == 32 ?
+			    0xffffffffU : htonl(~(0xffffffffU >> len4)));
+		}
+		break;
+	case AF_INET6:
+		for (i = 0, len = len6; i < 4 && len >= 32; i++, len -= 32)
+			dst->addr32[i] = src->addr32[i];
+		if (i < 4 && len != 0) {
+			dst->addr32[i] = src->addr32[i] &
+			    htonl(~(0xffffffffU >> len));
+		}
+		break;
+	}
+}
+
+/* Work out the key of a flow, leaving unused parts zeroed for hashing */
+static void
+aggr_key_make(const struct aggr_params *p,
+    const struct store_flow_complete *flow, struct aggr_key *key)
+{
+	struct xaddr addr;
+	u_int32_t fields;
+
+	bzero(key, sizeof(*key));
+	fields = ntohl(flow->hdr.fields) & ~AGGR_DROP_FIELDS;
+	if (p->key & AGGR_KEY_AGENT) {
+		addr = flow->agent_addr;
+		aggr_addr_copy(&key->agent, &addr, 32, 128);
+	} else
+		fields &= ~AGGR_AGENT_FIELDS;
+	if (p->key & AGGR_KEY_SRC_ADDR) {
+		addr = flow->src_addr;
+		aggr_addr_copy(&key->src, &addr, p->src_len4, p->src_len6);
+	} else
+		fields &= ~STORE_FIELD_SRC_ADDR;
+	if (p->key & AGGR_KEY_DST_ADDR) {
+		addr = flow->dst_addr;
+		aggr_addr_copy(&key->dst, &addr, p->dst_len4, p->dst_len6);
+	} else
+		fields &= ~STORE_FIELD_DST_ADDR;
+	if ((p->key & (AGGR_KEY_SRC_PORT|AGGR_KEY_DST_PORT)) == 0)
+		fields &= ~STORE_FIELD_SRCDST_PORT;
+	if ((p->key & (AGGR_KEY_IF_IN|AGGR_KEY_IF_OUT)) == 0)
+		fields &= ~STORE_FIELD_IF_INDICES;
+
+	key->fields = fields;
+	key->tag = flow->tag.tag;
+	if (p->key & AGGR_KEY_SRC_PORT)
+		key->src_port = flow->ports.src_port;
+	if (p->key & AGGR_KEY_DST_PORT)
+		key->dst_port = flow->ports.dst_port;
+	if (p->key & AGGR_KEY_PROTO)
+		key->proto = flow->pft.protocol;
+	if (p->key & AGGR_KEY_TOS)
+		key->tos = flow->pft.tos;
+	if (p->key & AGGR_KEY_IF_IN)
+		key->if_in = flow->ifndx.if_index_in;
+	if (p->key & AGGR_KEY_IF_OUT)
+		key->if_out = flow->ifndx.if_index_out;
+}
+
+/* FNV-1a */
+static u_int32_t
+aggr_key_hash(const struct aggr_key *key)
+{
+	const u_int8_t *p = (const u_int8_t *)key;
+	u_int32_t h = 0x811c9dc5;
+	size_t i;
+
+	for (i = 0; i < sizeof(*key); i++)
+		h = (h ^ p[i]) * 0x01000193;
+	return (h);
+}
+
+/* Begin a record from its first flow; the key supplies what is kept */
+static void
+aggr_flow_begin(struct aggr_flow *af, const struct store_flow_complete *flow)
+{
+	struct store_flow_complete *rec = &af->flow;
+	const struct aggr_key *key = &af->key;
+
+	bzero(rec, sizeof(*rec));
+	rec->hdr.fields = htonl(key->fields);
+	rec->tag = flow->tag;
+	rec->recv_time = flow->recv_time;
+	rec->pft.tcp_flags = flow->pft.tcp_flags;
+	rec->pft.protocol = key->proto;
+	rec->pft.tos = key->tos;
+	rec->agent_addr = key->agent;
+	rec->src_addr = key->src;
+	rec->dst_addr = key->dst;
+	rec->ports.src_port = key->src_port;
+	rec->ports.dst_port = key->dst_port;
+	rec->packets = flow->packets;
+	rec->octets = flow->octets;
+	rec->ifndx.if_index_in = key->if_in;
+	rec->ifndx.if_index_out = key->if_out;
+	rec->ainfo = flow->ainfo;
+	rec->ftimes = flow->ftimes;
+}
+
+static void
+aggr_flow_merge(struct aggr_flow *af, const struct store_flow_complete *flow)
+{
+	struct store_flow_complete *rec = &af->flow;
+
+	rec->recv_time = flow->recv_time;
+	rec->pft.tcp_flags |= flow->pft.tcp_flags;
+	rec->packets.flow_packets = store_htonll(
+	    store_ntohll(rec->packets.flow_packets) +
+	    store_ntohll(flow->packets.flow_packets));
+	rec->octets.flow_octets = store_htonll(
+	    store_ntohll(rec->octets.flow_octets) +
+	    store_ntohll(flow->octets.flow_octets));
+	/* Flow times are relative to the latest agent uptime */
+	rec->ainfo = flow->ainfo;
+	if (ntohl(flow->ftimes.flow_start) < ntohl(rec->ftimes.flow_start))
+		rec->ftimes.flow_start = flow->ftimes.flow_start;
+	if (ntohl(flow->ftimes.flow_finish) > ntohl(rec->ftimes.flow_finish))
+		rec->ftimes.flow_finish = flow->ftimes.flow_finish;
+}
+
+static void
+aggr_hash_remove(struct aggr_table *t, struct aggr_flow *af)
+{
+	struct aggr_flow **pp;
+
+	for (pp = &t->hash[af->hash & (t->hash_size - 1)]; *pp != af;
+	    pp = &(*pp)->hnext)
+		;
+	*pp = af->hnext;
+}
+
+/* Take a record off the table, copying it out */
+static void
+aggr_flow_end(struct aggr_table *t, struct aggr_flow *af,
+    struct store_flow_complete *out)
+{
+	memcpy(out, &af->flow, sizeof(*out));
+	aggr_hash_remove(t, af);
+	TAILQ_REMOVE(&t->active, af, entry);
+	TAILQ_INSERT_HEAD(&t->free, af, entry);
+	t->num_active--;
+	t->flows_out++;
+}
+
+void
+aggr_init(struct aggr_table *t, const struct aggr_params *params)
+{
+	u_int i;
+
+	bzero(t, sizeof(*t));
+	t->params = *params;
+	TAILQ_INIT(&t->active);
+	TAILQ_INIT(&t->free);
+	if (params->key == 0)
+		return;
+
+	if ((t->arena = calloc(params->max, sizeof(*t->arena))) == NULL)
+		logerrx("%s: calloc failed (%u records)", __func__,
+		    params->max);
+	for (t->hash_size = 1; t->hash_size < params->max; t->hash_size <<= 1)
+		;
+	if ((t->hash = calloc(t->hash_size, sizeof(*t->hash))) == NULL)
+		logerrx("%s: calloc failed", __func__);
+	for (i = 0; i < params->max; i++)
+		TAILQ_INSERT_TAIL(&t->free, &t->arena[i], entry);
+}
+
+void
+aggr_free(struct aggr_table *t)
+{
+	free(t->arena);
+	free(t->hash);
+	free(t->staged);
+	bzero(t, sizeof(*t));
+	TAILQ_INIT(&t->active);
+	TAILQ_INIT(&t->free);
+}
+
+int
+aggr_params_differ(const struct aggr_table *t,
+    const struct aggr_params *params)
+{
+	const struct aggr_params *p = &t->params;
+
+	return (p->key != params->key ||
+	    p->src_len4 != params->src_len4 ||
+	    p->src_len6 != params->src_len6 ||
+	    p->dst_len4 != params->dst_len4 ||
+	    p->dst_len6 != params->dst_len6 ||
+	    p->timeout != params->timeout || p->max != params->max);
+}
+
+/* Hold a flow until the packet it came in is known to be valid */
+void
+aggr_stage(struct aggr_table *t, const struct store_flow_complete *flow)
+{
+	struct store_flow_complete *tmp;
+	u_int n;
+
+	if (t->num_staged == t->staged_alloc) {
+		n = t->staged_alloc == 0 ? 64 : t->staged_alloc * 2;
+		if ((tmp = realloc(t->staged, n * sizeof(*tmp))) == NULL)
+			logerrx("%s: realloc failed (%u flows)", __func__, n);
+		t->staged = tmp;
+		t->staged_alloc = n;
+	}
+	memcpy(&t->staged[t->num_staged++], flow, sizeof(*flow));
+}
+
+void
+aggr_rollback(struct aggr_table *t)
+{
+	t->num_staged = t->num_merged = 0;
+}
+
+/*
+ * Merge the staged flows into the table. If the oldest record has to be
+ * evicted to make room, it is copied to out and 1 returned; call again
+ * until 0 is returned to merge the rest.
+ */
+int
+aggr_commit(struct aggr_table *t, time_t now, struct store_flow_complete *out)
+{
+	const struct store_flow_complete *flow;
+	struct aggr_flow *af;
+	struct aggr_key key;
+	u_int32_t hash;
+	int evicted;
+
+	while (t->num_merged < t->num_staged) {
+		flow = &t->staged[t->num_merged++];
+		t->flows_in++;
+		aggr_key_make(&t->params, flow, &key);
+		hash = aggr_key_hash(&key);
+		for (af = t->hash[hash & (t->hash_size - 1)]; af != NULL;
+		    af = af->hnext) {
+			if (af->hash == hash &&
+			    memcmp(&af->key, &key, sizeof(key)) == 0)
+				break;
+		}
+		if (af != NULL) {
+			aggr_flow_merge(af, flow);
+			continue;
+		}
+
+		evicted = 0;
+		if (TAILQ_EMPTY(&t->free)) {
+			aggr_flow_end(t, TAILQ_FIRST(&t->active), out);
+			t->evicted++;
+			evicted = 1;
+		}
+		af = TAILQ_FIRST(&t->free);
+		TAILQ_REMOVE(&t->free, af, entry);
+		memcpy(&af->key, &key, sizeof(af->key));
+		af->hash = hash;
+		af->begun = now;
+		aggr_flow_begin(af, flow);
+		af->hnext = t->hash[hash & (t->hash_size - 1)];
+		t->hash[hash & (t->hash_size - 1)] = af;
+		TAILQ_INSERT_TAIL(&t->active, af, entry);
+		t->num_active++;
+		if (evicted)
+			return (1);
+	}
+	t->num_staged = t->num_merged = 0;
+
+	return (0);
+}
+
+/*
+ * Copy out and remove the oldest record if it has been held for the
+ * timeout, or any record if now is 0. Returns 0 if there isn't one.
+ */
+int
+aggr_expire(struct aggr_table *t, time_t now, struct store_flow_complete *out)
+{
+	struct aggr_flow *af;
+
+	if ((af = TAILQ_FIRST(&t->active)) == NULL ||
+	    (now != 0 && af->begun + (time_t)t->params.timeout > now))
+		return (0);
+	aggr_flow_end(t, af, out);
+
+	return (1);
+}
+
+/* Seconds until the oldest record is due, or -1 if there are none */
+int
+aggr_next_expiry(const struct aggr_table *t, time_t now)
+{
+	struct aggr_flow *af;
+	time_t due;
+
+	if ((af = TAILQ_FIRST(&t->active)) == NULL)
+		return (-1);
+	due = af->begun + (time_t)t->params.timeout;
+
+	return (due <= now ? 0 : (int)(due - now));
+}
@@ -0,0 +1,115 @@
+/*	$Id$	*/
+
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Pre-aggregation of accepted flows. Flows that share a key (some of their
+ * addresses, ports, protocol and so on) are merged into one record, which
+ * is written out once it has been held for the timeout or when room is
+ * needed for another. Each worker has a table of its own.
+ *
+ * The table is a fixed arena of a configured number of records, allocated
+ * up front, hashed by key and kept on a list in the order they were begun
+ * so the oldest can be found at once. Flows from the packet being decoded
+ * are staged first, so that they can be taken back if it turns out to be
+ * invalid, and merged when it is complete.
+ */
+
+#ifndef _AGGR_H
+#define _AGGR_H
+
+#include <sys/types.h>
+#include "flowd-common.h"
+#include "sys-queue.h"
+#include "addr.h"
+#include "store.h"
+
+/* Fields that make up the key */
+#define AGGR_KEY_AGENT		(1<<0)
+#define AGGR_KEY_SRC_ADDR	(1<<1)
+#define AGGR_KEY_DST_ADDR	(1<<2)
+#define AGGR_KEY_SRC_PORT	(1<<3)
+#define AGGR_KEY_DST_PORT	(1<<4)
+#define AGGR_KEY_PROTO		(1<<5)
+#define AGGR_KEY_TOS		(1<<6)
+#define AGGR_KEY_IF_IN		(1<<7)
+#define AGGR_KEY_IF_OUT		(1<<8)
+
+#define DEFAULT_AGGR_TIMEOUT	60		/* seconds */
+#define LIMIT_AGGR_TIMEOUT	3600
+#define DEFAULT_AGGR_MAX	(1024*64)	/* records held per worker */
+#define LIMIT_AGGR_MAX		(1024*1024*16)
+
+/* Parameters of a table, as configured */
+struct aggr_params {
+	u_int32_t key;		/* AGGR_KEY_*, 0 for no aggregation */
+	u_int src_len4, src_len6;	/* prefix lengths kept */
+	u_int dst_len4, dst_len6;
+	u_int timeout;
+	u_int max;
+};
+
+/* The part of a flow that is compared, with the rest zeroed */
+struct aggr_key {
+	u_int32_t fields;
+	u_int32_t tag;
+	struct xaddr agent, src, dst;
+	u_int32_t if_in, if_out;
+	u_int16_t src_port, dst_port;
+	u_int8_t proto, tos;
+};
+
+struct aggr_flow {
+	TAILQ_ENTRY(aggr_flow) entry;	/* age order, or free list */
+	struct aggr_flow *hnext;	/* hash chain */
+	u_int32_t hash;
+	time_t begun;
+	struct aggr_key key;
+	struct store_flow_complete flow;
+};
+TAILQ_HEAD(aggr_flows, aggr_flow);
+
+struct aggr_table {
+	struct aggr_params params;
+	struct aggr_flow *arena;
+	struct aggr_flow **hash;	/* power of 2 size */
+	u_int hash_size;
+	struct aggr_flows active;
+	struct aggr_flows free;
+	u_int num_active;
+
+	/* Flows from the packet being decoded */
+	struct store_flow_complete *staged;
+	u_int num_staged, staged_alloc, num_merged;
+
+	/* Only counted by the worker that owns the table */
+	u_int64_t flows_in, flows_out, evicted;
+};
+
+void aggr_init(struct aggr_table *t, const struct aggr_params *params);
+void aggr_free(struct aggr_table *t);
+int aggr_params_differ(const struct aggr_table *t,
+    const struct aggr_params *params);
+void aggr_stage(struct aggr_table *t, const struct store_flow_complete *flow);
+void aggr_rollback(struct aggr_table *t);
+int aggr_commit(struct aggr_table *t, time_t now,
+    struct store_flow_complete *out);
+int aggr_expire(struct aggr_table *t, time_t now,
+    struct store_flow_complete *out);
+int aggr_next_expiry(const struct aggr_table *t, time_t now);
+
+#endif /* _AGGR_H */
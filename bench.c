@@ -0,0 +1,734 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Microbenchmarks of the collector's hot paths, run by "make bench".
+ *
+ * flowd.c is included whole so the decoders, which are static, can be
+ * driven directly, with its main() renamed out of the way. The input is
+ * synthetic but fixed, so results are comparable from run to run; each
+ * benchmark is timed several times and the fastest run reported.
+ */
+
+int flowd_main(int, char **);
+#define main flowd_main
+#include "flowd.c"
+#undef main
+
+#define BENCH_RUNS	5
+#define BENCH_FLOWS	1024	/* distinct flows for filter and store */
+#define BENCH_RECS	24	/* v.9/IPFIX records per data packet */
+
+/* Runs a benchmark for n rounds, returns the number of flows handled */
+typedef u_int64_t (*bench_fn)(void *ctx, u_int64_t n);
+
+static u_int64_t bench_ns = 200000000;	/* per run */
+static const char *bench_match = NULL;
+static u_int32_t bench_seed;
+static volatile u_int bench_sink;	/* keeps results from being elided */
+
+static u_int32_t
+bench_random(void)
+{
+	/* xorshift32, for the same sequence everywhere */
+	bench_seed ^= bench_seed << 13;
+	bench_seed ^= bench_seed >> 17;
+	bench_seed ^= bench_seed << 5;
+	return (bench_seed);
+}
+
+static void
+bench_run(const char *name, bench_fn fn, void *ctx)
+{
+	u_int64_t n, flows, t, best;
+	double ns;
+	u_int i;
+
+	if (bench_match != NULL && strstr(name, bench_match) == NULL)
+		return;
+
+	/* Find how many rounds fill a run, warming the caches as we go */
+	for (n = 1;; n *= 2) {
+		t = stats_now_ns();
+		fn(ctx, n);
+		if ((t = stats_now_ns() - t) >= bench_ns / 16)
+			break;
+	}
+	n = n * bench_ns / t;
+	if (n == 0)
+		n = 1;
+
+	best = (u_int64_t)-1;
+	for (i = flows = 0; i < BENCH_RUNS; i++) {
+		t = stats_now_ns();
+		flows = fn(ctx, n);
+		if ((t = stats_now_ns() - t) < best)
+			best = t;
+	}
+	ns = flows == 0 ? 0 : (double)best / flows;
+	printf("%-36s %12.0f flows/s %10.1f ns/flow\n", name,
+	    ns == 0 ? 0 : 1e9 / ns, ns);
+	fflush(stdout);
+}
+
+/* Synthetic export packets, big-endian as on the wire */
+
+struct bench_pkt {
+	u_int8_t	buf[2048];
+	u_int		len;
+};
+
+static void
+put8(struct bench_pkt *p, u_int v)
+{
+	p->buf[p->len++] = v;
+}
+
+static void
+put16(struct bench_pkt *p, u_int v)
+{
+	put8(p, v >> 8);
+	put8(p, v);
+}
+
+static void
+put32(struct bench_pkt *p, u_int32_t v)
+{
+	put16(p, v >> 16);
+	put16(p, v);
+}
+
+static void
+set16(struct bench_pkt *p, u_int off, u_int v)
+{
+	p->buf[off] = v >> 8;
+	p->buf[off + 1] = v;
+}
+
+static void
+bench_v5_packet(struct bench_pkt *p)
+{
+	u_int i, k;
+
+	p->len = 0;
+	put16(p, 5);
+	put16(p, NF5_MAXFLOWS);
+	put32(p, 100000);		/* uptime_ms */
+	put32(p, 1700000000);		/* time_sec */
+	put32(p, 0);
+	put32(p, 12345);		/* flow_sequence */
+	put8(p, 1);
+	put8(p, 2);
+	put16(p, 0);
+	for (i = 0; i < NF5_MAXFLOWS; i++) {
+		k = bench_random();
+		put32(p, 0x0a000000 | (k & 0xffffff));		/* 10/8 */
+		put32(p, 0xc0a80000 | (k >> 16));		/* 192.168/16 */
+		put32(p, 0x0a000001);
+		put16(p, k % 5);
+		put16(p, k % 9);
+		put32(p, 1 + k % 100);
+		put32(p, 40 + k % 150000);
+		put32(p, 50000);
+		put32(p, 60000);
+		put16(p, 1024 + k % 60000);
+		put16(p, (k & 1) ? 443 : 80);
+		put8(p, 0);
+		put8(p, 0x1b);
+		put8(p, (k & 2) ? IPPROTO_TCP : IPPROTO_UDP);
+		put8(p, 0);
+		put16(p, 65000 + k % 10);
+		put16(p, 64512 + k % 7);
+		put8(p, 24);
+		put8(p, 16);
+		put16(p, 0);
+	}
+}
+
+/* A typical router's IPv4 template, shared by v.9 and IPFIX */
+static const u_int16_t bench_template[][2] = {
+	{ NF9_IPV4_SRC_ADDR, 4 }, { NF9_IPV4_DST_ADDR, 4 },
+	{ NF9_IPV4_NEXT_HOP, 4 }, { NF9_INPUT_SNMP, 2 },
+	{ NF9_OUTPUT_SNMP, 2 }, { NF9_IN_PACKETS, 4 }, { NF9_IN_BYTES, 4 },
+	{ NF9_FIRST_SWITCHED, 4 }, { NF9_LAST_SWITCHED, 4 },
+	{ NF9_L4_SRC_PORT, 2 }, { NF9_L4_DST_PORT, 2 },
+	{ NF9_TCP_FLAGS, 1 }, { NF9_IN_PROTOCOL, 1 }, { NF9_SRC_TOS, 1 },
+	{ NF9_SRC_AS, 2 }, { NF9_DST_AS, 2 }, { NF9_SRC_MASK, 1 },
+	{ NF9_DST_MASK, 1 },
+};
+#define BENCH_TEMPLATE_ID	256
+#define BENCH_NFIELDS	(sizeof(bench_template) / sizeof(bench_template[0]))
+
+static void
+bench_template_set(struct bench_pkt *p, u_int set_id)
+{
+	u_int i;
+
+	put16(p, set_id);
+	put16(p, 8 + BENCH_NFIELDS * 4);
+	put16(p, BENCH_TEMPLATE_ID);
+	put16(p, BENCH_NFIELDS);
+	for (i = 0; i < BENCH_NFIELDS; i++) {
+		put16(p, bench_template[i][0]);
+		put16(p, bench_template[i][1]);
+	}
+}
+
+static void
+bench_data_set(struct bench_pkt *p, u_int nrecs)
+{
+	u_int i, start = p->len, k;
+
+	put16(p, BENCH_TEMPLATE_ID);
+	put16(p, 0);
+	for (i = 0; i < nrecs; i++) {
+		k = bench_random();
+		put32(p, 0xac100000 | (k & 0xfffff));		/* 172.16/12 */
+		put32(p, 0x08080000 | (k >> 16));
+		put32(p, 0xac100001);
+		put16(p, k % 3);
+		put16(p, k % 4);
+		put32(p, 2 + k % 1000);
+		put32(p, 100 + k % 1000000);
+		put32(p, 1000);
+		put32(p, 2000);
+		put16(p, 1024 + k % 60000);
+		put16(p, (k & 1) ? 443 : 53);
+		put8(p, 0x10);
+		put8(p, (k & 2) ? IPPROTO_TCP : IPPROTO_UDP);
+		put8(p, 0);
+		put16(p, 100 + k % 3);
+		put16(p, 200);
+		put8(p, 24);
+		put8(p, 8);
+	}
+	while ((p->len - start) % 4 != 0)
+		put8(p, 0);
+	set16(p, start + 2, p->len - start);
+}
+
+static void
+bench_v9_packet(struct bench_pkt *p, int with_template, u_int nrecs)
+{
+	p->len = 0;
+	put16(p, 9);
+	put16(p, nrecs + (with_template ? 1 : 0));
+	put32(p, 100000);
+	put32(p, 1700000000);
+	put32(p, 777);
+	put32(p, 42);			/* source_id */
+	if (with_template)
+		bench_template_set(p, NF9_TEMPLATE_FLOWSET_ID);
+	if (nrecs > 0)
+		bench_data_set(p, nrecs);
+}
+
+static void
+bench_v10_packet(struct bench_pkt *p, int with_template, u_int nrecs)
+{
+	p->len = 0;
+	put16(p, 10);
+	put16(p, 0);
+	put32(p, 1700000000);
+	put32(p, 888);
+	put32(p, 43);			/* observation domain */
+	if (with_template)
+		bench_template_set(p, NF10_TEMPLATE_FLOWSET_ID);
+	if (nrecs > 0)
+		bench_data_set(p, nrecs);
+	set16(p, 2, p->len);
+}
+
+/* Decoding, through to the serialised flows in the output queue */
+
+struct bench_decode {
+	struct flowd_config	*conf;
+	struct flowd_worker	*w;
+	struct flow_packet	 fp;
+	struct bench_pkt	 pkt;
+	u_int			 flows;
+};
+
+static u_int64_t
+bench_decode(void *ctx, u_int64_t n)
+{
+	struct bench_decode *b = ctx;
+	u_int64_t i;
+
+	for (i = 0; i < n; i++) {
+		/* Decoders may rewrite the packet, so give each a fresh one */
+		memcpy(b->fp.packet, b->pkt.buf, b->pkt.len);
+		b->fp.len = b->pkt.len;
+		process_packet(&b->fp, b->conf, b->w);
+		b->w->outq->offset = 0;
+		b->w->outq_marked = 0;
+	}
+	return (n * b->flows);
+}
+
+/* Decode the packet once, leaving its flows in "out" */
+static size_t
+bench_decode_once(struct bench_decode *b, u_int8_t *out, size_t len)
+{
+	size_t n;
+
+	memcpy(b->fp.packet, b->pkt.buf, b->pkt.len);
+	b->fp.len = b->pkt.len;
+	process_packet(&b->fp, b->conf, b->w);
+	if ((n = b->w->outq->offset) > len)
+		logerrx("%s: %zu bytes of flows", __func__, n);
+	memcpy(out, b->w->outq->buf, n);
+	b->w->outq->offset = 0;
+	return (n);
+}
+
+/*
+ * With a filter rule, even one that matches nothing, v.5 flows are
+ * decoded one by one instead of being copied straight to the output
+ * queue. Both ways must write the same thing.
+ */
+static void
+bench_v5_by_flow(struct bench_decode *b)
+{
+	struct flowd_config rconf;
+	struct filter_index *saved = b->w->filters;
+	u_int8_t direct[8192], by_flow[8192];
+	size_t dlen, flen;
+	FILE *f;
+
+	dlen = bench_decode_once(b, direct, sizeof(direct));
+
+	if ((f = tmpfile()) == NULL)
+		logerr("%s: tmpfile", __func__);
+	fprintf(f, "discard agent 10.9.9.9\n");
+	rewind(f);
+	bzero(&rconf, sizeof(rconf));
+	if (parse_config("bench", f, &rconf, 1) != 0)
+		logerrx("%s: couldn't parse rule", __func__);
+	fclose(f);
+	b->w->filters = filter_compile(&rconf.filter_list);
+
+	flen = bench_decode_once(b, by_flow, sizeof(by_flow));
+	if (dlen != flen || memcmp(direct, by_flow, dlen) != 0)
+		logerrx("%s: v.5 flows differ when decoded by flow", __func__);
+	bench_run("decode v5 by flow", bench_decode, b);
+
+	filter_index_free(b->w->filters);
+	b->w->filters = saved;
+}
+
+static void
+bench_decoders(struct flowd_config *conf, struct flowd_worker *w)
+{
+	struct bench_decode b;
+	struct bench_pkt tmpl;
+	u_int8_t *buf;
+
+	bzero(&b, sizeof(b));
+	b.conf = conf;
+	b.w = w;
+	if ((buf = malloc(sizeof(b.pkt.buf))) == NULL)
+		logerrx("%s: malloc", __func__);
+	b.fp.packet = buf;
+	gettimeofday(&b.fp.recv_time, NULL);
+	addr_pton("10.0.0.1", &b.fp.flow_source);
+	if ((b.fp.peer = new_peer(&w->peers, conf, &b.fp.flow_source)) == NULL)
+		logerrx("%s: new_peer", __func__);
+
+	bench_v5_packet(&b.pkt);
+	b.flows = NF5_MAXFLOWS;
+	bench_run("decode v5", bench_decode, &b);
+	bench_v5_by_flow(&b);
+
+	/* Templates arrive once; the data packets are what matter */
+	bench_v9_packet(&tmpl, 1, 0);
+	memcpy(buf, tmpl.buf, tmpl.len);
+	b.fp.len = tmpl.len;
+	process_packet(&b.fp, conf, w);
+	bench_v9_packet(&b.pkt, 0, BENCH_RECS);
+	b.flows = BENCH_RECS;
+	bench_run("decode v9", bench_decode, &b);
+
+	bench_v10_packet(&tmpl, 1, 0);
+	memcpy(buf, tmpl.buf, tmpl.len);
+	b.fp.len = tmpl.len;
+	process_packet(&b.fp, conf, w);
+	bench_v10_packet(&b.pkt, 0, BENCH_RECS);
+	b.flows = BENCH_RECS;
+	bench_run("decode v10", bench_decode, &b);
+
+	bench_v9_packet(&b.pkt, 1, BENCH_RECS);
+	bench_run("decode v9 with template", bench_decode, &b);
+
+	w->outq->offset = 0;
+	free(buf);
+}
+
+/* Flows as they are when filtered: in network byte order */
+static void
+bench_flows(struct store_flow_complete *flows, u_int n)
+{
+	struct store_flow_complete *f;
+	struct xaddr agent;
+	u_int i, k;
+
+	for (i = 0; i < n; i++) {
+		f = &flows[i];
+		k = bench_random();
+		bzero(f, sizeof(*f));
+		f->hdr.fields = htonl(STORE_FIELD_ALL &
+		    ~(STORE_FIELD_TAG | STORE_FIELD_SRC_ADDR6 |
+		    STORE_FIELD_DST_ADDR6 | STORE_FIELD_GATEWAY_ADDR6));
+		f->recv_time.recv_sec = htonl(1700000000 + i);
+		f->recv_time.recv_usec = htonl(k % 1000000);
+		f->pft.tcp_flags = 0x1b;
+		f->pft.protocol = (k & 2) ? IPPROTO_TCP : IPPROTO_UDP;
+		f->pft.tos = 0;
+		addr_pton((k & 4) ? "10.0.0.1" : "10.0.0.2", &agent);
+		f->agent_addr = agent;
+		f->src_addr.af = f->dst_addr.af = f->gateway_addr.af = AF_INET;
+		f->src_addr.v4.s_addr = htonl(0x0a000000 | (k & 0xffffff));
+		f->dst_addr.v4.s_addr = htonl(0xc0a80000 | (k >> 16));
+		f->gateway_addr.v4.s_addr = htonl(0x0a000001);
+		f->ports.src_port = htons(1024 + k % 60000);
+		f->ports.dst_port = htons((k & 1) ? 443 : 80);
+		f->packets.flow_packets = store_htonll(1 + k % 100);
+		f->octets.flow_octets = store_htonll(40 + k % 150000);
+		f->ifndx.if_index_in = htonl(k % 5);
+		f->ifndx.if_index_out = htonl(k % 9);
+		f->ainfo.sys_uptime_ms = htonl(100000);
+		f->ainfo.time_sec = htonl(1700000000);
+		f->ainfo.netflow_version = htons(5);
+		f->ftimes.flow_start = htonl(50000);
+		f->ftimes.flow_finish = htonl(60000);
+		f->asinf.src_as = htonl(65000 + k % 10);
+		f->asinf.dst_as = htonl(64512 + k % 7);
+		f->asinf.src_mask = 24;
+		f->asinf.dst_mask = 16;
+		f->finf.engine_type = 1;
+		f->finf.engine_id = 2;
+		f->finf.flow_sequence = htonl(i);
+	}
+}
+
+/* Filtering */
+
+struct bench_filter {
+	struct filter_index		*fi;
+	struct store_flow_complete	*flows;
+};
+
+static u_int64_t
+bench_filter(void *ctx, u_int64_t n)
+{
+	struct bench_filter *b = ctx;
+	u_int64_t i;
+
+	for (i = 0; i < n; i++)
+		bench_sink += filter_flow(&b->flows[i % BENCH_FLOWS], b->fi);
+	return (n);
+}
+
+/* A rule set of the sort an ISP might keep: mostly per-prefix tags */
+static void
+bench_rules(struct flowd_config *conf, u_int nrules)
+{
+	FILE *f;
+	u_int i, k;
+
+	if ((f = tmpfile()) == NULL)
+		logerr("%s: tmpfile", __func__);
+	for (i = 0; i < nrules; i++) {
+		k = bench_random();
+		switch (i % 4) {
+		case 0:
+			fprintf(f, "accept tag %u src 10.%u.%u.0/24\n", i,
+			    k & 0xff, (k >> 8) & 0xff);
+			break;
+		case 1:
+			fprintf(f, "accept tag %u dst 192.168.%u.0/24 "
+			    "port %u proto tcp\n", i, k & 0xff,
+			    1 + (k >> 8) % 1024);
+			break;
+		case 2:
+			fprintf(f, "discard src 172.%u.%u.0/24 dst any "
+			    "port %u proto udp\n", 16 + (k & 0xf),
+			    (k >> 4) & 0xff, 1 + (k >> 12) % 1024);
+			break;
+		default:
+			fprintf(f, "accept tag %u agent 10.0.%u.%u "
+			    "in_ifndx %u\n", i, k & 0xff, (k >> 8) & 0xff,
+			    1 + (k >> 16) % 64);
+			break;
+		}
+	}
+	rewind(f);
+	bzero(conf, sizeof(*conf));
+	if (parse_config("bench", f, conf, 1) != 0)
+		logerrx("%s: couldn't parse %u rules", __func__, nrules);
+	fclose(f);
+}
+
+static void
+bench_filters(void)
+{
+	static const u_int counts[] = { 10, 100, 2000 };
+	struct bench_filter b;
+	struct flowd_config conf;
+	char name[64];
+	u_int i;
+
+	if ((b.flows = calloc(BENCH_FLOWS, sizeof(*b.flows))) == NULL)
+		logerrx("%s: calloc", __func__);
+	bench_flows(b.flows, BENCH_FLOWS);
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		bench_rules(&conf, counts[i]);
+		b.fi = filter_compile(&conf.filter_list);
+		snprintf(name, sizeof(name), "filter %u rules", counts[i]);
+		bench_run(name, bench_filter, &b);
+		filter_index_free(b.fi);
+	}
+	free(b.flows);
+}
+
+/* Storage */
+
+struct bench_store {
+	struct store_flow_complete	*flows;
+	u_int32_t			 mask;
+	u_int8_t			*bufs;		/* serialised flows */
+	int				 lens[BENCH_FLOWS];
+};
+
+#define BENCH_FLOW_MAX	256
+
+static u_int64_t
+bench_serialise(void *ctx, u_int64_t n)
+{
+	struct bench_store *b = ctx;
+	char ebuf[512];
+	u_int8_t buf[BENCH_FLOW_MAX];
+	u_int64_t i;
+	int len;
+
+	for (i = 0; i < n; i++) {
+		if (store_flow_serialise_masked(&b->flows[i % BENCH_FLOWS],
+		    b->mask, buf, sizeof(buf), &len, ebuf,
+		    sizeof(ebuf)) != STORE_ERR_OK)
+			logerrx("%s: %s", __func__, ebuf);
+	}
+	return (n);
+}
+
+static u_int64_t
+bench_deserialise(void *ctx, u_int64_t n)
+{
+	struct bench_store *b = ctx;
+	struct store_flow_complete flow;
+	char ebuf[512];
+	u_int64_t i;
+	u_int j;
+
+	for (i = 0; i < n; i++) {
+		j = i % BENCH_FLOWS;
+		if (store_flow_deserialise(b->bufs + j * BENCH_FLOW_MAX,
+		    b->lens[j], &flow, ebuf, sizeof(ebuf)) != STORE_ERR_OK)
+			logerrx("%s: %s", __func__, ebuf);
+	}
+	return (n);
+}
+
+static u_int64_t
+bench_format(void *ctx, u_int64_t n)
+{
+	struct bench_store *b = ctx;
+	char buf[1024];
+	u_int64_t i;
+
+	for (i = 0; i < n; i++) {
+		store_format_flow(&b->flows[i % BENCH_FLOWS], buf, sizeof(buf),
+		    1, STORE_DISPLAY_ALL, 0);
+	}
+	return (n);
+}
+
+static void
+bench_store(void)
+{
+	struct bench_store b;
+	char ebuf[512];
+	u_int i;
+
+	bzero(&b, sizeof(b));
+	if ((b.flows = calloc(BENCH_FLOWS, sizeof(*b.flows))) == NULL ||
+	    (b.bufs = calloc(BENCH_FLOWS, BENCH_FLOW_MAX)) == NULL)
+		logerrx("%s: calloc", __func__);
+	bench_flows(b.flows, BENCH_FLOWS);
+
+	for (b.mask = STORE_FIELD_ALL & ~STORE_FIELD_CRC32;;
+	    b.mask = STORE_FIELD_ALL) {
+		for (i = 0; i < BENCH_FLOWS; i++) {
+			if (store_flow_serialise_masked(&b.flows[i], b.mask,
+			    b.bufs + i * BENCH_FLOW_MAX, BENCH_FLOW_MAX,
+			    &b.lens[i], ebuf, sizeof(ebuf)) != STORE_ERR_OK)
+				logerrx("%s: %s", __func__, ebuf);
+		}
+		if (b.mask & STORE_FIELD_CRC32) {
+			bench_run("store serialise crc32", bench_serialise, &b);
+			bench_run("store deserialise crc32",
+			    bench_deserialise, &b);
+			break;
+		}
+		bench_run("store serialise", bench_serialise, &b);
+		bench_run("store deserialise", bench_deserialise, &b);
+	}
+	bench_run("store format", bench_format, &b);
+
+	free(b.flows);
+	free(b.bufs);
+}
+
+/* Peer and template lookup, as done for each packet */
+
+struct bench_peers {
+	struct peers	 peers;
+	struct xaddr	*addrs;
+	u_int		 npeers;
+};
+
+#define BENCH_TEMPLATES	4	/* per peer */
+
+static u_int64_t
+bench_lookup(void *ctx, u_int64_t n)
+{
+	struct bench_peers *b = ctx;
+	struct peer_state *peer;
+	u_int64_t i;
+	u_int j;
+
+	for (i = 0; i < n; i++) {
+		/* Visit the peers in a scattered order */
+		j = (u_int)((i * 2654435761U) % b->npeers);
+		if ((peer = find_peer(&b->peers, &b->addrs[j])) == NULL ||
+		    peer_nf9_find_template(peer, 1,
+		    BENCH_TEMPLATE_ID + i % BENCH_TEMPLATES) == NULL)
+			logerrx("%s: lookup failed", __func__);
+	}
+	return (n);
+}
+
+static void
+bench_peer_lookup(struct flowd_config *conf)
+{
+	static const u_int counts[] = { 16, 1024, 65536 };
+	struct bench_peers b;
+	struct peer_state *peer;
+	char name[64];
+	u_int i, j, t;
+
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		bzero(&b, sizeof(b));
+		b.npeers = counts[i];
+		b.peers.max_peers = b.npeers;
+		b.peers.max_templates = conf->max_templates;
+		b.peers.max_sources = conf->max_sources;
+		b.peers.max_template_len = conf->max_template_len;
+		TAILQ_INIT(&b.peers.peer_list);
+		if ((b.addrs = calloc(b.npeers, sizeof(*b.addrs))) == NULL)
+			logerrx("%s: calloc", __func__);
+		for (j = 0; j < b.npeers; j++) {
+			b.addrs[j].af = AF_INET;
+			b.addrs[j].v4.s_addr = htonl(0x0a000000 + j * 7919);
+			if ((peer = new_peer(&b.peers, conf,
+			    &b.addrs[j])) == NULL)
+				logerrx("%s: new_peer", __func__);
+			for (t = 0; t < BENCH_TEMPLATES; t++) {
+				peer_nf9_new_template(peer, &b.peers, 1,
+				    BENCH_TEMPLATE_ID + t);
+			}
+		}
+		snprintf(name, sizeof(name), "peer+template lookup %u peers",
+		    b.npeers);
+		bench_run(name, bench_lookup, &b);
+		/* The peers are left behind; we're not here for long */
+		free(b.addrs);
+	}
+}
+
+static void
+bench_usage(void)
+{
+	fprintf(stderr, "Usage: flowd-bench [-t msec] [benchmark]\n");
+	fprintf(stderr, "  -t msec    Time each run for msec milliseconds\n");
+	fprintf(stderr, "Only benchmarks whose names contain \"benchmark\" "
+	    "are run.\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	struct flowd_config conf;
+	FILE *f;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "t:h")) != -1) {
+		switch (ch) {
+		case 't':
+			if ((bench_ns = strtoul(optarg, NULL, 10)) == 0) {
+				bench_usage();
+				exit(1);
+			}
+			bench_ns *= 1000000;
+			break;
+		default:
+			bench_usage();
+			exit(1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1) {
+		bench_usage();
+		exit(1);
+	}
+	if (argc == 1)
+		bench_match = argv[0];
+
+	loginit("flowd-bench", 1, 0);
+	bench_seed = 0x666;
+
+	/* The collector's defaults, with no filter and every field stored */
+	if ((f = tmpfile()) == NULL)
+		logerr("tmpfile");
+	rewind(f);
+	bzero(&conf, sizeof(conf));
+	if (parse_config("bench", f, &conf, 1) != 0)
+		logerrx("couldn't set up configuration");
+	fclose(f);
+	conf.store_mask = STORE_FIELD_ALL;
+	conf.workers = 1;
+	workers_setup(&conf);
+	if (workers[0].outq == NULL)
+		workers[0].outq = output_queue_new(&conf);
+
+	printf("%-36s %20s %18s\n", "benchmark", "rate", "cost");
+	bench_decoders(&conf, &workers[0]);
+	bench_filters();
+	bench_store();
+	bench_peer_lookup(&conf);
+
+	return (0);
+}
@@ -305,18 +305,361 @@ flow_match(const struct filter_rule *rule,
 	return (1);
 }
 
+
+/*
+ * Compiled rule index.
+ *
+ * Each rule is filed under a single criterion that every flow it can
+ * match must satisfy: a src, dst or agent prefix in a binary trie, or a
+ * port or protocol bucket. Rules that use only negated criteria, or none
+ * that can be indexed, go on a list that is evaluated for every flow.
+ * A flow is tested against just the rules its own addresses, ports and
+ * protocol select, in rule order, so "quick" and last-match semantics
+ * are unchanged.
+ */
+
+#define FI_NONE		((u_int32_t)-1)
+#define FI_BUCKETS	256
+#define FI_TRIE_AGENT	0
+#define FI_TRIE_SRC	1
+#define FI_TRIE_DST	2
+
+struct filter_trie_node {
+	u_int32_t	child[2];	/* 0 if none; node 0 is the root */
+	u_int32_t	first;		/* first rule with this exact prefix */
+};
+
+struct filter_trie {
+	struct filter_trie_node	*nodes;
+	u_int32_t		 num_nodes;
+	u_int32_t		 alloc_nodes;
+};
+
+/* Counts not yet folded into a rule, as its flows' packet may be invalid */
+struct filter_held {
+	u_int64_t		 matches, wins, stops;
+};
+
+struct filter_index {
+	u_int32_t		 num_rules;
+	struct filter_rule	**rules;	/* in rule order */
+	u_int32_t		*next;		/* next rule in same bucket */
+	u_int32_t		*cand;		/* scratch: candidate rules */
+	/* Flows whose evaluation stopped at each rule, [num_rules] = none */
+	u_int64_t		*stops;
+	struct filter_held	*held;		/* since filter_index_commit() */
+	u_int32_t		*touched;	/* rules with held counts */
+	u_int32_t		 num_touched;
+	struct filter_trie	 trie[3][2];	/* agent/src/dst, inet/inet6 */
+	u_int32_t		 src_port[FI_BUCKETS];
+	u_int32_t		 dst_port[FI_BUCKETS];
+	u_int32_t		 proto[FI_BUCKETS];
+	u_int32_t		 other;		/* tested against every flow */
+};
+
+static struct filter_trie *
+filter_trie_get(struct filter_index *fi, int which, int af)
+{
+	switch (af) {
+	case AF_INET:
+		return (&fi->trie[which][0]);
+	case AF_INET6:
+		return (&fi->trie[which][1]);
+	default:
+		return (NULL);
+	}
+}
+
+static u_int32_t *
+filter_trie_insert(struct filter_trie *t, const struct xaddr *net,
+    int masklen)
+{
+	struct filter_trie_node *n;
+	u_int32_t node, bit;
+	int i;
+
+	if (t->nodes == NULL) {
+		t->alloc_nodes = 16;
+		if ((t->nodes = calloc(t->alloc_nodes,
+		    sizeof(*t->nodes))) == NULL)
+			logerrx("%s: calloc failed", __func__);
+		t->nodes[0].first = FI_NONE;
+		t->num_nodes = 1;
+	}
+	for (node = 0, i = 0; i < masklen; i++) {
+		bit = (net->addr8[i >> 3] >> (7 - (i & 7))) & 1;
+		if (t->nodes[node].child[bit] != 0) {
+			node = t->nodes[node].child[bit];
+			continue;
+		}
+		if (t->num_nodes == t->alloc_nodes) {
+			if ((n = realloc(t->nodes, t->alloc_nodes * 2 *
+			    sizeof(*t->nodes))) == NULL)
+				logerrx("%s: realloc failed", __func__);
+			t->nodes = n;
+			t->alloc_nodes *= 2;
+		}
+		n = &t->nodes[t->num_nodes];
+		n->child[0] = n->child[1] = 0;
+		n->first = FI_NONE;
+		t->nodes[node].child[bit] = t->num_nodes;
+		node = t->num_nodes++;
+	}
+	return (&t->nodes[node].first);
+}
+
+static u_int32_t *
+filter_index_key(struct filter_index *fi, const struct filter_rule *fr)
+{
+	const struct filter_match *m = &fr->match;
+	const struct xaddr *net = NULL;
+	struct filter_trie *t = NULL, *tt;
+	u_int32_t indexable;
+	int masklen = -1;
+
+	indexable = m->match_what & ~m->match_negate;
+
+	/* Prefer the most specific prefix, then ports, then protocol */
+#define FI_TRY_ADDR(what, which, addr, len) do { \
+		if ((indexable & FF_MATCH_##what) && m->len > masklen && \
+		    addr_netmatch(&m->addr, &m->addr, m->len) == 0 && \
+		    (tt = filter_trie_get(fi, which, m->addr.af)) != NULL) { \
+			t = tt; \
+			net = &m->addr; \
+			masklen = m->len; \
+		} \
+	} while (0)
+	FI_TRY_ADDR(SRC_ADDR, FI_TRIE_SRC, src_addr, src_masklen);
+	FI_TRY_ADDR(DST_ADDR, FI_TRIE_DST, dst_addr, dst_masklen);
+	FI_TRY_ADDR(AGENT_ADDR, FI_TRIE_AGENT, agent_addr, agent_masklen);
+#undef FI_TRY_ADDR
+
+	if (masklen > 0)
+		return (filter_trie_insert(t, net, masklen));
+	if (indexable & FF_MATCH_DST_PORT)
+		return (&fi->dst_port[m->dst_port & (FI_BUCKETS - 1)]);
+	if (indexable & FF_MATCH_SRC_PORT)
+		return (&fi->src_port[m->src_port & (FI_BUCKETS - 1)]);
+	if ((indexable & FF_MATCH_PROTOCOL) &&
+	    m->proto >= 0 && m->proto < FI_BUCKETS)
+		return (&fi->proto[m->proto]);
+	if (masklen == 0)
+		return (filter_trie_insert(t, net, 0));
+
+	return (&fi->other);
+}
+
+struct filter_index *
+filter_compile(struct filter_list *filter)
+{
+	struct filter_index *fi;
+	struct filter_rule *fr;
+	u_int32_t i, *head;
+
+	if ((fi = calloc(1, sizeof(*fi))) == NULL)
+		logerrx("%s: calloc failed", __func__);
+	TAILQ_FOREACH(fr, filter, entry)
+		fi->num_rules++;
+	if ((fi->rules = calloc(fi->num_rules + 1,
+	    sizeof(*fi->rules))) == NULL ||
+	    (fi->next = calloc(fi->num_rules + 1, sizeof(*fi->next))) == NULL ||
+	    (fi->cand = calloc(fi->num_rules + 1, sizeof(*fi->cand))) == NULL ||
+	    (fi->stops = calloc(fi->num_rules + 1,
+	    sizeof(*fi->stops))) == NULL ||
+	    (fi->held = calloc(fi->num_rules + 1,
+	    sizeof(*fi->held))) == NULL ||
+	    (fi->touched = calloc(fi->num_rules + 1,
+	    sizeof(*fi->touched))) == NULL)
+		logerrx("%s: calloc failed", __func__);
+	memset(fi->src_port, 0xff, sizeof(fi->src_port));
+	memset(fi->dst_port, 0xff, sizeof(fi->dst_port));
+	memset(fi->proto, 0xff, sizeof(fi->proto));
+	fi->other = FI_NONE;
+
+	i = 0;
+	TAILQ_FOREACH(fr, filter, entry)
+		fi->rules[i++] = fr;
+
+	/* Insert backwards so every bucket's chain is in rule order */
+	for (i = fi->num_rules; i > 0; i--) {
+		head = filter_index_key(fi, fi->rules[i - 1]);
+		fi->next[i - 1] = *head;
+		*head = i - 1;
+	}
+
+	return (fi);
+}
+
+void
+filter_index_free(struct filter_index *fi)
+{
+	int i, j;
+
+	if (fi == NULL)
+		return;
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 2; j++)
+			free(fi->trie[i][j].nodes);
+	}
+	free(fi->rules);
+	free(fi->next);
+	free(fi->cand);
+	free(fi->stops);
+	free(fi->held);
+	free(fi->touched);
+	free(fi);
+}
+
+/* Held counts for rule r, or [num_rules] for flows that stopped at none */
+static struct filter_held *
+filter_held(struct filter_index *fi, u_int32_t r)
+{
+	struct filter_held *h = &fi->held[r];
+
+	if (h->matches == 0 && h->wins == 0 && h->stops == 0)
+		fi->touched[fi->num_touched++] = r;
+	return (h);
+}
+
+/*
+ * Count the flows filtered since the last commit or rollback. flowd does
+ * so once a packet is known to be valid; other callers needn't, as
+ * filter_index_sync() commits too.
+ */
+void
+filter_index_commit(struct filter_index *fi)
+{
+	struct filter_held *h;
+	u_int32_t i, r;
+
+	if (fi == NULL)
+		return;
+	for (i = 0; i < fi->num_touched; i++) {
+		r = fi->touched[i];
+		h = &fi->held[r];
+		if (r < fi->num_rules) {
+			fi->rules[r]->matches += h->matches;
+			fi->rules[r]->wins += h->wins;
+		}
+		fi->stops[r] += h->stops;
+		bzero(h, sizeof(*h));
+	}
+	fi->num_touched = 0;
+}
+
+/* Forget the flows filtered since the last commit or rollback */
+void
+filter_index_rollback(struct filter_index *fi)
+{
+	u_int32_t i;
+
+	if (fi == NULL)
+		return;
+	for (i = 0; i < fi->num_touched; i++)
+		bzero(&fi->held[fi->touched[i]], sizeof(*fi->held));
+	fi->num_touched = 0;
+}
+
+/*
+ * Fold pending evaluation counts into the rules. A flow that stopped at
+ * rule n was evaluated against every rule up to and including n.
+ */
+void
+filter_index_sync(struct filter_index *fi)
+{
+	u_int64_t evaluations;
+	u_int32_t i;
+
+	if (fi == NULL)
+		return;
+	filter_index_commit(fi);
+	evaluations = fi->stops[fi->num_rules];
+	fi->stops[fi->num_rules] = 0;
+	for (i = fi->num_rules; i > 0; i--) {
+		evaluations += fi->stops[i - 1];
+		fi->stops[i - 1] = 0;
+		fi->rules[i - 1]->evaluations += evaluations;
+	}
+}
+
+/* Whether every flow is accepted untagged, without looking at it */
+int
+filter_index_empty(const struct filter_index *fi)
+{
+	return (fi != NULL && fi->num_rules == 0);
+}
+
+static u_int32_t
+filter_collect(struct filter_index *fi, u_int32_t n, u_int32_t r)
+{
+	for (; r != FI_NONE; r = fi->next[r])
+		fi->cand[n++] = r;
+	return (n);
+}
+
+static u_int32_t
+filter_collect_trie(struct filter_index *fi, u_int32_t n, int which,
+    const struct xaddr *addr)
+{
+	struct filter_trie *t;
+	u_int32_t node, bit;
+	int i, maxlen;
+
+	if ((t = filter_trie_get(fi, which, addr->af)) == NULL ||
+	    t->nodes == NULL)
+		return (n);
+	maxlen = addr->af == AF_INET ? 32 : 128;
+	for (node = 0, i = 0;; i++) {
+		n = filter_collect(fi, n, t->nodes[node].first);
+		if (i == maxlen)
+			break;
+		bit = (addr->addr8[i >> 3] >> (7 - (i & 7))) & 1;
+		if ((node = t->nodes[node].child[bit]) == 0)
+			break;
+	}
+	return (n);
+}
+
 u_int
-filter_flow(struct store_flow_complete *flow, struct filter_list *filter)
+filter_flow(struct store_flow_complete *flow, struct filter_index *fi)
 {
 	u_int action = FF_ACTION_ACCEPT;
 	struct filter_rule *fr, *last_rule;
-	int i, m;
+	u_int32_t i, j, n, r, other, stop, last = 0;
+	struct xaddr addr;
+	int m;
 
-	i = 0;
+	/* Gather the rules this flow could match, in rule order */
+	addr = flow->src_addr;
+	n = filter_collect_trie(fi, 0, FI_TRIE_SRC, &addr);
+	addr = flow->dst_addr;
+	n = filter_collect_trie(fi, n, FI_TRIE_DST, &addr);
+	addr = flow->agent_addr;
+	n = filter_collect_trie(fi, n, FI_TRIE_AGENT, &addr);
+	n = filter_collect(fi, n, fi->src_port[ntohs(flow->ports.src_port) &
+	    (FI_BUCKETS - 1)]);
+	n = filter_collect(fi, n, fi->dst_port[ntohs(flow->ports.dst_port) &
+	    (FI_BUCKETS - 1)]);
+	n = filter_collect(fi, n, fi->proto[flow->pft.protocol]);
+	for (i = 1; i < n; i++) {
+		r = fi->cand[i];
+		for (j = i; j > 0 && fi->cand[j - 1] > r; j--)
+			fi->cand[j] = fi->cand[j - 1];
+		fi->cand[j] = r;
+	}
+
+	/* Merge with the unindexed rules as we go */
 	last_rule = NULL;
-	TAILQ_FOREACH(fr, filter, entry) {
+	stop = fi->num_rules;
+	other = fi->other;
+	for (i = 0; i < n || other != FI_NONE;) {
+		if (other != FI_NONE && (i == n || other < fi->cand[i])) {
+			r = other;
+			other = fi->next[other];
+		} else
+			r = fi->cand[i++];
+		fr = fi->rules[r];
 		m = flow_match(fr, flow);
-		fr->evaluations++;
 
 #ifdef FILTER_DEBUG
 		logit(LOG_DEBUG, "%s: match %s = %d action %d/%d", __func__,
@@ -324,15 +667,19 @@ filter_flow(struct store_flow_complete *flow, struct filter_list *filter)
 #endif
 
 		if (m) {
-			fr->matches++;
+			filter_held(fi, r)->matches++;
 			last_rule = fr;
-			if (fr->quick)
+			last = r;
+			if (fr->quick) {
+				stop = r;
 				break;
+			}
 		}
 	}
+	filter_held(fi, stop)->stops++;
 
 	if (last_rule != NULL) {
-		last_rule->wins++;
+		filter_held(fi, last)->wins++;
 		action = last_rule->action.action_what;
 		if (action == FF_ACTION_TAG) {
 			flow->hdr.fields = ntohl(flow->hdr.fields);
@@ -350,3 +697,255 @@ filter_flow(struct store_flow_complete *flow, struct filter_list *filter)
 	return (action);
 }
 
+/*
+ * Deciding from a v4 block's header and column directory whether any of
+ * its flows could be accepted, so a reader may skip a block the rules
+ * would discard whole. Each criterion of a rule is tested against the
+ * range of the column it depends on; a flow without the field reads as
+ * zero, as it does once decoded.
+ */
+
+#define FB_NO		0
+#define FB_YES		1
+#define FB_MAYBE	2
+
+#define FB_ACCEPT	1	/* or tag */
+#define FB_DISCARD	2
+
+struct filter_block_stats {
+	u_int32_t		flows;
+	u_int32_t		count[STORE_NUM_COLUMNS];
+	u_int16_t		width[STORE_NUM_COLUMNS];
+	u_int8_t		min[STORE_NUM_COLUMNS][16];
+	u_int8_t		max[STORE_NUM_COLUMNS][16];
+};
+
+static u_int64_t
+fb_value(const u_int8_t *v, u_int width)
+{
+	u_int64_t r = 0;
+	u_int i;
+
+	for (i = 0; i < width && i < 8; i++)
+		r = (r << 8) | v[i];
+	return (r);
+}
+
+/* Are the values of a numeric column all, some or none in [lo, hi]? */
+static int
+fb_range(const struct filter_block_stats *st, int id, u_int64_t lo,
+    u_int64_t hi)
+{
+	u_int64_t min, max;
+
+	min = max = 0;
+	if (st->count[id] != 0) {
+		if (st->width[id] > 8)
+			return (FB_MAYBE);
+		max = fb_value(st->max[id], st->width[id]);
+		if (st->count[id] == st->flows)
+			min = fb_value(st->min[id], st->width[id]);
+	}
+	if (max < lo || min > hi)
+		return (FB_NO);
+	if (min >= lo && max <= hi)
+		return (FB_YES);
+	return (FB_MAYBE);
+}
+
+/* Likewise for an address criterion, on its v4 and v6 columns */
+static int
+fb_addr(const struct filter_block_stats *st, int id4, int id6,
+    const struct xaddr *net, int masklen)
+{
+	struct xaddr mask, lo, hi;
+	int id, other;
+	u_int w;
+
+	id = net->af == AF_INET ? id4 : id6;
+	other = net->af == AF_INET ? id6 : id4;
+	w = net->af == AF_INET ? 4 : 16;
+	if (st->count[id] == 0 || st->width[id] != w)
+		return (st->count[id] == 0 ? FB_NO : FB_MAYBE);
+	if (addr_netmask(net->af, masklen, &mask) == -1 ||
+	    addr_and(&lo, net, &mask) == -1 ||
+	    addr_hostmask(net->af, masklen, &mask) == -1 ||
+	    addr_or(&hi, &lo, &mask) == -1)
+		return (FB_MAYBE);
+	if (memcmp(st->max[id], lo.addr8, w) < 0 ||
+	    memcmp(st->min[id], hi.addr8, w) > 0)
+		return (FB_NO);
+	if (st->count[id] == st->flows && st->count[other] == 0 &&
+	    memcmp(st->min[id], lo.addr8, w) >= 0 &&
+	    memcmp(st->max[id], hi.addr8, w) <= 0)
+		return (FB_YES);
+	return (FB_MAYBE);
+}
+
+/* Does the rule match all, some or none of a block's flows? */
+static int
+fb_match(const struct filter_rule *rule, const struct filter_block_stats *st)
+{
+	u_int64_t lo, hi;
+	u_int32_t n4, n6, n;
+	int id, m, flags, ret = FB_YES;
+
+#define FBNEG(what) (rule->match.match_negate & FF_MATCH_##what)
+#define FBMATCH(what) (rule->match.match_what & FF_MATCH_##what)
+#define FBRET(what) do { \
+		if (FBNEG(what) && m != FB_MAYBE) \
+			m = m == FB_YES ? FB_NO : FB_YES; \
+		if (m == FB_NO) \
+			return (FB_NO); \
+		if (m == FB_MAYBE) \
+			ret = FB_MAYBE; \
+	} while (0)
+
+	if (FBMATCH(AGENT_ADDR)) {
+		m = fb_addr(st, STORE_COL_AGENT_ADDR4, STORE_COL_AGENT_ADDR6,
+		    &rule->match.agent_addr, rule->match.agent_masklen);
+		FBRET(AGENT_ADDR);
+	}
+	if (FBMATCH(IFNDX_IN)) {
+		m = fb_range(st, STORE_COL_IF_INDEX_IN,
+		    (u_int32_t)rule->match.ifndx_in,
+		    (u_int32_t)rule->match.ifndx_in);
+		FBRET(IFNDX_IN);
+	}
+	if (FBMATCH(IFNDX_OUT)) {
+		m = fb_range(st, STORE_COL_IF_INDEX_OUT,
+		    (u_int32_t)rule->match.ifndx_out,
+		    (u_int32_t)rule->match.ifndx_out);
+		FBRET(IFNDX_OUT);
+	}
+	if (FBMATCH(AF)) {
+		/* Either address of the family will do */
+		n4 = st->count[STORE_COL_SRC_ADDR4] +
+		    st->count[STORE_COL_DST_ADDR4];
+		n6 = st->count[STORE_COL_SRC_ADDR6] +
+		    st->count[STORE_COL_DST_ADDR6];
+		id = rule->match.af == AF_INET ? STORE_COL_SRC_ADDR4 :
+		    STORE_COL_SRC_ADDR6;
+		m = FB_MAYBE;
+		if ((rule->match.af == AF_INET ? n4 : n6) == 0)
+			m = FB_NO;
+		else if (st->count[id] == st->flows)
+			m = FB_YES;
+		FBRET(AF);
+	}
+	if (FBMATCH(SRC_ADDR)) {
+		m = fb_addr(st, STORE_COL_SRC_ADDR4, STORE_COL_SRC_ADDR6,
+		    &rule->match.src_addr, rule->match.src_masklen);
+		FBRET(SRC_ADDR);
+	}
+	if (FBMATCH(DST_ADDR)) {
+		m = fb_addr(st, STORE_COL_DST_ADDR4, STORE_COL_DST_ADDR6,
+		    &rule->match.dst_addr, rule->match.dst_masklen);
+		FBRET(DST_ADDR);
+	}
+	if (FBMATCH(SRC_PORT)) {
+		m = fb_range(st, STORE_COL_SRC_PORT, rule->match.src_port,
+		    rule->match.src_port);
+		FBRET(SRC_PORT);
+	}
+	if (FBMATCH(DST_PORT)) {
+		m = fb_range(st, STORE_COL_DST_PORT, rule->match.dst_port,
+		    rule->match.dst_port);
+		FBRET(DST_PORT);
+	}
+	if (FBMATCH(PROTOCOL)) {
+		m = fb_range(st, STORE_COL_PROTOCOL, rule->match.proto,
+		    rule->match.proto);
+		FBRET(PROTOCOL);
+	}
+	if (FBMATCH(TOS)) {
+		m = fb_range(st, STORE_COL_TOS, rule->match.tos,
+		    rule->match.tos);
+		FBRET(TOS);
+	}
+	if (FBMATCH(TCP_FLAGS)) {
+		/* Only known if every flow has the same flags */
+		m = FB_MAYBE;
+		n = st->count[STORE_COL_TCP_FLAGS];
+		if (n == 0 || (n == st->flows &&
+		    st->min[STORE_COL_TCP_FLAGS][0] ==
+		    st->max[STORE_COL_TCP_FLAGS][0])) {
+			flags = n == 0 ? 0 : st->min[STORE_COL_TCP_FLAGS][0];
+			m = (flags & rule->match.tcp_flags_mask) ==
+			    rule->match.tcp_flags_equals ? FB_YES : FB_NO;
+		}
+		FBRET(TCP_FLAGS);
+	}
+	if (FBMATCH(DAYTIME)) {
+		m = FB_MAYBE;
+		FBRET(DAYTIME);
+	}
+	if (FBMATCH(ABSTIME)) {
+		lo = rule->match.absafter > 0 ?
+		    (u_int64_t)rule->match.absafter + 1 : 0;
+		hi = rule->match.absbefore > 0 ?
+		    (u_int64_t)rule->match.absbefore - 1 : 0xffffffff;
+		m = lo > hi ? FB_NO : fb_range(st, STORE_COL_RECV_SEC, lo, hi);
+		FBRET(ABSTIME);
+	}
+
+#undef FBMATCH
+#undef FBNEG
+#undef FBRET
+
+	return (ret);
+}
+
+/*
+ * Returns 0 if the rules would discard every flow of the v4 block with
+ * the header and column directory given, or 1 if some may be accepted.
+ * Counters are not updated, as the flows of a skipped block are never
+ * evaluated.
+ */
+int
+filter_block(struct filter_index *fi, const struct store_block_header *hdr,
+    const struct store_block_column *cols, u_int ncols)
+{
+	struct filter_block_stats st;
+	struct store_block_column col;
+	struct filter_rule *fr;
+	u_int i, id;
+	int m, action, done, pending;
+
+	bzero(&st, sizeof(st));
+	st.flows = ntohl(hdr->flows);
+	for (i = 0; i < ncols; i++) {
+		memcpy(&col, &cols[i], sizeof(col));
+		if ((id = ntohs(col.id)) >= STORE_NUM_COLUMNS ||
+		    ntohs(col.width) > sizeof(col.min))
+			continue;
+		st.count[id] = ntohl(col.count);
+		st.width[id] = ntohs(col.width);
+		memcpy(st.min[id], col.min, sizeof(col.min));
+		memcpy(st.max[id], col.max, sizeof(col.max));
+	}
+
+	/*
+	 * Follow the rules as filter_flow() would, collecting the actions
+	 * that some of the flows could end with: those stopped by a quick
+	 * rule, and the last matches of the rest.
+	 */
+	done = 0;
+	pending = FB_ACCEPT;
+	for (i = 0; i < fi->num_rules && pending != 0; i++) {
+		fr = fi->rules[i];
+		if ((m = fb_match(fr, &st)) == FB_NO)
+			continue;
+		action = fr->action.action_what == FF_ACTION_DISCARD ?
+		    FB_DISCARD : FB_ACCEPT;
+		if (fr->quick) {
+			done |= action;
+			if (m == FB_YES)
+				pending = 0;
+		} else if (m == FB_YES)
+			pending = action;
+		else
+			pending |= action;
+	}
+	return (((done | pending) & FB_ACCEPT) != 0);
+}
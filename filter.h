@@ -83,7 +83,18 @@ struct filter_rule {
 };
 TAILQ_HEAD(filter_list, filter_rule);
 
-u_int filter_flow(struct store_flow_complete *flow, struct filter_list *filter);
+/* Rules compiled for matching; refers to, but does not own, the rules */
+struct filter_index;
+
+struct filter_index *filter_compile(struct filter_list *filter);
+void filter_index_free(struct filter_index *fi);
+void filter_index_sync(struct filter_index *fi);
+void filter_index_commit(struct filter_index *fi);
+void filter_index_rollback(struct filter_index *fi);
+int filter_index_empty(const struct filter_index *fi);
+u_int filter_flow(struct store_flow_complete *flow, struct filter_index *fi);
+int filter_block(struct filter_index *fi, const struct store_block_header *hdr,
+    const struct store_block_column *cols, u_int ncols);
 const char *format_rule(const struct filter_rule *rule);
 
 #endif /* _FILTER_H */
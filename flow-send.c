@@ -0,0 +1,816 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Replay flows from flowd logs as NetFlow v.5, v.9 or IPFIX export, for
+ * load testing collectors.
+ *
+ * The logs are encoded into packets up front, so that reading and encoding
+ * them doesn't limit the rate at which they are sent. Only the export
+ * header, which carries the exporter's sequence number and the time,
+ * differs between sends; it is built per message and sent alongside the
+ * shared packet body with scatter/gather I/O.
+ */
+
+#define PROGNAME	"flow-send"
+
+#include "flowd-common.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "flowd.h"
+#include "store.h"
+#include "netflow.h"
+#include "stats.h"
+
+RCSID("$Id$");
+
+#define SEND_MAX_PACKET		8192
+#define SEND_DEFAULT_PACKET	1400	/* v.9/IPFIX, to stay under the MTU */
+#define SEND_MAX_HDR		24
+#define SEND_MAX_BATCH		1024
+#define SEND_DEFAULT_BATCH	32
+#define SEND_DEFAULT_REFRESH	20	/* data packets between templates */
+#define SEND_UPTIME_MS		86400000	/* simulated exporter uptime */
+
+/* Template IDs and the fields of each; v.9 and IPFIX share the numbers */
+#define SEND_TEMPLATE4		256
+#define SEND_TEMPLATE6		257
+
+static const u_int16_t template4[][2] = {
+	{ NF9_IPV4_SRC_ADDR, 4 }, { NF9_IPV4_DST_ADDR, 4 },
+	{ NF9_IPV4_NEXT_HOP, 4 }, { NF9_SRC_MASK, 1 }, { NF9_DST_MASK, 1 },
+	{ 0, 0 }
+};
+static const u_int16_t template6[][2] = {
+	{ NF9_IPV6_SRC_ADDR, 16 }, { NF9_IPV6_DST_ADDR, 16 },
+	{ NF9_IPV6_NEXT_HOP, 16 }, { NF9_IPV6_SRC_MASK, 1 },
+	{ NF9_IPV6_DST_MASK, 1 },
+	{ 0, 0 }
+};
+/* Followed, in both, by these */
+static const u_int16_t template_common[][2] = {
+	{ NF9_INPUT_SNMP, 4 }, { NF9_OUTPUT_SNMP, 4 },
+	{ NF9_IN_PACKETS, 8 }, { NF9_IN_BYTES, 8 },
+	{ NF9_FIRST_SWITCHED, 4 }, { NF9_LAST_SWITCHED, 4 },
+	{ NF9_L4_SRC_PORT, 2 }, { NF9_L4_DST_PORT, 2 },
+	{ NF9_TCP_FLAGS, 1 }, { NF9_IN_PROTOCOL, 1 }, { NF9_SRC_TOS, 1 },
+	{ NF9_SRC_AS, 4 }, { NF9_DST_AS, 4 },
+	{ NF9_ENGINE_TYPE, 1 }, { NF9_ENGINE_ID, 1 },
+	{ 0, 0 }
+};
+
+/* An encoded packet, less its export header */
+struct send_packet {
+	u_int32_t	offset;		/* of its body in bodies */
+	u_int16_t	len;
+	u_int16_t	flows;		/* 0 for the templates */
+};
+
+/* Packets being filled, one per address family for v.9 and IPFIX */
+struct send_builder {
+	u_int8_t	buf[SEND_MAX_PACKET];
+	u_int		len;
+	u_int		flows;
+	int		af;
+	u_int16_t	template_id;
+};
+
+struct exporter {
+	int		fd;
+	u_int32_t	source_id;
+	u_int32_t	seq;
+	u_int		since_templates;	/* data packets sent */
+	int		sent_templates;
+};
+
+static int version = 9;
+static u_int max_packet = SEND_DEFAULT_PACKET;
+static u_int8_t *bodies = NULL;
+static size_t bodies_len = 0, bodies_alloc = 0;
+static struct send_packet *packets = NULL;
+static u_int num_packets = 0, packets_alloc = 0;
+static struct send_packet templates;
+static u_int64_t flows_read = 0, flows_skipped = 0;
+static volatile sig_atomic_t stop_flag = 0;
+#ifdef HAVE_SENDMMSG
+static int no_sendmmsg = 0;
+#endif
+
+/* Totals */
+static u_int64_t sent_packets = 0, sent_flows = 0, sent_bytes = 0;
+static u_int64_t send_errors = 0;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: %s [options] host port flow-log "
+	    "[flow-log ...]\n", PROGNAME);
+	fprintf(stderr, "This is %s version %s. Valid commandline options:\n",
+	    PROGNAME, PROGVER);
+	fprintf(stderr, "  -V ver   Send NetFlow version 5, 9 (default) or 10 (IPFIX)\n");
+	fprintf(stderr, "  -r rate  Send at rate packets/sec, or flows/sec with an \"fps\" suffix\n");
+	fprintf(stderr, "  -l num   Send the logs 'num' times (default 1, 0 for ever)\n");
+	fprintf(stderr, "  -e num   Simulate 'num' exporters\n");
+	fprintf(stderr, "  -a addr  Send from addr, and each further exporter from the next\n");
+	fprintf(stderr, "  -b num   Send up to 'num' packets per system call\n");
+	fprintf(stderr, "  -t num   Resend templates every 'num' packets per exporter\n");
+	fprintf(stderr, "  -s size  Make v.9 and IPFIX packets at most 'size' bytes\n");
+	fprintf(stderr, "  -q       Don't report progress\n");
+	fprintf(stderr, "  -h       Display this help\n");
+}
+
+static void
+sighand_stop(int signo)
+{
+	stop_flag = 1;
+}
+
+static void
+bodies_append(const u_int8_t *buf, u_int len, u_int flows)
+{
+	struct send_packet *p;
+	void *tmp;
+	size_t n;
+
+	if (num_packets == packets_alloc) {
+		n = packets_alloc == 0 ? 1024 : packets_alloc * 2;
+		if ((tmp = realloc(packets, n * sizeof(*packets))) == NULL)
+			logerrx("%s: realloc", __func__);
+		packets = tmp;
+		packets_alloc = n;
+	}
+	if (bodies_len + len > bodies_alloc) {
+		for (n = bodies_alloc == 0 ? 1024 * 1024 : bodies_alloc;
+		    n < bodies_len + len; n *= 2)
+			;
+		if ((tmp = realloc(bodies, n)) == NULL)
+			logerrx("%s: realloc of %zu bytes", __func__, n);
+		bodies = tmp;
+		bodies_alloc = n;
+	}
+	p = &packets[num_packets++];
+	p->offset = bodies_len;
+	p->len = len;
+	p->flows = flows;
+	memcpy(bodies + bodies_len, buf, len);
+	bodies_len += len;
+}
+
+static void
+put8(struct send_builder *b, u_int v)
+{
+	b->buf[b->len++] = v;
+}
+
+static void
+put16(struct send_builder *b, u_int v)
+{
+	u_int16_t n = htons(v);
+
+	memcpy(b->buf + b->len, &n, sizeof(n));
+	b->len += sizeof(n);
+}
+
+static void
+put32(struct send_builder *b, u_int32_t v)
+{
+	u_int32_t n = htonl(v);
+
+	memcpy(b->buf + b->len, &n, sizeof(n));
+	b->len += sizeof(n);
+}
+
+/* Copy a field that is already in network byte order */
+static void
+putn(struct send_builder *b, const void *p, u_int len)
+{
+	memcpy(b->buf + b->len, p, len);
+	b->len += len;
+}
+
+static u_int
+template_len(const u_int16_t (*t)[2])
+{
+	u_int len;
+
+	for (len = 0; (*t)[0] != 0; t++)
+		len += (*t)[1];
+	return (len);
+}
+
+static u_int
+template_count(const u_int16_t (*t)[2])
+{
+	u_int n;
+
+	for (n = 0; t[n][0] != 0; n++)
+		;
+	return (n);
+}
+
+static void
+put_template(struct send_builder *b, u_int16_t id, const u_int16_t (*t)[2])
+{
+	u_int i, n = template_count(t), nc = template_count(template_common);
+
+	put16(b, id);
+	put16(b, n + nc);
+	for (i = 0; i < n; i++) {
+		put16(b, t[i][0]);
+		put16(b, t[i][1]);
+	}
+	for (i = 0; i < nc; i++) {
+		put16(b, template_common[i][0]);
+		put16(b, template_common[i][1]);
+	}
+}
+
+/* The templates, sent in a packet of their own */
+static void
+build_templates(void)
+{
+	struct send_builder b;
+
+	bzero(&b, sizeof(b));
+	put16(&b, version == 9 ? NF9_TEMPLATE_FLOWSET_ID :
+	    NF10_TEMPLATE_FLOWSET_ID);
+	put16(&b, 0);
+	put_template(&b, SEND_TEMPLATE4, template4);
+	put_template(&b, SEND_TEMPLATE6, template6);
+	b.buf[2] = b.len >> 8;
+	b.buf[3] = b.len;
+
+	bodies_append(b.buf, b.len, 0);
+	templates = packets[--num_packets];
+}
+
+/*
+ * Flow times are relative to the exporter's uptime; keep their age and
+ * make them relative to ours.
+ */
+static u_int32_t
+flow_time(struct store_flow_complete *f, u_int32_t t)
+{
+	u_int32_t age;
+
+	if ((ntohl(f->hdr.fields) & STORE_FIELD_AGENT_INFO) == 0)
+		return (SEND_UPTIME_MS);
+	age = ntohl(f->ainfo.sys_uptime_ms) - ntohl(t);
+	return (age > SEND_UPTIME_MS ? 0 : SEND_UPTIME_MS - age);
+}
+
+static u_int
+header_len(void)
+{
+	switch (version) {
+	case 5:
+		return (sizeof(struct NF5_HEADER));
+	case 9:
+		return (sizeof(struct NF9_HEADER));
+	default:
+		return (sizeof(struct NF10_HEADER));
+	}
+}
+
+static void
+builder_flush(struct send_builder *b)
+{
+	u_int16_t len;
+
+	if (b->flows == 0)
+		return;
+	if (version != 5) {
+		while (b->len % 4 != 0)
+			put8(b, 0);
+		len = htons(b->len);
+		memcpy(b->buf + 2, &len, sizeof(len));
+	}
+	bodies_append(b->buf, b->len, b->flows);
+	b->len = b->flows = 0;
+}
+
+static void
+encode_v5(struct send_builder *b, struct store_flow_complete *f)
+{
+	u_int32_t start, finish;
+
+	if (b->flows == NF5_MAXFLOWS)
+		builder_flush(b);
+
+	start = finish = SEND_UPTIME_MS;
+	if (ntohl(f->hdr.fields) & STORE_FIELD_FLOW_TIMES) {
+		start = flow_time(f, f->ftimes.flow_start);
+		finish = flow_time(f, f->ftimes.flow_finish);
+	}
+
+	putn(b, &f->src_addr.v4, 4);
+	putn(b, &f->dst_addr.v4, 4);
+	putn(b, &f->gateway_addr.v4, 4);
+	put16(b, ntohl(f->ifndx.if_index_in));
+	put16(b, ntohl(f->ifndx.if_index_out));
+	put32(b, store_ntohll(f->packets.flow_packets));
+	put32(b, store_ntohll(f->octets.flow_octets));
+	put32(b, start);
+	put32(b, finish);
+	putn(b, &f->ports.src_port, 2);
+	putn(b, &f->ports.dst_port, 2);
+	put8(b, 0);
+	put8(b, f->pft.tcp_flags);
+	put8(b, f->pft.protocol);
+	put8(b, f->pft.tos);
+	put16(b, ntohl(f->asinf.src_as));
+	put16(b, ntohl(f->asinf.dst_as));
+	put8(b, f->asinf.src_mask);
+	put8(b, f->asinf.dst_mask);
+	put16(b, 0);
+	b->flows++;
+}
+
+static void
+encode_v9(struct send_builder *b, struct store_flow_complete *f)
+{
+	u_int32_t start, finish;
+	u_int alen = b->af == AF_INET6 ? 16 : 4;
+	u_int rlen = template_len(template_common) + alen * 3 + 2;
+
+	if (header_len() + b->len + rlen + 3 > max_packet)
+		builder_flush(b);
+	if (b->flows == 0) {
+		/* Data set header; the length is filled in by the flush */
+		put16(b, b->template_id);
+		put16(b, 0);
+	}
+
+	start = finish = SEND_UPTIME_MS;
+	if (ntohl(f->hdr.fields) & STORE_FIELD_FLOW_TIMES) {
+		start = flow_time(f, f->ftimes.flow_start);
+		finish = flow_time(f, f->ftimes.flow_finish);
+	}
+
+	putn(b, &f->src_addr.xa, alen);
+	putn(b, &f->dst_addr.xa, alen);
+	putn(b, &f->gateway_addr.xa, alen);
+	put8(b, f->asinf.src_mask);
+	put8(b, f->asinf.dst_mask);
+	putn(b, &f->ifndx.if_index_in, 4);
+	putn(b, &f->ifndx.if_index_out, 4);
+	putn(b, &f->packets.flow_packets, 8);
+	putn(b, &f->octets.flow_octets, 8);
+	put32(b, start);
+	put32(b, finish);
+	putn(b, &f->ports.src_port, 2);
+	putn(b, &f->ports.dst_port, 2);
+	put8(b, f->pft.tcp_flags);
+	put8(b, f->pft.protocol);
+	put8(b, f->pft.tos);
+	putn(b, &f->asinf.src_as, 4);
+	putn(b, &f->asinf.dst_as, 4);
+	put8(b, f->finf.engine_type);
+	put8(b, f->finf.engine_id);
+	b->flows++;
+}
+
+static void
+encode_flow(struct send_builder *b4, struct send_builder *b6,
+    struct store_flow_complete *f)
+{
+	int af;
+
+	flows_read++;
+	/* Fields that weren't stored are sent as zero */
+	af = f->src_addr.af;
+	if (af != AF_INET && af != AF_INET6)
+		af = f->dst_addr.af;
+	if (af != AF_INET && af != AF_INET6)
+		af = AF_INET;
+	if ((f->src_addr.af != 0 && f->src_addr.af != af) ||
+	    (f->dst_addr.af != 0 && f->dst_addr.af != af)) {
+		flows_skipped++;
+		return;
+	}
+
+	if (version == 5) {
+		if (af == AF_INET6) {
+			flows_skipped++;
+			return;
+		}
+		encode_v5(b4, f);
+	} else
+		encode_v9(af == AF_INET6 ? b6 : b4, f);
+}
+
+static void
+load_logs(char **paths, int npaths)
+{
+	struct store_flow_complete flow;
+	struct send_builder *b4, *b6;
+	struct store_iter it;
+	char ebuf[512];
+	int i, fd, r;
+
+	if ((b4 = calloc(1, sizeof(*b4))) == NULL ||
+	    (b6 = calloc(1, sizeof(*b6))) == NULL)
+		logerrx("%s: calloc", __func__);
+	b4->af = AF_INET;
+	b4->template_id = SEND_TEMPLATE4;
+	b6->af = AF_INET6;
+	b6->template_id = SEND_TEMPLATE6;
+
+	for (i = 0; i < npaths; i++) {
+		if (strcmp(paths[i], "-") == 0)
+			fd = STDIN_FILENO;
+		else if ((fd = open(paths[i], O_RDONLY)) == -1)
+			logerr("open(%s)", paths[i]);
+		if (store_iter_open(&it, fd, ebuf,
+		    sizeof(ebuf)) != STORE_ERR_OK)
+			logerrx("%s: %s", paths[i], ebuf);
+		for (;;) {
+			r = store_iter_next(&it, &flow, ebuf, sizeof(ebuf));
+			if (r == STORE_ERR_EOF)
+				break;
+			if (r != STORE_ERR_OK)
+				logerrx("%s: %s", paths[i], ebuf);
+			encode_flow(b4, b6, &flow);
+		}
+		store_iter_close(&it);
+		if (fd != STDIN_FILENO)
+			close(fd);
+	}
+	builder_flush(b4);
+	builder_flush(b6);
+	free(b4);
+	free(b6);
+}
+
+/* The export header for the packet p from exporter ex */
+static u_int
+build_header(u_int8_t *hdr, struct exporter *ex, struct send_packet *p,
+    struct timeval *now)
+{
+	struct NF5_HEADER *h5 = (struct NF5_HEADER *)hdr;
+	struct NF9_HEADER *h9 = (struct NF9_HEADER *)hdr;
+	struct NF10_HEADER *h10 = (struct NF10_HEADER *)hdr;
+
+	switch (version) {
+	case 5:
+		bzero(h5, sizeof(*h5));
+		h5->c.version = htons(5);
+		h5->c.flows = htons(p->flows);
+		h5->uptime_ms = htonl(SEND_UPTIME_MS);
+		h5->time_sec = htonl(now->tv_sec);
+		h5->time_nanosec = htonl(now->tv_usec * 1000);
+		h5->flow_sequence = htonl(ex->seq);
+		h5->engine_id = ex->source_id;
+		ex->seq += p->flows;
+		return (sizeof(*h5));
+	case 9:
+		h9->c.version = htons(9);
+		/* Each template is a record too */
+		h9->c.flows = htons(p->flows == 0 ? 2 : p->flows);
+		h9->uptime_ms = htonl(SEND_UPTIME_MS);
+		h9->time_sec = htonl(now->tv_sec);
+		h9->package_sequence = htonl(ex->seq++);
+		h9->source_id = htonl(ex->source_id);
+		return (sizeof(*h9));
+	default:
+		h10->c.version = htons(10);
+		h10->c.flows = htons(sizeof(*h10) + p->len);
+		h10->time_sec = htonl(now->tv_sec);
+		h10->package_sequence = htonl(ex->seq);
+		h10->source_id = htonl(ex->source_id);
+		ex->seq += p->flows;
+		return (sizeof(*h10));
+	}
+}
+
+/* Send n packets through ex, counting what went */
+static void
+send_packets(struct exporter *ex, struct send_packet **pkts, u_int n)
+{
+	static u_int8_t hdrs[SEND_MAX_BATCH][SEND_MAX_HDR];
+	static struct iovec iov[SEND_MAX_BATCH][2];
+#ifdef HAVE_SENDMMSG
+	static struct mmsghdr msgs[SEND_MAX_BATCH];
+	int r;
+#endif
+	struct timeval now;
+	u_int i, done;
+
+	gettimeofday(&now, NULL);
+	for (i = 0; i < n; i++) {
+		iov[i][0].iov_base = hdrs[i];
+		iov[i][0].iov_len = build_header(hdrs[i], ex, pkts[i], &now);
+		iov[i][1].iov_base = bodies + pkts[i]->offset;
+		iov[i][1].iov_len = pkts[i]->len;
+	}
+
+	for (done = 0; done < n;) {
+#ifdef HAVE_SENDMMSG
+		if (!no_sendmmsg) {
+			for (i = done; i < n; i++) {
+				bzero(&msgs[i], sizeof(msgs[i]));
+				msgs[i].msg_hdr.msg_iov = iov[i];
+				msgs[i].msg_hdr.msg_iovlen = 2;
+			}
+			r = sendmmsg(ex->fd, msgs + done, n - done, 0);
+			if (r == -1 && errno == ENOSYS) {
+				no_sendmmsg = 1;
+				continue;
+			}
+			if (r > 0) {
+				for (i = done; i < done + r; i++) {
+					sent_packets++;
+					sent_flows += pkts[i]->flows;
+					sent_bytes += iov[i][0].iov_len +
+					    iov[i][1].iov_len;
+				}
+				done += r;
+				continue;
+			}
+			if (errno != EINTR) {
+				/* Lose this packet and carry on */
+				send_errors++;
+				done++;
+			}
+			continue;
+		}
+#endif
+		if (writev(ex->fd, iov[done], 2) == -1) {
+			if (errno != EINTR) {
+				send_errors++;
+				done++;
+			}
+			continue;
+		}
+		sent_packets++;
+		sent_flows += pkts[done]->flows;
+		sent_bytes += iov[done][0].iov_len + iov[done][1].iov_len;
+		done++;
+	}
+}
+
+/* Parse a rate, returning whether it counts flows rather than packets */
+static int
+parse_rate(const char *s, double *rate)
+{
+	char *ep;
+
+	*rate = strtod(s, &ep);
+	if (*rate <= 0 || ep == s)
+		logerrx("Invalid rate \"%s\"", s);
+	if (*ep == '\0' || strcasecmp(ep, "pps") == 0)
+		return (0);
+	if (strcasecmp(ep, "fps") == 0)
+		return (1);
+	logerrx("Invalid rate \"%s\"", s);
+}
+
+static void
+open_exporters(struct exporter *ex, u_int n, const char *host,
+    const char *port, const char *from)
+{
+	struct addrinfo hints, *ai;
+	struct sockaddr_storage ss;
+	struct xaddr base, addr;
+	socklen_t slen;
+	u_int i;
+	int r;
+
+	bzero(&hints, sizeof(hints));
+	hints.ai_socktype = SOCK_DGRAM;
+	if (from != NULL) {
+		if (addr_pton(from, &base) == -1)
+			logerrx("Invalid source address \"%s\"", from);
+		hints.ai_family = base.af;
+	}
+	if ((r = getaddrinfo(host, port, &hints, &ai)) != 0)
+		logerrx("%s port %s: %s", host, port, gai_strerror(r));
+
+	for (i = 0; i < n; i++) {
+		if ((ex[i].fd = socket(ai->ai_family, SOCK_DGRAM, 0)) == -1)
+			logerr("socket");
+		if (from != NULL) {
+			/* Count up from the base address */
+			addr = base;
+			if (addr.af == AF_INET)
+				addr.v4.s_addr = htonl(ntohl(addr.v4.s_addr) + i);
+			else {
+				addr.addr32[3] = htonl(ntohl(addr.addr32[3]) +
+				    i);
+			}
+			slen = sizeof(ss);
+			if (addr_xaddr_to_sa(&addr, (struct sockaddr *)&ss,
+			    &slen, 0) == -1)
+				logerrx("%s: addr_xaddr_to_sa", __func__);
+			if (bind(ex[i].fd, (struct sockaddr *)&ss, slen) == -1)
+				logerr("bind to %s", addr_ntop_buf(&addr));
+		}
+		if (connect(ex[i].fd, ai->ai_addr, ai->ai_addrlen) == -1)
+			logerr("connect to %s port %s", host, port);
+		ex[i].source_id = i;
+		ex[i].seq = 0;
+		ex[i].since_templates = 0;
+		ex[i].sent_templates = 0;
+	}
+	freeaddrinfo(ai);
+}
+
+static void
+report(u_int64_t start, int final)
+{
+	double secs = (stats_now_ns() - start) / 1e9;
+
+	if (secs <= 0)
+		secs = 1e-9;
+	fprintf(stderr, "%s%llu packets, %llu flows, %llu bytes in %.3fs: "
+	    "%.0f packets/s, %.0f flows/s, %.1f Mbit/s, %llu errors\n",
+	    final ? "sent " : "", (unsigned long long)sent_packets,
+	    (unsigned long long)sent_flows, (unsigned long long)sent_bytes,
+	    secs, sent_packets / secs, sent_flows / secs,
+	    sent_bytes * 8 / secs / 1e6, (unsigned long long)send_errors);
+}
+
+int
+main(int argc, char **argv)
+{
+	extern char *optarg;
+	extern int optind;
+	struct send_packet *batch[SEND_MAX_BATCH];
+	struct exporter *exporters, *ex;
+	const char *from;
+	u_int64_t start, due, now, units, last_report;
+	u_int nexporters, nbatch, loops, loop, refresh, cur, n, p;
+	struct timespec ts;
+	double rate;
+	int ch, count_flows, quiet;
+
+	from = NULL;
+	rate = 0;
+	count_flows = quiet = 0;
+	nexporters = loops = 1;
+	nbatch = SEND_DEFAULT_BATCH;
+	refresh = SEND_DEFAULT_REFRESH;
+
+	while ((ch = getopt(argc, argv, "V:a:b:e:hl:qr:s:t:")) != -1) {
+		switch (ch) {
+		case 'V':
+			version = atoi(optarg);
+			if (version != 5 && version != 9 && version != 10) {
+				fprintf(stderr, "Invalid -V version.\n");
+				usage();
+				exit(1);
+			}
+			break;
+		case 'a':
+			from = optarg;
+			break;
+		case 'b':
+			nbatch = atoi(optarg);
+			if (nbatch == 0 || nbatch > SEND_MAX_BATCH) {
+				fprintf(stderr, "-b must be between 1 and "
+				    "%d.\n", SEND_MAX_BATCH);
+				usage();
+				exit(1);
+			}
+			break;
+		case 'e':
+			nexporters = atoi(optarg);
+			if (nexporters == 0 || nexporters > 65536) {
+				fprintf(stderr, "Invalid -e value.\n");
+				usage();
+				exit(1);
+			}
+			break;
+		case 'h':
+			usage();
+			return (0);
+		case 'l':
+			loops = atoi(optarg);
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'r':
+			count_flows = parse_rate(optarg, &rate);
+			break;
+		case 's':
+			max_packet = atoi(optarg);
+			if (max_packet < 512 || max_packet > SEND_MAX_PACKET) {
+				fprintf(stderr, "-s must be between 512 and "
+				    "%d.\n", SEND_MAX_PACKET);
+				usage();
+				exit(1);
+			}
+			break;
+		case 't':
+			if ((refresh = atoi(optarg)) == 0) {
+				fprintf(stderr, "Invalid -t value.\n");
+				usage();
+				exit(1);
+			}
+			break;
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	loginit(PROGNAME, 1, 0);
+
+	if (argc - optind < 3) {
+		usage();
+		exit(1);
+	}
+
+	if (version != 5)
+		build_templates();
+	load_logs(argv + optind + 2, argc - optind - 2);
+	if (num_packets == 0)
+		logerrx("No flows to send");
+	if (!quiet) {
+		fprintf(stderr, "%llu flows read, %llu skipped, in %u packets "
+		    "of %zu bytes\n", (unsigned long long)flows_read,
+		    (unsigned long long)flows_skipped, num_packets,
+		    bodies_len + num_packets * header_len());
+	}
+
+	if ((exporters = calloc(nexporters, sizeof(*exporters))) == NULL)
+		logerrx("calloc");
+	open_exporters(exporters, nexporters, argv[optind],
+	    argv[optind + 1], from);
+
+	signal(SIGINT, sighand_stop);
+	signal(SIGTERM, sighand_stop);
+	signal(SIGPIPE, SIG_IGN);
+
+	/*
+	 * Each exporter in turn sends a batch of packets, preceded by the
+	 * templates when they are due. With a rate, we sleep before each
+	 * batch until it may be sent.
+	 */
+	start = last_report = stats_now_ns();
+	units = 0;
+	cur = 0;
+	for (loop = 0; !stop_flag && (loops == 0 || loop < loops); loop++) {
+		for (p = 0; !stop_flag && p < num_packets;) {
+			ex = &exporters[cur];
+			cur = (cur + 1) % nexporters;
+			n = 0;
+			if (version != 5 && (!ex->sent_templates ||
+			    ex->since_templates >= refresh)) {
+				batch[n++] = &templates;
+				ex->sent_templates = 1;
+				ex->since_templates = 0;
+			}
+			for (; n < nbatch && p < num_packets; p++, n++) {
+				batch[n] = &packets[p];
+				units += count_flows ? packets[p].flows : 1;
+				ex->since_templates++;
+			}
+			if (rate > 0) {
+				due = start + (u_int64_t)(units * 1e9 / rate);
+				if ((now = stats_now_ns()) < due) {
+					ts.tv_sec = (due - now) / 1000000000;
+					ts.tv_nsec = (due - now) % 1000000000;
+					nanosleep(&ts, NULL);
+				}
+			}
+			send_packets(ex, batch, n);
+			if (!quiet && (now = stats_now_ns()) >
+			    last_report + 1000000000ULL) {
+				report(start, 0);
+				last_report = now;
+			}
+		}
+	}
+	report(start, 1);
+
+	return (stop_flag ? 1 : 0);
+}
@@ -19,6 +19,7 @@
 #include "flowd-common.h"
 
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include <unistd.h>
 #include <errno.h>
@@ -26,7 +27,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 #include <poll.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "flowd.h"
 #include "store.h"
@@ -47,10 +52,20 @@ usage(void)
 	fprintf(stderr, "  -q       Don't print flows to stdout (use with -o)\n");
 	fprintf(stderr, "  -d       Print debugging information\n");
 	fprintf(stderr, "  -f path  Filter flows using rule file\n");
+	fprintf(stderr, "  -r rule  Filter flows using rule (may be repeated)\n");
 	fprintf(stderr, "  -o path  Write binary log to path (use with -f)\n");
+	fprintf(stderr, "  -F fmt   Write the -o log in format fmt (v3 or v4)\n");
+	fprintf(stderr, "  -z       Compress the -o log\n");
 	fprintf(stderr, "  -v       Display all available flow information\n");
 	fprintf(stderr, "  -c       Return CSV output compatible with flow-import\n");
-	fprintf(stderr, "  -U       Report times in UTC rather than local time\n");
+	fprintf(stderr, "  -t type  Print flows as text (default), csv, json or raw\n");
+	fprintf(stderr, "  -C list  Print these comma separated columns (csv, json)\n");
+	fprintf(stderr, "  -s time  Read only flows received at or after time\n");
+	fprintf(stderr, "  -e time  Read only flows received at or before time\n");
+	fprintf(stderr, "  -U       Report (and read -s/-e) times in UTC rather than local time\n");
+	fprintf(stderr, "  -j num   Read logs using 'num' threads\n");
+	fprintf(stderr, "  -u       With -j, print flows as they are read, in no set order\n");
+	fprintf(stderr, "  -R       Follow the flow rings given rather than read logs\n");
 	fprintf(stderr, "  -h       Display this help\n");
 }
 
@@ -71,33 +86,689 @@ open_start_log(const char *path, int debug)
 	return (fd);
 }
 
+/* Write out any flows held in the output frame */
+static void
+flush_frame(int ofd, struct store_frame *frame)
+{
+	char ebuf[512];
+	u_int8_t *buf;
+	int len;
+
+	if (frame->raw_len == 0)
+		return;
+	if (store_frame_serialise(frame, &buf, &len, ebuf,
+	    sizeof(ebuf)) != STORE_ERR_OK ||
+	    store_put_buf(ofd, (char *)buf, len, ebuf,
+	    sizeof(ebuf)) != STORE_ERR_OK)
+		logerrx("%s", ebuf);
+}
+
+/* Write serialised flows to the output log, or its frame if compressed */
+static void
+put_output(int ofd, struct store_frame *frame, u_int8_t *buf, int len)
+{
+	char ebuf[512];
+
+	if (frame == NULL) {
+		if (store_put_buf(ofd, (char *)buf, len, ebuf,
+		    sizeof(ebuf)) != STORE_ERR_OK)
+			logerrx("%s", ebuf);
+		return;
+	}
+	if (store_frame_add(frame, buf, len, ebuf,
+	    sizeof(ebuf)) != STORE_ERR_OK)
+		logerrx("%s", ebuf);
+	if (frame->raw_len >= STORE_FRAME_SIZE)
+		flush_frame(ofd, frame);
+}
+
+/* Write out any flows held in the output block */
+static void
+flush_block(int ofd, struct store_block *block, struct store_frame *frame)
+{
+	char ebuf[512];
+	u_int8_t *buf;
+	int len;
+
+	if (block->flows == 0)
+		return;
+	if (store_block_serialise(block, &buf, &len, ebuf,
+	    sizeof(ebuf)) != STORE_ERR_OK)
+		logerrx("%s", ebuf);
+	put_output(ofd, frame, buf, len);
+}
+
+/* Seconds since the epoch, or an ISO 8601 date and time */
+static u_int32_t
+parse_time(const char *s, int utc)
+{
+	static const char *fmts[] = {
+		"%Y-%m-%dT%H:%M:%S", "%Y-%m-%dT%H:%M", "%Y-%m-%d", NULL
+	};
+	struct tm tm;
+	const char *cp;
+	char *ep;
+	unsigned long n;
+	time_t t;
+	int i;
+
+	n = strtoul(s, &ep, 10);
+	if (*s != '\0' && *ep == '\0')
+		return (n > 0xffffffff ? 0xffffffff : n);
+
+	for (i = 0; fmts[i] != NULL; i++) {
+		bzero(&tm, sizeof(tm));
+		if ((cp = strptime(s, fmts[i], &tm)) != NULL && *cp == '\0')
+			break;
+	}
+	if (fmts[i] == NULL)
+		logerrx("Invalid time \"%s\"", s);
+	if (utc) {
+#ifdef HAVE_TIMEGM
+		t = timegm(&tm);
+#else
+		logerrx("UTC times are not supported on this platform");
+#endif
+	} else {
+		tm.tm_isdst = -1;
+		t = mktime(&tm);
+	}
+	if (t < 0)
+		logerrx("Invalid time \"%s\"", s);
+	return (t);
+}
+
+/* Skip v4 blocks whose flows the filter rules would all discard */
+static int
+block_filter(void *arg, const struct store_block_header *hdr,
+    const struct store_block_column *cols, u_int ncols)
+{
+	return (filter_block((struct filter_index *)arg, hdr, cols, ncols));
+}
+
+/*
+ * Filter rules given on the command line, parsed as if they were lines of
+ * a rule file and appended to any from one
+ */
+static void
+parse_rules(char **rules, int nrules, struct flowd_config *conf, int merge)
+{
+	struct flowd_config rule_config;
+	struct filter_rule *fr;
+	FILE *f;
+	int i;
+
+	if ((f = tmpfile()) == NULL)
+		logerr("tmpfile");
+	for (i = 0; i < nrules; i++)
+		fprintf(f, "%s\n", rules[i]);
+	if (fflush(f) != 0 || fseek(f, 0, SEEK_SET) == -1)
+		logerr("tmpfile");
+	if (!merge) {
+		if (parse_config("-r", f, conf, 1) != 0)
+			exit(1);
+		fclose(f);
+		return;
+	}
+	bzero(&rule_config, sizeof(rule_config));
+	if (parse_config("-r", f, &rule_config, 1) != 0)
+		exit(1);
+	fclose(f);
+	while ((fr = TAILQ_FIRST(&rule_config.filter_list)) != NULL) {
+		TAILQ_REMOVE(&rule_config.filter_list, fr, entry);
+		TAILQ_INSERT_TAIL(&conf->filter_list, fr, entry);
+	}
+	conf->store_mask |= rule_config.store_mask;
+}
+
+/*
+ * Use a log's index, if it has one, to read only the part of it that
+ * holds flows in the time range.
+ */
+static void
+seek_index(struct store_iter *it, int fd, const char *path, u_int32_t from,
+    u_int32_t to, int debug)
+{
+	char ipath[1024], ebuf[512];
+	struct stat sb;
+	off_t start, end;
+	int ifd, r;
+
+	if (snprintf(ipath, sizeof(ipath), "%s%s", path,
+	    STORE_INDEX_SUFFIX) >= (int)sizeof(ipath) ||
+	    (ifd = open(ipath, O_RDONLY)) == -1)
+		return;
+	if (fstat(fd, &sb) == -1)
+		logerr("fstat(%s)", path);
+	r = store_index_find(ifd, sb.st_size, from, to, &start, &end,
+	    ebuf, sizeof(ebuf));
+	close(ifd);
+	if (r != STORE_ERR_OK) {
+		logit(LOG_WARNING, "%s: %s, ignoring index", ipath, ebuf);
+		return;
+	}
+	if (debug) {
+		fprintf(stderr, "%s: reading bytes %lld-%lld of %lld\n", path,
+		    (long long)start, (long long)end, (long long)sb.st_size);
+	}
+	if (store_iter_seek(it, start, end, ebuf, sizeof(ebuf)) != STORE_ERR_OK)
+		logerrx("%s: %s", path, ebuf);
+}
+
+/* Flows are written to stdout a buffer of this size at a time */
+#define OUTBUF_SIZE		(256 * 1024)
+
+#ifdef HAVE_PTHREAD
+#define OUTBUF_QUEUED		8	/* per thread, ahead of the writer */
+/* Smallest part of an indexed log read by a thread on its own */
+#define JOB_MIN_LEN		(1024 * 1024)
+
+struct outbuf {
+	TAILQ_ENTRY(outbuf)	entry;
+	size_t			len;
+	char			data[OUTBUF_SIZE];
+};
+TAILQ_HEAD(outbuf_list, outbuf);
+
+/* A log, or a part of one that begins and ends at index marks */
+struct read_job {
+	const char		*path;
+	off_t			start, end;	/* end is -1 to read to EOF */
+	int			first;		/* part of its log */
+	int			done;
+	struct outbuf_list	out;		/* formatted, unwritten */
+	u_int64_t		blocks, blocks_skipped;
+	u_int64_t		frames, frames_skipped;
+};
+
+struct read_thread {
+	pthread_t		thread;
+	struct store_fmt	fmt;		/* private time cache */
+	struct filter_list	filter_copy;	/* private rule counters */
+	struct filter_index	*filters;
+	struct outbuf		*ob;
+};
+
+/* State shared by the -j threads */
+static struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		ready;		/* output queued, or job done */
+	pthread_cond_t		space;		/* output written */
+	pthread_mutex_t		wlock;		/* stdout, if unordered */
+	struct read_job		*jobs;
+	u_int			njobs, next_job;
+	u_int			head;		/* job being written */
+	u_int			queued, max_queued;
+	struct outbuf_list	free;
+	int			ordered;
+	int			verbose, timed;
+	struct store_fmt	fmt;
+	u_int32_t		want, from, to;
+} par = {
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+	PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void
+add_job(const char *path, off_t start, off_t end, int first)
+{
+	struct read_job *job;
+
+	if ((par.jobs = realloc(par.jobs,
+	    (par.njobs + 1) * sizeof(*par.jobs))) == NULL)
+		logerrx("%s: realloc failed", __func__);
+	job = &par.jobs[par.njobs++];
+	bzero(job, sizeof(*job));
+	job->path = path;
+	job->start = start;
+	job->end = end;
+	job->first = first;
+}
+
+/*
+ * Queue a log to be read, split at its index marks into parts of at
+ * least chunk bytes. Only the part of the log that the index says may
+ * hold flows in the time range is queued.
+ */
+static void
+plan_jobs(const char *path, off_t chunk, int debug)
+{
+	char ipath[1024], ebuf[512];
+	struct stat sb;
+	off_t start, end, last, *marks;
+	int ifd, i, nmarks, first;
+
+	if (stat(path, &sb) == -1)
+		logerr("stat(%s)", path);
+	if (snprintf(ipath, sizeof(ipath), "%s%s", path,
+	    STORE_INDEX_SUFFIX) >= (int)sizeof(ipath) ||
+	    (ifd = open(ipath, O_RDONLY)) == -1) {
+		add_job(path, 0, -1, 1);
+		return;
+	}
+	start = 0;
+	end = sb.st_size;
+	if ((par.timed && store_index_find(ifd, sb.st_size, par.from,
+	    par.to, &start, &end, ebuf, sizeof(ebuf)) != STORE_ERR_OK) ||
+	    lseek(ifd, 0, SEEK_SET) == -1 ||
+	    store_index_marks(ifd, sb.st_size, &marks, &nmarks, ebuf,
+	    sizeof(ebuf)) != STORE_ERR_OK) {
+		close(ifd);
+		logit(LOG_WARNING, "%s: %s, ignoring index", ipath, ebuf);
+		add_job(path, 0, -1, 1);
+		return;
+	}
+	close(ifd);
+	if (debug && par.timed) {
+		fprintf(stderr, "%s: reading bytes %lld-%lld of %lld\n", path,
+		    (long long)start, (long long)end, (long long)sb.st_size);
+	}
+	first = 1;
+	last = start;
+	for (i = 0; i < nmarks && marks[i] < end; i++) {
+		if (marks[i] - last < chunk)
+			continue;
+		add_job(path, last, marks[i], first);
+		last = marks[i];
+		first = 0;
+	}
+	if (first || end > last)
+		add_job(path, last, end, first);
+	free(marks);
+}
+
+static struct outbuf *
+outbuf_get(void)
+{
+	struct outbuf *ob;
+
+	pthread_mutex_lock(&par.lock);
+	if ((ob = TAILQ_FIRST(&par.free)) != NULL)
+		TAILQ_REMOVE(&par.free, ob, entry);
+	pthread_mutex_unlock(&par.lock);
+	if (ob == NULL && (ob = malloc(sizeof(*ob))) == NULL)
+		logerrx("%s: malloc failed", __func__);
+	ob->len = 0;
+	return (ob);
+}
+
+static void
+outbuf_write(struct outbuf *ob)
+{
+	if (atomicio(vwrite, STDOUT_FILENO, ob->data, ob->len) != ob->len)
+		logerr("write(stdout)");
+}
+
+/* Hand a thread's full output buffer to be written */
+static void
+outbuf_flush(struct read_thread *t, struct read_job *job)
+{
+	if (t->ob == NULL || t->ob->len == 0)
+		return;
+	if (!par.ordered) {
+		pthread_mutex_lock(&par.wlock);
+		outbuf_write(t->ob);
+		pthread_mutex_unlock(&par.wlock);
+		t->ob->len = 0;
+		return;
+	}
+	pthread_mutex_lock(&par.lock);
+	/* The job being written mustn't wait on those queued behind it */
+	while (par.queued >= par.max_queued && job != &par.jobs[par.head])
+		pthread_cond_wait(&par.space, &par.lock);
+	TAILQ_INSERT_TAIL(&job->out, t->ob, entry);
+	par.queued++;
+	pthread_cond_signal(&par.ready);
+	pthread_mutex_unlock(&par.lock);
+	t->ob = NULL;
+}
+
+static void
+outbuf_line(struct read_thread *t, struct read_job *job, const char *s)
+{
+	size_t len;
+
+	len = strlen(s);
+	if (t->ob != NULL && t->ob->len + len + 1 > OUTBUF_SIZE)
+		outbuf_flush(t, job);
+	if (t->ob == NULL)
+		t->ob = outbuf_get();
+	memcpy(t->ob->data + t->ob->len, s, len);
+	t->ob->len += len;
+	t->ob->data[t->ob->len++] = '\n';
+}
+
+static void
+read_part(struct read_thread *t, struct read_job *job)
+{
+	struct store_flow_complete flow;
+	struct store_iter it;
+	char buf[2048], ebuf[512];
+	u_int32_t recv_sec;
+	u_int8_t *rec;
+	int fd, r, len;
+
+	if ((fd = open(job->path, O_RDONLY)) == -1)
+		logerr("open(%s)", job->path);
+	if (store_iter_open(&it, fd, ebuf, sizeof(ebuf)) != STORE_ERR_OK)
+		logerrx("%s: %s", job->path, ebuf);
+	store_iter_want(&it, par.want, par.timed, par.from, par.to);
+	if (t->filters != NULL)
+		store_iter_filter(&it, block_filter, t->filters);
+	if (job->end != -1 && store_iter_seek(&it, job->start, job->end,
+	    ebuf, sizeof(ebuf)) != STORE_ERR_OK)
+		logerrx("%s: %s", job->path, ebuf);
+
+	if (par.verbose >= 1 && job->first) {
+		snprintf(buf, sizeof(buf), "LOGFILE %s", job->path);
+		outbuf_line(t, job, buf);
+	}
+
+	for (;;) {
+		r = store_iter_next_raw(&it, &rec, &len, ebuf, sizeof(ebuf));
+		if (r == STORE_ERR_EOF)
+			break;
+		else if (r != STORE_ERR_OK)
+			logerrx("%s: %s", job->path, ebuf);
+		if (par.timed && (!store_raw_recv_time(rec, &recv_sec) ||
+		    recv_sec < par.from || recv_sec > par.to))
+			continue;
+		if (store_flow_deserialise(rec, len, &flow, ebuf,
+		    sizeof(ebuf)) != STORE_ERR_OK)
+			logerrx("%s: %s", job->path, ebuf);
+		if (t->filters != NULL && filter_flow(&flow,
+		    t->filters) == FF_ACTION_DISCARD)
+			continue;
+		if (par.verbose < 0)
+			continue;
+		if (t->ob != NULL &&
+		    OUTBUF_SIZE - t->ob->len < STORE_FMT_LINE_MAX)
+			outbuf_flush(t, job);
+		if (t->ob == NULL)
+			t->ob = outbuf_get();
+		t->ob->len += store_fmt_flow(&t->fmt, &flow,
+		    t->ob->data + t->ob->len);
+	}
+	outbuf_flush(t, job);
+
+	job->blocks = it.blocks;
+	job->blocks_skipped = it.blocks_skipped;
+	job->frames = it.frames;
+	job->frames_skipped = it.frames_skipped;
+	store_iter_close(&it);
+	close(fd);
+
+	pthread_mutex_lock(&par.lock);
+	job->done = 1;
+	pthread_cond_signal(&par.ready);
+	pthread_mutex_unlock(&par.lock);
+}
+
+static void *
+read_thread_main(void *arg)
+{
+	struct read_thread *t = (struct read_thread *)arg;
+	struct read_job *job;
+
+	for (;;) {
+		pthread_mutex_lock(&par.lock);
+		job = par.next_job < par.njobs ? &par.jobs[par.next_job++] :
+		    NULL;
+		pthread_mutex_unlock(&par.lock);
+		if (job == NULL)
+			break;
+		read_part(t, job);
+	}
+	if (t->ob != NULL)
+		free(t->ob);
+	return (NULL);
+}
+
+/* Write the threads' output in the order of the logs given */
+static void
+write_ordered(void)
+{
+	struct read_job *job;
+	struct outbuf *ob;
+
+	pthread_mutex_lock(&par.lock);
+	while (par.head < par.njobs) {
+		job = &par.jobs[par.head];
+		if ((ob = TAILQ_FIRST(&job->out)) != NULL) {
+			TAILQ_REMOVE(&job->out, ob, entry);
+			par.queued--;
+			pthread_mutex_unlock(&par.lock);
+			outbuf_write(ob);
+			ob->len = 0;
+			pthread_mutex_lock(&par.lock);
+			TAILQ_INSERT_HEAD(&par.free, ob, entry);
+			pthread_cond_broadcast(&par.space);
+		} else if (job->done) {
+			par.head++;
+			pthread_cond_broadcast(&par.space);
+		} else
+			pthread_cond_wait(&par.ready, &par.lock);
+	}
+	pthread_mutex_unlock(&par.lock);
+}
+
+/*
+ * Read the logs on nthreads threads, each taking a log or a part of an
+ * indexed one at a time.
+ */
+static void
+read_parallel(char **paths, int npaths, u_int nthreads,
+    struct filter_list *filter_list, int debug)
+{
+	struct read_thread *threads, *t;
+	struct filter_rule *fr, *copy;
+	struct read_job *job;
+	struct outbuf *ob;
+	struct stat sb;
+	off_t total, chunk;
+	u_int i;
+	int r;
+
+	total = 0;
+	for (i = 0; i < (u_int)npaths; i++) {
+		if (stat(paths[i], &sb) == -1)
+			logerr("stat(%s)", paths[i]);
+		total += sb.st_size;
+	}
+	/* Enough parts to keep the threads busy to the end */
+	if ((chunk = total / (nthreads * 4)) < JOB_MIN_LEN)
+		chunk = JOB_MIN_LEN;
+	for (i = 0; i < (u_int)npaths; i++)
+		plan_jobs(paths[i], chunk, debug);
+	/* Not before, as each realloc in add_job may move the queue heads */
+	for (i = 0; i < par.njobs; i++)
+		TAILQ_INIT(&par.jobs[i].out);
+	if (nthreads > par.njobs)
+		nthreads = par.njobs;
+	par.max_queued = nthreads * OUTBUF_QUEUED;
+	TAILQ_INIT(&par.free);
+
+	if ((threads = calloc(nthreads, sizeof(*threads))) == NULL)
+		logerrx("%s: calloc failed", __func__);
+	fflush(stdout);
+	for (i = 0; i < nthreads; i++) {
+		t = &threads[i];
+		memcpy(&t->fmt, &par.fmt, sizeof(t->fmt));
+		TAILQ_INIT(&t->filter_copy);
+		TAILQ_FOREACH(fr, filter_list, entry) {
+			if ((copy = malloc(sizeof(*copy))) == NULL)
+				logerrx("%s: malloc failed", __func__);
+			memcpy(copy, fr, sizeof(*copy));
+			copy->evaluations = copy->matches = copy->wins = 0;
+			TAILQ_INSERT_TAIL(&t->filter_copy, copy, entry);
+		}
+		if (!TAILQ_EMPTY(filter_list))
+			t->filters = filter_compile(&t->filter_copy);
+		if ((r = pthread_create(&t->thread, NULL, read_thread_main,
+		    t)) != 0)
+			logerrx("%s: pthread_create: %s", __func__, strerror(r));
+	}
+
+	if (par.ordered)
+		write_ordered();
+
+	for (i = 0; i < nthreads; i++) {
+		t = &threads[i];
+		pthread_join(t->thread, NULL);
+		filter_index_sync(t->filters);
+		filter_index_free(t->filters);
+		fr = TAILQ_FIRST(filter_list);
+		while ((copy = TAILQ_FIRST(&t->filter_copy)) != NULL) {
+			TAILQ_REMOVE(&t->filter_copy, copy, entry);
+			fr->evaluations += copy->evaluations;
+			fr->matches += copy->matches;
+			fr->wins += copy->wins;
+			fr = TAILQ_NEXT(fr, entry);
+			free(copy);
+		}
+	}
+	free(threads);
+
+	for (i = 0; i < par.njobs; i++) {
+		job = &par.jobs[i];
+		if (debug) {
+			fprintf(stderr, "%s", job->path);
+			if (job->end != -1) {
+				fprintf(stderr, " [%lld-%lld]",
+				    (long long)job->start, (long long)job->end);
+			}
+			fprintf(stderr, ": %llu blocks decoded, %llu skipped, "
+			    "%llu frames decompressed, %llu skipped\n",
+			    (unsigned long long)job->blocks,
+			    (unsigned long long)job->blocks_skipped,
+			    (unsigned long long)job->frames,
+			    (unsigned long long)job->frames_skipped);
+		}
+	}
+	free(par.jobs);
+	while ((ob = TAILQ_FIRST(&par.free)) != NULL) {
+		TAILQ_REMOVE(&par.free, ob, entry);
+		free(ob);
+	}
+}
+#endif /* HAVE_PTHREAD */
+
+/* Print the flows written to a flow ring as they arrive, until it closes */
+static void
+follow_ring(const char *path, struct store_fmt *fmt,
+    struct filter_index *filters, int head, int debug)
+{
+	struct store_flow_complete flow;
+	struct ring_reader r;
+	struct store_flow *hdr;
+	char line[STORE_FMT_LINE_MAX], ebuf[512];
+	static u_int8_t buf[65536];
+	size_t got, off, flen, n;
+	int nflows;
+
+	if (ring_reader_open(&r, path, ebuf, sizeof(ebuf)) != RING_ERR_OK)
+		logerrx("%s", ebuf);
+	for (nflows = 0; head == 0 || nflows < head;) {
+		switch (ring_read(&r, buf, sizeof(buf), &got)) {
+		case RING_ERR_OK:
+			break;
+		case RING_ERR_OVERRUN:
+			fprintf(stderr, "%s: overrun, %llu flows lost so far\n",
+			    path, (unsigned long long)r.lost);
+			continue;
+		case RING_ERR_CLOSED:
+			goto out;
+		default:
+			logerrx("%s: bad record", path);
+		}
+		if (got == 0) {
+			fflush(stdout);
+			poll(NULL, 0, 100);
+			continue;
+		}
+		for (off = 0; off < got && (head == 0 || nflows < head);
+		    off += flen) {
+			hdr = (struct store_flow *)(buf + off);
+			flen = sizeof(*hdr) + hdr->len_words * 4;
+			if (store_flow_deserialise(buf + off, flen, &flow,
+			    ebuf, sizeof(ebuf)) != STORE_ERR_OK)
+				logerrx("%s", ebuf);
+			if (filters != NULL && filter_flow(&flow,
+			    filters) == FF_ACTION_DISCARD)
+				continue;
+			n = store_fmt_flow(fmt, &flow, line);
+			fwrite(line, n, 1, stdout);
+			nflows++;
+		}
+	}
+ out:
+	fflush(stdout);
+	if (debug) {
+		fprintf(stderr, "%s: %llu flows read, %llu overruns, "
+		    "%llu flows lost\n", path, (unsigned long long)r.flows,
+		    (unsigned long long)r.overruns,
+		    (unsigned long long)r.lost);
+	}
+	ring_reader_close(&r);
+}
 
 int
 main(int argc, char **argv)
 {
-	int ch, i, fd, utc, r, verbose, debug, csv;
+	int ch, i, fd, utc, r, verbose, debug, otype;
 	extern char *optarg;
 	extern int optind;
 	struct store_flow_complete flow;
 	struct store_v2_flow_complete flow_v2;
-	char buf[2048], ebuf[512];
-	const char *ffile, *ofile;
+	char line[STORE_FMT_LINE_MAX], ebuf[512];
+	const char *ffile, *ofile, *sopt, *eopt, *columns;
+	char **rules;
 	FILE *ffilef;
-	int ofd, read_legacy, head, nflows;
-	u_int32_t disp_mask;
+	int ofd, read_legacy, head, nflows, oblocks, ocompress;
+	u_int32_t disp_mask, from, to, recv_sec, want;
+	struct store_fmt fmt;
+	size_t n;
+	struct store_iter it;
+	struct store_block block;
+	struct store_frame frame, *oframe;
+	u_int8_t *rec, fbuf[512];
+	int len, timed, flen, nthreads, unordered, nrules, rings;
 	struct flowd_config filter_config;
+	struct filter_index *filters;
 	struct store_v2_header hdr_v2;
 
-	utc = verbose = debug = read_legacy = csv = 0;
-	ofile = ffile = NULL;
+	utc = verbose = debug = read_legacy = oblocks = ocompress = 0;
+	otype = STORE_FMT_TEXT;
+	ofile = ffile = sopt = eopt = columns = NULL;
 	ofd = -1;
+	oframe = NULL;
 	ffilef = NULL;
-	head = 0;
+	filters = NULL;
+	head = unordered = nrules = rings = 0;
+	nthreads = 1;
+	if ((rules = calloc(argc, sizeof(*rules))) == NULL) {
+		fprintf(stderr, "calloc failed\n");
+		exit(1);
+	}
 
 	bzero(&filter_config, sizeof(filter_config));
 
-	while ((ch = getopt(argc, argv, "H:LUdf:ho:qvc")) != -1) {
+	while ((ch = getopt(argc, argv, "C:F:H:LRUde:f:hj:o:qr:s:t:uvcz")) != -1) {
 		switch (ch) {
+		case 'C':
+			columns = optarg;
+			break;
+		case 'F':
+			if (strcasecmp(optarg, "v3") == 0)
+				oblocks = 0;
+			else if (strcasecmp(optarg, "v4") == 0)
+				oblocks = 1;
+			else {
+				fprintf(stderr, "Invalid -F format.\n");
+				usage();
+				exit(1);
+			}
+			break;
 		case 'h':
 			usage();
 			return (0);
@@ -108,12 +779,28 @@ main(int argc, char **argv)
 				exit(1);
 			}
 			break;
+		case 'j':
+			if ((nthreads = atoi(optarg)) <= 0) {
+				fprintf(stderr, "Invalid -j value.\n");
+				usage();
+				exit(1);
+			}
+			break;
 		case 'L':
 			read_legacy = 1;
 			break;
+		case 'R':
+			rings = 1;
+			break;
 		case 'U':
 			utc = 1;
 			break;
+		case 'e':
+			eopt = optarg;
+			break;
+		case 's':
+			sopt = optarg;
+			break;
 		case 'd':
 			debug = 1;
 			filter_config.opts |= FLOWD_OPT_VERBOSE;
@@ -127,11 +814,35 @@ main(int argc, char **argv)
 		case 'q':
 			verbose = -1;
 			break;
+		case 'r':
+			rules[nrules++] = optarg;
+			break;
+		case 'u':
+			unordered = 1;
+			break;
 		case 'v':
 			verbose = 1;
 			break;
 		case 'c':
-			csv = 1;
+			otype = STORE_FMT_FLOWTOOLS;
+			break;
+		case 't':
+			if (strcasecmp(optarg, "text") == 0)
+				otype = STORE_FMT_TEXT;
+			else if (strcasecmp(optarg, "csv") == 0)
+				otype = STORE_FMT_CSV;
+			else if (strcasecmp(optarg, "json") == 0)
+				otype = STORE_FMT_JSON;
+			else if (strcasecmp(optarg, "raw") == 0)
+				otype = STORE_FMT_RAW;
+			else {
+				fprintf(stderr, "Invalid -t type.\n");
+				usage();
+				exit(1);
+			}
+			break;
+		case 'z':
+			ocompress = 1;
 			break;
 		default:
 			usage();
@@ -140,12 +851,35 @@ main(int argc, char **argv)
 	}
 	loginit(PROGNAME, 1, debug);
 
+	timed = sopt != NULL || eopt != NULL;
+	from = sopt == NULL ? 0 : parse_time(sopt, utc);
+	to = eopt == NULL ? 0xffffffff : parse_time(eopt, utc);
+	if (from > to)
+		logerrx("Start time is after end time");
+
 	if (argc - optind < 1) {
 		fprintf(stderr, "No logfile specified\n");
 		usage();
 		exit(1);
 	}
 
+	if (rings && (ofile != NULL || nthreads > 1 || read_legacy || timed ||
+	    verbose < 0))
+		logerrx("-R may not be used with -o, -j, -L, -q, -s or -e");
+
+	if (nthreads > 1) {
+#ifdef HAVE_PTHREAD
+		if (ofile != NULL || head != 0 || read_legacy)
+			logerrx("-j may not be used with -o, -H or -L");
+		for (i = optind; i < argc; i++) {
+			if (strcmp(argv[i], "-") == 0)
+				logerrx("-j can't read from standard input");
+		}
+#else
+		logerrx("-j is not supported on this platform");
+#endif
+	}
+
 	if (ffile != NULL) {
 		if ((ffilef = fopen(ffile, "r")) == NULL)
 			logerr("fopen(%s)", ffile);
@@ -153,6 +887,10 @@ main(int argc, char **argv)
 			exit(1);
 		fclose(ffilef);
 	}
+	if (nrules > 0)
+		parse_rules(rules, nrules, &filter_config, ffile != NULL);
+	if (ffile != NULL || nrules > 0)
+		filters = filter_compile(&filter_config.filter_list);
 
 	if (ofile != NULL) {
 		if (strcmp(ofile, "-") == 0) {
@@ -164,6 +902,15 @@ main(int argc, char **argv)
 				    "standard output.");
 		}
 		ofd = open_start_log(ofile, debug);
+		if (oblocks && store_block_init(&block, STORE_BLOCK_FLOWS,
+		    ebuf, sizeof(ebuf)) != STORE_ERR_OK)
+			logerrx("%s", ebuf);
+		if (ocompress) {
+			if (store_frame_init(&frame, DEFAULT_LOG_COMPRESS,
+			    ebuf, sizeof(ebuf)) != STORE_ERR_OK)
+				logerrx("%s", ebuf);
+			oframe = &frame;
+		}
 	}
 
 	if (filter_config.store_mask == 0)
@@ -172,6 +919,49 @@ main(int argc, char **argv)
 	disp_mask = (verbose > 0) ? STORE_DISPLAY_ALL: STORE_DISPLAY_BRIEF;
 	disp_mask &= filter_config.store_mask;
 
+	if (columns != NULL && otype != STORE_FMT_CSV &&
+	    otype != STORE_FMT_JSON)
+		logerrx("-C may only be used with -t csv or -t json");
+	if (store_fmt_init(&fmt, otype, columns, utc,
+	    otype == STORE_FMT_TEXT ? disp_mask : filter_config.store_mask,
+	    ebuf, sizeof(ebuf)) != STORE_ERR_OK)
+		logerrx("%s", ebuf);
+	if (otype == STORE_FMT_RAW && verbose >= 0 && isatty(STDOUT_FILENO))
+		logerrx("Refusing to write binary flow data to standard output.");
+	setvbuf(stdout, NULL, _IOFBF, OUTBUF_SIZE);
+	if (verbose >= 0 && (n = store_fmt_header(&fmt, line,
+	    sizeof(line))) > 0)
+		fwrite(line, n, 1, stdout);
+
+	/* Columns of v4 blocks that needn't be decoded */
+	want = STORE_FIELD_ALL;
+	if (filters == NULL && ofd == -1)
+		want = store_fmt_fields(&fmt) | STORE_FIELD_RECV_TIME;
+
+	if (rings) {
+		for (i = optind; i < argc; i++)
+			follow_ring(argv[i], &fmt, filters, head, debug);
+		optind = argc;
+	}
+
+#ifdef HAVE_PTHREAD
+	if (nthreads > 1) {
+#ifdef HAVE_TZSET
+		tzset();
+#endif
+		par.ordered = !unordered;
+		par.verbose = verbose;
+		par.timed = timed;
+		memcpy(&par.fmt, &fmt, sizeof(par.fmt));
+		par.want = want;
+		par.from = from;
+		par.to = to;
+		read_parallel(argv + optind, argc - optind, nthreads,
+		    &filter_config.filter_list, debug);
+		optind = argc;	/* all read */
+	}
+#endif
+
 	for (i = optind; i < argc; i++) {
 		if (strcmp(argv[i], "-") == 0)
 			fd = STDIN_FILENO;
@@ -182,70 +972,116 @@ main(int argc, char **argv)
 		    sizeof(ebuf)) != STORE_ERR_OK)
 			logerrx("%s", ebuf);
 
+		if (!read_legacy) {
+			if (store_iter_open(&it, fd, ebuf,
+			    sizeof(ebuf)) != STORE_ERR_OK)
+				logerrx("%s: %s", argv[i], ebuf);
+			store_iter_want(&it, want, timed, from, to);
+			if (filters != NULL)
+				store_iter_filter(&it, block_filter, filters);
+			if (timed && fd != STDIN_FILENO)
+				seek_index(&it, fd, argv[i], from, to, debug);
+		}
+
 		if (verbose >= 1) {
 			printf("LOGFILE %s", argv[i]);
 			if (read_legacy)
 				printf(" started at %s",
 				    iso_time(ntohl(hdr_v2.start_time), utc));
 			printf("\n");
-			fflush(stdout);
-		}
-
-		if (csv == 1) {
-			csv++;
-			printf("#:unix_secs,unix_nsecs,sysuptime,exaddr,"
-			    "dpkts,doctets,first,last,engine_type,engine_id,"
-			    "srcaddr,dstaddr,nexthop,input,output,srcport,"
-			    "dstport,prot,tos,tcp_flags,src_mask,dst_mask,"
-			    "src_as,dst_as\n");
 		}
 
 		for (nflows = 0; head == 0 || nflows < head; nflows++) {
-			bzero(&flow, sizeof(flow));
-
-			if (read_legacy)
+			if (read_legacy) {
+				bzero(&flow, sizeof(flow));
 				r = store_v2_get_flow(fd, &flow_v2, ebuf,
 				    sizeof(ebuf));
-			else
-				r = store_get_flow(fd, &flow, ebuf,
+				if (r == STORE_ERR_EOF)
+					break;
+				else if (r != STORE_ERR_OK)
+				    	logerrx("%s", ebuf);
+				if (store_v2_flow_convert(&flow_v2,
+				    &flow) == -1)
+				    	logerrx("legacy flow conversion failed");
+				recv_sec = ntohl(flow.recv_time.recv_sec);
+				if (timed && ((ntohl(flow.hdr.fields) &
+				    STORE_FIELD_RECV_TIME) == 0 ||
+				    recv_sec < from || recv_sec > to))
+					continue;
+			} else {
+				r = store_iter_next_raw(&it, &rec, &len, ebuf,
 				    sizeof(ebuf));
-				
-			if (r == STORE_ERR_EOF)
-				break;
-			else if (r != STORE_ERR_OK)
-			    	logerrx("%s", ebuf);
-
-			if (read_legacy &&
-			    store_v2_flow_convert(&flow_v2, &flow) == -1)
-			    	logerrx("legacy flow conversion failed");
-
-			if (ffile != NULL && filter_flow(&flow,
-			    &filter_config.filter_list) == FF_ACTION_DISCARD)
+				if (r == STORE_ERR_EOF)
+					break;
+				else if (r != STORE_ERR_OK)
+				    	logerrx("%s", ebuf);
+				/* Skip flows out of range before decoding */
+				if (timed && (!store_raw_recv_time(rec,
+				    &recv_sec) || recv_sec < from ||
+				    recv_sec > to))
+					continue;
+				if (store_flow_deserialise(rec, len, &flow,
+				    ebuf, sizeof(ebuf)) != STORE_ERR_OK)
+				    	logerrx("%s", ebuf);
+			}
+			if (filters != NULL && filter_flow(&flow,
+			    filters) == FF_ACTION_DISCARD)
 				continue;
-			if (csv) {
-				store_format_flow_flowtools_csv(&flow, buf,
-				    sizeof(buf), utc, disp_mask, 0);
-				printf("%s\n", buf);
+			if (verbose >= 0) {
+				n = store_fmt_flow(&fmt, &flow, line);
+				fwrite(line, n, 1, stdout);
+				/* Keep order with a binary log on stdout */
+				if (ofd == STDOUT_FILENO)
+					fflush(stdout);
 			}
-			else if (verbose >= 0) {
-				store_format_flow(&flow, buf, sizeof(buf), 
-				    utc, disp_mask, 0);
-				printf("%s\n", buf);
-				fflush(stdout);
+			if (ofd != -1 && oblocks) {
+				flow.hdr.fields = htonl(ntohl(flow.hdr.fields) &
+				    filter_config.store_mask);
+				if (store_block_add(&block, &flow, ebuf,
+				    sizeof(ebuf)) != STORE_ERR_OK)
+					logerrx("%s", ebuf);
+				if (block.flows == block.max_flows)
+					flush_block(ofd, &block, oframe);
+			} else if (ofd != -1) {
+				if (store_flow_serialise_masked(&flow,
+				    filter_config.store_mask, fbuf,
+				    sizeof(fbuf), &flen, ebuf,
+				    sizeof(ebuf)) != STORE_ERR_OK)
+					logerrx("%s", ebuf);
+				put_output(ofd, oframe, fbuf, flen);
 			}
-			if (ofd != -1 && store_put_flow(ofd, &flow, 
-			    filter_config.store_mask, ebuf, 
-			    sizeof(ebuf)) == -1)
-			    	logerrx("%s", ebuf);
+		}
+		if (!read_legacy) {
+			if (debug) {
+				fprintf(stderr, "%s: %llu blocks decoded, "
+				    "%llu skipped, %llu frames decompressed, "
+				    "%llu skipped\n", argv[i],
+				    (unsigned long long)it.blocks,
+				    (unsigned long long)it.blocks_skipped,
+				    (unsigned long long)it.frames,
+				    (unsigned long long)it.frames_skipped);
+			}
+			store_iter_close(&it);
 		}
 		if (fd != STDIN_FILENO)
 			close(fd);
 	}
-	if (ofd != -1)
+	if (ofd != -1) {
+		if (oblocks) {
+			flush_block(ofd, &block, oframe);
+			store_block_free(&block);
+		}
+		if (oframe != NULL) {
+			flush_frame(ofd, oframe);
+			store_frame_free(oframe);
+		}
 		close(ofd);
+	}
 
-	if (ffile != NULL && debug)
+	if (filters != NULL && debug) {
+		filter_index_sync(filters);
 		dump_config(&filter_config, "final", 1);
+	}
 
 	return (0);
 }
@@ -19,7 +19,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
+#include <stddef.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -30,6 +33,9 @@
 #include <stdio.h>
 #include <time.h>
 #include <poll.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "sys-queue.h"
 #include "sys-tree.h"
@@ -39,7 +45,9 @@
 #include "store.h"
 #include "store-v2.h"
 #include "atomicio.h"
+#include "crc32.h"
 #include "peer.h"
+#include "stats.h"
 
 RCSID("$Id$");
 
@@ -49,18 +57,43 @@ RCSID("$Id$");
 /* Reams of netflow v.9 verbosity */
 /* #define DEBUG_NF9 */
 
+/* Most log files kept open at once when logs are split by tag */
+#define LOG_MAX_OPEN_FILES		64
+
+/* Seconds before rotation that the next log files are opened */
+#define LOG_OPEN_AHEAD			10
+
+/*
+ * Longest a partly filled v4 block or compressed frame is held before it
+ * is written
+ */
+#define LOG_HOLD_MAX_AGE		10 /* seconds */
+
 /* Number of errors on Unix Domain log socket before we reopen */
 #define LOGSOCK_REOPEN_ERROR_COUNT	128
 
 /* Ratelimit for Unix Domain log socket reopens */
 #define LOGSOCK_REOPEN_DELAY		60 /* seconds */
 
+/* Datagrams passed to the log socket per sendmmsg call */
+#define LOGSOCK_SEND_BATCH		64
+
 /* Prototype this (can't make it static because it only #ifdef DEBUG_UNKNOWN) */
 void dump_packet(const char *tag, const u_int8_t *p, int len);
 
-/* Unix domain socket error detection and reopen counters */
+/*
+ * Unix domain socket error detection and reopen counters. The first two
+ * are updated by whichever thread writes output and read by the main
+ * loop, so they are kept under logsock_lock.
+ */
 static int logsock_first_error = 0;
 static int logsock_num_errors = 0;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t logsock_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static u_int64_t logsock_datagrams = 0;
+static u_int64_t logsock_errors = 0;
+static u_int64_t logsock_reopens = 0;
 
 /* Flags set by signal handlers */
 static sig_atomic_t exit_flag = 0;
@@ -68,139 +101,1603 @@ static sig_atomic_t reconf_flag = 0;
 static sig_atomic_t reopen_flag = 0;
 static sig_atomic_t info_flag = 0;
 
-/* Input queue management */
+/* Input queue management */
+
+#define INPUT_MAX_PACKET_PER_FD		512
+#define INPUT_MAX_PACKET_LEN		2048
+struct flow_packet {
+	TAILQ_ENTRY(flow_packet) entry;
+	struct timeval recv_time;
+	struct xaddr flow_source;
+	struct peer_state *peer;	/* held while the packet is queued */
+	u_int len;
+	u_int8_t *packet;
+};
+TAILQ_HEAD(flow_packets, flow_packet);
+
+/*
+ * Packets and their receive buffers are preallocated in a fixed-size
+ * pool, sized by the "receive pool" option. When the pool is empty we
+ * stop reading sockets and leave datagrams queued in the kernel.
+ */
+struct packet_pool {
+	u_int			 size;
+	u_int			 nfree;
+	u_int			 min_free;	/* low water mark */
+	u_int64_t		 exhausted;	/* allocations that failed */
+	struct flow_packet	*packets;
+	u_int8_t		*buffers;
+	struct flow_packets	 freelist;
+};
+
+/*
+ * Control message space for a kernel receive timestamp and, where the
+ * kernel reports it, the count of datagrams it has dropped on the socket
+ */
+#ifdef SO_RXQ_OVFL
+# define RECV_CMSG_DROPS	CMSG_SPACE(sizeof(u_int32_t))
+#else
+# define RECV_CMSG_DROPS	0
+#endif
+union recv_cmsgbuf {
+	struct cmsghdr		hdr;
+	u_int8_t		buf[CMSG_SPACE(sizeof(struct timeval)) +
+				    RECV_CMSG_DROPS];
+};
+
+#ifdef HAVE_RECVMMSG
+/* Message headers for batched receive, reallocated if the size changes */
+struct recv_batch {
+	u_int			 n;
+	int			 unsupported;
+	struct mmsghdr		*msgs;
+	struct iovec		*iovs;
+	struct sockaddr_storage	*from;
+	union recv_cmsgbuf	*cmsgs;
+	struct flow_packet	**fps;
+};
+#endif
+
+/* v.9/IPFIX records decoded at a time, before filtering and output */
+#define FLOW_DECODE_BATCH	32
+
+/* NetFlow versions whose decoding is timed, and 1 in how many flows'
+ * filtering and serialisation is */
+#define STATS_NF_VERSIONS	5
+#define STATS_FLOW_SAMPLE	16
+
+/*
+ * A worker's counters. Only its own thread writes them; the stats thread
+ * reads them without locking.
+ */
+struct worker_stats {
+	u_int64_t		 flows;
+	u_int64_t		 accepted;
+	u_int64_t		 discarded;
+	struct stats_hist	 decode[STATS_NF_VERSIONS];
+	struct stats_hist	 filter;
+	struct stats_hist	 serialise;
+};
+
+/* Serialised flows waiting to be written */
+struct output_queue {
+	TAILQ_ENTRY(output_queue) entry;
+	u_int8_t		*buf;
+	size_t			 alloc;
+	size_t			 offset;
+	u_int64_t		 since;		/* when offset left 0, ns */
+};
+TAILQ_HEAD(output_queues, output_queue);
+
+/*
+ * Collector state. Normally there is just one of these, run from the main
+ * loop, which hands full output queues to a writer thread so collection
+ * never waits on the disk unless both queues are waiting to be written.
+ * With "workers" configured each thread has its own listening sockets,
+ * peer shard, packet pool and output queue, and hands full output queues
+ * to the main thread instead, which is then the only one to touch the log.
+ */
+struct flowd_worker {
+	u_int			 id;
+	struct flowd_config	*conf;
+	struct peers		 peers;
+	struct filter_index	*filters;
+	struct flow_packets	 input_queue;
+	struct packet_pool	 pool;
+#ifdef HAVE_RECVMMSG
+	struct recv_batch	 batch;
+#endif
+	struct forward_queue	*fwdq;		/* packets to forward */
+	u_int			 accepted;	/* flows from this packet */
+	u_int			 discarded;
+	int			 invalid;	/* this packet was rolled back */
+	struct output_queue	*outq;
+	size_t			 outq_mark;	/* where this packet's flows start */
+	int			 outq_marked;
+	int			 outq_dropped;	/* this packet's flows don't fit */
+	struct {			/* stats at output_mark() */
+		u_int64_t	 flows, accepted, discarded;
+	}			 mark_stats;
+	struct store_flow_complete flows[FLOW_DECODE_BATCH];
+	struct aggr_table	 aggr;
+	struct pollfd		*pfd;
+	struct listen_addr	**pla;		/* pfd[i]'s listener */
+	struct listen_addr	*listener;	/* being read */
+	int			 num_fds;
+	struct worker_stats	 stats;
+#ifdef HAVE_PTHREAD
+	pthread_t		 thread;
+	int			 wake[2];	/* main -> worker: stop */
+	struct filter_list	 filter_copy;
+#endif
+};
+
+static struct flowd_worker *workers = NULL;
+static u_int num_workers = 0;
+static int workers_running = 0;
+static int aggr_flush_on_stop = 0;	/* write out what is held, at exit */
+
+/* Log socket; only used by the thread writing output */
+static int log_socket = -1;
+static struct ring_writer log_ring;	/* hdr is NULL when not open */
+static char *log_ring_path = NULL;	/* as opened, to notice changes */
+static size_t log_socket_batch = 0;	/* bytes per datagram, 0 for one flow */
+#ifdef HAVE_SENDMMSG
+static int no_sendmmsg = 0;	/* by the kernel; set on ENOSYS */
+#endif
+
+/* An open log file. A template with LOGFILE_TAG_ESCAPE has one per tag */
+struct log_file {
+	int			 fd;
+	time_t			 bucket;	/* start of its time interval */
+	int			 tagged;
+	u_int32_t		 tag;
+	off_t			 offset;	/* -1 if not seekable */
+	off_t			 allocated;
+	u_int64_t		 unsynced;	/* bytes since the last sync */
+	struct timeval		 dirty;		/* first of those written */
+	int			 idx_fd;	/* -1 if not indexed */
+	off_t			 idx_start;	/* first flow of next entry */
+	u_int32_t		 idx_flows;	/* flows since then */
+	u_int32_t		 idx_first;	/* and their time range */
+	u_int32_t		 idx_last;
+	time_t			 idx_opened;	/* when the entry was begun */
+	struct store_block	*block;		/* v4 block being built */
+	struct timeval		 block_start;	/* when its first flow came */
+	struct store_frame	*frame;		/* compressed frame, likewise */
+	struct timeval		 frame_start;
+	TAILQ_ENTRY(log_file)	 entry;
+};
+TAILQ_HEAD(log_files, log_file);
+
+/* Log files and policy; likewise only used by the thread writing output */
+static struct {
+	int			 active;	/* logfile open */
+	int			 monitor_fd;
+	struct log_files	 files;		/* current interval, MRU first */
+	struct log_files	 ahead;		/* opened for the next one */
+	u_int			 num_files;
+	time_t			 bucket;	/* start of current interval */
+	u_int			 rotate;	/* seconds per interval, or 0 */
+	int			 split_tag;
+	off_t			 prealloc;
+	u_int64_t		 sync_bytes;
+	u_int64_t		 sync_usec;
+	u_int			 index_flows;	/* flows per index entry */
+	u_int			 index_secs;	/* or seconds per entry */
+	u_int64_t		 index_entries;
+	int			 blocks;	/* write v4 blocks */
+	int			 compress;	/* level, or 0 */
+	u_int64_t		 hold_usec;	/* longest flows are held */
+	u_int64_t		 blocks_written;
+	u_int64_t		 frames_written;
+	u_int64_t		 frame_in;	/* bytes compressed */
+	u_int64_t		 frame_out;	/* and the result */
+	u_int64_t		 syncs;
+	u_int64_t		 sync_time;	/* usec spent syncing */
+	u_int64_t		 rotations;
+} log_state = {
+	0, -1,
+	TAILQ_HEAD_INITIALIZER(log_state.files),
+	TAILQ_HEAD_INITIALIZER(log_state.ahead)
+};
+
+#define LOG_BUCKET(t) \
+	(log_state.rotate == 0 ? 0 : (t) - (t) % log_state.rotate)
+
+/* (Re)build a packet pool. Must only be called with no packets in use */
+static void
+flow_packet_pool_init(struct packet_pool *pool, u_int size)
+{
+	u_int i;
+
+	if (pool->size == size)
+		return;
+	if (pool->nfree != pool->size)
+		logerrx("%s: %u packets still in use", __func__,
+		    pool->size - pool->nfree);
+
+	free(pool->packets);
+	free(pool->buffers);
+	TAILQ_INIT(&pool->freelist);
+
+	if ((pool->packets = calloc(size, sizeof(*pool->packets))) == NULL ||
+	    (pool->buffers = calloc(size, INPUT_MAX_PACKET_LEN)) == NULL)
+		logerrx("%s: calloc failed (%u packets)", __func__, size);
+
+	for (i = 0; i < size; i++) {
+		pool->packets[i].packet =
+		    pool->buffers + (i * INPUT_MAX_PACKET_LEN);
+		TAILQ_INSERT_TAIL(&pool->freelist, &pool->packets[i], entry);
+	}
+	pool->size = pool->nfree = pool->min_free = size;
+
+	logit(LOG_DEBUG, "%s: %u packets of %d bytes", __func__, size,
+	    INPUT_MAX_PACKET_LEN);
+}
+
+/* Take a packet and its buffer from the pool, NULL if it is exhausted */
+static struct flow_packet
+*flow_packet_alloc(struct packet_pool *pool)
+{
+	struct flow_packet *f;
+
+	if ((f = TAILQ_FIRST(&pool->freelist)) == NULL) {
+		pool->exhausted++;
+		return (NULL);
+	}
+	TAILQ_REMOVE(&pool->freelist, f, entry);
+	if (--pool->nfree < pool->min_free)
+		pool->min_free = pool->nfree;
+	f->len = 0;
+	return (f);
+}
+
+/* Return a packet to the pool */
+static void
+flow_packet_dealloc(struct packet_pool *pool, struct flow_packet *f)
+{
+	TAILQ_INSERT_HEAD(&pool->freelist, f, entry);
+	pool->nfree++;
+}
+
+static void
+flow_packet_pool_dump(struct flowd_worker *w)
+{
+	logit(LOG_INFO, "worker %u packet pool: %u of %u free, low water %u, "
+	    "exhausted %llu times", w->id, w->pool.nfree, w->pool.size,
+	    w->pool.min_free, (unsigned long long)w->pool.exhausted);
+	if (w->aggr.params.key != 0) {
+		logit(LOG_INFO, "worker %u aggregation: %llu flows written as "
+		    "%llu, %u of %u held, %llu written early for room", w->id,
+		    (unsigned long long)w->aggr.flows_in,
+		    (unsigned long long)w->aggr.flows_out, w->aggr.num_active,
+		    w->aggr.params.max, (unsigned long long)w->aggr.evicted);
+	}
+}
+
+/* Enqueue a flow packet in the input queue */
+static void
+flow_packet_enqueue(struct flowd_worker *w, struct flow_packet *f)
+{
+	TAILQ_INSERT_TAIL(&w->input_queue, f, entry);
+}
+
+/* Pull the first flow packet off the queue */
+static struct flow_packet
+*flow_packet_dequeue(struct flowd_worker *w)
+{
+	struct flow_packet *f;
+
+	if ((f = TAILQ_FIRST(&w->input_queue)) != NULL)
+		TAILQ_REMOVE(&w->input_queue, f, entry);
+	return (f);
+}
+
+/* Output queue management */
+
+#define OUTPUT_QUEUES_PER_WORKER	2
+
+/* Give a queue a buffer of the configured size, which it keeps */
+static void
+output_queue_alloc(struct output_queue *q, size_t size)
+{
+	if (q->buf != NULL && q->alloc == size)
+		return;
+	free(q->buf);
+	if ((q->buf = malloc(size)) == NULL)
+		logerrx("Output queue allocation (%zu bytes) failed", size);
+	q->alloc = size;
+	q->offset = 0;
+}
+
+static struct output_queue *
+output_queue_new(struct flowd_config *conf)
+{
+	struct output_queue *q;
+
+	if ((q = calloc(1, sizeof(*q))) == NULL)
+		logerrx("%s: calloc failed", __func__);
+	output_queue_alloc(q, (size_t)conf->output_queue_kb << 10);
+	return (q);
+}
+
+/* Enqueue a flow for output, return 0 on success, -1 on queue full */
+static int
+output_flow_enqueue(struct output_queue *q, u_int8_t *f, size_t len,
+    int verbose)
+{
+	/* Force flush on overflow */
+	if (q->offset + len > q->alloc) {
+		logit(LOG_DEBUG, "%s: output queue full", __func__);
+		return (-1);
+	}
+
+	if (q->offset == 0)
+		q->since = stats_now_ns();
+	memcpy(q->buf + q->offset, f, len);
+	q->offset += len;
+	if (verbose) {
+		logit(LOG_DEBUG, "%s: offset %zu alloc %zu", __func__,
+		    q->offset, q->alloc);
+	}
+	
+	return (0);
+}
+
+/* Track failures to send on log socket so we can reopen it */
+static void
+logsock_result(int failed)
+{
+	int save_errno = errno, num_errors = 0;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&logsock_lock);
+#endif
+	if (failed) {
+		logsock_errors++;
+		num_errors = logsock_num_errors;
+		if (save_errno != ENOBUFS) {
+			if (logsock_first_error == 0)
+				logsock_first_error = time(NULL);
+			logsock_num_errors++;
+		}
+	} else {
+		logsock_datagrams++;
+		/* Start to disregard errors after success */
+		if (logsock_num_errors > 0)
+			logsock_num_errors--;
+		if (logsock_num_errors == 0)
+			logsock_first_error = 0;
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&logsock_lock);
+#endif
+	if (num_errors > 0 && (num_errors % 10) == 0) {
+		logit(LOG_WARNING, "log socket send: %s (num errors %d)",
+		    strerror(save_errno), num_errors);
+	}
+}
+
+/*
+ * Whether the log socket has failed often enough for long enough to be
+ * reopened; if so, start counting afresh
+ */
+static int
+logsock_reopen_due(void)
+{
+	int due;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&logsock_lock);
+#endif
+	due = logsock_num_errors > LOGSOCK_REOPEN_ERROR_COUNT &&
+	    time(NULL) > logsock_first_error + LOGSOCK_REOPEN_DELAY;
+	if (due)
+		logsock_first_error = logsock_num_errors = 0;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&logsock_lock);
+#endif
+	return (due);
+}
+
+/*
+ * Relay the flows in a queue to the log socket, packing as many as fit
+ * in log_socket_batch bytes into each datagram
+ */
+static void
+output_send_socket(struct output_queue *q)
+{
+	struct store_flow *hdr;
+	struct iovec iov[LOGSOCK_SEND_BATCH];
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[LOGSOCK_SEND_BATCH];
+#endif
+	size_t off, flen, dlen;
+	int i, n, r, sent;
+
+	for (off = 0; off + sizeof(*hdr) <= q->offset;) {
+		for (n = 0; n < LOGSOCK_SEND_BATCH &&
+		    off + sizeof(*hdr) <= q->offset; n++) {
+			/* Flows are contiguous, so a datagram is a slice */
+			for (dlen = 0; off + dlen + sizeof(*hdr) <= q->offset;
+			    dlen += flen) {
+				hdr = (struct store_flow *)(q->buf + off + dlen);
+				flen = sizeof(*hdr) + (hdr->len_words * 4);
+				if (dlen > 0 && dlen + flen > log_socket_batch)
+					break;
+			}
+			iov[n].iov_base = q->buf + off;
+			iov[n].iov_len = dlen;
+			off += dlen;
+		}
+
+		sent = 0;
+#ifdef HAVE_SENDMMSG
+		while (!no_sendmmsg && sent < n) {
+			bzero(msgs, sizeof(*msgs) * (n - sent));
+			for (i = 0; i < n - sent; i++) {
+				msgs[i].msg_hdr.msg_iov = &iov[sent + i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+			}
+			if ((r = sendmmsg(log_socket, msgs, n - sent, 0)) == -1) {
+				if (errno == ENOSYS) {
+					logit(LOG_INFO, "sendmmsg not "
+					    "supported, sending one datagram "
+					    "at a time");
+					no_sendmmsg = 1;
+					break;
+				}
+				/* This datagram is dropped, as by send */
+				logsock_result(1);
+				sent++;
+				continue;
+			}
+			for (i = 0; i < r; i++)
+				logsock_result(0);
+			sent += r;
+		}
+#endif
+		for (; sent < n; sent++) {
+			r = send(log_socket, iov[sent].iov_base,
+			    iov[sent].iov_len, 0);
+			logsock_result(r == -1);
+		}
+	}
+}
+
+/* Only touched by whichever thread is writing output */
+static struct {
+	u_int64_t		 writes;
+	u_int64_t		 bytes;
+	u_int64_t		 usec;		/* spent in store_put_buf */
+	u_int64_t		 max_usec;
+	struct stats_hist	 flush_bytes;
+	struct stats_hist	 flush_ns;	/* to log file and socket */
+} output_stats;
+
+static u_int64_t
+usec_since(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	if (timercmp(&now, start, <))
+		return (0);
+	return ((now.tv_sec - start->tv_sec) * 1000000ULL +
+	    now.tv_usec - start->tv_usec);
+}
+
+/* Open a log file through the monitor and check it can be appended to */
+static int
+start_log(int monitor_fd, time_t bucket, int tagged, u_int32_t tag)
+{
+	int fd;
+	off_t r;
+	char ebuf[512];
+
+	if ((fd = client_open_log(monitor_fd, bucket, tagged, tag, 0)) == -1)
+		logerrx("Logfile open failed, exiting");
+
+	/* Don't try to write a v.3 log on the end of a v.2 one */
+
+	r = lseek(fd, 0, SEEK_END);
+
+	/*
+	 * If there isn't a full legacy header in the file or an error occurs
+	 * (r == -1, e.g. on a FIFO) then don't bother checking for an old 
+	 * log header.
+	 */
+	if (r < sizeof(struct store_v2_header))
+		return (fd);
+
+	if ((r = lseek(fd, 0, SEEK_SET)) == -1) {
+		if (errno == ESPIPE)
+			return fd;
+		logerr("%s: lseek", __func__);
+	}
+
+	switch (store_v2_check_header(fd, ebuf, sizeof(ebuf))) {
+	case STORE_ERR_OK:
+		/* Uh oh - an old flow log is in the way, don't try to write */
+		logerrx("Error: Cannot append to legacy (version 2) flow log, "
+		    "please move it out of the way and restart flowd");
+	case STORE_ERR_BAD_MAGIC:
+	case STORE_ERR_UNSUP_VERSION:
+		/* Good - the existing flow log is a probably a new one */
+		if ((r = lseek(fd, 0, SEEK_END)) == -1)
+			logerr("%s: lseek", __func__);
+		return (fd);
+	default:
+		logerrx("%s: %s", __func__, ebuf);
+	}
+
+	/* NOTREACHED */
+	return (-1);
+}
+
+/*
+ * Reserve space past the end of a log file in large extents, so the
+ * filesystem isn't allocating blocks on every write. The file size is
+ * left alone, readers never see the reserved space.
+ */
+static void
+log_prealloc(struct log_file *lf, size_t len)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+	off_t size;
+
+	if (log_state.prealloc == 0 || lf->offset == -1 ||
+	    lf->offset + (off_t)len <= lf->allocated)
+		return;
+	size = log_state.prealloc;
+	if (size < (off_t)len)
+		size = len;
+	if (fallocate(lf->fd, FALLOC_FL_KEEP_SIZE, lf->offset, size) == -1) {
+		logitm(LOG_WARNING, "logfile preallocation disabled: "
+		    "fallocate");
+		log_state.prealloc = 0;
+		return;
+	}
+	lf->allocated = lf->offset + size;
+#endif
+}
+
+/* Append an entry to a log file's index, disabling it if that fails */
+static void
+log_index_put(struct log_file *lf, off_t offset, off_t len, u_int32_t flows,
+    u_int32_t first, u_int32_t last)
+{
+	struct store_index_entry ent;
+
+	memset(&ent, 0, sizeof(ent));
+	ent.offset = store_htonll(offset);
+	ent.len = store_htonll(len);
+	ent.flows = htonl(flows);
+	ent.first_sec = htonl(first);
+	ent.last_sec = htonl(last);
+	if (atomicio(vwrite, lf->idx_fd, &ent, sizeof(ent)) != sizeof(ent)) {
+		logitm(LOG_WARNING, "logfile index disabled: write");
+		close(lf->idx_fd);
+		lf->idx_fd = -1;
+		return;
+	}
+	log_state.index_entries++;
+}
+
+/* Record the flows written since the last index entry */
+static void
+log_index_flush(struct log_file *lf)
+{
+	if (lf->idx_fd != -1 && lf->idx_flows != 0) {
+		log_index_put(lf, lf->idx_start, lf->offset - lf->idx_start,
+		    lf->idx_flows, lf->idx_first, lf->idx_last);
+	}
+	lf->idx_start = lf->offset;
+	lf->idx_flows = 0;
+}
+
+/*
+ * Open the index of a log file. A new index gets a header; an existing
+ * one gets an entry for anything appended to the log without updating it,
+ * which matches any time.
+ */
+static void
+log_index_open(struct log_file *lf)
+{
+	struct store_index_header hdr;
+	struct store_index_entry ent;
+	off_t size, end;
+
+	lf->idx_fd = -1;
+	lf->idx_start = lf->offset;
+	if ((log_state.index_flows == 0 && log_state.index_secs == 0) ||
+	    lf->offset == -1)
+		return;
+	if ((lf->idx_fd = client_open_log(log_state.monitor_fd, lf->bucket,
+	    lf->tagged, lf->tag, 1)) == -1)
+		logerrx("Logfile index open failed, exiting");
+	if ((size = lseek(lf->idx_fd, 0, SEEK_END)) == -1)
+		logerr("%s: lseek", __func__);
+
+	if (size == 0) {
+		hdr.magic = htonl(STORE_INDEX_MAGIC);
+		hdr.version = htonl(STORE_INDEX_VERSION);
+		if (atomicio(vwrite, lf->idx_fd, &hdr,
+		    sizeof(hdr)) != sizeof(hdr))
+			goto fail;
+		end = 0;
+	} else {
+		if (pread(lf->idx_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		    ntohl(hdr.magic) != STORE_INDEX_MAGIC ||
+		    ntohl(hdr.version) != STORE_INDEX_VERSION) {
+			logit(LOG_WARNING, "logfile index disabled: "
+			    "unrecognised index header");
+			close(lf->idx_fd);
+			lf->idx_fd = -1;
+			return;
+		}
+		/* Drop any partly written entry */
+		size -= (size - sizeof(hdr)) % sizeof(ent);
+		if (ftruncate(lf->idx_fd, size) == -1 ||
+		    lseek(lf->idx_fd, size, SEEK_SET) == -1)
+			goto fail;
+		end = 0;
+		if (size > (off_t)sizeof(hdr)) {
+			if (pread(lf->idx_fd, &ent, sizeof(ent),
+			    size - sizeof(ent)) != sizeof(ent))
+				goto fail;
+			end = store_ntohll(ent.offset) + store_ntohll(ent.len);
+		}
+		if (end > lf->offset) {
+			/* The log has shrunk underneath it, start again */
+			if (ftruncate(lf->idx_fd, sizeof(hdr)) == -1 ||
+			    lseek(lf->idx_fd, sizeof(hdr), SEEK_SET) == -1)
+				goto fail;
+			end = 0;
+		}
+	}
+	if (end < lf->offset)
+		log_index_put(lf, end, lf->offset - end, 0, 0, 0xffffffff);
+	return;
+
+ fail:
+	logitm(LOG_WARNING, "logfile index disabled");
+	close(lf->idx_fd);
+	lf->idx_fd = -1;
+}
+
+static struct log_file *
+log_file_open(time_t bucket, int tagged, u_int32_t tag)
+{
+	struct log_file *lf;
+	char ebuf[512];
+
+	if ((lf = calloc(1, sizeof(*lf))) == NULL)
+		logerrx("%s: calloc failed", __func__);
+	lf->fd = start_log(log_state.monitor_fd, bucket, tagged, tag);
+	lf->bucket = bucket;
+	lf->tagged = tagged;
+	lf->tag = tag;
+	if ((lf->offset = lseek(lf->fd, 0, SEEK_CUR)) == -1 &&
+	    errno != ESPIPE)
+		logerr("%s: lseek", __func__);
+	lf->allocated = lf->offset;
+	log_index_open(lf);
+	if (log_state.blocks) {
+		if ((lf->block = calloc(1, sizeof(*lf->block))) == NULL)
+			logerrx("%s: calloc failed", __func__);
+		if (store_block_init(lf->block, STORE_BLOCK_FLOWS, ebuf,
+		    sizeof(ebuf)) != STORE_ERR_OK)
+			logerrx("%s: %s", __func__, ebuf);
+	}
+	if (log_state.compress) {
+		if ((lf->frame = calloc(1, sizeof(*lf->frame))) == NULL)
+			logerrx("%s: calloc failed", __func__);
+		if (store_frame_init(lf->frame, log_state.compress, ebuf,
+		    sizeof(ebuf)) != STORE_ERR_OK)
+			logerrx("%s: %s", __func__, ebuf);
+	}
+	return (lf);
+}
+
+/*
+ * Write a run of flows received between first and last to a log file.
+ * since is when the earliest of them was ready to be written.
+ */
+static void
+log_file_put(struct log_file *lf, char *buf, int len,
+    const struct timeval *now, const struct timeval *since, u_int32_t flows,
+    u_int32_t first, u_int32_t last)
+{
+	char ebuf[512];
+
+	if (lf->idx_fd != -1) {
+		if (lf->idx_flows == 0) {
+			lf->idx_start = lf->offset;
+			lf->idx_first = first;
+			lf->idx_last = last;
+			lf->idx_opened = now->tv_sec;
+		}
+		if (first < lf->idx_first)
+			lf->idx_first = first;
+		if (last > lf->idx_last)
+			lf->idx_last = last;
+		lf->idx_flows += flows;
+	}
+	log_prealloc(lf, len);
+	if (store_put_buf_at(lf->fd, buf, len, &lf->offset, ebuf,
+	    sizeof(ebuf)) != STORE_ERR_OK)
+		logerrx("%s: exiting on %s", __func__, ebuf);
+	/* A sync interval runs from when the flows arrived */
+	if (lf->unsynced == 0)
+		lf->dirty = *since;
+	lf->unsynced += len;
+	if (lf->idx_fd != -1 && ((log_state.index_flows != 0 &&
+	    lf->idx_flows >= log_state.index_flows) ||
+	    (log_state.index_secs != 0 &&
+	    now->tv_sec - lf->idx_opened >= (time_t)log_state.index_secs)))
+		log_index_flush(lf);
+}
+
+/* Write out whatever is in a log file's compressed frame */
+static void
+log_frame_flush(struct log_file *lf, const struct timeval *now)
+{
+	struct store_frame_header hdr;
+	u_int32_t first, last;
+	size_t raw_len;
+	u_int8_t *buf;
+	char ebuf[512];
+	int len;
+
+	if (lf->frame == NULL || lf->frame->raw_len == 0)
+		return;
+	raw_len = lf->frame->raw_len;
+	if (store_frame_serialise(lf->frame, &buf, &len, ebuf,
+	    sizeof(ebuf)) != STORE_ERR_OK)
+		logerrx("%s: exiting on %s", __func__, ebuf);
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.flags & STORE_FRAME_F_TIMED) {
+		first = ntohl(hdr.first_sec);
+		last = ntohl(hdr.last_sec);
+	} else
+		first = last = now->tv_sec;
+	log_file_put(lf, (char *)buf, len, now, &lf->frame_start,
+	    ntohl(hdr.flows), first, last);
+	log_state.frames_written++;
+	log_state.frame_in += raw_len;
+	log_state.frame_out += len;
+}
+
+/*
+ * Write serialised flows to a log file, or add them to its frame if it is
+ * compressed
+ */
+static void
+log_file_emit(struct log_file *lf, char *buf, int len,
+    const struct timeval *now, const struct timeval *since, u_int32_t flows,
+    u_int32_t first, u_int32_t last)
+{
+	char ebuf[512];
+
+	if (lf->frame == NULL) {
+		log_file_put(lf, buf, len, now, since, flows, first, last);
+		return;
+	}
+	if (lf->frame->raw_len + len > STORE_FRAME_MAX_LEN)
+		log_frame_flush(lf, now);
+	if (lf->frame->raw_len == 0 || timercmp(since, &lf->frame_start, <))
+		lf->frame_start = *since;
+	if (store_frame_add(lf->frame, (u_int8_t *)buf, len, ebuf,
+	    sizeof(ebuf)) != STORE_ERR_OK)
+		logerrx("%s: exiting on %s", __func__, ebuf);
+	if (lf->frame->raw_len >= STORE_FRAME_SIZE)
+		log_frame_flush(lf, now);
+}
+
+/* Write out whatever is in a log file's v4 block */
+static void
+log_block_flush(struct log_file *lf, const struct timeval *now)
+{
+	struct store_block_header hdr;
+	u_int32_t first, last;
+	u_int8_t *buf;
+	char ebuf[512];
+	int len;
+
+	if (lf->block == NULL || lf->block->flows == 0)
+		return;
+	if (store_block_serialise(lf->block, &buf, &len, ebuf,
+	    sizeof(ebuf)) != STORE_ERR_OK)
+		logerrx("%s: exiting on %s", __func__, ebuf);
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (ntohl(hdr.fields) & STORE_FIELD_RECV_TIME) {
+		first = ntohl(hdr.first_sec);
+		last = ntohl(hdr.last_sec);
+	} else
+		first = last = now->tv_sec;
+	log_file_emit(lf, (char *)buf, len, now, &lf->block_start,
+	    ntohl(hdr.flows), first, last);
+	log_state.blocks_written++;
+}
+
+/*
+ * Write serialised flows to a log file, or add them to its block if it
+ * is written in v4 blocks
+ */
+static void
+log_file_write(struct log_file *lf, char *buf, int len,
+    const struct timeval *now, u_int32_t flows, u_int32_t first,
+    u_int32_t last)
+{
+	struct store_flow_complete flow;
+	struct store_flow hdr;
+	char ebuf[512];
+	int off, flowlen;
+
+	if (lf->block == NULL) {
+		log_file_emit(lf, buf, len, now, now, flows, first, last);
+		return;
+	}
+	for (off = 0; off < len; off += flowlen) {
+		memcpy(&hdr, buf + off, sizeof(hdr));
+		flowlen = sizeof(hdr) + hdr.len_words * 4;
+		if (store_flow_deserialise((u_int8_t *)buf + off, len - off,
+		    &flow, ebuf, sizeof(ebuf)) != STORE_ERR_OK ||
+		    store_block_add(lf->block, &flow, ebuf,
+		    sizeof(ebuf)) != STORE_ERR_OK)
+			logerrx("%s: exiting on %s", __func__, ebuf);
+		if (lf->block->flows == 1)
+			lf->block_start = *now;
+		if (lf->block->flows == lf->block->max_flows)
+			log_block_flush(lf, now);
+	}
+}
+
+/* Flush everything written to a log file so far to stable storage */
+static void
+log_sync(struct log_file *lf)
+{
+	struct timeval start;
+	int r;
+
+	if (lf->unsynced == 0 || lf->offset == -1)
+		return;
+	gettimeofday(&start, NULL);
+#ifdef HAVE_FDATASYNC
+	r = fdatasync(lf->fd);
+#else
+	r = fsync(lf->fd);
+#endif
+	if (r == -1)
+		logitm(LOG_WARNING, "%s: sync", __func__);
+	log_state.sync_time += usec_since(&start);
+	log_state.syncs++;
+	lf->unsynced = 0;
+}
+
+/* Sync any log file that has had the configured data or time pass */
+static void
+log_sync_check(void)
+{
+	struct log_file *lf;
+	struct timeval now;
+
+	TAILQ_FOREACH(lf, &log_state.files, entry) {
+		/* Blocks and frames are held a bounded time */
+		if (lf->block != NULL && lf->block->flows != 0 &&
+		    usec_since(&lf->block_start) >= log_state.hold_usec) {
+			gettimeofday(&now, NULL);
+			log_block_flush(lf, &now);
+		}
+		if (lf->frame != NULL && lf->frame->raw_len != 0 &&
+		    usec_since(&lf->frame_start) >= log_state.hold_usec) {
+			gettimeofday(&now, NULL);
+			log_frame_flush(lf, &now);
+		}
+		if (lf->unsynced == 0)
+			continue;
+		if ((log_state.sync_bytes != 0 &&
+		    lf->unsynced >= log_state.sync_bytes) ||
+		    (log_state.sync_usec != 0 &&
+		    usec_since(&lf->dirty) >= log_state.sync_usec))
+			log_sync(lf);
+	}
+}
+
+/* A sync policy also covers whatever is still pending at close */
+static void
+log_file_close(struct log_files *list, struct log_file *lf)
+{
+	struct timeval now;
+
+	if (lf->block != NULL) {
+		gettimeofday(&now, NULL);
+		log_block_flush(lf, &now);
+		store_block_free(lf->block);
+		free(lf->block);
+	}
+	if (lf->frame != NULL) {
+		gettimeofday(&now, NULL);
+		log_frame_flush(lf, &now);
+		store_frame_free(lf->frame);
+		free(lf->frame);
+	}
+	if (log_state.sync_bytes != 0 || log_state.sync_usec != 0)
+		log_sync(lf);
+	close(lf->fd);
+	if (lf->idx_fd != -1) {
+		log_index_flush(lf);
+		if (lf->idx_fd != -1)
+			close(lf->idx_fd);
+	}
+	TAILQ_REMOVE(list, lf, entry);
+	free(lf);
+}
+
+/* Called whenever the logfile is to be (re)opened */
+static void
+log_open(struct flowd_config *conf, int monitor_fd)
+{
+	struct log_file *lf;
+
+	log_state.monitor_fd = monitor_fd;
+	log_state.rotate = conf->log_rotate;
+	log_state.split_tag = strstr(conf->log_file, LOGFILE_TAG_ESCAPE) !=
+	    NULL;
+	log_state.prealloc = (off_t)conf->log_prealloc_mb * 1024 * 1024;
+	log_state.sync_bytes = (u_int64_t)conf->log_sync_mb * 1024 * 1024;
+	log_state.sync_usec = (u_int64_t)conf->log_sync_ms * 1000;
+	log_state.index_flows = conf->log_index_flows;
+	log_state.index_secs = conf->log_index_secs;
+	log_state.blocks = conf->store_version == STORE_BLOCK_VER_MAJOR;
+	log_state.compress = conf->log_compress;
+	log_state.hold_usec = LOG_HOLD_MAX_AGE * 1000000ULL;
+	if (log_state.sync_usec != 0 &&
+	    log_state.sync_usec < log_state.hold_usec)
+		log_state.hold_usec = log_state.sync_usec;
+#if !defined(HAVE_FALLOCATE) || !defined(FALLOC_FL_KEEP_SIZE)
+	if (log_state.prealloc != 0) {
+		logit(LOG_WARNING, "logfile preallocation not supported on "
+		    "this platform");
+		log_state.prealloc = 0;
+	}
+#endif
+	log_state.bucket = LOG_BUCKET(time(NULL));
+	log_state.active = 1;
+
+	/* Tagged logs are opened as flows with each tag turn up */
+	if (!log_state.split_tag) {
+		lf = log_file_open(log_state.bucket, 0, 0);
+		TAILQ_INSERT_HEAD(&log_state.files, lf, entry);
+		log_state.num_files = 1;
+	}
+}
+
+static void
+log_close(void)
+{
+	while (!TAILQ_EMPTY(&log_state.files))
+		log_file_close(&log_state.files, TAILQ_FIRST(&log_state.files));
+	while (!TAILQ_EMPTY(&log_state.ahead))
+		log_file_close(&log_state.ahead, TAILQ_FIRST(&log_state.ahead));
+	log_state.num_files = 0;
+	log_state.active = 0;
+}
+
+/* Move on to the files for a new time interval, if one has started */
+static void
+log_rotate(time_t now)
+{
+	struct log_file *lf;
+	time_t bucket;
+
+	if (log_state.rotate == 0 ||
+	    (bucket = LOG_BUCKET(now)) == log_state.bucket)
+		return;
+	while ((lf = TAILQ_FIRST(&log_state.files)) != NULL)
+		log_file_close(&log_state.files, lf);
+	log_state.num_files = 0;
+	while ((lf = TAILQ_FIRST(&log_state.ahead)) != NULL) {
+		if (lf->bucket != bucket) {
+			/* Nothing was written while they were current */
+			log_file_close(&log_state.ahead, lf);
+			continue;
+		}
+		TAILQ_REMOVE(&log_state.ahead, lf, entry);
+		TAILQ_INSERT_TAIL(&log_state.files, lf, entry);
+		log_state.num_files++;
+	}
+	log_state.bucket = bucket;
+	log_state.rotations++;
+}
+
+/*
+ * Shortly before the interval ends, have the monitor open the next set of
+ * files, so rotating doesn't wait on it.
+ */
+static void
+log_open_ahead(time_t now)
+{
+	struct log_file *lf, *next;
+	time_t bucket, lead;
+
+	if (log_state.rotate == 0 || !TAILQ_EMPTY(&log_state.ahead))
+		return;
+	bucket = log_state.bucket + log_state.rotate;
+	lead = log_state.rotate / 2;
+	if (lead > LOG_OPEN_AHEAD)
+		lead = LOG_OPEN_AHEAD;
+	if (now < bucket - lead)
+		return;
+	TAILQ_FOREACH(lf, &log_state.files, entry) {
+		next = log_file_open(bucket, lf->tagged, lf->tag);
+		log_prealloc(next, 1);
+		TAILQ_INSERT_TAIL(&log_state.ahead, next, entry);
+	}
+}
+
+/* Find or open the current file for a tag, keeping the list MRU first */
+static struct log_file *
+log_file_get(int tagged, u_int32_t tag)
+{
+	struct log_file *lf;
+
+	TAILQ_FOREACH(lf, &log_state.files, entry) {
+		if (lf->tagged == tagged && lf->tag == tag)
+			break;
+	}
+	if (lf == NULL) {
+		if (log_state.num_files >= LOG_MAX_OPEN_FILES) {
+			log_file_close(&log_state.files,
+			    TAILQ_LAST(&log_state.files, log_files));
+			log_state.num_files--;
+		}
+		lf = log_file_open(log_state.bucket, tagged, tag);
+		TAILQ_INSERT_HEAD(&log_state.files, lf, entry);
+		log_state.num_files++;
+	} else if (lf != TAILQ_FIRST(&log_state.files)) {
+		TAILQ_REMOVE(&log_state.files, lf, entry);
+		TAILQ_INSERT_HEAD(&log_state.files, lf, entry);
+	}
+	return (lf);
+}
+
+/* Write serialised flows to the current log file(s) */
+static void
+log_write(char *buf, int len)
+{
+	struct store_flow hdr;
+	struct timeval now;
+	u_int32_t fields, tag, run_tag, secs, flows, first, last;
+	int off, run, flowlen, tagged, run_tagged;
+
+	gettimeofday(&now, NULL);
+	log_rotate(now.tv_sec);
+
+	if (!log_state.split_tag && log_state.index_flows == 0 &&
+	    log_state.index_secs == 0) {
+		log_file_write(log_file_get(0, 0), buf, len, &now, 0, 0, 0);
+		goto out;
+	}
+
+	/*
+	 * Write each run of flows with the same tag to that tag's file,
+	 * noting when they were received for the index
+	 */
+	run_tagged = 0;
+	run_tag = 0;
+	flows = first = last = 0;
+	for (run = off = 0; off < len; off += flowlen) {
+		if (len - off < (int)sizeof(hdr))
+			logerrx("%s: truncated flow in output", __func__);
+		memcpy(&hdr, buf + off, sizeof(hdr));
+		flowlen = sizeof(hdr) + hdr.len_words * 4;
+		fields = ntohl(hdr.fields);
+		tag = 0;
+		if ((tagged = (fields & STORE_FIELD_TAG) != 0) &&
+		    log_state.split_tag) {
+			/* It is always the first field */
+			memcpy(&tag, buf + off + sizeof(hdr), sizeof(tag));
+			tag = ntohl(tag);
+		}
+		if (!store_raw_recv_time((u_int8_t *)buf + off, &secs))
+			secs = now.tv_sec;
+		if (!log_state.split_tag)
+			tagged = 0;
+		if (off > run && (tagged != run_tagged || tag != run_tag)) {
+			log_file_write(log_file_get(run_tagged, run_tag),
+			    buf + run, off - run, &now, flows, first, last);
+			run = off;
+			flows = 0;
+		}
+		if (flows == 0 || secs < first)
+			first = secs;
+		if (flows == 0 || secs > last)
+			last = secs;
+		flows++;
+		run_tagged = tagged;
+		run_tag = tag;
+	}
+	if (off != len)
+		logerrx("%s: truncated flow in output", __func__);
+	if (off > run) {
+		log_file_write(log_file_get(run_tagged, run_tag),
+		    buf + run, off - run, &now, flows, first, last);
+	}
+
+ out:
+	log_sync_check();
+	log_open_ahead(now.tv_sec);
+}
+
+/*
+ * Milliseconds until log_sync_check() has a time-based sync, or a block
+ * or frame write, due
+ */
+static int
+log_sync_timeout(void)
+{
+	struct log_file *lf;
+	const struct timeval *held;
+	u_int64_t elapsed;
+	int ms, timeout = INFTIM;
+
+	if (log_state.sync_usec == 0 && !log_state.blocks &&
+	    !log_state.compress)
+		return (INFTIM);
+	TAILQ_FOREACH(lf, &log_state.files, entry) {
+		held = NULL;
+		if (lf->block != NULL && lf->block->flows != 0)
+			held = &lf->block_start;
+		if (lf->frame != NULL && lf->frame->raw_len != 0 &&
+		    (held == NULL || timercmp(&lf->frame_start, held, <)))
+			held = &lf->frame_start;
+		if (held != NULL) {
+			elapsed = usec_since(held);
+			if (elapsed >= log_state.hold_usec)
+				return (0);
+			ms = (log_state.hold_usec - elapsed + 999) / 1000;
+			if (timeout == INFTIM || ms < timeout)
+				timeout = ms;
+		}
+		if (log_state.sync_usec == 0 || lf->unsynced == 0 ||
+		    lf->offset == -1)
+			continue;
+		if ((elapsed = usec_since(&lf->dirty)) >= log_state.sync_usec)
+			return (0);
+		ms = (log_state.sync_usec - elapsed + 999) / 1000;
+		if (timeout == INFTIM || ms < timeout)
+			timeout = ms;
+	}
+	return (timeout);
+}
+
+static u_int64_t
+log_unsynced(void)
+{
+	struct log_file *lf;
+	u_int64_t n = 0;
+
+	TAILQ_FOREACH(lf, &log_state.files, entry)
+		n += lf->unsynced;
+	return (n);
+}
+
+/* Write a queue to the log file and socket and empty it */
+static void
+output_write(struct output_queue *q, int verbose)
+{
+	struct timeval start;
+	u_int64_t usec, flush_start;
+
+	if (verbose) {
+		logit(LOG_DEBUG, "%s: flushing output queue len %zu", __func__,
+		    q->offset);
+	}
+
+	if (q->offset == 0)
+		return;
+	flush_start = stats_now_ns();
+
+	if (log_state.active) {
+		gettimeofday(&start, NULL);
+		log_write(q->buf, q->offset);
+		usec = usec_since(&start);
+		output_stats.writes++;
+		output_stats.bytes += q->offset;
+		output_stats.usec += usec;
+		if (usec > output_stats.max_usec)
+			output_stats.max_usec = usec;
+	}
+
+	if (log_socket != -1)
+		output_send_socket(q);
+
+	if (log_ring.hdr != NULL)
+		ring_write(&log_ring, q->buf, q->offset);
+
+	stats_hist_add(&output_stats.flush_bytes, q->offset);
+	stats_hist_add(&output_stats.flush_ns, stats_now_ns() - flush_start);
+
+	/* XXX reopen log file on one failure, exit on multiple */
+
+	q->offset = 0;
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * Full output queues passed from workers to the main thread or, with a
+ * single worker, from the main thread to a writer thread.
+ */
+static struct {
+	pthread_mutex_t		 lock;
+	pthread_cond_t		 filled;	/* queue handed over, or exit */
+	pthread_cond_t		 released;	/* queue put back on free list */
+	struct output_queues	 full;
+	struct output_queues	 free;
+	u_int			 running;	/* workers not yet exited */
+	int			 notify[2];	/* worker -> main: queue full */
+	pthread_t		 writer;
+	u_int64_t		 queued;	/* bytes handed over */
+	u_int64_t		 stalls;	/* waits for a free queue */
+	u_int64_t		 stall_usec;
+	u_int			 depth;		/* queues in "full" */
+	u_int			 max_depth;
+} handoff = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	TAILQ_HEAD_INITIALIZER(handoff.full),
+	TAILQ_HEAD_INITIALIZER(handoff.free),
+	0, { -1, -1 }
+};
+
+/*
+ * Pass a worker's output queue to the main thread and take an empty one,
+ * waiting if the writer has fallen behind. A worker that is exiting
+ * ("final") doesn't take a replacement.
+ */
+static void
+output_handoff(struct flowd_worker *w, int final)
+{
+	struct output_queue *q;
+	struct timeval start;
+	int wake;
+
+	pthread_mutex_lock(&handoff.lock);
+	wake = TAILQ_EMPTY(&handoff.full);
+	handoff.queued += w->outq->offset;
+	if (w->outq->offset > 0) {
+		TAILQ_INSERT_TAIL(&handoff.full, w->outq, entry);
+		if (++handoff.depth > handoff.max_depth)
+			handoff.max_depth = handoff.depth;
+	} else
+		TAILQ_INSERT_TAIL(&handoff.free, w->outq, entry);
+	w->outq = NULL;
+	if (final)
+		handoff.running--;
+	else {
+		if (TAILQ_EMPTY(&handoff.free)) {
+			/* Every queue is waiting on the writer */
+			pthread_cond_signal(&handoff.filled);
+			handoff.stalls++;
+			gettimeofday(&start, NULL);
+			while (TAILQ_EMPTY(&handoff.free)) {
+				pthread_cond_wait(&handoff.released,
+				    &handoff.lock);
+			}
+			handoff.stall_usec += usec_since(&start);
+		}
+		q = TAILQ_FIRST(&handoff.free);
+		TAILQ_REMOVE(&handoff.free, q, entry);
+		w->outq = q;
+	}
+	pthread_cond_signal(&handoff.filled);
+	pthread_mutex_unlock(&handoff.lock);
+
+	/* A full pipe means the main thread has a wakeup pending anyway */
+	if (wake && handoff.notify[1] != -1 &&
+	    write(handoff.notify[1], "", 1) == -1 && errno != EAGAIN)
+		logitm(LOG_WARNING, "%s: write", __func__);
+}
+
+/* Write out all handed over queues. Called and returns with lock held */
+static void
+output_drain_locked(int verbose)
+{
+	struct output_queues todo;
+	struct output_queue *q;
 
-#define INPUT_MAX_PACKET_PER_FD		512
-struct flow_packet {
-	TAILQ_ENTRY(flow_packet) entry;
-	struct timeval recv_time;
-	struct xaddr flow_source;
-	u_int len;
-	u_int8_t *packet;
-};
-TAILQ_HEAD(flow_packets, flow_packet);
+	TAILQ_INIT(&todo);
+	while ((q = TAILQ_FIRST(&handoff.full)) != NULL) {
+		TAILQ_REMOVE(&handoff.full, q, entry);
+		TAILQ_INSERT_TAIL(&todo, q, entry);
+	}
+	handoff.depth = 0;
+	pthread_mutex_unlock(&handoff.lock);
 
-struct flow_packets input_queue = TAILQ_HEAD_INITIALIZER(input_queue);
+	TAILQ_FOREACH(q, &todo, entry)
+		output_write(q, verbose);
 
-/* Allocate a new packet (XXX: make this use a pool of preallocated entries) */
-static struct flow_packet
-*flow_packet_alloc(void)
+	pthread_mutex_lock(&handoff.lock);
+	while ((q = TAILQ_FIRST(&todo)) != NULL) {
+		TAILQ_REMOVE(&todo, q, entry);
+		TAILQ_INSERT_TAIL(&handoff.free, q, entry);
+	}
+	pthread_cond_broadcast(&handoff.released);
+}
+
+/* With a single worker, output is written by this thread */
+static void *
+writer_main(void *arg)
 {
-	return (calloc(1, sizeof(struct flow_packet)));
+	struct flowd_config *conf = (struct flowd_config *)arg;
+	struct timeval now;
+	struct timespec deadline;
+	int timeout;
+
+	pthread_mutex_lock(&handoff.lock);
+	for (;;) {
+		if (!TAILQ_EMPTY(&handoff.full))
+			output_drain_locked(conf->opts & FLOWD_OPT_VERBOSE);
+		else if (handoff.running == 0)
+			break;
+		else if ((timeout = log_sync_timeout()) == INFTIM)
+			pthread_cond_wait(&handoff.filled, &handoff.lock);
+		else {
+			/* Idle with a sync pending */
+			gettimeofday(&now, NULL);
+			deadline.tv_sec = now.tv_sec + timeout / 1000;
+			deadline.tv_nsec = (now.tv_usec +
+			    (timeout % 1000) * 1000) * 1000;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			if (timeout == 0 || pthread_cond_timedwait(
+			    &handoff.filled, &handoff.lock,
+			    &deadline) == ETIMEDOUT) {
+				pthread_mutex_unlock(&handoff.lock);
+				log_sync_check();
+				pthread_mutex_lock(&handoff.lock);
+			}
+		}
+	}
+	pthread_mutex_unlock(&handoff.lock);
+
+	return (NULL);
 }
+#endif /* HAVE_PTHREAD */
 
-/* Deallocate a flow packet (XXX: change to return entry to freelist) */
 static void
-flow_packet_dealloc(struct flow_packet *f)
+output_stats_dump(void)
 {
-	if (f->packet != NULL)
-		free(f->packet);
-	free(f);
+	logit(LOG_INFO, "output: %llu writes, %llu bytes, %llu ms writing, "
+	    "longest %llu ms", (unsigned long long)output_stats.writes,
+	    (unsigned long long)output_stats.bytes,
+	    (unsigned long long)output_stats.usec / 1000,
+	    (unsigned long long)output_stats.max_usec / 1000);
+	logit(LOG_INFO, "output: %u log files open, %llu rotations, %llu "
+	    "index entries, %llu blocks, %llu frames (%llu bytes from %llu), "
+	    "%llu syncs, %llu ms syncing, %llu bytes unsynced",
+	    log_state.num_files, (unsigned long long)log_state.rotations,
+	    (unsigned long long)log_state.index_entries,
+	    (unsigned long long)log_state.blocks_written,
+	    (unsigned long long)log_state.frames_written,
+	    (unsigned long long)log_state.frame_out,
+	    (unsigned long long)log_state.frame_in,
+	    (unsigned long long)log_state.syncs,
+	    (unsigned long long)log_state.sync_time / 1000,
+	    (unsigned long long)log_unsynced());
+#ifdef HAVE_PTHREAD
+	logit(LOG_INFO, "output: %llu bytes queued, collection stalled %llu "
+	    "times for %llu ms waiting on the writer",
+	    (unsigned long long)handoff.queued,
+	    (unsigned long long)handoff.stalls,
+	    (unsigned long long)handoff.stall_usec / 1000);
+#endif
+	if (log_ring.hdr != NULL) {
+		logit(LOG_INFO, "output: log ring %llu flows, %llu bytes, "
+		    "%llu writes, %llu pads", (unsigned long long)log_ring.flows,
+		    (unsigned long long)log_ring.head,
+		    (unsigned long long)log_ring.writes,
+		    (unsigned long long)log_ring.pads);
+	}
 }
 
-/* Enqueue a flow packet in the input queue */
 static void
-flow_packet_enqueue(struct flow_packet *f)
+output_flow_flush(struct flowd_worker *w, int verbose)
 {
-	TAILQ_INSERT_TAIL(&input_queue, f, entry);
+	/* Anything queued now can't be taken back */
+	w->outq_marked = 0;
+	if (w->outq->offset == 0)
+		return;
+#ifdef HAVE_PTHREAD
+	if (workers_running) {
+		output_handoff(w, 0);
+		return;
+	}
+#endif
+	output_write(w->outq, verbose);
 }
 
-/* Pull the first flow packet off the queue */
-static struct flow_packet
-*flow_packet_dequeue(void)
+/*
+ * Flush the output queue if the configured policy calls for it: after
+ * every wakeup by default, otherwise once enough is queued or the oldest
+ * flow has waited long enough.
+ */
+static void
+output_flush_check(struct flowd_worker *w)
 {
-	struct flow_packet *f;
+	struct flowd_config *conf = w->conf;
+	struct output_queue *q = w->outq;
 
-	if ((f = TAILQ_FIRST(&input_queue)) != NULL)
-		TAILQ_REMOVE(&input_queue, f, entry);
-	return (f);
+	if (q->offset == 0)
+		return;
+	if ((conf->output_flush_kb == 0 && conf->output_flush_ms == 0) ||
+	    (conf->output_flush_kb != 0 &&
+	    q->offset >= (size_t)conf->output_flush_kb << 10) ||
+	    (conf->output_flush_ms != 0 && stats_now_ns() - q->since >=
+	    (u_int64_t)conf->output_flush_ms * 1000000))
+		output_flow_flush(w, conf->opts & FLOWD_OPT_VERBOSE);
 }
 
-/* Output queue management */
+/* Shorten a poll timeout so queued flows are flushed on time */
+static int
+output_flush_timeout(struct flowd_worker *w, int timeout)
+{
+	struct flowd_config *conf = w->conf;
+	u_int64_t waited;
+	int ms;
+
+	if (conf->output_flush_ms == 0 || w->outq->offset == 0)
+		return (timeout);
+	waited = (stats_now_ns() - w->outq->since) / 1000000;
+	ms = waited >= conf->output_flush_ms ? 0 :
+	    conf->output_flush_ms - waited;
+	if (timeout == INFTIM || ms < timeout)
+		timeout = ms;
+	return (timeout);
+}
 
-#define OUTPUT_INITIAL_QLEN	(1024*16)
-#define OUTPUT_MAX_QLEN		(1024*512) /* Must be 2^x multiple of initial */
-u_int8_t *output_queue = NULL;
-size_t output_queue_alloc = 0;
-size_t output_queue_offset = 0;
+/* Bring idle output queues to a newly configured size */
+static void
+output_queues_resize(struct flowd_config *conf)
+{
+	size_t size = (size_t)conf->output_queue_kb << 10;
+#ifdef HAVE_PTHREAD
+	struct output_queue *q;
+
+	TAILQ_FOREACH(q, &handoff.free, entry)
+		output_queue_alloc(q, size);
+#else
+	/* Write out what is held first, as the new buffer starts empty */
+	if (workers[0].outq->alloc != size)
+		output_write(workers[0].outq, conf->opts & FLOWD_OPT_VERBOSE);
+	output_queue_alloc(workers[0].outq, size);
+#endif
+}
 
-/* Enqueue a flow for output, return 0 on success, -1 on queue full */
+/*
+ * Remember where the flows from the packet being decoded start, so they
+ * can be taken back out of the output queue if the packet turns out
+ * to be invalid.
+ */
+static void
+output_mark(struct flowd_worker *w, int verbose)
+{
+	/*
+	 * Leave room for most packets' flows, and write once the flush size
+	 * is reached rather than in mid-packet. A packet of many small
+	 * records may still outgrow the room; see output_make_room().
+	 */
+	if (w->outq->offset > w->outq->alloc / 2 ||
+	    (w->conf->output_flush_kb != 0 &&
+	    w->outq->offset >= (size_t)w->conf->output_flush_kb << 10))
+		output_flow_flush(w, verbose);
+	w->outq_mark = w->outq->offset;
+	w->outq_marked = 1;
+	w->outq_dropped = 0;
+	w->mark_stats.flows = w->stats.flows;
+	w->mark_stats.accepted = w->stats.accepted;
+	w->mark_stats.discarded = w->stats.discarded;
+}
+
+/*
+ * Make room in the output queue for a flow of len bytes. While a packet
+ * is being decoded only the flows queued before its output_mark() may be
+ * written; its own are moved to the front of the queue, as they can
+ * still be taken back. If they can't be made to fit, all of the packet's
+ * flows are dropped. Returns -1 if the flow is to be dropped.
+ */
 static int
-output_flow_enqueue(u_int8_t *f, size_t len, int verbose)
+output_make_room(struct flowd_worker *w, size_t len, int verbose)
 {
-	/* Force flush on overflow */
-	if (output_queue_offset + len > OUTPUT_MAX_QLEN) {
-		logit(LOG_DEBUG, "%s: output queue full", __func__);
+	struct output_queue *q = w->outq;
+#ifdef HAVE_PTHREAD
+	u_int8_t *held;
+#endif
+	size_t nheld;
+
+	if (w->outq_dropped)
 		return (-1);
+	if (q->offset + len <= q->alloc)
+		return (0);
+	if (!w->outq_marked) {
+		output_flow_flush(w, verbose);
+		return (0);
 	}
 
-	if (output_queue == NULL) {
-		output_queue_alloc = OUTPUT_INITIAL_QLEN;
-		if ((output_queue = malloc(output_queue_alloc)) == NULL) {
-			logerrx("Output queue allocation (%zu bytes) failed",
-			    output_queue_alloc);
+	nheld = q->offset - w->outq_mark;
+	if (w->outq_mark == 0 || nheld + len > q->alloc)
+		goto drop;
+	q->offset = w->outq_mark;
+#ifdef HAVE_PTHREAD
+	if (workers_running) {
+		/* The queue may be reused as soon as it is handed over */
+		if ((held = malloc(nheld)) == NULL)
+			logerrx("%s: malloc failed", __func__);
+		memcpy(held, q->buf + w->outq_mark, nheld);
+		output_handoff(w, 0);
+		q = w->outq;
+		/* Smaller, if it was resized since */
+		if (nheld + len > q->alloc) {
+			free(held);
+			w->outq_mark = 0;
+			goto drop;
 		}
-		if (verbose) {
-			logit(LOG_DEBUG, "%s: initial allocation %zu", __func__,
-			    output_queue_alloc);
-		}
-	}
-	
-	while (output_queue_offset + len > output_queue_alloc) {
-		u_int8_t *tmp_q;
-		size_t tmp_len = output_queue_alloc << 1;
-
-		/* This should never happen if max = initial * 2^x */
-		if (tmp_len > OUTPUT_MAX_QLEN) {
-			logit(LOG_DEBUG, "%s: oops, tmp_len (%zu) > "
-			    "OUTPUT_MAX_QLEN (%u)", __func__, tmp_len,
-			    OUTPUT_MAX_QLEN);
-			return (-1);
-		}
-		if ((tmp_q = realloc(output_queue, tmp_len)) == NULL) {
-			logit(LOG_DEBUG, "%s: realloc of %zu fail", __func__,
-			    tmp_len);
-			return (-1);
-		}
-		if (verbose) {
-			logit(LOG_DEBUG, "%s: increased output queue "
-			    "from %zuKB to %zuKB", __func__,
-			    output_queue_alloc >> 10, tmp_len >> 10);
-		}
-		output_queue = tmp_q;
-		output_queue_alloc = tmp_len;
-	}
-	memcpy(output_queue + output_queue_offset, f, len);
-	output_queue_offset += len;
-	if (verbose) {
-		logit(LOG_DEBUG, "%s: offset %zu alloc %zu", __func__,
-		    output_queue_offset, output_queue_alloc);
+		memcpy(q->buf, held, nheld);
+		free(held);
+	} else
+#endif
+	{
+		output_write(q, verbose);
+		memmove(q->buf, q->buf + w->outq_mark, nheld);
 	}
-	
+	q->offset = nheld;
+	q->since = stats_now_ns();
+	w->outq_mark = 0;
 	return (0);
+
+ drop:
+	q->offset = w->outq_mark;
+	w->outq_dropped = 1;
+	return (-1);
 }
 
+/* The packet being decoded was valid, so its flows are kept */
 static void
-output_flow_flush(int log_fd, int verbose)
+output_commit(struct flowd_worker *w, struct flow_packet *fp)
 {
-	char ebuf[512];
-
-	if (log_fd == -1)
-		return;
-
-	if (verbose) {
-		logit(LOG_DEBUG, "%s: flushing output queue len %zu", __func__,
-		    output_queue_offset);
+	if (w->outq_dropped) {
+		logit(LOG_WARNING, "flows of a packet from %s don't fit in the "
+		    "output queue, dropped", addr_ntop_buf(&fp->flow_source));
 	}
+	w->outq_marked = 0;
+	w->outq_dropped = 0;
+	filter_index_commit(w->filters);
+}
 
-	if (output_queue_offset == 0)
+/* Discard the flows queued since output_mark(), and forget counting them */
+static void
+output_rollback(struct flowd_worker *w)
+{
+	aggr_rollback(&w->aggr);
+	filter_index_rollback(w->filters);
+	w->stats.flows = w->mark_stats.flows;
+	w->stats.accepted = w->mark_stats.accepted;
+	w->stats.discarded = w->mark_stats.discarded;
+	w->accepted = w->discarded = 0;
+	w->invalid = 1;
+	if (!w->outq_marked) {
+		logit(LOG_DEBUG, "%s: flows already flushed", __func__);
 		return;
-	
-	if (store_put_buf(log_fd, output_queue, output_queue_offset, ebuf,
-	    sizeof(ebuf)) != STORE_ERR_OK)
-		logerrx("%s: exiting on %s", __func__, ebuf);
-
-	output_queue_offset = 0;
+	}
+	w->outq->offset = w->outq_mark;
+	w->outq_marked = 0;
+	w->outq_dropped = 0;
 }
 
 /* Signal handlers */
@@ -264,69 +1761,79 @@ dump_packet(const char *tag, const u_int8_t *p, int len)
 }
 
 static int
-start_log(int monitor_fd)
+start_socket(int monitor_fd)
 {
 	int fd;
-	off_t r;
-	char ebuf[512];
 
-	if ((fd = client_open_log(monitor_fd)) == -1)
-		logerrx("Logfile open failed, exiting");
-
-	/* Don't try to write a v.3 log on the end of a v.2 one */
-
-	r = lseek(fd, 0, SEEK_END);
-
-	/*
-	 * If there isn't a full legacy header in the file or an error occurs
-	 * (r == -1, e.g. on a FIFO) then don't bother checking for an old 
-	 * log header.
-	 */
-	if (r < sizeof(struct store_v2_header))
-		return (fd);
-
-	if ((r = lseek(fd, 0, SEEK_SET)) == -1) {
-		if (errno == ESPIPE)
-			return fd;
-		logerr("%s: lseek", __func__);
-	}
+	if ((fd = client_open_socket(monitor_fd)) == -1)
+		logerrx("Logsock open failed, exiting");
+	return (fd);
+}
 
-	switch (store_v2_check_header(fd, ebuf, sizeof(ebuf))) {
-	case STORE_ERR_OK:
-		/* Uh oh - an old flow log is in the way, don't try to write */
-		logerrx("Error: Cannot append to legacy (version 2) flow log, "
-		    "please move it out of the way and restart flowd");
-	case STORE_ERR_BAD_MAGIC:
-	case STORE_ERR_UNSUP_VERSION:
-		/* Good - the existing flow log is a probably a new one */
-		if ((r = lseek(fd, 0, SEEK_END)) == -1)
-			logerr("%s: lseek", __func__);
-		return (fd);
-	default:
-		logerrx("%s: %s", __func__, ebuf);
+/* Open the flow ring through the monitor, replacing it if resized */
+static void
+start_ring(struct flowd_config *conf, int monitor_fd)
+{
+	char ebuf[512];
+	int fd, r, replace;
+
+	for (replace = 0;; replace = 1) {
+		if ((fd = client_open_ring(monitor_fd, replace)) == -1)
+			logerrx("Log ring open failed, exiting");
+		r = ring_writer_open(&log_ring, fd, conf->log_ring_size,
+		    ebuf, sizeof(ebuf));
+		close(fd);
+		if (r == RING_ERR_OK)
+			break;
+		if (r != RING_ERR_SIZE || replace)
+			logerrx("Log ring open failed: %s", ebuf);
+		logit(LOG_INFO, "log ring \"%s\" has changed size, "
+		    "replacing it", conf->log_ring);
 	}
+	if ((log_ring_path = strdup(conf->log_ring)) == NULL)
+		logerrx("%s: strdup failed", __func__);
+}
 
-	/* NOTREACHED */
-	return (-1);
+static void
+stop_ring(void)
+{
+	ring_writer_close(&log_ring);
+	free(log_ring_path);
+	log_ring_path = NULL;
 }
 
-static int
-start_socket(int monitor_fd)
+/* Serialise an accepted flow onto the output queue */
+static void
+output_flow(struct store_flow_complete *flow, struct flowd_config *conf,
+    struct flowd_worker *w, int sample)
 {
-	int fd;
+	char ebuf[512], fbuf[1024];
+	int flen;
+	u_int64_t start = 0;
 
-	if ((fd = client_open_socket(monitor_fd)) == -1)
-		logerrx("Logsock open failed, exiting");
-	return (fd);
+	if (sample)
+		start = stats_now_ns();
+	if (store_flow_serialise_masked(flow, conf->store_mask, fbuf,
+	    sizeof(fbuf), &flen, ebuf, sizeof(ebuf)) != STORE_ERR_OK)
+		logerrx("%s: exiting on %s", __func__, ebuf);
+	if (sample)
+		stats_hist_add(&w->stats.serialise, stats_now_ns() - start);
+
+	if (output_make_room(w, flen, conf->opts & FLOWD_OPT_VERBOSE) == -1)
+		return;
+	/* Must not fail once there is room */
+	if (output_flow_enqueue(w->outq, fbuf, flen,
+	    conf->opts & FLOWD_OPT_VERBOSE) == -1)
+		logerrx("%s: enqueue failed after flush", __func__);
 }
 
 static void
 process_flow(struct store_flow_complete *flow, struct flowd_config *conf,
-    int log_fd, int log_socket)
+    struct flowd_worker *w)
 {
-	char ebuf[512], fbuf[1024];
-	int flen;
+	int sample;
 	u_int filtres;
+	u_int64_t start = 0;
 
 	/* Another sanity check */
 	if (flow->src_addr.af != flow->dst_addr.af) {
@@ -340,7 +1847,11 @@ process_flow(struct store_flow_complete *flow, struct flowd_config *conf,
 	flow->recv_time.recv_sec = htonl(flow->recv_time.recv_sec);
 	flow->recv_time.recv_usec = htonl(flow->recv_time.recv_usec);
 
-	filtres = filter_flow(flow, &conf->filter_list);
+	if ((sample = (w->stats.flows++ % STATS_FLOW_SAMPLE) == 0))
+		start = stats_now_ns();
+	filtres = filter_flow(flow, w->filters);
+	if (sample)
+		stats_hist_add(&w->stats.filter, stats_now_ns() - start);
 	if (conf->opts & FLOWD_OPT_VERBOSE) {
 		char fmtbuf[1024];
 
@@ -350,49 +1861,247 @@ process_flow(struct store_flow_complete *flow, struct flowd_config *conf,
 		    filtres == FF_ACTION_DISCARD ? "DISCARD" : "ACCEPT", fmtbuf);
 	}
 
-	if (filtres == FF_ACTION_DISCARD)
+	if (filtres == FF_ACTION_DISCARD) {
+		w->stats.discarded++;
+		w->discarded++;
 		return;
+	}
+	w->stats.accepted++;
+	w->accepted++;
 
-	if (store_flow_serialise_masked(flow, conf->store_mask, fbuf,
-	    sizeof(fbuf), &flen, ebuf, sizeof(ebuf)) != STORE_ERR_OK)
-		logerrx("%s: exiting on %s", __func__, ebuf);
+	/* Merged flows are written when they leave the table */
+	if (w->aggr.params.key != 0) {
+		aggr_stage(&w->aggr, flow);
+		return;
+	}
+	output_flow(flow, conf, w, sample);
+}
+
+/* Write aggregated flows that are due, or all of them if now is 0 */
+static void
+output_aggr_flows(struct flowd_config *conf, struct flowd_worker *w,
+    time_t now)
+{
+	struct store_flow_complete flow;
+
+	while (aggr_expire(&w->aggr, now, &flow))
+		output_flow(&flow, conf, w, 0);
+}
+
+/* Merge the flows of a valid packet, writing any evicted to make room */
+static void
+commit_aggr_flows(struct flowd_config *conf, struct flowd_worker *w)
+{
+	struct store_flow_complete flow;
+
+	while (aggr_commit(&w->aggr, time(NULL), &flow))
+		output_flow(&flow, conf, w, 0);
+}
 
-	if (log_fd != -1 && output_flow_enqueue(fbuf, flen,
-	    conf->opts & FLOWD_OPT_VERBOSE) == -1) {
-		output_flow_flush(log_fd, conf->opts & FLOWD_OPT_VERBOSE);
-		/* Must not fail after flush */
-		if (output_flow_enqueue(fbuf, flen,
-		    conf->opts & FLOWD_OPT_VERBOSE) == -1)
-			logerrx("%s: enqueue failed after flush", __func__);
+/*
+ * Called before polling: rebuild the table if it has been reconfigured,
+ * write what is due and return the poll timeout to wake for the next.
+ */
+static int
+poll_aggr_flows(struct flowd_config *conf, struct flowd_worker *w,
+    int timeout)
+{
+	u_int64_t before;
+	time_t now;
+	int secs, flush = 0;
+
+	if (aggr_params_differ(&w->aggr, &conf->aggr)) {
+		flush = w->aggr.num_active > 0;
+		output_aggr_flows(conf, w, 0);
+		aggr_free(&w->aggr);
+		aggr_init(&w->aggr, &conf->aggr);
 	}
+	if (w->aggr.num_active > 0) {
+		now = time(NULL);
+		before = w->aggr.flows_out;
+		output_aggr_flows(conf, w, now);
+		flush |= w->aggr.flows_out != before;
+		if ((secs = aggr_next_expiry(&w->aggr, now)) >= 0 &&
+		    (timeout == INFTIM || secs * 1000 < timeout))
+			timeout = secs * 1000;
+	}
+	/* Nothing else may flush them until a packet arrives */
+	if (flush)
+		output_flush_check(w);
+	return (timeout);
+}
+
+/*
+ * NetFlow v.5 and v.7 records are of fixed size and, like the log, in
+ * network byte order. When nothing needs to look at the flows - no filter
+ * rules, aggregation or verbose logging - they are serialised straight
+ * into the output queue instead of by way of a store_flow_complete. All
+ * the records of a packet share their fields, so the record header and
+ * the fields that come from the packet header are prepared only once.
+ */
+struct fixed_flows {
+	struct store_flow			hdr;
+	u_int32_t				fields;
+	size_t					len;	/* of a record */
+	struct store_flow_RECV_TIME		recv_time;
+	struct store_flow_AGENT_INFO		ainfo;
+	struct store_flow_FLOW_ENGINE_INFO	finf;
+};
+
+static int
+fixed_flows_direct(struct flowd_config *conf, struct flowd_worker *w)
+{
+	return (filter_index_empty(w->filters) && w->aggr.params.key == 0 &&
+	    (conf->opts & FLOWD_OPT_VERBOSE) == 0);
+}
+
+/* Work out the fields and length of the records, as store_flow_serialise */
+static void
+fixed_flows_init(struct fixed_flows *ff, struct flow_packet *fp,
+    struct flowd_config *conf)
+{
+	u_int32_t fields;
+
+	bzero(ff, sizeof(*ff));
+	fields = STORE_FIELD_ALL & conf->store_mask & ~(STORE_FIELD_TAG |
+	    STORE_FIELD_SRC_ADDR6 | STORE_FIELD_DST_ADDR6 |
+	    STORE_FIELD_GATEWAY_ADDR6);
+	if (fp->flow_source.af == AF_INET &&
+	    (fields & STORE_FIELD_AGENT_ADDR4))
+		fields &= ~STORE_FIELD_AGENT_ADDR6;
+	else if (fp->flow_source.af == AF_INET6 &&
+	    (fields & STORE_FIELD_AGENT_ADDR6))
+		fields &= ~STORE_FIELD_AGENT_ADDR4;
+	ff->fields = fields;
+	ff->hdr.version = STORE_VERSION;
+	ff->hdr.fields = htonl(fields);
+	ff->len = store_calc_flow_len(&ff->hdr);
+	ff->hdr.len_words = ff->len / 4;
+	ff->len += sizeof(ff->hdr);
+
+	ff->recv_time.recv_sec = htonl(fp->recv_time.tv_sec);
+	ff->recv_time.recv_usec = htonl(fp->recv_time.tv_usec);
+}
+
+/*
+ * Serialise nflows records, each "stride" bytes apart. v.7 records begin
+ * with the same layout as v.5 ones.
+ */
+static void
+output_fixed_flows(struct fixed_flows *ff, const u_int8_t *recs,
+    size_t stride, u_int nflows, struct flow_packet *fp,
+    struct flowd_config *conf, struct flowd_worker *w)
+{
+	const struct NF5_FLOW *rec;
+	struct output_queue *q;
+	u_int8_t *o, *start;
+	u_int32_t fields = ff->fields, crc;
+	u_int64_t t = 0;
+	u_int i, sampled;
+
+#define FIXED_PUT(field, src, len) do {					\
+	if (fields & STORE_FIELD_##field) {				\
+		memcpy(o, (src), (len));				\
+		o += (len);						\
+	}  } while (0)
+	/* Widen a big-endian value by zero-filling its high bytes */
+#define FIXED_PUT_WIDE(src, len, wide) do {				\
+	memset(o, 0, (wide) - (len));					\
+	memcpy(o + (wide) - (len), (src), (len));			\
+	o += (wide);							\
+	} while (0)
+
+	/* The records are written in place, so the whole packet must fit */
+	if (output_make_room(w, nflows * ff->len,
+	    conf->opts & FLOWD_OPT_VERBOSE) == -1)
+		return;
+	q = w->outq;
+	if (q->offset + nflows * ff->len > q->alloc)
+		logerrx("%s: no room for %u flows after flush", __func__,
+		    nflows);
+
+	sampled = w->stats.flows % STATS_FLOW_SAMPLE == 0 ||
+	    w->stats.flows % STATS_FLOW_SAMPLE + nflows > STATS_FLOW_SAMPLE;
+	if (sampled)
+		t = stats_now_ns();
+	w->stats.flows += nflows;
+	w->stats.accepted += nflows;
+	w->accepted += nflows;
+
+	if (q->offset == 0)
+		q->since = stats_now_ns();
+	o = q->buf + q->offset;
 
-	/* Track failures to send on log socket so we can reopen it */
-	if (log_socket != -1 && send(log_socket, fbuf, flen, 0) == -1) {
-		if (logsock_num_errors > 0 &&
-		    (logsock_num_errors % 10) == 0) {
-			logit(LOG_WARNING, "log socket send: %s "
-			    "(num errors %d)", strerror(errno),
-			    logsock_num_errors);
+	for (i = 0; i < nflows; i++) {
+		rec = (const struct NF5_FLOW *)(recs + i * stride);
+		start = o;
+		memcpy(o, &ff->hdr, sizeof(ff->hdr));
+		o += sizeof(ff->hdr);
+		FIXED_PUT(RECV_TIME, &ff->recv_time, sizeof(ff->recv_time));
+		if (fields & STORE_FIELD_PROTO_FLAGS_TOS) {
+			o[0] = rec->tcp_flags;
+			o[1] = rec->protocol;
+			o[2] = rec->tos;
+			o[3] = 0;
+			o += 4;
 		}
-		if (errno != ENOBUFS) {
-			if (logsock_first_error == 0)
-				logsock_first_error = time(NULL);
-			logsock_num_errors++;
+		if (fields & STORE_FIELD_AGENT_ADDR4) {
+			if (fp->flow_source.af == AF_INET)
+				memcpy(o, &fp->flow_source.v4, 4);
+			else
+				memset(o, 0, 4);
+			o += 4;
+		}
+		if (fields & STORE_FIELD_AGENT_ADDR6) {
+			if (fp->flow_source.af == AF_INET6)
+				memcpy(o, &fp->flow_source.v6, 16);
+			else
+				memset(o, 0, 16);
+			o += 16;
+		}
+		FIXED_PUT(SRC_ADDR4, &rec->src_ip, 4);
+		FIXED_PUT(DST_ADDR4, &rec->dest_ip, 4);
+		FIXED_PUT(GATEWAY_ADDR4, &rec->nexthop_ip, 4);
+		/* Ports, like the flow times, are adjacent in the record */
+		FIXED_PUT(SRCDST_PORT, &rec->src_port, 4);
+		if (fields & STORE_FIELD_PACKETS)
+			FIXED_PUT_WIDE(&rec->flow_packets, 4, 8);
+		if (fields & STORE_FIELD_OCTETS)
+			FIXED_PUT_WIDE(&rec->flow_octets, 4, 8);
+		if (fields & STORE_FIELD_IF_INDICES) {
+			FIXED_PUT_WIDE(&rec->if_index_in, 2, 4);
+			FIXED_PUT_WIDE(&rec->if_index_out, 2, 4);
+		}
+		FIXED_PUT(AGENT_INFO, &ff->ainfo, sizeof(ff->ainfo));
+		FIXED_PUT(FLOW_TIMES, &rec->flow_start, 8);
+		if (fields & STORE_FIELD_AS_INFO) {
+			FIXED_PUT_WIDE(&rec->src_as, 2, 4);
+			FIXED_PUT_WIDE(&rec->dest_as, 2, 4);
+			o[0] = rec->src_mask;
+			o[1] = rec->dst_mask;
+			o[2] = o[3] = 0;
+			o += 4;
+		}
+		FIXED_PUT(FLOW_ENGINE_INFO, &ff->finf, sizeof(ff->finf));
+		if (fields & STORE_FIELD_CRC32) {
+			crc = htonl(flowd_crc32(start, o - start));
+			memcpy(o, &crc, sizeof(crc));
+			o += sizeof(crc);
 		}
-	} else {
-		/* Start to disregard errors after success */
-		if (logsock_num_errors > 0)
-			logsock_num_errors--;
-		if (logsock_num_errors == 0)
-			logsock_first_error = 0;
 	}
+#undef FIXED_PUT
+#undef FIXED_PUT_WIDE
+	q->offset = o - q->buf;
 
-	/* XXX reopen log file on one failure, exit on multiple */
+	if (sampled) {
+		stats_hist_add(&w->stats.serialise,
+		    (stats_now_ns() - t) / nflows);
+	}
 }
 
 static void
 process_netflow_v1(struct flow_packet *fp, struct flowd_config *conf,
-    struct peer_state *peer, struct peers *peers, int log_fd, int log_socket)
+    struct peer_state *peer, struct flowd_worker *w)
 {
 	struct NF1_HEADER *nf1_hdr = (struct NF1_HEADER *)fp->packet;
 	struct NF1_FLOW *nf1_flow;
@@ -423,7 +2132,7 @@ process_netflow_v1(struct flow_packet *fp, struct flowd_config *conf,
 	}
 
 	logit(LOG_DEBUG, "Valid netflow v.1 packet %d flows", nflows);
-	update_peer(peers, peer, nflows, 1);
+	update_peer(&w->peers, peer, nflows, 1);
 
 	for (i = 0; i < nflows; i++) {
 		offset = NF1_PACKET_SIZE(i);
@@ -477,13 +2186,13 @@ process_netflow_v1(struct flow_packet *fp, struct flowd_config *conf,
 		flow.ftimes.flow_start = nf1_flow->flow_start;
 		flow.ftimes.flow_finish = nf1_flow->flow_finish;
 
-		process_flow(&flow, conf, log_fd, log_socket);
+		process_flow(&flow, conf, w);
 	}
 }
 
 static void
 process_netflow_v5(struct flow_packet *fp, struct flowd_config *conf,
-    struct peer_state *peer, struct peers *peers, int log_fd, int log_socket)
+    struct peer_state *peer, struct flowd_worker *w)
 {
 	struct NF5_HEADER *nf5_hdr = (struct NF5_HEADER *)fp->packet;
 	struct NF5_FLOW *nf5_flow;
@@ -514,7 +2223,25 @@ process_netflow_v5(struct flow_packet *fp, struct flowd_config *conf,
 	}
 
 	logit(LOG_DEBUG, "Valid netflow v.5 packet %d flows", nflows);
-	update_peer(peers, peer, nflows, 5);
+	update_peer(&w->peers, peer, nflows, 5);
+	peer_sequence(&w->peers, peer, 5, (nf5_hdr->engine_type << 8) |
+	    nf5_hdr->engine_id, ntohl(nf5_hdr->flow_sequence), nflows);
+
+	if (fixed_flows_direct(conf, w)) {
+		struct fixed_flows ff;
+
+		fixed_flows_init(&ff, fp, conf);
+		ff.ainfo.sys_uptime_ms = nf5_hdr->uptime_ms;
+		ff.ainfo.time_sec = nf5_hdr->time_sec;
+		ff.ainfo.time_nanosec = nf5_hdr->time_nanosec;
+		ff.ainfo.netflow_version = nf5_hdr->c.version;
+		ff.finf.engine_type = nf5_hdr->engine_type;
+		ff.finf.engine_id = nf5_hdr->engine_id;
+		ff.finf.flow_sequence = nf5_hdr->flow_sequence;
+		output_fixed_flows(&ff, fp->packet + NF5_PACKET_SIZE(0),
+		    sizeof(*nf5_flow), nflows, fp, conf, w);
+		return;
+	}
 
 	for (i = 0; i < nflows; i++) {
 		offset = NF5_PACKET_SIZE(i);
@@ -575,13 +2302,13 @@ process_netflow_v5(struct flow_packet *fp, struct flowd_config *conf,
 		flow.finf.engine_id = nf5_hdr->engine_id;
 		flow.finf.flow_sequence = nf5_hdr->flow_sequence;
 
-		process_flow(&flow, conf, log_fd, log_socket);
+		process_flow(&flow, conf, w);
 	}
 }
 
 static void
 process_netflow_v7(struct flow_packet *fp, struct flowd_config *conf,
-    struct peer_state *peer, struct peers *peers, int log_fd, int log_socket)
+    struct peer_state *peer, struct flowd_worker *w)
 {
 	struct NF7_HEADER *nf7_hdr = (struct NF7_HEADER *)fp->packet;
 	struct NF7_FLOW *nf7_flow;
@@ -612,7 +2339,23 @@ process_netflow_v7(struct flow_packet *fp, struct flowd_config *conf,
 	}
 
 	logit(LOG_DEBUG, "Valid netflow v.7 packet %d flows", nflows);
-	update_peer(peers, peer, nflows, 7);
+	update_peer(&w->peers, peer, nflows, 7);
+	peer_sequence(&w->peers, peer, 7, 0, ntohl(nf7_hdr->flow_sequence),
+	    nflows);
+
+	if (fixed_flows_direct(conf, w)) {
+		struct fixed_flows ff;
+
+		fixed_flows_init(&ff, fp, conf);
+		ff.ainfo.sys_uptime_ms = nf7_hdr->uptime_ms;
+		ff.ainfo.time_sec = nf7_hdr->time_sec;
+		ff.ainfo.time_nanosec = nf7_hdr->time_nanosec;
+		ff.ainfo.netflow_version = nf7_hdr->c.version;
+		ff.finf.flow_sequence = nf7_hdr->flow_sequence;
+		output_fixed_flows(&ff, fp->packet + NF7_PACKET_SIZE(0),
+		    sizeof(*nf7_flow), nflows, fp, conf, w);
+		return;
+	}
 
 	for (i = 0; i < nflows; i++) {
 		offset = NF7_PACKET_SIZE(i);
@@ -677,124 +2420,210 @@ process_netflow_v7(struct flow_packet *fp, struct flowd_config *conf,
 
 		flow.finf.flow_sequence = nf7_hdr->flow_sequence;
 
-		process_flow(&flow, conf, log_fd, log_socket);
+		process_flow(&flow, conf, w);
+	}
+}
+
+/*
+ * Where each NetFlow v.9 field that we understand lands in a flow. IPFIX
+ * information elements share the v.9 numbering for all of these.
+ */
+struct nf_field_map {
+	u_int		type;
+	u_int32_t	store_field;
+	u_int16_t	offset;
+	u_int16_t	size;
+	u_int16_t	af_offset;	/* address fields only */
+	sa_family_t	af;
+};
+
+#define SFC_OFFSET(f)	offsetof(struct store_flow_complete, f)
+#define SFC_SIZE(f)	sizeof(((struct store_flow_complete *)0)->f)
+#define NF_FIELD(type, store_field, flow_field) \
+	{ type, STORE_FIELD_##store_field, SFC_OFFSET(flow_field), \
+	  SFC_SIZE(flow_field), 0, 0 }
+#define NF_FIELD_ADDR(type, store_field, flow_field, sub, family) \
+	{ type, STORE_FIELD_##store_field, SFC_OFFSET(flow_field.v##sub), \
+	  SFC_SIZE(flow_field.v##sub), SFC_OFFSET(flow_field.af), AF_##family }
+
+static const struct nf_field_map nf_fields[] = {
+	NF_FIELD(NF9_IN_BYTES, OCTETS, octets.flow_octets),
+	NF_FIELD(NF9_IN_PACKETS, PACKETS, packets.flow_packets),
+	NF_FIELD(NF9_IN_PROTOCOL, PROTO_FLAGS_TOS, pft.protocol),
+	NF_FIELD(NF9_SRC_TOS, PROTO_FLAGS_TOS, pft.tos),
+	NF_FIELD(NF9_TCP_FLAGS, PROTO_FLAGS_TOS, pft.tcp_flags),
+	NF_FIELD(NF9_L4_SRC_PORT, SRCDST_PORT, ports.src_port),
+	NF_FIELD(NF9_SRC_MASK, AS_INFO, asinf.src_mask),
+	NF_FIELD(NF9_INPUT_SNMP, IF_INDICES, ifndx.if_index_in),
+	NF_FIELD(NF9_L4_DST_PORT, SRCDST_PORT, ports.dst_port),
+	NF_FIELD(NF9_DST_MASK, AS_INFO, asinf.dst_mask),
+	NF_FIELD(NF9_OUTPUT_SNMP, IF_INDICES, ifndx.if_index_out),
+	NF_FIELD(NF9_SRC_AS, AS_INFO, asinf.src_as),
+	NF_FIELD(NF9_DST_AS, AS_INFO, asinf.dst_as),
+	NF_FIELD(NF9_LAST_SWITCHED, FLOW_TIMES, ftimes.flow_finish),
+	NF_FIELD(NF9_FIRST_SWITCHED, FLOW_TIMES, ftimes.flow_start),
+	NF_FIELD(NF9_IPV6_SRC_MASK, AS_INFO, asinf.src_mask),
+	NF_FIELD(NF9_IPV6_DST_MASK, AS_INFO, asinf.dst_mask),
+	NF_FIELD(NF9_ENGINE_TYPE, FLOW_ENGINE_INFO, finf.engine_type),
+	NF_FIELD(NF9_ENGINE_ID, FLOW_ENGINE_INFO, finf.engine_id),
+
+	NF_FIELD_ADDR(NF9_IPV4_SRC_ADDR, SRC_ADDR4, src_addr, 4, INET),
+	NF_FIELD_ADDR(NF9_IPV4_DST_ADDR, DST_ADDR4, dst_addr, 4, INET),
+	NF_FIELD_ADDR(NF9_IPV4_NEXT_HOP, GATEWAY_ADDR4, gateway_addr, 4, INET),
+
+	NF_FIELD_ADDR(NF9_IPV6_SRC_ADDR, SRC_ADDR6, src_addr, 6, INET6),
+	NF_FIELD_ADDR(NF9_IPV6_DST_ADDR, DST_ADDR6, dst_addr, 6, INET6),
+	NF_FIELD_ADDR(NF9_IPV6_NEXT_HOP, GATEWAY_ADDR6, gateway_addr, 6, INET6),
+};
+
+#undef NF_FIELD
+#undef NF_FIELD_ADDR
+#undef SFC_OFFSET
+#undef SFC_SIZE
+
+static const struct nf_field_map *
+nf_field_lookup(u_int type)
+{
+	u_int i;
+
+	for (i = 0; i < sizeof(nf_fields) / sizeof(*nf_fields); i++) {
+		if (nf_fields[i].type == type)
+			return (&nf_fields[i]);
+	}
+	return (NULL);
+}
+
+static int
+nf_check_rec_len(u_int type, u_int len)
+{
+	const struct nf_field_map *map;
+
+	/* Sanity check */
+	if (len == 0 || len > 0x4000)
+		return (0);
+
+	/* Fields we don't understand are skipped, whatever their length */
+	if ((map = nf_field_lookup(type)) == NULL)
+		return (1);
+
+	return (len <= map->size);
+}
+
+/* Start compiling a template with up to num_records fields */
+static void
+nf_prog_init(struct peer_decode_prog *prog, u_int num_records)
+{
+	if (prog->ops != NULL)
+		free(prog->ops);
+	bzero(prog, sizeof(*prog));
+	if (num_records > 0 &&
+	    (prog->ops = calloc(num_records, sizeof(*prog->ops))) == NULL)
+		logerrx("%s: calloc failed (num %u)", __func__, num_records);
+}
+
+/* Append the field at offset "src" of each data record to a template */
+static void
+nf_prog_add(struct peer_decode_prog *prog, u_int type, u_int len, u_int src)
+{
+	const struct nf_field_map *map;
+	struct peer_decode_op *op;
+	u_int i, dst;
+
+	if ((map = nf_field_lookup(type)) == NULL)
+		return;
+
+	prog->fields |= map->store_field;
+	if (map->af != 0) {
+		/* Addresses are copied to the start of the xaddr */
+		dst = map->offset;
+		for (i = 0; i < prog->num_af; i++) {
+			if (prog->af[i].dst == map->af_offset)
+				break;
+		}
+		if (i == prog->num_af) {
+			if (prog->num_af >= PEER_DECODE_MAX_AF)
+				logerrx("%s: too many addresses", __func__);
+			prog->num_af++;
+		}
+		prog->af[i].dst = map->af_offset;
+		prog->af[i].af = map->af;
+	} else {
+		/* Integers are short big-endian copies, LSBs aligned */
+		dst = map->offset + map->size - len;
 	}
-}
 
-static int
-nf9_rec_to_flow(struct peer_nf9_record *rec, struct store_flow_complete *flow,
-    u_int8_t *data)
-{
-	/* XXX: use a table-based interpreter */
-	switch (rec->type) {
-
-/* Copy an int (possibly shorter than the target) keeping their LSBs aligned */
-#define BE_COPY(a) memcpy((u_char*)&a + (sizeof(a) - rec->len), data, rec->len);
-#define V9_FIELD(v9_field, store_field, flow_field) \
-	case v9_field: \
-		flow->hdr.fields |= STORE_FIELD_##store_field; \
-		BE_COPY(flow->flow_field); \
-		break
-#define V9_FIELD_ADDR(v9_field, store_field, flow_field, sub, family) \
-	case v9_field: \
-		flow->hdr.fields |= STORE_FIELD_##store_field; \
-		memcpy(&flow->flow_field.v##sub, data, rec->len); \
-		flow->flow_field.af = AF_##family; \
-		break
-
-	V9_FIELD(NF9_IN_BYTES, OCTETS, octets.flow_octets);
-	V9_FIELD(NF9_IN_PACKETS, PACKETS, packets.flow_packets);
-	V9_FIELD(NF9_IN_PROTOCOL, PROTO_FLAGS_TOS, pft.protocol);
-	V9_FIELD(NF9_SRC_TOS, PROTO_FLAGS_TOS, pft.tos);
-	V9_FIELD(NF9_TCP_FLAGS, PROTO_FLAGS_TOS, pft.tcp_flags);
-	V9_FIELD(NF9_L4_SRC_PORT, SRCDST_PORT, ports.src_port);
-	V9_FIELD(NF9_SRC_MASK, AS_INFO, asinf.src_mask);
-	V9_FIELD(NF9_INPUT_SNMP, IF_INDICES, ifndx.if_index_in);
-	V9_FIELD(NF9_L4_DST_PORT, SRCDST_PORT, ports.dst_port);
-	V9_FIELD(NF9_DST_MASK, AS_INFO, asinf.dst_mask);
-	V9_FIELD(NF9_OUTPUT_SNMP, IF_INDICES, ifndx.if_index_out);
-	V9_FIELD(NF9_SRC_AS, AS_INFO, asinf.src_as);
-	V9_FIELD(NF9_DST_AS, AS_INFO, asinf.dst_as);
-	V9_FIELD(NF9_LAST_SWITCHED, FLOW_TIMES, ftimes.flow_finish);
-	V9_FIELD(NF9_FIRST_SWITCHED, FLOW_TIMES, ftimes.flow_start);
-	V9_FIELD(NF9_IPV6_SRC_MASK, AS_INFO, asinf.src_mask);
-	V9_FIELD(NF9_IPV6_DST_MASK, AS_INFO, asinf.dst_mask);
-	V9_FIELD(NF9_ENGINE_TYPE, FLOW_ENGINE_INFO, finf.engine_type);
-	V9_FIELD(NF9_ENGINE_ID, FLOW_ENGINE_INFO, finf.engine_id);
-
-	V9_FIELD_ADDR(NF9_IPV4_SRC_ADDR, SRC_ADDR4, src_addr, 4, INET);
-	V9_FIELD_ADDR(NF9_IPV4_DST_ADDR, DST_ADDR4, dst_addr, 4, INET);
-	V9_FIELD_ADDR(NF9_IPV4_NEXT_HOP, GATEWAY_ADDR4, gateway_addr, 4, INET);
-
-	V9_FIELD_ADDR(NF9_IPV6_SRC_ADDR, SRC_ADDR6, src_addr, 6, INET6);
-	V9_FIELD_ADDR(NF9_IPV6_DST_ADDR, DST_ADDR6, dst_addr, 6, INET6);
-	V9_FIELD_ADDR(NF9_IPV6_NEXT_HOP, GATEWAY_ADDR6, gateway_addr, 6, INET6);
-
-#undef V9_FIELD
-#undef V9_FIELD_ADDR
-#undef BE_COPY
+	/* Merge with the previous copy if both ends are adjacent */
+	if (prog->num_ops > 0) {
+		op = &prog->ops[prog->num_ops - 1];
+		if (op->src + op->len == src && op->dst + op->len == dst) {
+			op->len += len;
+			return;
+		}
 	}
-	return (0);
+	op = &prog->ops[prog->num_ops++];
+	op->src = src;
+	op->dst = dst;
+	op->len = len;
 }
 
-static int
-nf9_check_rec_len(u_int type, u_int len)
+/* Run a compiled template over one data record */
+static void
+nf_prog_decode(const struct peer_decode_prog *prog,
+    struct store_flow_complete *flow, const u_int8_t *data)
 {
-	struct store_flow_complete t;
+	const struct peer_decode_op *op, *end;
+	u_int8_t *base = (u_int8_t *)flow;
+	u_int i;
 
-	/* Sanity check */
-	if (len == 0 || len > 0x4000)
-		return (0);
+	flow->hdr.fields |= prog->fields;
 
-	/* XXX: use a table-based interpreter */
-	switch (type) {
-#define V9_FIELD_LEN(v9_field, flow_field) \
-	case v9_field: \
-		return (len <= sizeof(t.flow_field));
-
-	V9_FIELD_LEN(NF9_IN_BYTES, octets.flow_octets);
-	V9_FIELD_LEN(NF9_IN_PACKETS, packets.flow_packets);
-	V9_FIELD_LEN(NF9_IN_PROTOCOL, pft.protocol);
-	V9_FIELD_LEN(NF9_SRC_TOS, pft.tos);
-	V9_FIELD_LEN(NF9_TCP_FLAGS, pft.tcp_flags);
-	V9_FIELD_LEN(NF9_L4_SRC_PORT, ports.src_port);
-	V9_FIELD_LEN(NF9_IPV4_SRC_ADDR, src_addr.v4);
-	V9_FIELD_LEN(NF9_SRC_MASK, asinf.src_mask);
-	V9_FIELD_LEN(NF9_INPUT_SNMP, ifndx.if_index_in);
-	V9_FIELD_LEN(NF9_L4_DST_PORT, ports.dst_port);
-	V9_FIELD_LEN(NF9_IPV4_DST_ADDR, dst_addr.v4);
-	V9_FIELD_LEN(NF9_DST_MASK, asinf.src_mask);
-	V9_FIELD_LEN(NF9_OUTPUT_SNMP, ifndx.if_index_out);
-	V9_FIELD_LEN(NF9_IPV4_NEXT_HOP, gateway_addr.v4);
-	V9_FIELD_LEN(NF9_SRC_AS, asinf.src_as);
-	V9_FIELD_LEN(NF9_DST_AS, asinf.dst_as);
-	V9_FIELD_LEN(NF9_LAST_SWITCHED, ftimes.flow_finish);
-	V9_FIELD_LEN(NF9_FIRST_SWITCHED, ftimes.flow_start);
-	V9_FIELD_LEN(NF9_IPV6_SRC_ADDR, src_addr.v6);
-	V9_FIELD_LEN(NF9_IPV6_DST_ADDR, dst_addr.v6);
-	V9_FIELD_LEN(NF9_IPV6_SRC_MASK, asinf.src_mask);
-	V9_FIELD_LEN(NF9_IPV6_DST_MASK, asinf.dst_mask);
-	V9_FIELD_LEN(NF9_ENGINE_TYPE, finf.engine_type);
-	V9_FIELD_LEN(NF9_ENGINE_ID, finf.engine_id);
-	V9_FIELD_LEN(NF9_IPV6_NEXT_HOP, gateway_addr.v6);
-
-#undef V9_FIELD_LEN
-	default:
-		return (1);
+	/* Fixed width copies for the common sizes compile to plain moves */
+	for (op = prog->ops, end = op + prog->num_ops; op < end; op++) {
+		switch (op->len) {
+		case 1:
+			base[op->dst] = data[op->src];
+			break;
+		case 2:
+			memcpy(base + op->dst, data + op->src, 2);
+			break;
+		case 4:
+			memcpy(base + op->dst, data + op->src, 4);
+			break;
+		case 8:
+			memcpy(base + op->dst, data + op->src, 8);
+			break;
+		case 16:
+			memcpy(base + op->dst, data + op->src, 16);
+			break;
+		default:
+			memcpy(base + op->dst, data + op->src, op->len);
+			break;
+		}
+	}
+	for (i = 0; i < prog->num_af; i++) {
+		memcpy(base + prog->af[i].dst, &prog->af[i].af,
+		    sizeof(prog->af[i].af));
 	}
 }
 
-static int
-nf9_flowset_to_store(u_int8_t *pkt, size_t len, struct timeval *tv, 
-    struct xaddr *flow_source, struct NF9_HEADER *nf9_hdr,
-    struct peer_nf9_template *template, u_int32_t source_id,
-    struct store_flow_complete *flow)
+static void
+nf9_compile_template(struct peer_nf9_template *template)
 {
-	u_int offset, i;
+	u_int i, offset;
 
-	if (template->total_len > len)
-		return (-1);
+	nf_prog_init(&template->prog, template->num_records);
+	for (i = offset = 0; i < template->num_records; i++) {
+		nf_prog_add(&template->prog, template->records[i].type,
+		    template->records[i].len, offset);
+		offset += template->records[i].len;
+	}
+}
 
+/* Fill in the fields that every record of a packet shares */
+static void
+nf9_flow_header(struct store_flow_complete *flow, struct timeval *tv,
+    struct xaddr *flow_source, struct NF9_HEADER *nf9_hdr, u_int32_t source_id)
+{
 	bzero(flow, sizeof(*flow));
 
 	flow->hdr.fields = STORE_FIELD_RECV_TIME | STORE_FIELD_AGENT_INFO |
@@ -807,18 +2636,6 @@ nf9_flowset_to_store(u_int8_t *pkt, size_t len, struct timeval *tv,
 	flow->recv_time.recv_sec = tv->tv_sec;
 	flow->recv_time.recv_usec = tv->tv_usec;
 	memcpy(&flow->agent_addr, flow_source, sizeof(flow->agent_addr));
-
-	offset = 0;
-	for (i = 0; i < template->num_records; i++) {
-#ifdef DEBUG_NF9
-		logit(LOG_DEBUG, "    record %d: type %d len %d: %s",
-		    i, template->records[i].type, template->records[i].len,
-		    data_ntoa(pkt + offset, template->records[i].len));
-#endif
-		nf9_rec_to_flow(&template->records[i], flow, pkt + offset);
-		offset += template->records[i].len;
-	}
-	return (0);
 }
 
 static int
@@ -900,7 +2717,7 @@ process_netflow_v9_template(u_int8_t *pkt, size_t len, struct peer_state *peer,
 				/* XXX ratelimit */
 				return (-1);
 			}
-			if (!nf9_check_rec_len(recs[i].type, recs[i].len)) {
+			if (!nf_check_rec_len(recs[i].type, recs[i].len)) {
 				peer->ninvalid++;
 				logit(LOG_WARNING, "Invalid field length in "
 				    "netflow v.9 flowset template %d from "
@@ -926,20 +2743,37 @@ process_netflow_v9_template(u_int8_t *pkt, size_t len, struct peer_state *peer,
 		template->records = recs;
 		template->num_records = i;
 		template->total_len = total_size;
+		template->refreshed = time(NULL);
+		nf9_compile_template(template);
 	}
 
 	return (0);
 }
 
+#ifdef DEBUG_NF9
+static void
+nf9_dump_record(struct peer_nf9_template *template, u_int8_t *pkt)
+{
+	u_int offset, i;
+
+	for (i = offset = 0; i < template->num_records; i++) {
+		logit(LOG_DEBUG, "    record %d: type %d len %d: %s",
+		    i, template->records[i].type, template->records[i].len,
+		    data_ntoa(pkt + offset, template->records[i].len));
+		offset += template->records[i].len;
+	}
+}
+#endif
+
 static int
 process_netflow_v9_data(u_int8_t *pkt, size_t len, struct timeval *tv, 
     struct peer_state *peer, u_int32_t source_id, struct NF9_HEADER *nf9_hdr,
-    struct flowd_config *conf, int log_fd, int log_socket, u_int *num_flows)
+    struct flowd_config *conf, struct flowd_worker *w, u_int *num_flows)
 {
-	struct store_flow_complete *flows;
+	struct store_flow_complete proto;
 	struct peer_nf9_template *template;
 	struct NF9_DATA_FLOWSET_HEADER *dath;
-	u_int flowset_id, i, offset, num_flowsets;
+	u_int flowset_id, i, j, n, offset, num_flowsets;
 
 	*num_flows = 0;
 
@@ -970,7 +2804,8 @@ process_netflow_v9_data(u_int8_t *pkt, size_t len, struct timeval *tv,
 		logerrx("%s: template->records == NULL", __func__);
 
 	offset = sizeof(*dath);
-	num_flowsets = (len - offset) / template->total_len;
+	num_flowsets = template->total_len == 0 ? 0 :
+	    (len - offset) / template->total_len;
 
 	if (num_flowsets == 0 || num_flowsets > 0x4000) {
 		logit(LOG_WARNING, "invalid netflow v.9 data flowset "
@@ -979,36 +2814,35 @@ process_netflow_v9_data(u_int8_t *pkt, size_t len, struct timeval *tv,
 		return (-1);
 	}
 
-	if ((flows = calloc(num_flowsets, sizeof(*flows))) == NULL)
-		logerrx("%s: calloc failed (num %d)", __func__, num_flowsets);
-
-	for (i = 0; i < num_flowsets; i++) {
-		if (nf9_flowset_to_store(pkt + offset, template->total_len, tv,
-		    &peer->from, nf9_hdr, template, source_id, 
-		    &flows[i]) == -1) {
-			peer->ninvalid++;
-			free(flows);
-			logit(LOG_WARNING, "invalid netflow v.9 data flowset "
-			    "from %s", addr_ntop_buf(&peer->from));
-			/* XXX ratelimit */
-			return (-1);
+	/*
+	 * Decode a batch of records at a time into the worker's flow buffer
+	 * and send each batch on through the filter to the output queue
+	 */
+	nf9_flow_header(&proto, tv, &peer->from, nf9_hdr, source_id);
+	for (i = 0; i < num_flowsets; i += n) {
+		n = num_flowsets - i;
+		if (n > FLOW_DECODE_BATCH)
+			n = FLOW_DECODE_BATCH;
+		for (j = 0; j < n; j++) {
+#ifdef DEBUG_NF9
+			nf9_dump_record(template, pkt + offset);
+#endif
+			memcpy(&w->flows[j], &proto, sizeof(proto));
+			nf_prog_decode(&template->prog, &w->flows[j],
+			    pkt + offset);
+			offset += template->total_len;
 		}
-
-		offset += template->total_len;
+		for (j = 0; j < n; j++)
+			process_flow(&w->flows[j], conf, w);
 	}
-	*num_flows = i;
-
-	for (i = 0; i < *num_flows; i++)
-		process_flow(&flows[i], conf, log_fd, log_socket);
-
-	free(flows);
+	*num_flows = num_flowsets;
 
 	return (0);
 }
 
 static void
 process_netflow_v9(struct flow_packet *fp, struct flowd_config *conf,
-    struct peer_state *peer, struct peers *peers, int log_fd, int log_socket)
+    struct peer_state *peer, struct flowd_worker *w)
 {
 	struct NF9_HEADER *nf9_hdr = (struct NF9_HEADER *)fp->packet;
 	struct NF9_FLOWSET_HEADER_COMMON *flowset;
@@ -1038,6 +2872,9 @@ process_netflow_v9(struct flow_packet *fp, struct flowd_config *conf,
 	offset = sizeof(*nf9_hdr);
 	total_flows = 0;
 
+	/* Flows are only recorded if the whole packet is valid */
+	output_mark(w, conf->opts & FLOWD_OPT_VERBOSE);
+
 	for (i = 0;; i++) {
 		/* Make sure we don't run off the end of the flow */
 		if (offset >= fp->len) {
@@ -1045,7 +2882,7 @@ process_netflow_v9(struct flow_packet *fp, struct flowd_config *conf,
 			logit(LOG_WARNING,
 			    "short netflow v.9 flowset header %d bytes from %s",
 			    fp->len, addr_ntop_buf(&fp->flow_source));
-			return;
+			goto bad;
 		}
 
 		flowset = (struct NF9_FLOWSET_HEADER_COMMON *)
@@ -1067,19 +2904,20 @@ process_netflow_v9(struct flow_packet *fp, struct flowd_config *conf,
 		 * the packet before we pass it to the flowset-specific
 		 * handlers below.
 		 */
-		if (offset + flowset_len > fp->len) {
+		if (flowset_len < sizeof(*flowset) ||
+		    offset + flowset_len > fp->len) {
 			peer->ninvalid++;
 			logit(LOG_WARNING,
 			    "short netflow v.9 flowset length %d bytes from %s",
 			    fp->len, addr_ntop_buf(&fp->flow_source));
-			return;
+			goto bad;
 		}
 
 		switch (flowset_id) {
 		case NF9_TEMPLATE_FLOWSET_ID:
 			if (process_netflow_v9_template(fp->packet + offset,
-			    flowset_len, peer, peers, source_id) != 0)
-				return;
+			    flowset_len, peer, &w->peers, source_id) != 0)
+				goto bad;
 			break;
 		case NF9_OPTIONS_FLOWSET_ID:
 			/* XXX: implement this (maybe) */
@@ -1096,9 +2934,9 @@ process_netflow_v9(struct flow_packet *fp, struct flowd_config *conf,
 			}
 			if (process_netflow_v9_data(fp->packet + offset,
 			    flowset_len, &fp->recv_time, peer, source_id,
-			    nf9_hdr, conf, log_fd, log_socket,
+			    nf9_hdr, conf, w,
 			    &flowset_flows) != 0)
-				return;
+				goto bad;
 			total_flows += flowset_flows;
 			break;
 		}
@@ -1110,123 +2948,33 @@ process_netflow_v9(struct flow_packet *fp, struct flowd_config *conf,
 
 	/* Don't update peer unless we actually receive data from it */
 	if (total_flows > 0)
-		update_peer(peers, peer, total_flows, 9);
-}
+		update_peer(&w->peers, peer, total_flows, 9);
+	peer_sequence(&w->peers, peer, 9, source_id,
+	    ntohl(nf9_hdr->package_sequence), 1);
+	return;
 
-static int
-nf10_rec_to_flow(struct peer_nf10_record *rec, struct store_flow_complete *flow,
-    u_int8_t *data)
-{
-	/* XXX: use a table-based interpreter */
-	switch (rec->type) {
-
-/* Copy an int (possibly shorter than the target) keeping their LSBs aligned */
-#define BE_COPY(a) memcpy((u_char*)&a + (sizeof(a) - rec->len), data, rec->len);
-#define V10_FIELD(v10_field, store_field, flow_field) \
-	case v10_field: \
-		flow->hdr.fields |= STORE_FIELD_##store_field; \
-		BE_COPY(flow->flow_field); \
-		break
-#define V10_FIELD_ADDR(v10_field, store_field, flow_field, sub, family) \
-	case v10_field: \
-		flow->hdr.fields |= STORE_FIELD_##store_field; \
-		memcpy(&flow->flow_field.v##sub, data, rec->len); \
-		flow->flow_field.af = AF_##family; \
-		break
-
-	V10_FIELD(NF10_IN_BYTES, OCTETS, octets.flow_octets);
-	V10_FIELD(NF10_IN_PACKETS, PACKETS, packets.flow_packets);
-	V10_FIELD(NF10_IN_PROTOCOL, PROTO_FLAGS_TOS, pft.protocol);
-	V10_FIELD(NF10_SRC_TOS, PROTO_FLAGS_TOS, pft.tos);
-	V10_FIELD(NF10_TCP_FLAGS, PROTO_FLAGS_TOS, pft.tcp_flags);
-	V10_FIELD(NF10_L4_SRC_PORT, SRCDST_PORT, ports.src_port);
-	V10_FIELD(NF10_SRC_MASK, AS_INFO, asinf.src_mask);
-	V10_FIELD(NF10_INPUT_SNMP, IF_INDICES, ifndx.if_index_in);
-	V10_FIELD(NF10_L4_DST_PORT, SRCDST_PORT, ports.dst_port);
-	V10_FIELD(NF10_DST_MASK, AS_INFO, asinf.dst_mask);
-	V10_FIELD(NF10_OUTPUT_SNMP, IF_INDICES, ifndx.if_index_out);
-	V10_FIELD(NF10_SRC_AS, AS_INFO, asinf.src_as);
-	V10_FIELD(NF10_DST_AS, AS_INFO, asinf.dst_as);
-	V10_FIELD(NF10_LAST_SWITCHED, FLOW_TIMES, ftimes.flow_finish);
-	V10_FIELD(NF10_FIRST_SWITCHED, FLOW_TIMES, ftimes.flow_start);
-	V10_FIELD(NF10_IPV6_SRC_MASK, AS_INFO, asinf.src_mask);
-	V10_FIELD(NF10_IPV6_DST_MASK, AS_INFO, asinf.dst_mask);
-	V10_FIELD(NF10_ENGINE_TYPE, FLOW_ENGINE_INFO, finf.engine_type);
-	V10_FIELD(NF10_ENGINE_ID, FLOW_ENGINE_INFO, finf.engine_id);
-
-	V10_FIELD_ADDR(NF10_IPV4_SRC_ADDR, SRC_ADDR4, src_addr, 4, INET);
-	V10_FIELD_ADDR(NF10_IPV4_DST_ADDR, DST_ADDR4, dst_addr, 4, INET);
-	V10_FIELD_ADDR(NF10_IPV4_NEXT_HOP, GATEWAY_ADDR4, gateway_addr, 4, INET);
-
-	V10_FIELD_ADDR(NF10_IPV6_SRC_ADDR, SRC_ADDR6, src_addr, 6, INET6);
-	V10_FIELD_ADDR(NF10_IPV6_DST_ADDR, DST_ADDR6, dst_addr, 6, INET6);
-	V10_FIELD_ADDR(NF10_IPV6_NEXT_HOP, GATEWAY_ADDR6, gateway_addr, 6, INET6);
-
-#undef V10_FIELD
-#undef V10_FIELD_ADDR
-#undef BE_COPY
-	}
-	return (0);
+ bad:
+	output_rollback(w);
 }
 
-static int
-nf10_check_rec_len(u_int type, u_int len)
+static void
+nf10_compile_template(struct peer_nf10_template *template)
 {
-	struct store_flow_complete t;
-
-	/* Sanity check */
-	if (len == 0 || len > 0x4000)
-		return (0);
+	u_int i, offset;
 
-	/* XXX: use a table-based interpreter */
-	switch (type) {
-#define V10_FIELD_LEN(v10_field, flow_field) \
-	case v10_field: \
-		return (len <= sizeof(t.flow_field));
-
-	V10_FIELD_LEN(NF10_IN_BYTES, octets.flow_octets);
-	V10_FIELD_LEN(NF10_IN_PACKETS, packets.flow_packets);
-	V10_FIELD_LEN(NF10_IN_PROTOCOL, pft.protocol);
-	V10_FIELD_LEN(NF10_SRC_TOS, pft.tos);
-	V10_FIELD_LEN(NF10_TCP_FLAGS, pft.tcp_flags);
-	V10_FIELD_LEN(NF10_L4_SRC_PORT, ports.src_port);
-	V10_FIELD_LEN(NF10_IPV4_SRC_ADDR, src_addr.v4);
-	V10_FIELD_LEN(NF10_SRC_MASK, asinf.src_mask);
-	V10_FIELD_LEN(NF10_INPUT_SNMP, ifndx.if_index_in);
-	V10_FIELD_LEN(NF10_L4_DST_PORT, ports.dst_port);
-	V10_FIELD_LEN(NF10_IPV4_DST_ADDR, dst_addr.v4);
-	V10_FIELD_LEN(NF10_DST_MASK, asinf.src_mask);
-	V10_FIELD_LEN(NF10_OUTPUT_SNMP, ifndx.if_index_out);
-	V10_FIELD_LEN(NF10_IPV4_NEXT_HOP, gateway_addr.v4);
-	V10_FIELD_LEN(NF10_SRC_AS, asinf.src_as);
-	V10_FIELD_LEN(NF10_DST_AS, asinf.dst_as);
-	V10_FIELD_LEN(NF10_LAST_SWITCHED, ftimes.flow_finish);
-	V10_FIELD_LEN(NF10_FIRST_SWITCHED, ftimes.flow_start);
-	V10_FIELD_LEN(NF10_IPV6_SRC_ADDR, src_addr.v6);
-	V10_FIELD_LEN(NF10_IPV6_DST_ADDR, dst_addr.v6);
-	V10_FIELD_LEN(NF10_IPV6_SRC_MASK, asinf.src_mask);
-	V10_FIELD_LEN(NF10_IPV6_DST_MASK, asinf.dst_mask);
-	V10_FIELD_LEN(NF10_ENGINE_TYPE, finf.engine_type);
-	V10_FIELD_LEN(NF10_ENGINE_ID, finf.engine_id);
-	V10_FIELD_LEN(NF10_IPV6_NEXT_HOP, gateway_addr.v6);
-
-#undef V10_FIELD_LEN
-	default:
-		return (1);
+	nf_prog_init(&template->prog, template->num_records);
+	for (i = offset = 0; i < template->num_records; i++) {
+		nf_prog_add(&template->prog, template->records[i].type,
+		    template->records[i].len, offset);
+		offset += template->records[i].len;
 	}
 }
 
-static int
-nf10_flowset_to_store(u_int8_t *pkt, size_t len, struct timeval *tv,
-    struct xaddr *flow_source, struct NF10_HEADER *nf10_hdr,
-    struct peer_nf10_template *template, u_int32_t source_id,
-    struct store_flow_complete *flow)
+/* Fill in the fields that every record of a packet shares */
+static void
+nf10_flow_header(struct store_flow_complete *flow, struct timeval *tv,
+    struct xaddr *flow_source, struct NF10_HEADER *nf10_hdr, u_int32_t source_id)
 {
-	u_int offset, i;
-
-	if (template->total_len > len)
-		return (-1);
-
 	bzero(flow, sizeof(*flow));
 
 	flow->hdr.fields = STORE_FIELD_RECV_TIME | STORE_FIELD_AGENT_INFO |
@@ -1239,18 +2987,6 @@ nf10_flowset_to_store(u_int8_t *pkt, size_t len, struct timeval *tv,
 	flow->recv_time.recv_sec = tv->tv_sec;
 	flow->recv_time.recv_usec = tv->tv_usec;
 	memcpy(&flow->agent_addr, flow_source, sizeof(flow->agent_addr));
-
-	offset = 0;
-	for (i = 0; i < template->num_records; i++) {
-#ifdef DEBUG_NF10
-		logit(LOG_DEBUG, "    record %d: type %d len %d: %s",
-		    i, template->records[i].type, template->records[i].len,
-		    data_ntoa(pkt + offset, template->records[i].len));
-#endif
-		nf10_rec_to_flow(&template->records[i], flow, pkt + offset);
-		offset += template->records[i].len;
-	}
-	return (0);
 }
 
 static int
@@ -1334,7 +3070,7 @@ process_netflow_v10_template(u_int8_t *pkt, size_t len, struct peer_state *peer,
 				/* XXX ratelimit */
 				return (-1);
 			}
-			if (!nf10_check_rec_len(recs[i].type, recs[i].len)) {
+			if (!nf_check_rec_len(recs[i].type, recs[i].len)) {
 				peer->ninvalid++;
 				logit(LOG_WARNING, "Invalid field length in "
 				    "netflow v. flowset template %d from "
@@ -1360,20 +3096,37 @@ process_netflow_v10_template(u_int8_t *pkt, size_t len, struct peer_state *peer,
 		template->records = recs;
 		template->num_records = i;
 		template->total_len = total_size;
+		template->refreshed = time(NULL);
+		nf10_compile_template(template);
 	}
 
 	return (0);
 }
 
+#ifdef DEBUG_NF10
+static void
+nf10_dump_record(struct peer_nf10_template *template, u_int8_t *pkt)
+{
+	u_int offset, i;
+
+	for (i = offset = 0; i < template->num_records; i++) {
+		logit(LOG_DEBUG, "    record %d: type %d len %d: %s",
+		    i, template->records[i].type, template->records[i].len,
+		    data_ntoa(pkt + offset, template->records[i].len));
+		offset += template->records[i].len;
+	}
+}
+#endif
+
 static int
 process_netflow_v10_data(u_int8_t *pkt, size_t len, struct timeval *tv,
     struct peer_state *peer, u_int32_t source_id, struct NF10_HEADER *nf10_hdr,
-    struct flowd_config *conf, int log_fd, int log_socket, u_int *num_flows)
+    struct flowd_config *conf, struct flowd_worker *w, u_int *num_flows)
 {
-	struct store_flow_complete *flows;
+	struct store_flow_complete proto;
 	struct peer_nf10_template *template;
 	struct NF10_DATA_FLOWSET_HEADER *dath;
-	u_int flowset_id, i, offset, num_flowsets;
+	u_int flowset_id, i, j, n, offset, num_flowsets;
 
 	*num_flows = 0;
 
@@ -1404,7 +3157,8 @@ process_netflow_v10_data(u_int8_t *pkt, size_t len, struct timeval *tv,
 		logerrx("%s: template->records == NULL", __func__);
 
 	offset = sizeof(*dath);
-	num_flowsets = (len - offset) / template->total_len;
+	num_flowsets = template->total_len == 0 ? 0 :
+	    (len - offset) / template->total_len;
 
 	if (num_flowsets == 0 || num_flowsets > 0x4000) {
 		logit(LOG_WARNING, "invalid netflow v.10 data flowset "
@@ -1413,41 +3167,41 @@ process_netflow_v10_data(u_int8_t *pkt, size_t len, struct timeval *tv,
 		return (-1);
 	}
 
-	if ((flows = calloc(num_flowsets, sizeof(*flows))) == NULL)
-		logerrx("%s: calloc failed (num %d)", __func__, num_flowsets);
-
-	for (i = 0; i < num_flowsets; i++) {
-		if (nf10_flowset_to_store(pkt + offset, template->total_len, tv,
-		    &peer->from, nf10_hdr, template, source_id,
-		    &flows[i]) == -1) {
-			peer->ninvalid++;
-			free(flows);
-			logit(LOG_WARNING, "invalid netflow v.10 data flowset "
-			    "from %s", addr_ntop_buf(&peer->from));
-			/* XXX ratelimit */
-			return (-1);
+	/*
+	 * Decode a batch of records at a time into the worker's flow buffer
+	 * and send each batch on through the filter to the output queue
+	 */
+	nf10_flow_header(&proto, tv, &peer->from, nf10_hdr, source_id);
+	for (i = 0; i < num_flowsets; i += n) {
+		n = num_flowsets - i;
+		if (n > FLOW_DECODE_BATCH)
+			n = FLOW_DECODE_BATCH;
+		for (j = 0; j < n; j++) {
+#ifdef DEBUG_NF10
+			nf10_dump_record(template, pkt + offset);
+#endif
+			memcpy(&w->flows[j], &proto, sizeof(proto));
+			nf_prog_decode(&template->prog, &w->flows[j],
+			    pkt + offset);
+			offset += template->total_len;
 		}
-
-		offset += template->total_len;
+		for (j = 0; j < n; j++)
+			process_flow(&w->flows[j], conf, w);
 	}
-	*num_flows = i;
-
-	for (i = 0; i < *num_flows; i++)
-		process_flow(&flows[i], conf, log_fd, log_socket);
-
-	free(flows);
+	*num_flows = num_flowsets;
 
 	return (0);
 }
 
 static void
 process_netflow_v10(struct flow_packet *fp, struct flowd_config *conf,
-    struct peer_state *peer, struct peers *peers, int log_fd, int log_socket)
+    struct peer_state *peer, struct flowd_worker *w)
 {
 	struct NF10_HEADER *nf10_hdr = (struct NF10_HEADER *)fp->packet;
 	struct NF10_FLOWSET_HEADER_COMMON *flowset;
 	u_int32_t i, pktlen, flowset_id, flowset_len, flowset_flows;
 	u_int32_t offset, source_id, total_flows;
+	u_int64_t no_template = peer->no_template;
 
 	if (fp->len < sizeof(*nf10_hdr)) {
 		peer->ninvalid++;
@@ -1473,6 +3227,9 @@ process_netflow_v10(struct flow_packet *fp, struct flowd_config *conf,
 	offset = sizeof(*nf10_hdr);
 	total_flows = 0;
 
+	/* Flows are only recorded if the whole packet is valid */
+	output_mark(w, conf->opts & FLOWD_OPT_VERBOSE);
+
 	for (i = 0;; i++) {
 		/* Make sure we don't run off the end of the flow */
 		if (offset >= fp->len) {
@@ -1480,7 +3237,7 @@ process_netflow_v10(struct flow_packet *fp, struct flowd_config *conf,
 			logit(LOG_WARNING,
 			    "short netflow v.10 flowset header %d bytes from %s",
 			    fp->len, addr_ntop_buf(&fp->flow_source));
-			return;
+			goto bad;
 		}
 
 		flowset = (struct NF10_FLOWSET_HEADER_COMMON *)
@@ -1502,19 +3259,20 @@ process_netflow_v10(struct flow_packet *fp, struct flowd_config *conf,
 		 * the packet before we pass it to the flowset-specific
 		 * handlers below.
 		 */
-		if (offset + flowset_len > fp->len) {
+		if (flowset_len < sizeof(*flowset) ||
+		    offset + flowset_len > fp->len) {
 			peer->ninvalid++;
 			logit(LOG_WARNING,
 			    "short netflow v.10 flowset length %d bytes from %s",
 			    fp->len, addr_ntop_buf(&fp->flow_source));
-			return;
+			goto bad;
 		}
 
 		switch (flowset_id) {
 		case NF10_TEMPLATE_FLOWSET_ID:
 			if (process_netflow_v10_template(fp->packet + offset,
-			    flowset_len, peer, peers, source_id) != 0)
-				return;
+			    flowset_len, peer, &w->peers, source_id) != 0)
+				goto bad;
 			break;
 		case NF10_OPTIONS_FLOWSET_ID:
 			/* XXX: implement this (maybe) */
@@ -1531,9 +3289,9 @@ process_netflow_v10(struct flow_packet *fp, struct flowd_config *conf,
 			}
 			if (process_netflow_v10_data(fp->packet + offset,
 			    flowset_len, &fp->recv_time, peer, source_id,
-			    nf10_hdr, conf, log_fd, log_socket,
+			    nf10_hdr, conf, w,
 			    &flowset_flows) != 0)
-				return;
+				goto bad;
 			total_flows += flowset_flows;
 			break;
 		}
@@ -1544,89 +3302,562 @@ process_netflow_v10(struct flow_packet *fp, struct flowd_config *conf,
 
 	/* Don't update peer unless we actually receive data from it */
 	if (total_flows > 0)
-		update_peer(peers, peer, total_flows, 10);
+		update_peer(&w->peers, peer, total_flows, 10);
+	/* Records without a template count too, but we can't tell how many */
+	peer_sequence(&w->peers, peer, 10, source_id,
+	    ntohl(nf10_hdr->package_sequence),
+	    peer->no_template != no_template ? PEER_SEQ_UNKNOWN : total_flows);
+	return;
+
+ bad:
+	output_rollback(w);
 }
 
+/*
+ * Fetch the kernel receive timestamp into tv, returning 0 if there isn't
+ * one, and catch up with the kernel's count of drops for the listener
+ */
 static int
-receive_packet(struct flowd_config *conf, struct peers *peers, int net_fd)
+packet_recv_cmsgs(struct listen_addr *la, struct msghdr *msg,
+    struct timeval *tv)
+{
+#if defined(SO_TIMESTAMP) || defined(SO_RXQ_OVFL)
+	struct cmsghdr *cmsg;
+#endif
+	int found = 0;
+#ifdef SO_RXQ_OVFL
+	u_int32_t drops;
+#endif
+
+#if defined(SO_TIMESTAMP) || defined(SO_RXQ_OVFL)
+	if (msg->msg_controllen == 0)
+		return (0);
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET)
+			continue;
+# ifdef SO_TIMESTAMP
+		if (cmsg->cmsg_type == SCM_TIMESTAMP &&
+		    cmsg->cmsg_len >= CMSG_LEN(sizeof(*tv))) {
+			memcpy(tv, CMSG_DATA(cmsg), sizeof(*tv));
+			found = 1;
+		}
+# endif
+# ifdef SO_RXQ_OVFL
+		/* A running total for the socket, only sent once non-zero */
+		if (cmsg->cmsg_type == SO_RXQ_OVFL &&
+		    cmsg->cmsg_len >= CMSG_LEN(sizeof(drops))) {
+			memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+			la->kernel_drops += (u_int32_t)(drops - la->rxq_ovfl);
+			la->rxq_ovfl = drops;
+		}
+# endif
+	}
+#endif
+	return (found);
+}
+
+/*
+ * Packets for the "forward to" destinations are copied into a queue as
+ * they are processed and are sent once per receive pass, with a sendmmsg
+ * call per destination. With "forward thread" full queues are sent by a
+ * thread of their own instead, and are dropped rather than waited for if
+ * it falls behind, so a slow relay can't hold up collection.
+ */
+#define FORWARD_BATCH		64	/* packets per queue */
+#define FORWARD_QUEUES		8	/* for the forwarding thread */
+
+struct forward_queue {
+	TAILQ_ENTRY(forward_queue) entry;
+	u_int			 n;
+	u_int8_t		*buf;		/* FORWARD_BATCH packets */
+	struct iovec		 iov[FORWARD_BATCH];
+	u_int8_t		 accepted[FORWARD_BATCH]; /* not all discarded */
+};
+TAILQ_HEAD(forward_queues, forward_queue);
+
+#ifdef HAVE_PTHREAD
+static struct {
+	pthread_mutex_t		 lock;		/* also guards fa counters */
+	pthread_cond_t		 filled;
+	struct forward_queues	 full;
+	struct forward_queues	 free;
+	u_int			 nqueues;
+	int			 running;
+	int			 exiting;
+	pthread_t		 thread;
+} fwd = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	TAILQ_HEAD_INITIALIZER(fwd.full),
+	TAILQ_HEAD_INITIALIZER(fwd.free),
+	0, 0, 0
+};
+#endif
+
+static struct forward_queue *
+forward_queue_new(void)
+{
+	struct forward_queue *q;
+
+	if ((q = calloc(1, sizeof(*q))) == NULL ||
+	    (q->buf = calloc(FORWARD_BATCH, INPUT_MAX_PACKET_LEN)) == NULL)
+		logerrx("%s: calloc failed", __func__);
+	return (q);
+}
+
+/* Number of packets in a queue that are for a destination */
+static u_int
+forward_count(struct forward_addr *fa, struct forward_queue *q)
+{
+	u_int i, n;
+
+	if (!fa->filtered)
+		return (q->n);
+	for (i = n = 0; i < q->n; i++)
+		n += q->accepted[i];
+	return (n);
+}
+
+static void
+forward_account(struct forward_addr *fa, u_int sent, u_int dropped,
+    const char *why)
+{
+	char addr[INET6_ADDRSTRLEN];
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&fwd.lock);
+#endif
+	fa->packets += sent;
+	fa->dropped += dropped;
+	/* Warn when drops start, rather than for every one */
+	if (dropped > 0 && !fa->failing) {
+		if (addr_ntop(&fa->addr, addr, sizeof(addr)) == -1)
+			strlcpy(addr, "?", sizeof(addr));
+		logit(LOG_WARNING, "forward to [%s]:%d: %s, dropping "
+		    "packets", addr, fa->port, why);
+		fa->failing = 1;
+	} else if (dropped == 0 && sent > 0)
+		fa->failing = 0;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&fwd.lock);
+#endif
+}
+
+/* Send a queue's packets to every destination and empty it */
+static void
+forward_send(struct flowd_config *conf, struct forward_queue *q)
+{
+	struct forward_addr *fa;
+	struct iovec *iov[FORWARD_BATCH];
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[FORWARD_BATCH];
+#endif
+	u_int i, n, pos, sent;
+	int r, err;
+
+	TAILQ_FOREACH(fa, &conf->forward_addrs, entry) {
+		for (i = n = 0; i < q->n; i++) {
+			if (!fa->filtered || q->accepted[i])
+				iov[n++] = &q->iov[i];
+		}
+		err = 0;
+		for (pos = sent = 0; pos < n;) {
+#ifdef HAVE_SENDMMSG
+			if (!no_sendmmsg) {
+				bzero(msgs, sizeof(*msgs) * (n - pos));
+				for (i = 0; i < n - pos; i++) {
+					msgs[i].msg_hdr.msg_iov = iov[pos + i];
+					msgs[i].msg_hdr.msg_iovlen = 1;
+				}
+				r = sendmmsg(fa->fd, msgs, n - pos, 0);
+				if (r == -1 && errno == ENOSYS) {
+					logit(LOG_INFO, "sendmmsg not "
+					    "supported, sending one datagram "
+					    "at a time");
+					no_sendmmsg = 1;
+					continue;
+				}
+			} else
+#endif
+			r = send(fa->fd, iov[pos]->iov_base,
+			    iov[pos]->iov_len, 0) == -1 ? -1 : 1;
+			if (r > 0) {
+				pos += r;
+				sent += r;
+				continue;
+			}
+			if ((err = errno) == EINTR)
+				continue;
+			/* Nothing more will fit now; the rest are lost */
+			if (err == EAGAIN || err == EWOULDBLOCK ||
+			    err == ENOBUFS)
+				break;
+			/* e.g. an ICMP error for an earlier packet */
+			pos++;
+		}
+		if (n > 0)
+			forward_account(fa, sent, n - sent,
+			    err == 0 ? "" : strerror(err));
+	}
+	q->n = 0;
+}
+
+/* Send the packets a worker has queued, or pass them to the thread */
+static void
+forward_flush(struct flowd_config *conf, struct flowd_worker *w)
+{
+	struct forward_queue *q = w->fwdq;
+#ifdef HAVE_PTHREAD
+	struct forward_addr *fa;
+#endif
+
+	if (q == NULL || q->n == 0)
+		return;
+#ifdef HAVE_PTHREAD
+	if (fwd.running) {
+		pthread_mutex_lock(&fwd.lock);
+		if ((w->fwdq = TAILQ_FIRST(&fwd.free)) != NULL) {
+			TAILQ_REMOVE(&fwd.free, w->fwdq, entry);
+			TAILQ_INSERT_TAIL(&fwd.full, q, entry);
+			pthread_cond_signal(&fwd.filled);
+			pthread_mutex_unlock(&fwd.lock);
+			return;
+		}
+		w->fwdq = q;
+		pthread_mutex_unlock(&fwd.lock);
+		TAILQ_FOREACH(fa, &conf->forward_addrs, entry) {
+			forward_account(fa, 0, forward_count(fa, q),
+			    "forwarding thread behind");
+		}
+		q->n = 0;
+		return;
+	}
+#endif
+	forward_send(conf, q);
+}
+
+/* Queue a copy of a processed packet to be forwarded */
+static void
+forward_packet(struct flowd_config *conf, struct flowd_worker *w,
+    struct flow_packet *fp, int accepted)
+{
+	struct forward_queue *q;
+
+	if (w->fwdq == NULL)
+		w->fwdq = forward_queue_new();
+	if (w->fwdq->n == FORWARD_BATCH)
+		forward_flush(conf, w);
+	q = w->fwdq;
+	q->iov[q->n].iov_base = q->buf + q->n * INPUT_MAX_PACKET_LEN;
+	q->iov[q->n].iov_len = fp->len;
+	memcpy(q->iov[q->n].iov_base, fp->packet, fp->len);
+	q->accepted[q->n++] = accepted;
+}
+
+#ifdef HAVE_PTHREAD
+static void *
+forward_main(void *arg)
+{
+	struct flowd_config *conf = (struct flowd_config *)arg;
+	struct forward_queue *q;
+
+	pthread_mutex_lock(&fwd.lock);
+	for (;;) {
+		while (TAILQ_EMPTY(&fwd.full) && !fwd.exiting)
+			pthread_cond_wait(&fwd.filled, &fwd.lock);
+		if ((q = TAILQ_FIRST(&fwd.full)) == NULL)
+			break;
+		TAILQ_REMOVE(&fwd.full, q, entry);
+		pthread_mutex_unlock(&fwd.lock);
+		forward_send(conf, q);
+		pthread_mutex_lock(&fwd.lock);
+		TAILQ_INSERT_TAIL(&fwd.free, q, entry);
+	}
+	pthread_mutex_unlock(&fwd.lock);
+
+	return (NULL);
+}
+
+/* Called with signals blocked, before the workers start */
+static void
+forward_start(struct flowd_config *conf)
+{
+	struct forward_queue *q;
+	int r;
+
+	if ((conf->opts & FLOWD_OPT_FORWARD_THREAD) == 0 ||
+	    TAILQ_EMPTY(&conf->forward_addrs))
+		return;
+	for (; fwd.nqueues < FORWARD_QUEUES; fwd.nqueues++) {
+		q = forward_queue_new();
+		TAILQ_INSERT_TAIL(&fwd.free, q, entry);
+	}
+	fwd.exiting = 0;
+	if ((r = pthread_create(&fwd.thread, NULL, forward_main, conf)) != 0)
+		logerrx("%s: pthread_create: %s", __func__, strerror(r));
+	fwd.running = 1;
+}
+
+/* Called once the workers have stopped; sends whatever is queued */
+static void
+forward_stop(void)
+{
+	if (!fwd.running)
+		return;
+	pthread_mutex_lock(&fwd.lock);
+	fwd.exiting = 1;
+	pthread_cond_signal(&fwd.filled);
+	pthread_mutex_unlock(&fwd.lock);
+	pthread_join(fwd.thread, NULL);
+	fwd.running = 0;
+}
+#endif /* HAVE_PTHREAD */
+
+static void
+forward_stats_dump(struct flowd_config *conf)
+{
+	struct forward_addr *fa;
+
+	TAILQ_FOREACH(fa, &conf->forward_addrs, entry) {
+		logit(LOG_INFO, "forward to [%s]:%d: %llu packets sent, %llu "
+		    "dropped", addr_ntop_buf(&fa->addr), fa->port,
+		    (unsigned long long)fa->packets,
+		    (unsigned long long)fa->dropped);
+	}
+}
+
+static void
+listen_stats_dump(struct flowd_config *conf)
+{
+	struct listen_addr *la;
+
+	TAILQ_FOREACH(la, &conf->listen_addrs, entry) {
+		logit(LOG_INFO, "listen on [%s]:%d: %llu datagrams, %llu "
+		    "bytes, %llu dropped by the kernel",
+		    addr_ntop_buf(&la->addr), la->port,
+		    (unsigned long long)la->datagrams,
+		    (unsigned long long)la->bytes,
+		    (unsigned long long)la->kernel_drops);
+	}
+}
+
+/*
+ * Check a datagram received into fp and place it on the input queue.
+ * The packet is returned to the pool if it is rejected.
+ */
+static void
+accept_packet(struct flowd_config *conf, struct flowd_worker *w,
+    struct flow_packet *fp, struct sockaddr *from, socklen_t fromlen)
 {
-	struct sockaddr_storage from;
 	struct peer_state *peer;
-	socklen_t fromlen;
-	u_int8_t buf[2048];
-	ssize_t len;
-	struct xaddr flow_source;
+
+	w->listener->datagrams++;
+	w->listener->bytes += fp->len;
+
+	if (addr_sa_to_xaddr(from, fromlen, &fp->flow_source) == -1) {
+		logit(LOG_WARNING, "Invalid agent address");
+		flow_packet_dealloc(&w->pool, fp);
+		return;
+	}
+
+	if ((peer = find_peer(&w->peers, &fp->flow_source)) == NULL)
+		peer = new_peer(&w->peers, conf, &fp->flow_source);
+	if (peer == NULL) {
+		logit(LOG_DEBUG, "packet from unauthorised agent %s",
+		    addr_ntop_buf(&fp->flow_source));
+		flow_packet_dealloc(&w->pool, fp);
+		return;
+	}
+
+	if (fp->len < sizeof(struct NF_HEADER_COMMON)) {
+		peer->ninvalid++;
+		logit(LOG_WARNING, "short packet %d bytes from %s", fp->len,
+		    addr_ntop_buf(&fp->flow_source));
+		flow_packet_dealloc(&w->pool, fp);
+		return;
+	}
+
+	peer_hold(peer);
+	fp->peer = peer;
+	flow_packet_enqueue(w, fp);
+}
+
+static int
+receive_packet(struct flowd_config *conf, struct flowd_worker *w, int net_fd)
+{
+	struct sockaddr_storage from;
+	union recv_cmsgbuf cmsgbuf;
+	struct msghdr msg;
+	struct iovec iov;
 	struct flow_packet *fp;
-	struct forward_addr *fa;
+	ssize_t len;
 
-	if ((fp = flow_packet_alloc()) == NULL) {
-		logit(LOG_WARNING, "flow packet metadata alloc failed");
+	if ((fp = flow_packet_alloc(&w->pool)) == NULL) {
+		logit(LOG_DEBUG, "packet pool exhausted");
 		return (0);
 	}
 
+	bzero(&msg, sizeof(msg));
+	iov.iov_base = fp->packet;
+	iov.iov_len = INPUT_MAX_PACKET_LEN;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
  retry:
-	fromlen = sizeof(from);
-	if ((len = recvfrom(net_fd, buf, sizeof(buf), 0,
-	    (struct sockaddr *)&from, &fromlen)) < 0) {
+	msg.msg_name = &from;
+	msg.msg_namelen = sizeof(from);
+	if (RECV_CMSG_DROPS != 0 || (conf->opts & FLOWD_OPT_RECV_TIMESTAMP)) {
+		msg.msg_control = &cmsgbuf;
+		msg.msg_controllen = sizeof(cmsgbuf);
+	}
+	if ((len = recvmsg(net_fd, &msg, 0)) < 0) {
 		if (errno == EINTR)
 			goto retry;
 		if (errno != EAGAIN)
-			logit(LOG_WARNING, "recvfrom(fd = %d)", net_fd);
+			logit(LOG_WARNING, "recvmsg(fd = %d)", net_fd);
 		/* XXX ratelimit errors */
-		flow_packet_dealloc(fp);
+		flow_packet_dealloc(&w->pool, fp);
 		return (0);
 	}
 	fp->len = len;
-	gettimeofday(&fp->recv_time, NULL);
+	if (packet_recv_cmsgs(w->listener, &msg, &fp->recv_time) == 0)
+		gettimeofday(&fp->recv_time, NULL);
 
-	if (addr_sa_to_xaddr((struct sockaddr *)&from, fromlen,
-	    &fp->flow_source) == -1) {
-		logit(LOG_WARNING, "Invalid agent address");
-		flow_packet_dealloc(fp);
-		return (1);
-	}
+	accept_packet(conf, w, fp, (struct sockaddr *)&from,
+	    msg.msg_namelen);
 
-	if ((peer = find_peer(peers, &fp->flow_source)) == NULL)
-		peer = new_peer(peers, conf, &fp->flow_source);
-	if (peer == NULL) {
-		logit(LOG_DEBUG, "packet from unauthorised agent %s",
-		    addr_ntop_buf(&fp->flow_source));
-		flow_packet_dealloc(fp);
-		return (1);
-	}
+	return (1);
+}
 
-	if (fp->len < sizeof(struct NF_HEADER_COMMON)) {
-		peer->ninvalid++;
-		logit(LOG_WARNING, "short packet %d bytes from %s", fp->len,
-		    addr_ntop_buf(&flow_source));
-		flow_packet_dealloc(fp);
-		return (1);
-	}
+#ifdef HAVE_RECVMMSG
+static void
+recv_batch_setup(struct recv_batch *b, u_int n)
+{
+	u_int i;
 
-	if ((fp->packet = malloc(fp->len)) == NULL) {
-		logit(LOG_WARNING, "flow packet alloc failed (len %d)",
-		    fp->len);
-		flow_packet_dealloc(fp);
-		return (0);
+	if (b->n == n)
+		return;
+
+	free(b->msgs);
+	free(b->iovs);
+	free(b->from);
+	free(b->cmsgs);
+	free(b->fps);
+
+	if ((b->msgs = calloc(n, sizeof(*b->msgs))) == NULL ||
+	    (b->iovs = calloc(n, sizeof(*b->iovs))) == NULL ||
+	    (b->from = calloc(n, sizeof(*b->from))) == NULL ||
+	    (b->cmsgs = calloc(n, sizeof(*b->cmsgs))) == NULL ||
+	    (b->fps = calloc(n, sizeof(*b->fps))) == NULL)
+		logerrx("%s: calloc failed (batch %u)", __func__, n);
+
+	for (i = 0; i < n; i++) {
+		b->iovs[i].iov_len = INPUT_MAX_PACKET_LEN;
+		b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
 	}
-	memcpy(fp->packet, buf, fp->len);
-	flow_packet_enqueue(fp);
+	b->n = n;
+}
 
-	TAILQ_FOREACH(fa, &conf->forward_addrs, entry) {
-		logit(LOG_DEBUG, "Forwarding packet to %s", addr_ntop_buf(&fa->addr));
-		send(fa->fd, fp->packet, fp->len, 0);
+/*
+ * Pull datagrams off a socket conf->recv_batch at a time, directly
+ * into pool buffers. Returns -1 if recvmmsg is not available at runtime.
+ */
+static int
+receive_batch(struct flowd_config *conf, struct flowd_worker *w, int net_fd)
+{
+	struct recv_batch *b = &w->batch;
+	struct msghdr *msg;
+	struct timeval recv_time;
+	struct flow_packet *fp;
+	u_int i, total, want;
+	int n, timestamp, control;
+
+	recv_batch_setup(b, conf->recv_batch);
+	timestamp = (conf->opts & FLOWD_OPT_RECV_TIMESTAMP) != 0;
+	control = timestamp || RECV_CMSG_DROPS != 0;
+
+	for (total = 0; total < INPUT_MAX_PACKET_PER_FD; total += n) {
+		want = INPUT_MAX_PACKET_PER_FD - total;
+		if (want > b->n)
+			want = b->n;
+		for (i = 0; i < want; i++) {
+			if ((fp = flow_packet_alloc(&w->pool)) == NULL)
+				break;
+			b->fps[i] = fp;
+			b->iovs[i].iov_base = fp->packet;
+			msg = &b->msgs[i].msg_hdr;
+			msg->msg_name = &b->from[i];
+			msg->msg_namelen = sizeof(b->from[i]);
+			msg->msg_control = control ? &b->cmsgs[i] : NULL;
+			msg->msg_controllen = control ?
+			    sizeof(b->cmsgs[i]) : 0;
+			msg->msg_flags = 0;
+		}
+		if ((want = i) == 0) {
+			logit(LOG_DEBUG, "packet pool exhausted");
+			return (0);
+		}
+		if ((n = recvmmsg(net_fd, b->msgs, want,
+		    MSG_DONTWAIT, NULL)) < 0) {
+			for (i = 0; i < want; i++)
+				flow_packet_dealloc(&w->pool, b->fps[i]);
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			if (errno == ENOSYS) {
+				logit(LOG_INFO, "recvmmsg not supported, "
+				    "receiving one packet at a time");
+				b->unsupported = 1;
+				return (-1);
+			}
+			if (errno != EAGAIN)
+				logitm(LOG_WARNING, "recvmmsg(fd = %d)", net_fd);
+			return (0);
+		}
+		/* Return the slots that weren't filled */
+		for (i = n; i < want; i++)
+			flow_packet_dealloc(&w->pool, b->fps[i]);
+		/* One clock read covers the whole batch */
+		if (!timestamp)
+			gettimeofday(&recv_time, NULL);
+		for (i = 0; i < (u_int)n; i++) {
+			fp = b->fps[i];
+			msg = &b->msgs[i].msg_hdr;
+			if (control && packet_recv_cmsgs(w->listener, msg,
+			    &recv_time) == 0 && timestamp)
+				gettimeofday(&recv_time, NULL);
+			fp->len = b->msgs[i].msg_len;
+			fp->recv_time = recv_time;
+			accept_packet(conf, w, fp,
+			    (struct sockaddr *)msg->msg_name, msg->msg_namelen);
+		}
+		/* Socket drained */
+		if ((u_int)n < want)
+			return (0);
 	}
+	logit(LOG_DEBUG, "Received max number of packets (%d) on fd %d",
+	    INPUT_MAX_PACKET_PER_FD, net_fd);
 
-	return (1);
+	return (0);
 }
+#endif /* HAVE_RECVMMSG */
 
 static void
-receive_many(struct flowd_config *conf, struct peers *peers, int net_fd)
+receive_many(struct flowd_config *conf, struct flowd_worker *w, int net_fd)
 {
 	int i;
 
+#ifdef HAVE_RECVMMSG
+	if (conf->recv_batch > 1 && !w->batch.unsupported &&
+	    receive_batch(conf, w, net_fd) == 0)
+		return;
+#endif
+
 	for (i = 0; i < INPUT_MAX_PACKET_PER_FD; i++) {
-		if (receive_packet(conf, peers, net_fd) == 0) {
+		if (receive_packet(conf, w, net_fd) == 0) {
 			logit(LOG_DEBUG, "Received max number of packets "
 			    "(%d) on fd %d", INPUT_MAX_PACKET_PER_FD, net_fd);
 			return;
@@ -1636,33 +3867,34 @@ receive_many(struct flowd_config *conf, struct peers *peers, int net_fd)
 
 static void
 process_packet(struct flow_packet *fp, struct flowd_config *conf,
-    struct peers *peers, int log_fd, int log_socket)
+    struct flowd_worker *w)
 {
-	struct peer_state *peer;
+	struct peer_state *peer = fp->peer;
 	struct NF_HEADER_COMMON *hdr = (struct NF_HEADER_COMMON *)fp->packet;
+	u_int64_t start;
+	u_int v;
 
-	if ((peer = find_peer(peers, &fp->flow_source)) == NULL) {
-		logit(LOG_WARNING, "flow source %s was expired between "
-		    "between flow packet reception and processing", 
-		    addr_ntop_buf(&fp->flow_source));
-		return;
-	}
-
+	start = stats_now_ns();
 	switch (ntohs(hdr->version)) {
 	case 1:
-		process_netflow_v1(fp, conf, peer, peers, log_fd, log_socket);
+		process_netflow_v1(fp, conf, peer, w);
+		v = 0;
 		break;
 	case 5:
-		process_netflow_v5(fp, conf, peer, peers, log_fd, log_socket);
+		process_netflow_v5(fp, conf, peer, w);
+		v = 1;
 		break;
 	case 7:
-		process_netflow_v7(fp, conf, peer, peers, log_fd, log_socket);
+		process_netflow_v7(fp, conf, peer, w);
+		v = 2;
 		break;
 	case 9:
-		process_netflow_v9(fp, conf, peer, peers, log_fd, log_socket);
+		process_netflow_v9(fp, conf, peer, w);
+		v = 3;
 		break;
 	case 10:
-		process_netflow_v10(fp, conf, peer, peers, log_fd, log_socket);
+		process_netflow_v10(fp, conf, peer, w);
+		v = 4;
 		break;
 	default:
 		logit(LOG_INFO, "Unsupported netflow version %u from %s",
@@ -1672,114 +3904,870 @@ process_packet(struct flow_packet *fp, struct flowd_config *conf,
 #endif
 		return;
 	}
+	stats_hist_add(&w->stats.decode[v], stats_now_ns() - start);
 }
 
 static void
-process_input_queue(struct flowd_config *conf, struct peers *peers,
-    int log_fd, int log_socket)
+process_input_queue(struct flowd_config *conf, struct flowd_worker *w)
 {
 	struct flow_packet *fp;
-
-	while ((fp = flow_packet_dequeue()) != NULL) {
-		process_packet(fp, conf, peers, log_fd, log_socket);
-		flow_packet_dealloc(fp);
+	int forward = !TAILQ_EMPTY(&conf->forward_addrs);
+
+	while ((fp = flow_packet_dequeue(w)) != NULL) {
+		w->accepted = w->discarded = 0;
+		w->invalid = 0;
+		process_packet(fp, conf, w);
+		output_commit(w, fp);
+		if (w->aggr.num_staged > 0)
+			commit_aggr_flows(conf, w);
+		/* Packets of templates alone count as accepted */
+		if (forward)
+			forward_packet(conf, w, fp,
+			    !w->invalid &&
+			    (w->accepted > 0 || w->discarded == 0));
+		peer_release(fp->peer);
+		fp->peer = NULL;
+		flow_packet_dealloc(&w->pool, fp);
 	}
 }
 
+/*
+ * Build a worker's poll set: a control descriptor (the monitor fd, or the
+ * wake pipe for threaded workers) followed by the worker's listeners.
+ */
 static void
-init_pfd(struct flowd_config *conf, struct pollfd **pfdp, int mfd, int *num_fds)
+init_pfd(struct flowd_config *conf, struct flowd_worker *w, int ctl_fd)
 {
-	struct pollfd *pfd = *pfdp;
+	struct pollfd *pfd = w->pfd;
 	struct listen_addr *la;
 	int i;
 
-	logit(LOG_DEBUG, "%s: entering (num_fds = %d)", __func__, *num_fds);
+	logit(LOG_DEBUG, "%s: entering (worker %u, num_fds = %d)", __func__,
+	    w->id, w->num_fds);
 
 	if (pfd != NULL)
 		free(pfd);
+	free(w->pla);
 
-	*num_fds = 1; /* fd to monitor */
+	w->num_fds = 1; /* control fd */
 
 	/* Count socks */
-	TAILQ_FOREACH(la, &conf->listen_addrs, entry)
-		(*num_fds)++;
+	TAILQ_FOREACH(la, &conf->listen_addrs, entry) {
+		if (la->worker % num_workers == w->id)
+			w->num_fds++;
+	}
 
-	if ((pfd = calloc((*num_fds) + 1, sizeof(*pfd))) == NULL) {
+	if ((pfd = calloc(w->num_fds + 1, sizeof(*pfd))) == NULL ||
+	    (w->pla = calloc(w->num_fds + 1, sizeof(*w->pla))) == NULL) {
 		logerrx("%s: calloc failed (num %d)",
-		    __func__, *num_fds + 1);
+		    __func__, w->num_fds + 1);
 	}
 
-	pfd[0].fd = mfd;
+	pfd[0].fd = ctl_fd;
 	pfd[0].events = POLLIN;
+#ifdef HAVE_PTHREAD
+	/*
+	 * With a single worker, ctl_fd is the monitor socket, which the writer
+	 * thread uses to open log files. Only watch for the monitor going away.
+	 */
+	if (num_workers == 1)
+		pfd[0].events = 0;
+#endif
 
 	i = 1;
 	TAILQ_FOREACH(la, &conf->listen_addrs, entry) {
+		if (la->worker % num_workers != w->id)
+			continue;
 		pfd[i].fd = la->fd;
 		pfd[i].events = POLLIN;
+		w->pla[i] = la;
 		i++;
 	}
 
-	*pfdp = pfd;
+	w->pfd = pfd;
+
+	logit(LOG_DEBUG, "%s: done (worker %u, num_fds = %d)", __func__,
+	    w->id, w->num_fds);
+}
+
+/*
+ * Wait for and then process one round of packets. Returns -1 when
+ * the control descriptor becomes readable.
+ */
+static int
+worker_poll(struct flowd_worker *w, struct flowd_config *conf, int timeout)
+{
+	int i;
+
+	timeout = poll_aggr_flows(conf, w, timeout);
+	timeout = output_flush_timeout(w, timeout);
+	i = poll(w->pfd, w->num_fds, timeout);
+	if (i <= 0) {
+		if (i == 0 || errno == EINTR) {
+			output_flush_check(w);
+			return (0);
+		}
+		logerr("%s: poll", __func__);
+	}
+
+	if (w->pfd[0].revents != 0)
+		return (-1);
+
+	for (i = 1; i < w->num_fds; i++) {
+		if ((w->pfd[i].revents & POLLIN) == 0)
+			continue;
+		w->listener = w->pla[i];
+		receive_many(conf, w, w->pfd[i].fd);
+	}
+
+	process_input_queue(conf, w);
+	forward_flush(conf, w);
+	output_flush_check(w);
+
+	return (0);
+}
+
+#ifdef HAVE_PTHREAD
+static int
+set_nonblock(int fd)
+{
+	int fl;
+
+	if ((fl = fcntl(fd, F_GETFL, 0)) == -1)
+		return (-1);
+	return (fcntl(fd, F_SETFL, fl | O_NONBLOCK));
+}
+#endif
+
+static void
+workers_setup(struct flowd_config *conf)
+{
+	struct flowd_worker *w;
+#ifdef HAVE_PTHREAD
+	struct output_queue *q;
+#endif
+	u_int i;
+
+	num_workers = conf->workers;
+	if ((workers = calloc(num_workers, sizeof(*workers))) == NULL)
+		logerrx("%s: calloc failed (%u workers)", __func__, num_workers);
+
+	for (i = 0; i < num_workers; i++) {
+		w = &workers[i];
+		w->id = i;
+		w->conf = conf;
+		w->peers.max_peers = conf->max_peers;
+		w->peers.max_templates = conf->max_templates;
+		w->peers.max_sources = conf->max_sources;
+		w->peers.max_template_len = conf->max_template_len;
+		TAILQ_INIT(&w->peers.peer_list);
+		TAILQ_INIT(&w->input_queue);
+		flow_packet_pool_init(&w->pool, conf->packet_pool);
+		aggr_init(&w->aggr, &conf->aggr);
+	}
+
+	if (num_workers == 1) {
+		workers[0].filters = filter_compile(&conf->filter_list);
+#ifdef HAVE_PTHREAD
+		/* Double buffered, the spare being written by writer_main */
+		for (i = 0; i < OUTPUT_QUEUES_PER_WORKER; i++) {
+			q = output_queue_new(conf);
+			TAILQ_INSERT_TAIL(&handoff.free, q, entry);
+		}
+#else
+		workers[0].outq = output_queue_new(conf);
+#endif
+		return;
+	}
+
+#ifdef HAVE_PTHREAD
+	if (pipe(handoff.notify) == -1 ||
+	    set_nonblock(handoff.notify[0]) == -1 ||
+	    set_nonblock(handoff.notify[1]) == -1)
+		logerr("%s: notify pipe", __func__);
+	for (i = 0; i < num_workers; i++) {
+		w = &workers[i];
+		if (pipe(w->wake) == -1 || set_nonblock(w->wake[0]) == -1 ||
+		    set_nonblock(w->wake[1]) == -1)
+			logerr("%s: wake pipe", __func__);
+	}
+	for (i = 0; i < num_workers * OUTPUT_QUEUES_PER_WORKER; i++) {
+		q = output_queue_new(conf);
+		TAILQ_INSERT_TAIL(&handoff.free, q, entry);
+	}
+	logit(LOG_DEBUG, "%s: %u workers", __func__, num_workers);
+#else
+	logerrx("%s: %u workers requested without thread support", __func__,
+	    num_workers);
+#endif
+}
+
+#ifdef HAVE_PTHREAD
+static void *
+worker_main(void *arg)
+{
+	struct flowd_worker *w = (struct flowd_worker *)arg;
+
+	while (worker_poll(w, w->conf, INFTIM) == 0)
+		;
+	if (aggr_flush_on_stop)
+		output_aggr_flows(w->conf, w, 0);
+	output_handoff(w, 1);
+
+	return (NULL);
+}
+
+static void
+workers_start(struct flowd_config *conf)
+{
+	struct flowd_worker *w;
+	struct filter_rule *fr, *copy;
+	sigset_t all, old;
+	u_int i;
+	int r;
+
+	/* Set first, so workers flush to the handoff from the outset */
+	workers_running = 1;
+
+	/* Signals are left to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	forward_start(conf);
+
+	if (num_workers == 1) {
+		/* Collect here, write from another thread */
+		w = &workers[0];
+		pthread_mutex_lock(&handoff.lock);
+		w->outq = TAILQ_FIRST(&handoff.free);
+		TAILQ_REMOVE(&handoff.free, w->outq, entry);
+		handoff.running = 1;
+		pthread_mutex_unlock(&handoff.lock);
+		if ((r = pthread_create(&handoff.writer, NULL, writer_main,
+		    conf)) != 0)
+			logerrx("%s: pthread_create: %s", __func__, strerror(r));
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		return;
+	}
+
+	for (i = 0; i < num_workers; i++) {
+		w = &workers[i];
+		init_pfd(conf, w, w->wake[0]);
+
+		/* Private rule counters, merged back by workers_stop */
+		TAILQ_INIT(&w->filter_copy);
+		TAILQ_FOREACH(fr, &conf->filter_list, entry) {
+			if ((copy = malloc(sizeof(*copy))) == NULL)
+				logerrx("%s: malloc failed", __func__);
+			memcpy(copy, fr, sizeof(*copy));
+			copy->evaluations = copy->matches = copy->wins = 0;
+			TAILQ_INSERT_TAIL(&w->filter_copy, copy, entry);
+		}
+		w->filters = filter_compile(&w->filter_copy);
+
+		pthread_mutex_lock(&handoff.lock);
+		if ((w->outq = TAILQ_FIRST(&handoff.free)) == NULL)
+			logerrx("%s: no free output queue", __func__);
+		TAILQ_REMOVE(&handoff.free, w->outq, entry);
+		handoff.running++;
+		pthread_mutex_unlock(&handoff.lock);
+
+		if ((r = pthread_create(&w->thread, NULL, worker_main, w)) != 0)
+			logerrx("%s: pthread_create: %s", __func__, strerror(r));
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+#endif /* HAVE_PTHREAD */
+
+/* Stop worker threads, writing out everything they have queued */
+static void
+workers_stop(struct flowd_config *conf)
+{
+#ifdef HAVE_PTHREAD
+	struct flowd_worker *w;
+	struct filter_rule *fr, *copy;
+	u_int i;
+	int done;
+	char buf[64];
+
+	if (!workers_running)
+		return;
+
+	if (num_workers == 1) {
+		if (aggr_flush_on_stop)
+			output_aggr_flows(conf, &workers[0], 0);
+		/* The writer exits once it has written the final queue */
+		output_handoff(&workers[0], 1);
+		pthread_join(handoff.writer, NULL);
+		forward_stop();
+		workers_running = 0;
+		return;
+	}
+
+	for (i = 0; i < num_workers; i++) {
+		if (write(workers[i].wake[1], "", 1) == -1 && errno != EAGAIN)
+			logerr("%s: write", __func__);
+	}
 
-	logit(LOG_DEBUG, "%s: done (num_fds = %d)", __func__, *num_fds);
+	pthread_mutex_lock(&handoff.lock);
+	for (;;) {
+		/* Final queues are handed over before "running" drops */
+		done = handoff.running == 0;
+		output_drain_locked(conf->opts & FLOWD_OPT_VERBOSE);
+		if (done)
+			break;
+		if (handoff.running > 0 && TAILQ_EMPTY(&handoff.full))
+			pthread_cond_wait(&handoff.filled, &handoff.lock);
+	}
+	pthread_mutex_unlock(&handoff.lock);
+
+	for (i = 0; i < num_workers; i++) {
+		w = &workers[i];
+		pthread_join(w->thread, NULL);
+		while (read(w->wake[0], buf, sizeof(buf)) > 0)
+			;
+
+		filter_index_sync(w->filters);
+		filter_index_free(w->filters);
+		w->filters = NULL;
+		fr = TAILQ_FIRST(&conf->filter_list);
+		while ((copy = TAILQ_FIRST(&w->filter_copy)) != NULL) {
+			TAILQ_REMOVE(&w->filter_copy, copy, entry);
+			fr->evaluations += copy->evaluations;
+			fr->matches += copy->matches;
+			fr->wins += copy->wins;
+			fr = TAILQ_NEXT(fr, entry);
+			free(copy);
+		}
+	}
+	while (read(handoff.notify[0], buf, sizeof(buf)) > 0)
+		;
+
+	forward_stop();
+	workers_running = 0;
+#else
+	if (aggr_flush_on_stop)
+		output_aggr_flows(conf, &workers[0], 0);
+	/* Flows may be held back by the flush policy */
+	output_flow_flush(&workers[0], conf->opts & FLOWD_OPT_VERBOSE);
+#endif /* HAVE_PTHREAD */
 }
 
+#ifdef HAVE_PTHREAD
+/*
+ * The stats socket is opened before privileges are dropped, and is served
+ * by a thread of its own that writes a JSON snapshot of the counters to
+ * each client. stats_lock keeps the configuration still while it is read.
+ */
+static int stats_fd = -1;
+static time_t stats_started;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static void
-flowd_mainloop(struct flowd_config *conf, struct peers *peers, int monitor_fd)
+stats_snapshot(struct flowd_config *conf, struct stats_buf *sb)
 {
-	int i, log_fd, log_socket, num_fds = 0;
+	static const char *versions[STATS_NF_VERSIONS] = {
+		"v1", "v5", "v7", "v9", "v10"
+	};
+	static struct stats_hist h;
+	struct flowd_worker *w;
 	struct listen_addr *la;
-	struct pollfd *pfd = NULL;
+	struct forward_addr *fa;
+	char addr[INET6_ADDRSTRLEN];
+	const char *sep;
+	u_int i, v;
+
+	stats_buf_printf(sb, "{\"version\":\"%s\",\"uptime\":%lld,"
+	    "\"workers\":[", PROGVER, (long long)(time(NULL) - stats_started));
+	for (i = 0; i < num_workers; i++) {
+		w = &workers[i];
+		stats_buf_printf(sb, "%s{\"id\":%u,\"flows\":%llu,"
+		    "\"accepted\":%llu,\"discarded\":%llu,\"pool_free\":%u,"
+		    "\"pool_exhausted\":%llu,\"peers\":%u,\"sequence\":"
+		    "{\"lost\":%llu,\"gaps\":%llu,\"late\":%llu,"
+		    "\"resets\":%llu},\"aggregate\":{\"flows_in\":%llu,"
+		    "\"flows_out\":%llu,\"held\":%u,\"evicted\":%llu}}",
+		    i == 0 ? "" : ",", w->id,
+		    (unsigned long long)w->stats.flows,
+		    (unsigned long long)w->stats.accepted,
+		    (unsigned long long)w->stats.discarded, w->pool.nfree,
+		    (unsigned long long)w->pool.exhausted, w->peers.num_peers,
+		    (unsigned long long)w->peers.seq.lost,
+		    (unsigned long long)w->peers.seq.gaps,
+		    (unsigned long long)w->peers.seq.late,
+		    (unsigned long long)w->peers.seq.resets,
+		    (unsigned long long)w->aggr.flows_in,
+		    (unsigned long long)w->aggr.flows_out, w->aggr.num_active,
+		    (unsigned long long)w->aggr.evicted);
+	}
+
+	stats_buf_printf(sb, "],\"listen\":[");
+	sep = "";
+	TAILQ_FOREACH(la, &conf->listen_addrs, entry) {
+		if (addr_ntop(&la->addr, addr, sizeof(addr)) == -1)
+			strlcpy(addr, "?", sizeof(addr));
+		stats_buf_printf(sb, "%s{\"addr\":\"%s\",\"port\":%u,"
+		    "\"worker\":%u,\"datagrams\":%llu,\"bytes\":%llu,"
+		    "\"kernel_drops\":%llu}", sep, addr, la->port,
+		    la->worker % num_workers,
+		    (unsigned long long)la->datagrams,
+		    (unsigned long long)la->bytes,
+		    (unsigned long long)la->kernel_drops);
+		sep = ",";
+	}
+
+	/* Histograms are summed over the workers */
+	stats_buf_printf(sb, "],\"decode_ns\":{");
+	for (v = 0; v < STATS_NF_VERSIONS; v++) {
+		bzero(&h, sizeof(h));
+		for (i = 0; i < num_workers; i++)
+			stats_hist_merge(&h, &workers[i].stats.decode[v]);
+		if (v > 0)
+			stats_buf_printf(sb, ",");
+		stats_buf_hist(sb, versions[v], &h);
+	}
+	stats_buf_printf(sb, "},");
+	bzero(&h, sizeof(h));
+	for (i = 0; i < num_workers; i++)
+		stats_hist_merge(&h, &workers[i].stats.filter);
+	stats_buf_hist(sb, "filter_ns", &h);
+	stats_buf_printf(sb, ",");
+	bzero(&h, sizeof(h));
+	for (i = 0; i < num_workers; i++)
+		stats_hist_merge(&h, &workers[i].stats.serialise);
+	stats_buf_hist(sb, "serialise_ns", &h);
+
+	stats_buf_printf(sb, ",\"output\":{\"writes\":%llu,\"bytes\":%llu,"
+	    "\"queue_depth\":%u,\"queue_depth_max\":%u,\"queued_bytes\":%llu,"
+	    "\"stalls\":%llu,", (unsigned long long)output_stats.writes,
+	    (unsigned long long)output_stats.bytes, handoff.depth,
+	    handoff.max_depth, (unsigned long long)handoff.queued,
+	    (unsigned long long)handoff.stalls);
+	stats_buf_hist(sb, "flush_bytes", &output_stats.flush_bytes);
+	stats_buf_printf(sb, ",");
+	stats_buf_hist(sb, "flush_ns", &output_stats.flush_ns);
+	stats_buf_printf(sb, "},\"logsock\":{\"datagrams\":%llu,"
+	    "\"errors\":%llu,\"reopens\":%llu},\"logring\":{\"flows\":%llu,"
+	    "\"bytes\":%llu,\"writes\":%llu},\"forward\":[",
+	    (unsigned long long)logsock_datagrams,
+	    (unsigned long long)logsock_errors,
+	    (unsigned long long)logsock_reopens,
+	    (unsigned long long)log_ring.flows,
+	    (unsigned long long)log_ring.head,
+	    (unsigned long long)log_ring.writes);
+	sep = "";
+	TAILQ_FOREACH(fa, &conf->forward_addrs, entry) {
+		if (addr_ntop(&fa->addr, addr, sizeof(addr)) == -1)
+			strlcpy(addr, "?", sizeof(addr));
+		stats_buf_printf(sb, "%s{\"addr\":\"%s\",\"port\":%u,"
+		    "\"packets\":%llu,\"dropped\":%llu}", sep, addr, fa->port,
+		    (unsigned long long)fa->packets,
+		    (unsigned long long)fa->dropped);
+		sep = ",";
+	}
+	stats_buf_printf(sb, "]}\n");
+}
+
+static void *
+stats_main(void *arg)
+{
+	struct flowd_config *conf = (struct flowd_config *)arg;
+	struct stats_buf sb;
+	struct timeval tv;
+	int fd;
+
+	bzero(&sb, sizeof(sb));
+	for (;;) {
+		if ((fd = accept(stats_fd, NULL, NULL)) == -1) {
+			if (errno != EINTR && errno != ECONNABORTED) {
+				logitm(LOG_WARNING, "stats socket accept");
+				sleep(1);
+			}
+			continue;
+		}
+		/* Don't let a client that won't read hold us up */
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+		sb.len = 0;
+		pthread_mutex_lock(&stats_lock);
+		stats_snapshot(conf, &sb);
+		pthread_mutex_unlock(&stats_lock);
+		if (atomicio(vwrite, fd, sb.buf, sb.len) != sb.len)
+			logitm(LOG_DEBUG, "stats socket write");
+		close(fd);
+	}
+	/* NOTREACHED */
+	return (NULL);
+}
+
+/* Called once the workers are set up */
+static void
+stats_start(struct flowd_config *conf)
+{
+	pthread_t thread;
+	sigset_t all, old;
+	int r;
+
+	if (stats_fd == -1)
+		return;
+	stats_started = time(NULL);
+
+	/* Signals are left to the main thread; SIGPIPE becomes EPIPE */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if ((r = pthread_create(&thread, NULL, stats_main, conf)) != 0)
+		logerrx("%s: pthread_create: %s", __func__, strerror(r));
+	pthread_detach(thread);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+#endif /* HAVE_PTHREAD */
+
+/* Template cache */
+
+static time_t template_cache_next;	/* when it is next saved */
+
+/*
+ * Install a cached template, unless one as new is already held. Returns 1
+ * if it was installed, 0 if not and -1 if it is no longer acceptable.
+ */
+static int
+template_cache_install(struct flowd_config *conf, struct flowd_worker *w,
+    struct peer_cache_entry *e)
+{
+	struct peers *peers = &w->peers;
+	struct peer_state *peer;
+	struct peer_nf9_template *nf9tmpl;
+	struct peer_nf10_template *nf10tmpl;
+	u_int i, total_len = 0;
+
+	/* Check it as if it had just arrived */
+	for (i = 0; i < e->num_records; i++) {
+		if (!nf_check_rec_len(e->records[i].type, e->records[i].len))
+			return (-1);
+		total_len += e->records[i].len;
+	}
+	if (total_len > peers->max_template_len)
+		return (-1);
+	/* Perhaps no longer an allowed device */
+	if ((peer = find_peer(peers, &e->from)) == NULL &&
+	    (peer = new_peer(peers, conf, &e->from)) == NULL)
+		return (-1);
+
+	if (e->netflow_version == 9) {
+		nf9tmpl = peer_nf9_find_template(peer, e->source_id,
+		    e->template_id);
+		if (nf9tmpl != NULL && nf9tmpl->refreshed >= e->refreshed)
+			return (0);
+		if (nf9tmpl == NULL) {
+			nf9tmpl = peer_nf9_new_template(peer, peers,
+			    e->source_id, e->template_id);
+		}
+		if (nf9tmpl->records != NULL)
+			free(nf9tmpl->records);
+		if ((nf9tmpl->records = calloc(e->num_records,
+		    sizeof(*nf9tmpl->records))) == NULL)
+			logerrx("%s: calloc failed", __func__);
+		for (i = 0; i < e->num_records; i++)
+			nf9tmpl->records[i] = e->records[i];
+		nf9tmpl->num_records = e->num_records;
+		nf9tmpl->total_len = total_len;
+		nf9tmpl->refreshed = e->refreshed;
+		nf9_compile_template(nf9tmpl);
+	} else {
+		nf10tmpl = peer_nf10_find_template(peer, e->source_id,
+		    e->template_id);
+		if (nf10tmpl != NULL && nf10tmpl->refreshed >= e->refreshed)
+			return (0);
+		if (nf10tmpl == NULL) {
+			nf10tmpl = peer_nf10_new_template(peer, peers,
+			    e->source_id, e->template_id);
+		}
+		if (nf10tmpl->records != NULL)
+			free(nf10tmpl->records);
+		if ((nf10tmpl->records = calloc(e->num_records,
+		    sizeof(*nf10tmpl->records))) == NULL)
+			logerrx("%s: calloc failed", __func__);
+		for (i = 0; i < e->num_records; i++) {
+			nf10tmpl->records[i].type = e->records[i].type;
+			nf10tmpl->records[i].len = e->records[i].len;
+		}
+		nf10tmpl->num_records = e->num_records;
+		nf10tmpl->total_len = total_len;
+		nf10tmpl->refreshed = e->refreshed;
+		nf10_compile_template(nf10tmpl);
+	}
+	return (1);
+}
+
+/*
+ * Load the templates saved by the last run. Which worker a source's packets
+ * reach depends on its port and the kernel's hashing, so every worker gets
+ * every template. Those held by more than one worker were saved more than
+ * once and the newest wins. Must be called with the workers stopped.
+ */
+static void
+template_cache_load(struct flowd_config *conf, int monitor_fd)
+{
+	struct peer_cache_header hdr;
+	struct peer_cache_entry e;
+	u_int i, loaded = 0, stale = 0, bad = 0;
+	time_t now;
+	FILE *f;
+	int fd, r, installed;
+
+	if (conf->template_cache == NULL)
+		return;
+	template_cache_next = time(NULL) + conf->template_cache_secs;
+	if ((fd = client_open_cache(monitor_fd, 0)) == -1)
+		return;
+	if ((f = fdopen(fd, "r")) == NULL) {
+		logerr("%s: fdopen", __func__);
+		close(fd);
+		return;
+	}
+	if (peer_cache_read_header(f, &hdr) == -1) {
+		logit(LOG_WARNING, "template cache \"%s\" is corrupt, "
+		    "ignoring it", conf->template_cache);
+		fclose(f);
+		return;
+	}
+
+	now = time(NULL);
+	while ((r = peer_cache_read(f, &e)) == 1) {
+		if (e.refreshed + (time_t)conf->template_cache_age < now) {
+			stale++;
+			free(e.records);
+			continue;
+		}
+		/* Acceptable to one worker is acceptable to all */
+		for (installed = i = 0; i < num_workers; i++) {
+			installed |= template_cache_install(conf,
+			    &workers[i], &e);
+		}
+		if (installed == -1)
+			bad++;
+		else if (installed)
+			loaded++;
+		free(e.records);
+	}
+	if (r == -1) {
+		logit(LOG_WARNING, "template cache \"%s\" is truncated or "
+		    "corrupt", conf->template_cache);
+	}
+	fclose(f);
+
+	logit(LOG_INFO, "loaded %u templates from cache saved at %s, "
+	    "skipped %u stale and %u unusable", loaded,
+	    iso_time(hdr.saved, 0), stale, bad);
+}
+
+/* Save the templates of every worker, which must be stopped */
+static void
+template_cache_save(struct flowd_config *conf, int monitor_fd)
+{
+	u_int i, saved = 0;
+	FILE *f;
+	int fd, r = 0;
+
+	if (conf->template_cache == NULL)
+		return;
+	template_cache_next = time(NULL) + conf->template_cache_secs;
+	if ((fd = client_open_cache(monitor_fd, 1)) == -1) {
+		logit(LOG_WARNING, "couldn't open template cache for writing");
+		return;
+	}
+	if ((f = fdopen(fd, "w")) == NULL) {
+		logerr("%s: fdopen", __func__);
+		close(fd);
+		return;
+	}
+	if (peer_cache_write_header(f) == -1)
+		r = -1;
+	for (i = 0; r != -1 && i < num_workers; i++) {
+		if ((r = peer_cache_write(f, &workers[i].peers)) != -1)
+			saved += r;
+	}
+	/* Only replace the old cache with one that is complete */
+	if (r == -1 || fflush(f) != 0 || fsync(fileno(f)) == -1) {
+		logerr("%s: write", __func__);
+		fclose(f);
+		return;
+	}
+	fclose(f);
+	if (client_commit_cache(monitor_fd) == -1) {
+		logit(LOG_WARNING, "couldn't replace template cache");
+		return;
+	}
+	logit(LOG_DEBUG, "saved %u templates to cache", saved);
+}
+
+/* Shorten a poll timeout to wake for the next template cache save */
+static int
+template_cache_timeout(struct flowd_config *conf, int timeout)
+{
+	time_t now;
+	int ms;
+
+	if (conf->template_cache == NULL)
+		return (timeout);
+	now = time(NULL);
+	ms = now >= template_cache_next ? 0 :
+	    (template_cache_next - now) * 1000;
+	if (timeout == INFTIM || ms < timeout)
+		timeout = ms;
+	return (timeout);
+}
+
+static void
+flowd_mainloop(struct flowd_config *conf, int monitor_fd)
+{
+	struct flowd_worker *w;
+	u_int n;
+#ifdef HAVE_PTHREAD
+	struct pollfd pfd[2];
+	char buf[64];
+	int i;
+#endif
 
-	init_pfd(conf, &pfd, monitor_fd, &num_fds);
+	log_socket_batch = conf->log_socket_batch;
+	workers_setup(conf);
+	if (num_workers == 1)
+		init_pfd(conf, &workers[0], monitor_fd);
+	template_cache_load(conf, monitor_fd);
+#ifdef HAVE_PTHREAD
+	stats_start(conf);
+#endif
 
 	/* Main loop */
-	log_fd = log_socket = -1;
 	for(;exit_flag == 0;) {
-		if (log_socket != -1 &&
-		    logsock_num_errors > LOGSOCK_REOPEN_ERROR_COUNT &&
-		    time(NULL) > logsock_first_error + LOGSOCK_REOPEN_DELAY) {
+		if (log_socket != -1 && logsock_reopen_due()) {
 			logit(LOG_INFO, "reopening log socket because of "
 			    "frequent errors");
+			workers_stop(conf);
 			close(log_socket);
 			log_socket = -1;
-			logsock_first_error = logsock_num_errors = 0;
+			logsock_reopens++;
 		}
-		if (reopen_flag && (log_fd != -1 || log_socket != -1)) {
+		if (reopen_flag && (log_state.active || log_socket != -1)) {
 			logit(LOG_INFO, "log reopen requested");
-			if (log_fd != -1)
-				close(log_fd);
+			workers_stop(conf);
+			if (log_state.active)
+				log_close();
 			if (log_socket != -1)
 				close(log_socket);
-			log_fd = log_socket = -1;
+			log_socket = -1;
 			reopen_flag = 0;
 		}
 		if (reconf_flag) {
 			logit(LOG_INFO, "reconfiguration requested");
+			workers_stop(conf);
+			if (num_workers == 1) {
+				/* The rules it refers to are about to go */
+				filter_index_free(workers[0].filters);
+				workers[0].filters = NULL;
+			}
+#ifdef HAVE_PTHREAD
+			pthread_mutex_lock(&stats_lock);
+#endif
 			if (client_reconfigure(monitor_fd, conf) == -1)
 				logerrx("reconfigure failed, exiting");
-			init_pfd(conf, &pfd, monitor_fd, &num_fds);
-			scrub_peers(conf, peers);
+			log_socket_batch = conf->log_socket_batch;
+			output_queues_resize(conf);
+			if (log_ring.hdr != NULL && (conf->log_ring == NULL ||
+			    strcmp(conf->log_ring, log_ring_path) != 0 ||
+			    conf->log_ring_size != log_ring.size))
+				stop_ring();
+			if (conf->workers != num_workers) {
+				logit(LOG_WARNING, "changing the number of "
+				    "workers (%u -> %u) requires a restart",
+				    num_workers, conf->workers);
+			}
+			for (n = 0; n < num_workers; n++) {
+				w = &workers[n];
+				flow_packet_pool_init(&w->pool,
+				    conf->packet_pool);
+				w->peers.max_peers = conf->max_peers;
+				w->peers.max_templates = conf->max_templates;
+				w->peers.max_sources = conf->max_sources;
+				w->peers.max_template_len =
+				    conf->max_template_len;
+				scrub_peers(conf, &w->peers);
+			}
+			if (num_workers == 1) {
+				workers[0].filters =
+				    filter_compile(&conf->filter_list);
+				init_pfd(conf, &workers[0], monitor_fd);
+			}
+#ifdef HAVE_PTHREAD
+			pthread_mutex_unlock(&stats_lock);
+#endif
 			reconf_flag = 0;
 		}
-		if (log_fd == -1 && conf->log_file != NULL)
-			log_fd = start_log(monitor_fd);
+		if (!log_state.active && conf->log_file != NULL)
+			log_open(conf, monitor_fd);
 		if (log_socket == -1 && conf->log_socket != NULL)
 			log_socket = start_socket(monitor_fd);
+		if (log_ring.hdr == NULL && conf->log_ring != NULL)
+			start_ring(conf, monitor_fd);
 
 		if (info_flag) {
 			struct filter_rule *fr;
 
 			info_flag = 0;
+			workers_stop(conf);
+			if (num_workers == 1)
+				filter_index_sync(workers[0].filters);
 			TAILQ_FOREACH(fr, &conf->filter_list, entry)
 				logit(LOG_INFO, "%s", format_rule(fr));
-			dump_peers(peers);
+			for (n = 0; n < num_workers; n++) {
+				dump_peers(&workers[n].peers);
+				flow_packet_pool_dump(&workers[n]);
+			}
+			output_stats_dump();
+			listen_stats_dump(conf);
+			forward_stats_dump(conf);
+		}
+
+		if (conf->template_cache != NULL &&
+		    time(NULL) >= template_cache_next) {
+			workers_stop(conf);
+			template_cache_save(conf, monitor_fd);
+		}
+
+#ifdef HAVE_PTHREAD
+		if (!workers_running)
+			workers_start(conf);
+#endif
+		if (num_workers == 1) {
+			/* Unless a writer thread is running, syncs are ours */
+			if (worker_poll(&workers[0], conf,
+			    template_cache_timeout(conf, workers_running ?
+			    INFTIM : log_sync_timeout())) == -1) {
+				logit(LOG_DEBUG, "%s: monitor closed",
+				    __func__);
+				break;
+			}
+			if (!workers_running)
+				log_sync_check();
+			continue;
 		}
 
-		i = poll(pfd, num_fds, INFTIM);
+#ifdef HAVE_PTHREAD
+		/* Workers collect; this thread writes what they hand over */
+		pfd[0].fd = monitor_fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = handoff.notify[0];
+		pfd[1].events = POLLIN;
+		i = poll(pfd, 2, template_cache_timeout(conf,
+		    log_sync_timeout()));
 		if (i <= 0) {
-			if (i == 0 || errno == EINTR)
+			if (i == 0 || errno == EINTR) {
+				log_sync_check();
 				continue;
+			}
 			logerr("%s: poll", __func__);
 		}
 
@@ -1789,17 +4777,24 @@ flowd_mainloop(struct flowd_config *conf, struct peers *peers, int monitor_fd)
 			break;
 		}
 
-		i = 1;
-		TAILQ_FOREACH(la, &conf->listen_addrs, entry) {
-			if ((pfd[i].revents & POLLIN) != 0)
-				receive_many(conf, peers, pfd[i].fd);
-			i++;
-		}
-
-		process_input_queue(conf, peers, log_fd, log_socket);
-		output_flow_flush(log_fd, conf->opts & FLOWD_OPT_VERBOSE);
+		/* Empty the pipe before the queue so no wakeup is lost */
+		while (read(handoff.notify[0], buf, sizeof(buf)) > 0)
+			;
+		pthread_mutex_lock(&handoff.lock);
+		output_drain_locked(conf->opts & FLOWD_OPT_VERBOSE);
+		pthread_mutex_unlock(&handoff.lock);
+#endif
 	}
 
+	aggr_flush_on_stop = 1;
+	workers_stop(conf);
+	if (log_state.active)
+		log_close();
+	stop_ring();
+	/* Not if the monitor has gone */
+	if (exit_flag != 0)
+		template_cache_save(conf, monitor_fd);
+
 	if (exit_flag != 0)
 		logit(LOG_NOTICE, "Exiting on signal %d", exit_flag);
 }
@@ -1811,7 +4806,7 @@ startup_listen_init(struct flowd_config *conf)
 
 	TAILQ_FOREACH(la, &conf->listen_addrs, entry) {
 		if ((la->fd = open_listener(&la->addr, la->port, la->bufsiz,
-		    &conf->join_groups)) == -1) {
+		    conf->opts, &conf->join_groups)) == -1) {
 			logerrx("Listener setup of [%s]:%d failed",
 			    addr_ntop_buf(&la->addr), la->port);
 		}
@@ -1832,6 +4827,16 @@ startup_forward_init(struct flowd_config *conf)
 	}
 }
 
+#ifdef HAVE_PTHREAD
+static void
+startup_stats_init(struct flowd_config *conf)
+{
+	if (conf->stats_socket != NULL &&
+	    (stats_fd = open_stats_socket(conf->stats_socket)) == -1)
+		logerrx("Stats socket setup of %s failed", conf->stats_socket);
+}
+#endif
+
 /* Display commandline usage information */
 static void
 usage(void)
@@ -1856,7 +4861,6 @@ main(int argc, char **argv)
 	const char *config_file = DEFAULT_CONFIG;
 	struct flowd_config conf;
 	int monitor_fd;
-	struct peers peers;
 
 #ifndef HAVE_SETPROCTITLE
 	compat_init_setproctitle(argc, &argv);
@@ -1870,13 +4874,6 @@ main(int argc, char **argv)
 	loginit(PROGNAME, 1, 0);
 
 	bzero(&conf, sizeof(conf));
-	bzero(&peers, sizeof(peers));
-	peers.max_peers = DEFAULT_MAX_PEERS;
-	peers.max_templates = DEFAULT_MAX_TEMPLATES;
-	peers.max_sources = DEFAULT_MAX_SOURCES;
-	peers.max_template_len = DEFAULT_MAX_TEMPLATE_LEN;
-	SPLAY_INIT(&peers.peer_tree);
-	TAILQ_INIT(&peers.peer_list);
 
 	while ((ch = getopt(argc, argv, "dghD:f:X:")) != -1) {
 		switch (ch) {
@@ -1922,6 +4919,11 @@ main(int argc, char **argv)
 	/* Start forwarding (same reason) */
 	startup_forward_init(&conf);
 
+#ifdef HAVE_PTHREAD
+	/* And the stats socket, which can't be made once chrooted */
+	startup_stats_init(&conf);
+#endif
+
 	/* Start the monitor - we continue as the unprivileged child */
 	privsep_init(&conf, &monitor_fd, config_file);
 
@@ -1934,7 +4936,7 @@ main(int argc, char **argv)
 	signal(SIGINFO, sighand_info);
 #endif
 
-	flowd_mainloop(&conf, &peers, monitor_fd);
+	flowd_mainloop(&conf, monitor_fd);
 
 	return (0);
 }
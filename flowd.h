@@ -28,6 +28,8 @@
 #include "sys-queue.h"
 #include "addr.h"
 #include "filter.h"
+#include "aggr.h"
+#include "ring.h"
 
 #ifndef PROGNAME
 #define PROGNAME			"flowd"
@@ -37,12 +39,61 @@
 #define DEFAULT_PIDFILE			PIDFILEDIR "/flowd.pid"
 #define PRIVSEP_USER			"_flowd"
 
-/* Initial stateholding limits */
-/* XXX these are not actually tunable yet */
+/* Default stateholding limits, and the largest that may be configured */
 #define DEFAULT_MAX_PEERS		128
 #define DEFAULT_MAX_TEMPLATES		8
 #define DEFAULT_MAX_TEMPLATE_LEN	1024
 #define DEFAULT_MAX_SOURCES		64
+#define LIMIT_MAX_PEERS			(1024*64)
+#define LIMIT_MAX_TEMPLATES		(1024*64)
+#define LIMIT_MAX_TEMPLATE_LEN		(1024*64)
+#define LIMIT_MAX_SOURCES		(1024*64)
+
+/* Log file preallocation (MB) and sync policy (MB written, ms elapsed) */
+#define LIMIT_LOG_PREALLOCATE		1024
+#define LIMIT_LOG_SYNC_MB		(1024*64)
+#define LIMIT_LOG_SYNC_MS		(1000*3600)
+
+/* Longest logfile rotation interval, in seconds */
+#define LIMIT_LOG_ROTATE		(3600*24)
+
+/* Logfile index granularity, in flows or seconds per entry */
+#define LIMIT_LOG_INDEX_FLOWS		(1024*1024*64)
+#define LIMIT_LOG_INDEX_SECS		(3600*24)
+
+/* Logfile compression level (zlib's) */
+#define DEFAULT_LOG_COMPRESS		6
+#define LIMIT_LOG_COMPRESS		9
+
+/* Expanded to the flow's tag in logfile names, splitting logs by tag */
+#define LOGFILE_TAG_ESCAPE		"%{tag}"
+
+/* Log socket datagram size when batching flows, and its upper bound */
+#define DEFAULT_LOGSOCK_BATCH		8192
+#define LIMIT_LOGSOCK_BATCH		(1024*64)
+
+/* Output queue size and flush thresholds (KB queued, ms since queued) */
+#define DEFAULT_OUTPUT_QUEUE_KB		512
+#define MIN_OUTPUT_QUEUE_KB		64
+#define LIMIT_OUTPUT_QUEUE_KB		(1024*64)
+#define LIMIT_OUTPUT_FLUSH_MS		(1000*60)
+
+/* Template cache save interval and the oldest template loaded (secs) */
+#define DEFAULT_TEMPLATE_CACHE_SECS	300
+#define LIMIT_TEMPLATE_CACHE_SECS	(3600*24)
+#define DEFAULT_TEMPLATE_CACHE_AGE	3600
+#define LIMIT_TEMPLATE_CACHE_AGE	(3600*24*7)
+
+/* Number of datagrams to pull from a socket per receive call */
+#define DEFAULT_RECV_BATCH		32
+#define MAX_RECV_BATCH			512
+
+/* Number of preallocated packet receive buffers */
+#define DEFAULT_PACKET_POOL		1024
+#define MAX_PACKET_POOL			(1024*64)
+
+/* Collector threads, each with its own SO_REUSEPORT listeners */
+#define MAX_WORKERS			64
 
 struct allowed_device {
 	struct xaddr			addr;
@@ -56,6 +107,12 @@ struct listen_addr {
 	u_int16_t			port;
 	int				fd;
 	size_t				bufsiz;
+	u_int				worker;
+	/* Only counted by the worker that reads fd */
+	u_int64_t			datagrams;
+	u_int64_t			bytes;
+	u_int64_t			kernel_drops;	/* SO_RXQ_OVFL */
+	u_int32_t			rxq_ovfl;	/* last total seen */
 	TAILQ_ENTRY(listen_addr)	entry;
 };
 TAILQ_HEAD(listen_addrs, listen_addr);
@@ -72,6 +129,10 @@ struct forward_addr {
 	u_int16_t	port;
 	int			fd;
 	size_t		bufsiz;
+	int			filtered;	/* only packets with accepted flows */
+	int			failing;	/* dropping since last warning */
+	u_int64_t	packets;
+	u_int64_t	dropped;
 	TAILQ_ENTRY(forward_addr) entry;
 };
 TAILQ_HEAD(forward_addrs, forward_addr);
@@ -79,13 +140,42 @@ TAILQ_HEAD(forward_addrs, forward_addr);
 #define FLOWD_OPT_DONT_FORK		(1)
 #define FLOWD_OPT_VERBOSE		(1<<1)
 #define FLOWD_OPT_INSECURE		(1<<2)
+#define FLOWD_OPT_RECV_TIMESTAMP	(1<<3)
+#define FLOWD_OPT_REUSEPORT		(1<<4)
+#define FLOWD_OPT_FORWARD_THREAD	(1<<5)
 struct flowd_config {
 	char			*log_file;
 	char			*log_socket;
 	size_t			log_socket_bufsiz;
+	size_t			log_socket_batch;	/* 0 for no batching */
 	char			*pid_file;
+	char			*stats_socket;
+	char			*template_cache;
+	char			*log_ring;
 	u_int32_t		store_mask;
 	u_int32_t		opts;
+	u_int			recv_batch;
+	u_int			packet_pool;
+	u_int			workers;
+	u_int			max_peers;
+	u_int			max_templates;
+	u_int			max_template_len;
+	u_int			max_sources;
+	u_int			log_prealloc_mb;
+	u_int			log_sync_mb;
+	u_int			log_sync_ms;
+	u_int			log_rotate;
+	u_int			log_index_flows;
+	u_int			log_index_secs;
+	u_int			store_version;	/* 0 for the default */
+	u_int			log_compress;	/* level, or 0 for none */
+	u_int			output_queue_kb;
+	u_int			output_flush_kb;	/* 0 for every wakeup */
+	u_int			output_flush_ms;
+	u_int			template_cache_secs;
+	u_int			template_cache_age;
+	u_int			log_ring_size;
+	struct aggr_params	aggr;
 	struct listen_addrs	listen_addrs;
 	struct forward_addrs forward_addrs;
 	struct filter_list	filter_list;
@@ -142,7 +142,9 @@ fi
 %attr(0644,root,root) %{_mandir}/man5/flowd.conf.5*
 %attr(0644,root,root) %{_mandir}/man8/flowd.8*
 %attr(0644,root,root) %{_mandir}/man8/flowd-reader.8*
+%attr(0644,root,root) %{_mandir}/man8/flow-send.8*
 %attr(0755,root,root) %{_bindir}/flowd-reader
+%attr(0755,root,root) %{_bindir}/flow-send
 %attr(0755,root,root) %config /etc/rc.d/init.d/flowd
 %attr(0755,root,root) %{_sbindir}/flowd
 
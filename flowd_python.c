@@ -17,7 +17,17 @@
 #include "Python.h"
 #include "flowd-common.h"
 #include "structmember.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
 #include "store.h"
+#include "ring.h"
 #include "flowd-pytypes.h"
 
 /* $Id$ */
@@ -440,15 +450,198 @@ static PyTypeObject Flow_Type = {
 typedef struct _FlowLogObject {
 	PyObject_HEAD
 	PyObject *flowlog; /* PyFile */
+	struct store_iter it; /* reads bypass the PyFile's buffering */
+	int it_open;
+	int timed; /* only return flows received from start to end */
+	u_int32_t start, end;
 } FlowLogObject;
 
 static PyTypeObject FlowLog_Type;
 
+static void
+flowlog_init(FlowLogObject *self)
+{
+	self->it_open = 0;
+	self->timed = 0;
+	self->start = 0;
+	self->end = 0xffffffff;
+}
+
+/* Start reading where the file object is positioned */
+static int
+flowlog_open_iter(FlowLogObject *self, char *ebuf, int elen)
+{
+	FILE *f = PyFile_AsFile(self->flowlog);
+	int r;
+
+	if (self->it_open)
+		return (STORE_ERR_OK);
+	fflush(f);
+	if ((r = store_iter_open(&self->it, fileno(f),
+	    ebuf, elen)) != STORE_ERR_OK)
+		return (r);
+	self->it_open = 1;
+	return (STORE_ERR_OK);
+}
+
+/*
+ * Read the next flow that has all the fields in mask, honouring any range
+ * set by seek_time()
+ */
+static int
+flowlog_next(FlowLogObject *self, struct store_flow_complete *flow,
+    u_int32_t mask, char *ebuf, int elen)
+{
+	struct store_flow hdr;
+	u_int32_t recv_sec;
+	u_int8_t *rec;
+	int r, len;
+
+	if ((r = flowlog_open_iter(self, ebuf, elen)) != STORE_ERR_OK)
+		return (r);
+	for (;;) {
+		if ((r = store_iter_next_raw(&self->it, &rec, &len,
+		    ebuf, elen)) != STORE_ERR_OK)
+			return (r);
+		memcpy(&hdr, rec, sizeof(hdr));
+		if ((ntohl(hdr.fields) & mask) != mask)
+			continue;
+		if (!self->timed || (store_raw_recv_time(rec, &recv_sec) &&
+		    recv_sec >= self->start && recv_sec <= self->end))
+			return (store_flow_deserialise(rec, len, flow,
+			    ebuf, elen));
+	}
+}
+
+/* Columns returned by FlowLog.read_columns(), in host byte order */
+#define COL_U8		0
+#define COL_U16		1
+#define COL_U32		2
+#define COL_U64		3
+#define COL_AF		4	/* of an xaddr: 4, 6 or 0 if absent */
+#define COL_ADDR4	5	/* 4 bytes, zero unless AF_INET */
+#define COL_ADDR6	6	/* 16 bytes, zero unless AF_INET6 */
+
+#define COL(name, kind, format, member) \
+	{ name, kind, format, offsetof(struct store_flow_complete, member) }
+static const struct flowlog_column {
+	const char *name;
+	int kind;
+	const char *format;	/* for the struct module */
+	size_t offset;
+} flowlog_columns[] = {
+	COL("fields",		COL_U32,	"I",	hdr.fields),
+	COL("tag",		COL_U32,	"I",	tag.tag),
+	COL("recv_sec",		COL_U32,	"I",	recv_time.recv_sec),
+	COL("recv_usec",	COL_U32,	"I",	recv_time.recv_usec),
+	COL("tcp_flags",	COL_U8,		"B",	pft.tcp_flags),
+	COL("protocol",		COL_U8,		"B",	pft.protocol),
+	COL("tos",		COL_U8,		"B",	pft.tos),
+	COL("agent_addr_af",	COL_AF,		"B",	agent_addr),
+	COL("agent_addr4",	COL_ADDR4,	"4s",	agent_addr),
+	COL("agent_addr6",	COL_ADDR6,	"16s",	agent_addr),
+	COL("src_addr_af",	COL_AF,		"B",	src_addr),
+	COL("src_addr4",	COL_ADDR4,	"4s",	src_addr),
+	COL("src_addr6",	COL_ADDR6,	"16s",	src_addr),
+	COL("dst_addr_af",	COL_AF,		"B",	dst_addr),
+	COL("dst_addr4",	COL_ADDR4,	"4s",	dst_addr),
+	COL("dst_addr6",	COL_ADDR6,	"16s",	dst_addr),
+	COL("gateway_addr_af",	COL_AF,		"B",	gateway_addr),
+	COL("gateway_addr4",	COL_ADDR4,	"4s",	gateway_addr),
+	COL("gateway_addr6",	COL_ADDR6,	"16s",	gateway_addr),
+	COL("src_port",		COL_U16,	"H",	ports.src_port),
+	COL("dst_port",		COL_U16,	"H",	ports.dst_port),
+	COL("packets",		COL_U64,	"Q",	packets.flow_packets),
+	COL("octets",		COL_U64,	"Q",	octets.flow_octets),
+	COL("if_ndx_in",	COL_U32,	"I",	ifndx.if_index_in),
+	COL("if_ndx_out",	COL_U32,	"I",	ifndx.if_index_out),
+	COL("flow_start",	COL_U32,	"I",	ftimes.flow_start),
+	COL("flow_finish",	COL_U32,	"I",	ftimes.flow_finish),
+	COL("src_as",		COL_U32,	"I",	asinf.src_as),
+	COL("dst_as",		COL_U32,	"I",	asinf.dst_as),
+	COL("src_mask",		COL_U8,		"B",	asinf.src_mask),
+	COL("dst_mask",		COL_U8,		"B",	asinf.dst_mask),
+	{ NULL }
+};
+#undef COL
+#define NUM_COLUMNS \
+	(sizeof(flowlog_columns) / sizeof(*flowlog_columns) - 1)
+
+static size_t
+column_width(const struct flowlog_column *c)
+{
+	switch (c->kind) {
+	case COL_U16:
+		return (2);
+	case COL_U32:
+	case COL_ADDR4:
+		return (4);
+	case COL_U64:
+		return (8);
+	case COL_ADDR6:
+		return (16);
+	default:
+		return (1);
+	}
+}
+
+/* Append a flow's value for a column to its buffer */
+static void
+column_put(const struct flowlog_column *c,
+    const struct store_flow_complete *flow, u_int8_t *p)
+{
+	const u_int8_t *v = (const u_int8_t *)flow + c->offset;
+	struct xaddr addr;
+	u_int16_t v16;
+	u_int32_t v32;
+	u_int64_t v64;
+
+	switch (c->kind) {
+	case COL_U8:
+		*p = *v;
+		break;
+	case COL_U16:
+		memcpy(&v16, v, sizeof(v16));
+		v16 = ntohs(v16);
+		memcpy(p, &v16, sizeof(v16));
+		break;
+	case COL_U32:
+		memcpy(&v32, v, sizeof(v32));
+		v32 = ntohl(v32);
+		memcpy(p, &v32, sizeof(v32));
+		break;
+	case COL_U64:
+		memcpy(&v64, v, sizeof(v64));
+		v64 = store_ntohll(v64);
+		memcpy(p, &v64, sizeof(v64));
+		break;
+	default:
+		memcpy(&addr, v, sizeof(addr));
+		if (c->kind == COL_AF) {
+			*p = addr.af == AF_INET ? 4 :
+			    (addr.af == AF_INET6 ? 6 : 0);
+		} else if (c->kind == COL_ADDR4) {
+			if (addr.af == AF_INET)
+				memcpy(p, &addr.v4, 4);
+			else
+				memset(p, 0, 4);
+		} else {
+			if (addr.af == AF_INET6)
+				memcpy(p, &addr.v6, 16);
+			else
+				memset(p, 0, 16);
+		}
+		break;
+	}
+}
+
 /* FlowLog methods */
 
 static void
 FlowLog_dealloc(FlowLogObject *self)
 {
+	if (self->it_open)
+		store_iter_close(&self->it);
 	Py_XDECREF(self->flowlog);
 	PyObject_Del(self);
 }
@@ -465,8 +658,7 @@ FlowLog_read_flow(FlowLogObject *self)
 	struct store_flow_complete flow;
 	char ebuf[512];
 
-	switch (store_read_flow(PyFile_AsFile(self->flowlog), &flow, 
-	    ebuf, sizeof(ebuf))) {
+	switch (flowlog_next(self, &flow, 0, ebuf, sizeof(ebuf))) {
 	case STORE_ERR_OK:
 		return (PyObject *)newFlowObject_from_flow(&flow);
 	case STORE_ERR_EOF:
@@ -515,6 +707,174 @@ FlowLog_write_flow(FlowLogObject *self, PyObject *args, PyObject *kw_args)
 	return Py_None;
 }
 
+PyDoc_STRVAR(FlowLog_seek_time_doc,
+"FlowLog.seek_time(start = 0, end = 0xffffffff) -> None\n\
+\n\
+Restricts subsequent reads to flows received between start and end\n\
+(inclusive, in seconds since the epoch). If the log has an index it is\n\
+used to skip directly to the part of the log holding those flows.\n\
+");
+
+static PyObject *
+FlowLog_seek_time(FlowLogObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "start", "end", NULL };
+	unsigned long start = 0, end = 0xffffffff;
+	char ipath[1024], ebuf[512];
+	off_t from, to;
+	struct stat sb;
+	int ifd, r;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|kk:seek_time",
+	    keywords, &start, &end))
+		return NULL;
+	if (start > 0xffffffff || end > 0xffffffff || start > end) {
+		PyErr_SetString(PyExc_ValueError, "Invalid time range");
+		return (NULL);
+	}
+	self->timed = 1;
+	self->start = start;
+	self->end = end;
+	if (flowlog_open_iter(self, ebuf, sizeof(ebuf)) != STORE_ERR_OK) {
+		PyErr_SetString(PyExc_ValueError, ebuf);
+		return (NULL);
+	}
+
+	if (snprintf(ipath, sizeof(ipath), "%s%s",
+	    PyString_AsString(PyFile_Name(self->flowlog)),
+	    STORE_INDEX_SUFFIX) >= (int)sizeof(ipath) ||
+	    (ifd = open(ipath, O_RDONLY)) == -1)
+		goto out;
+	if (fstat(self->it.fd, &sb) == -1) {
+		close(ifd);
+		return PyErr_SetFromErrno(PyExc_OSError);
+	}
+	r = store_index_find(ifd, sb.st_size, start, end, &from, &to,
+	    ebuf, sizeof(ebuf));
+	close(ifd);
+	if (r != STORE_ERR_OK) {
+		PyErr_SetString(PyExc_ValueError, ebuf);
+		return (NULL);
+	}
+	if (store_iter_seek(&self->it, from, to,
+	    ebuf, sizeof(ebuf)) != STORE_ERR_OK) {
+		PyErr_SetString(PyExc_ValueError, ebuf);
+		return (NULL);
+	}
+ out:
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+PyDoc_STRVAR(FlowLog_read_columns_doc,
+"FlowLog.read_columns(count = 4096, mask = 0, columns = None) -> (n, dict)\n\
+\n\
+Reads up to count flows that have all the fields in mask, returning the\n\
+number read and a dict mapping column names to bytearrays holding one\n\
+value per flow, in host byte order. The columns and their struct module\n\
+formats are listed in flowd.COLUMNS; by default all are returned, or\n\
+just those named in the columns sequence. Fields a flow lacks are zero,\n\
+addresses are given as 4 byte (IPv4) and 16 byte (IPv6) columns, either\n\
+of which is zero for a flow of the other family. Returns None at the\n\
+end of the log.\n\
+");
+
+static PyObject *
+FlowLog_read_columns(FlowLogObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "count", "mask", "columns", NULL };
+	const struct flowlog_column *sel[NUM_COLUMNS];
+	PyObject *bufs[NUM_COLUMNS], *want = NULL, *seq, *ret = NULL;
+	struct store_flow_complete flow;
+	unsigned long count = 4096, mask = 0, n;
+	size_t width[NUM_COLUMNS];
+	char ebuf[512];
+	const char *name;
+	int i, j, ncols, r;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|kkO:read_columns",
+	    keywords, &count, &mask, &want))
+		return NULL;
+	if (count == 0 || count > 1024 * 1024 * 16) {
+		PyErr_SetString(PyExc_ValueError, "Invalid count");
+		return (NULL);
+	}
+
+	ncols = 0;
+	if (want == NULL || want == Py_None) {
+		for (; flowlog_columns[ncols].name != NULL; ncols++)
+			sel[ncols] = &flowlog_columns[ncols];
+	} else {
+		if ((seq = PySequence_Fast(want, "columns must be a "
+		    "sequence")) == NULL)
+			return (NULL);
+		for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+			name = PyString_AsString(
+			    PySequence_Fast_GET_ITEM(seq, i));
+			if (name == NULL) {
+				Py_DECREF(seq);
+				return (NULL);
+			}
+			for (j = 0; flowlog_columns[j].name != NULL; j++) {
+				if (strcmp(name, flowlog_columns[j].name) == 0)
+					break;
+			}
+			if (flowlog_columns[j].name == NULL) {
+				PyErr_Format(PyExc_KeyError,
+				    "Unknown column \"%s\"", name);
+				Py_DECREF(seq);
+				return (NULL);
+			}
+			if (ncols < (int)NUM_COLUMNS)
+				sel[ncols++] = &flowlog_columns[j];
+		}
+		Py_DECREF(seq);
+	}
+
+	for (i = 0; i < ncols; i++) {
+		width[i] = column_width(sel[i]);
+		bufs[i] = PyByteArray_FromStringAndSize(NULL,
+		    count * width[i]);
+		if (bufs[i] == NULL)
+			goto out;
+	}
+
+	for (n = 0; n < count; n++) {
+		r = flowlog_next(self, &flow, mask, ebuf, sizeof(ebuf));
+		if (r == STORE_ERR_EOF)
+			break;
+		if (r != STORE_ERR_OK) {
+			PyErr_SetString(PyExc_ValueError, ebuf);
+			goto out;
+		}
+		for (j = 0; j < ncols; j++) {
+			column_put(sel[j], &flow, (u_int8_t *)
+			    PyByteArray_AS_STRING(bufs[j]) + n * width[j]);
+		}
+	}
+	if (n == 0) {
+		Py_INCREF(Py_None);
+		ret = Py_None;
+		goto out;
+	}
+
+	if ((ret = PyDict_New()) == NULL)
+		goto out;
+	for (j = 0; j < ncols; j++) {
+		if (PyByteArray_Resize(bufs[j], n * width[j]) == -1 ||
+		    PyDict_SetItemString(ret, sel[j]->name, bufs[j]) == -1) {
+			Py_DECREF(ret);
+			ret = NULL;
+			goto out;
+		}
+	}
+	ret = Py_BuildValue("(kN)", n, ret);
+ out:
+	while (--i >= 0)
+		Py_DECREF(bufs[i]);
+	return (ret);
+}
+
 static PyObject *
 FlowLog_getiter(FlowLogObject *self)
 {
@@ -531,6 +891,8 @@ PyDoc_STRVAR(FlowLog_doc, "NetFlow log");
 static PyMethodDef FlowLog_methods[] = {
 	{"read_flow",	(PyCFunction)FlowLog_read_flow,	0,				FlowLog_read_flow_doc	},
 	{"write_flow",	(PyCFunction)FlowLog_write_flow,METH_VARARGS|METH_KEYWORDS,	FlowLog_write_flow_doc	},
+	{"seek_time",	(PyCFunction)FlowLog_seek_time,METH_VARARGS|METH_KEYWORDS,	FlowLog_seek_time_doc	},
+	{"read_columns",(PyCFunction)FlowLog_read_columns,METH_VARARGS|METH_KEYWORDS,	FlowLog_read_columns_doc},
 	{NULL,		NULL}		/* sentinel */
 };
 
@@ -622,8 +984,7 @@ FlowLogIter_iternext(FlowLogIterObject *self)
 	struct store_flow_complete flow;
 	char ebuf[512];
 
-	switch (store_read_flow(PyFile_AsFile(self->parent->flowlog), &flow, 
-	    ebuf, sizeof(ebuf))) {
+	switch (flowlog_next(self->parent, &flow, 0, ebuf, sizeof(ebuf))) {
 	case STORE_ERR_OK:
 		return (PyObject *)newFlowObject_from_flow(&flow);
 	case STORE_ERR_EOF:
@@ -687,6 +1048,232 @@ static PyTypeObject FlowLogIter_Type = {
 
 /* ------------------------------------------------------------------------ */
 
+/* FlowRing: follows a flowd "logring" */
+
+#define FLOWRING_BUFLEN		65536
+
+typedef struct {
+	PyObject_HEAD
+	struct ring_reader r;
+	int closed;	/* flowd has closed the ring and it has been read */
+} FlowRingObject;
+
+static PyTypeObject FlowRing_Type;
+
+/* FlowRing methods */
+
+static void
+FlowRing_dealloc(FlowRingObject *self)
+{
+	ring_reader_close(&self->r);
+	PyObject_Del(self);
+}
+
+/*
+ * Read what has been written since the last call, if need be waiting up
+ * to wait seconds for something to be. Returns a new string of flow records,
+ * None once the ring has closed, or NULL with an exception set.
+ */
+static PyObject *
+flowring_read(FlowRingObject *self, double wait)
+{
+	PyObject *blob;
+	size_t got;
+	int r, waited, wait_ms;
+
+	if (self->closed) {
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	if ((blob = PyString_FromStringAndSize(NULL, FLOWRING_BUFLEN)) == NULL)
+		return (NULL);
+	wait_ms = wait > 0 ? (int)(wait * 1000) : 0;
+	for (waited = 0;;) {
+		r = ring_read(&self->r, (u_int8_t *)PyString_AS_STRING(blob),
+		    FLOWRING_BUFLEN, &got);
+		if (r == RING_ERR_OVERRUN)
+			continue;	/* counted, carry on from the newest */
+		if (r == RING_ERR_CLOSED) {
+			self->closed = 1;
+			Py_DECREF(blob);
+			Py_INCREF(Py_None);
+			return Py_None;
+		}
+		if (r != RING_ERR_OK) {
+			PyErr_SetString(PyExc_ValueError, "Bad flow ring record");
+			Py_DECREF(blob);
+			return (NULL);
+		}
+		if (got > 0 || waited >= wait_ms)
+			break;
+		Py_BEGIN_ALLOW_THREADS
+		poll(NULL, 0, MIN(50, wait_ms - waited));
+		Py_END_ALLOW_THREADS
+		waited += 50;
+		if (PyErr_CheckSignals() == -1) {
+			Py_DECREF(blob);
+			return (NULL);
+		}
+	}
+	if (_PyString_Resize(&blob, got) == -1)
+		return (NULL);
+	return (blob);
+}
+
+PyDoc_STRVAR(FlowRing_read_doc,
+"FlowRing.read(wait = 0) -> List of Flow objects\n\
+\n\
+Returns the flows written to the ring since the last read, or since it\n\
+was opened, waiting up to wait seconds for some if there are none.\n\
+The list may be empty. Returns None once flowd has closed the ring and\n\
+everything in it has been read. If the reader fell so far behind that\n\
+flows it had not read were overwritten, reading continues from the\n\
+newest and the overruns and lost attributes count what was missed.\n\
+");
+
+static PyObject *
+FlowRing_read(FlowRingObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "wait", NULL };
+	struct store_flow *hdr;
+	PyObject *blob, *list;
+	FlowObject *flow;
+	u_int8_t *buf;
+	double wait = 0;
+	int buflen, off, len;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|d:read", keywords,
+	    &wait))
+		return NULL;
+	if ((blob = flowring_read(self, wait)) == NULL || blob == Py_None)
+		return (blob);
+	if ((list = PyList_New(0)) == NULL)
+		goto out;
+	buf = (u_int8_t *)PyString_AS_STRING(blob);
+	buflen = PyString_GET_SIZE(blob);
+	/* ring_read only returns whole records */
+	for (off = 0; off < buflen; off += len) {
+		hdr = (struct store_flow *)(buf + off);
+		len = sizeof(*hdr) + hdr->len_words * 4;
+		if ((flow = newFlowObject_from_blob(buf + off, len)) == NULL ||
+		    PyList_Append(list, (PyObject *)flow) == -1) {
+			Py_XDECREF(flow);
+			Py_DECREF(list);
+			list = NULL;
+			goto out;
+		}
+		Py_DECREF(flow);
+	}
+ out:
+	Py_DECREF(blob);
+	return (list);
+}
+
+PyDoc_STRVAR(FlowRing_read_raw_doc,
+"FlowRing.read_raw(wait = 0) -> String\n\
+\n\
+As read(), but returns the flow records undecoded, as a string that\n\
+may be passed to flowd.Flows().\n\
+");
+
+static PyObject *
+FlowRing_read_raw(FlowRingObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "wait", NULL };
+	double wait = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "|d:read_raw",
+	    keywords, &wait))
+		return NULL;
+	return (flowring_read(self, wait));
+}
+
+static PyObject *
+FlowRing_get_counter(FlowRingObject *self, void *which)
+{
+	u_int64_t v;
+
+	switch ((long)which) {
+	case 0:
+		v = self->r.flows;
+		break;
+	case 1:
+		v = self->r.overruns;
+		break;
+	default:
+		v = self->r.lost;
+		break;
+	}
+	return PyLong_FromUnsignedLongLong(v);
+}
+
+static PyGetSetDef FlowRing_getset[] = {
+	{"flows",	(getter)FlowRing_get_counter, NULL,
+	    "Flows read", (void *)0 },
+	{"overruns",	(getter)FlowRing_get_counter, NULL,
+	    "Times the reader was overrun", (void *)1 },
+	{"lost",	(getter)FlowRing_get_counter, NULL,
+	    "Flows overwritten before they were read", (void *)2 },
+	{NULL}
+};
+
+PyDoc_STRVAR(FlowRing_doc, "Reader of a flowd flow ring");
+
+static PyMethodDef FlowRing_methods[] = {
+	{"read",	(PyCFunction)FlowRing_read,	METH_VARARGS|METH_KEYWORDS,	FlowRing_read_doc	},
+	{"read_raw",	(PyCFunction)FlowRing_read_raw,	METH_VARARGS|METH_KEYWORDS,	FlowRing_read_raw_doc	},
+	{NULL,		NULL}		/* sentinel */
+};
+
+static PyTypeObject FlowRing_Type = {
+	/* The ob_type field must be initialized in the module init function
+	 * to be portable to Windows without using C++. */
+	PyObject_HEAD_INIT(NULL)
+	0,			/*ob_size*/
+	"flowd.FlowRing",	/*tp_name*/
+	sizeof(FlowRingObject),	/*tp_basicsize*/
+	0,			/*tp_itemsize*/
+	/* methods */
+	(destructor)FlowRing_dealloc, /*tp_dealloc*/
+	0,			/*tp_print*/
+	0,			/*tp_getattr*/
+	0,			/*tp_setattr*/
+	0,			/*tp_compare*/
+	0,			/*tp_repr*/
+	0,			/*tp_as_number*/
+	0,			/*tp_as_sequence*/
+	0,			/*tp_as_mapping*/
+	0,			/*tp_hash*/
+	0,			/*tp_call*/
+	0,			/*tp_str*/
+	0,			/*tp_getattro*/
+	0,			/*tp_setattro*/
+	0,			/*tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT,	/*tp_flags*/
+	FlowRing_doc,		/*tp_doc*/
+	0,			/*tp_traverse*/
+	0,			/*tp_clear*/
+	0,			/*tp_richcompare*/
+	0,			/*tp_weaklistoffset*/
+	0,			/*tp_iter*/
+	0,			/*tp_iternext*/
+	FlowRing_methods,	/*tp_methods*/
+	0,			/*tp_members*/
+	FlowRing_getset,	/*tp_getset*/
+	0,			/*tp_base*/
+	0,			/*tp_dict*/
+	0,			/*tp_descr_get*/
+	0,			/*tp_descr_set*/
+	0,			/*tp_dictoffset*/
+	0,			/*tp_init*/
+	0,			/*tp_alloc*/
+	0,			/*tp_new*/
+	0,			/*tp_free*/
+	0,			/*tp_is_gc*/
+};
+
+/* ------------------------------------------------------------------------ */
+
 PyDoc_STRVAR(flow_Flow_doc,
 "Flow(blob = None) -> new Flow object\n\
 \n\
@@ -714,6 +1301,49 @@ flow_Flow(PyObject *self, PyObject *args, PyObject *kw_args)
 	return (PyObject *)rv;
 }
 
+PyDoc_STRVAR(flow_Flows_doc,
+"Flows(blob) -> List of Flow objects\n\
+\n\
+Unpack a string of one or more consecutive binary flow records, such as\n\
+a datagram received from a batching flowd log socket, into Flow objects.");
+
+static PyObject *
+flow_Flows(PyObject *self, PyObject *args, PyObject *kw_args)
+{
+	static char *keywords[] = { "blob", NULL };
+	struct store_flow *hdr;
+	PyObject *list;
+	FlowObject *flow;
+	u_int8_t *blob;
+	int bloblen, off, len;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "s#:Flows", keywords,
+	    &blob, &bloblen))
+		return NULL;
+	if ((list = PyList_New(0)) == NULL)
+		return NULL;
+	for (off = 0; off < bloblen; off += len) {
+		hdr = (struct store_flow *)(blob + off);
+		if (bloblen - off < (int)sizeof(*hdr) ||
+		    (len = sizeof(*hdr) + hdr->len_words * 4) > bloblen - off) {
+			PyErr_SetString(PyExc_ValueError,
+			    "Truncated flow record");
+			goto fail;
+		}
+		if ((flow = newFlowObject_from_blob(blob + off, len)) == NULL)
+			goto fail;
+		if (PyList_Append(list, (PyObject *)flow) == -1) {
+			Py_DECREF(flow);
+			goto fail;
+		}
+		Py_DECREF(flow);
+	}
+	return list;
+ fail:
+	Py_DECREF(list);
+	return NULL;
+}
+
 PyDoc_STRVAR(flow_FlowLog_doc,
 "FlowLog(path, mode = \"rb\") -> new FlowLog object\n\
 \n\
@@ -732,6 +1362,7 @@ flow_FlowLog(PyObject *self, PyObject *args, PyObject *kw_args)
 		return NULL;
 	if ((rv = PyObject_New(FlowLogObject, &FlowLog_Type)) == NULL)
 		return (NULL);
+	flowlog_init(rv);
 	if ((rv->flowlog = PyFile_FromString(path, mode)) == NULL)
 		return (NULL);
 	PyFile_SetBufSize(rv->flowlog, 8192);
@@ -757,6 +1388,7 @@ flow_FlowLog_fromfile(PyObject *self, PyObject *args, PyObject *kw_args)
 		return NULL;
 	if ((rv = PyObject_New(FlowLogObject, &FlowLog_Type)) == NULL)
 		return (NULL);
+	flowlog_init(rv);
 	Py_INCREF(file);
 	rv->flowlog = file;
 	PyFile_SetBufSize(rv->flowlog, 8192);
@@ -764,6 +1396,36 @@ flow_FlowLog_fromfile(PyObject *self, PyObject *args, PyObject *kw_args)
 	return (PyObject *)rv;
 }
 
+PyDoc_STRVAR(flow_FlowRing_doc,
+"FlowRing(path) -> new FlowRing object\n\
+\n\
+Open a flowd flow ring (see \"logring\" in flowd.conf(5)) by path.\n\
+Reading starts with the next flow written to it.\n\
+");
+
+static PyObject *
+flow_FlowRing(PyObject *self, PyObject *args, PyObject *kw_args)
+{
+	FlowRingObject *rv;
+	static char *keywords[] = { "path", NULL };
+	char *path = NULL, ebuf[512];
+
+	if (!PyArg_ParseTupleAndKeywords(args, kw_args, "s:FlowRing", keywords,
+	    &path))
+		return NULL;
+	if ((rv = PyObject_New(FlowRingObject, &FlowRing_Type)) == NULL)
+		return (NULL);
+	rv->closed = 0;
+	if (ring_reader_open(&rv->r, path, ebuf,
+	    sizeof(ebuf)) != RING_ERR_OK) {
+		Py_DECREF(rv);
+		PyErr_SetString(PyExc_IOError, ebuf);
+		return (NULL);
+	}
+
+	return (PyObject *)rv;
+}
+
 PyDoc_STRVAR(flow_iso_time_doc,
 "iso_time(time, utc_flag = 0) -> String\n\
 \n\
@@ -806,8 +1468,10 @@ flow_interval_time(PyObject *self, PyObject *args, PyObject *kw_args)
 
 static PyMethodDef flowd_methods[] = {
 	{"Flow",	(PyCFunction)flow_Flow,    METH_VARARGS|METH_KEYWORDS,	flow_Flow_doc	},
+	{"Flows",	(PyCFunction)flow_Flows,   METH_VARARGS|METH_KEYWORDS,	flow_Flows_doc	},
 	{"FlowLog",	(PyCFunction)flow_FlowLog, METH_VARARGS|METH_KEYWORDS,	flow_FlowLog_doc },
 	{"FlowLog_fromfile",(PyCFunction)flow_FlowLog_fromfile, METH_VARARGS|METH_KEYWORDS,	flow_FlowLog_fromfile_doc },
+	{"FlowRing",	(PyCFunction)flow_FlowRing, METH_VARARGS|METH_KEYWORDS,	flow_FlowRing_doc },
 	{"iso_time",	(PyCFunction)flow_iso_time, METH_VARARGS|METH_KEYWORDS,	flow_iso_time_doc },
 	{"interval_time",(PyCFunction)flow_interval_time, METH_VARARGS|METH_KEYWORDS,	flow_interval_time_doc },
 	{NULL,		NULL}		/* sentinel */
@@ -820,12 +1484,15 @@ PyDoc_STRVAR(module_doc,
 PyMODINIT_FUNC
 initflowd(void)
 {
-	PyObject *m;
+	PyObject *m, *columns, *v;
+	int i;
 
 	if (PyType_Ready(&Flow_Type) < 0)
 		return;
 	if (PyType_Ready(&FlowLog_Type) < 0)
 		return;
+	if (PyType_Ready(&FlowRing_Type) < 0)
+		return;
 	m = Py_InitModule3("flowd", flowd_methods, module_doc);
 
 #define STORE_CONST(c) \
@@ -867,6 +1534,18 @@ initflowd(void)
 	STORE_CONST2(VERSION);
 #undef STORE_CONST2
 
+	if ((columns = PyDict_New()) != NULL) {
+		for (i = 0; flowlog_columns[i].name != NULL; i++) {
+			v = PyString_FromString(flowlog_columns[i].format);
+			if (v == NULL)
+				break;
+			PyDict_SetItemString(columns, flowlog_columns[i].name,
+			    v);
+			Py_DECREF(v);
+		}
+		PyModule_AddObject(m, "COLUMNS", columns);
+	}
+
 	PyModule_AddStringConstant(m, "__version__", PROGVER);
 }
 
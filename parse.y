@@ -102,13 +102,18 @@ static const char *longdays[7] = {
 
 %}
 
-%token	LISTEN ON JOIN GROUP LOGFILE LOGSOCK BUFSIZE STORE PIDFILE FLOW SOURCE
+%token	LISTEN ON JOIN GROUP LOGFILE LOGSOCK LOGRING BUFSIZE STORE PIDFILE FLOW SOURCE
 %token	ALL TAG ACCEPT DISCARD QUICK AGENT SRC DST PORT PROTO TOS ANY FORWARD TO
 %token	TCP_FLAGS EQUALS MASK INET INET6 DAYS AFTER BEFORE DATE
 %token  IN_IFNDX OUT_IFNDX
+%token	RECEIVE BATCH POOL TIMESTAMP WORKERS
+%token	MAX PEERS SOURCES TEMPLATES TEMPLATE LENGTH
+%token	PREALLOCATE SYNC EVERY ROTATE INDEX FORMAT COMPRESS LEVEL
+%token	FILTERED THREAD STATS SOCKET AGGREGATE TIMEOUT
+%token	OUTPUT QUEUE FLUSH CACHE AGE
 %token	ERROR
 %token	<v.string>		STRING
-%type	<v.number>		number quick logspec not octet tcp_flags tcp_mask af dayname dayrange daylist dayspec daytime abstime
+%type	<v.number>		number quick fwdfilter logspec not octet tcp_flags tcp_mask af dayname dayrange daylist dayspec daytime abstime
 %type	<v.string>		string
 %type	<v.addr>		address
 %type	<v.addrport>		address_port
@@ -425,6 +430,121 @@ conf_main	: LISTEN ON address_port	{
 		| LOGFILE string		{
 			conf->log_file = $2;
 		}
+		| LOGFILE PREALLOCATE number	{
+			if ($3 > LIMIT_LOG_PREALLOCATE) {
+				yyerror("logfile preallocate must be between "
+				    "0 and %d", LIMIT_LOG_PREALLOCATE);
+				YYERROR;
+			}
+			conf->log_prealloc_mb = $3;
+		}
+		| LOGFILE COMPRESS		{
+#ifndef HAVE_LIBZ
+			yyerror("logfile compression is not supported");
+			YYERROR;
+#endif
+			conf->log_compress = DEFAULT_LOG_COMPRESS;
+		}
+		| LOGFILE COMPRESS LEVEL number	{
+#ifndef HAVE_LIBZ
+			yyerror("logfile compression is not supported");
+			YYERROR;
+#endif
+			if ($4 == 0 || $4 > LIMIT_LOG_COMPRESS) {
+				yyerror("logfile compress level must be "
+				    "between 1 and %d", LIMIT_LOG_COMPRESS);
+				YYERROR;
+			}
+			conf->log_compress = $4;
+		}
+		| LOGFILE INDEX EVERY number STRING	{
+			if (strcasecmp($5, "flows") == 0) {
+				if ($4 == 0 || $4 > LIMIT_LOG_INDEX_FLOWS) {
+					yyerror("logfile index every flows "
+					    "must be between 1 and %d",
+					    LIMIT_LOG_INDEX_FLOWS);
+					free($5);
+					YYERROR;
+				}
+				conf->log_index_flows = $4;
+			} else if (strcasecmp($5, "seconds") == 0) {
+				if ($4 == 0 || $4 > LIMIT_LOG_INDEX_SECS) {
+					yyerror("logfile index every seconds "
+					    "must be between 1 and %d",
+					    LIMIT_LOG_INDEX_SECS);
+					free($5);
+					YYERROR;
+				}
+				conf->log_index_secs = $4;
+			} else {
+				yyerror("logfile index interval must be in "
+				    "\"flows\" or \"seconds\"");
+				free($5);
+				YYERROR;
+			}
+			free($5);
+		}
+		| LOGFILE ROTATE EVERY number STRING	{
+			u_int64_t secs = $4;
+
+			if (strncasecmp($5, "second", 6) == 0)
+				;
+			else if (strncasecmp($5, "minute", 6) == 0)
+				secs *= 60;
+			else if (strncasecmp($5, "hour", 4) == 0)
+				secs *= 3600;
+			else {
+				yyerror("logfile rotate interval must be in "
+				    "seconds, minutes or hours");
+				free($5);
+				YYERROR;
+			}
+			free($5);
+			if (secs == 0 || secs > LIMIT_LOG_ROTATE) {
+				yyerror("logfile rotate interval must be "
+				    "between 1 and %d seconds",
+				    LIMIT_LOG_ROTATE);
+				YYERROR;
+			}
+			conf->log_rotate = secs;
+		}
+		| LOGFILE SYNC STRING	{
+			if (strcasecmp($3, "none") != 0) {
+				yyerror("unknown logfile sync policy \"%s\"",
+				    $3);
+				free($3);
+				YYERROR;
+			}
+			free($3);
+			conf->log_sync_mb = conf->log_sync_ms = 0;
+		}
+		| LOGFILE SYNC EVERY number STRING	{
+			if (strcasecmp($5, "mb") == 0) {
+				if ($4 == 0 || $4 > LIMIT_LOG_SYNC_MB) {
+					yyerror("logfile sync every mb must be "
+					    "between 1 and %d",
+					    LIMIT_LOG_SYNC_MB);
+					free($5);
+					YYERROR;
+				}
+				conf->log_sync_mb = $4;
+			} else if (strcasecmp($5, "ms") == 0) {
+				if ($4 == 0 || $4 > LIMIT_LOG_SYNC_MS) {
+					yyerror("logfile sync every ms must be "
+					    "between 1 and %d",
+					    LIMIT_LOG_SYNC_MS);
+					free($5);
+					YYERROR;
+				}
+				conf->log_sync_ms = $4;
+			} else {
+				yyerror("logfile sync interval must be in "
+				    "\"mb\" or \"ms\"");
+				free($5);
+				YYERROR;
+			}
+			free($5);
+		}
 		| LOGSOCK string		{
 			conf->log_socket = $2;
 		}
@@ -432,7 +552,84 @@ conf_main	: LISTEN ON address_port	{
 			conf->log_socket = $2;
 			conf->log_socket_bufsiz = $4;
 		}
-		| FORWARD TO address_port {
+		| LOGRING string		{
+			if (conf->log_ring != NULL)
+				free(conf->log_ring);
+			conf->log_ring = $2;
+		}
+		| LOGRING string BUFSIZE number {
+			if ($4 < MIN_RING_SIZE || $4 > LIMIT_RING_SIZE ||
+			    ($4 & ($4 - 1)) != 0) {
+				yyerror("logring bufsize must be a power of 2 "
+				    "between %d and %d bytes", MIN_RING_SIZE,
+				    LIMIT_RING_SIZE);
+				free($2);
+				YYERROR;
+			}
+			if (conf->log_ring != NULL)
+				free(conf->log_ring);
+			conf->log_ring = $2;
+			conf->log_ring_size = $4;
+		}
+		| LOGSOCK BATCH			{
+			conf->log_socket_batch = DEFAULT_LOGSOCK_BATCH;
+		}
+		| LOGSOCK BATCH number		{
+			if ($3 == 0 || $3 > LIMIT_LOGSOCK_BATCH) {
+				yyerror("logsock batch must be between 1 "
+				    "and %d bytes", LIMIT_LOGSOCK_BATCH);
+				YYERROR;
+			}
+			conf->log_socket_batch = $3;
+		}
+		| OUTPUT QUEUE number		{
+			if ($3 < MIN_OUTPUT_QUEUE_KB ||
+			    $3 > LIMIT_OUTPUT_QUEUE_KB) {
+				yyerror("output queue must be between %d "
+				    "and %d KB", MIN_OUTPUT_QUEUE_KB,
+				    LIMIT_OUTPUT_QUEUE_KB);
+				YYERROR;
+			}
+			conf->output_queue_kb = $3;
+		}
+		| OUTPUT FLUSH STRING	{
+			if (strcasecmp($3, "always") != 0) {
+				yyerror("unknown output flush policy \"%s\"",
+				    $3);
+				free($3);
+				YYERROR;
+			}
+			free($3);
+			conf->output_flush_kb = conf->output_flush_ms = 0;
+		}
+		| OUTPUT FLUSH EVERY number STRING	{
+			if (strcasecmp($5, "kb") == 0) {
+				if ($4 == 0 || $4 > LIMIT_OUTPUT_QUEUE_KB / 2) {
+					yyerror("output flush every kb must be "
+					    "between 1 and %d",
+					    LIMIT_OUTPUT_QUEUE_KB / 2);
+					free($5);
+					YYERROR;
+				}
+				conf->output_flush_kb = $4;
+			} else if (strcasecmp($5, "ms") == 0) {
+				if ($4 == 0 || $4 > LIMIT_OUTPUT_FLUSH_MS) {
+					yyerror("output flush every ms must be "
+					    "between 1 and %d",
+					    LIMIT_OUTPUT_FLUSH_MS);
+					free($5);
+					YYERROR;
+				}
+				conf->output_flush_ms = $4;
+			} else {
+				yyerror("output flush interval must be in "
+				    "\"kb\" or \"ms\"");
+				free($5);
+				YYERROR;
+			}
+			free($5);
+		}
+		| FORWARD TO address_port fwdfilter {
 			struct forward_addr *fa;
 
 			if ((fa = calloc(1, sizeof(*fa))) == NULL)
@@ -442,14 +639,227 @@ conf_main	: LISTEN ON address_port	{
 			fa->addr = $3.addr;
 			fa->port = $3.port;
 			fa->bufsiz = -1;
+			fa->filtered = $4;
 
 			TAILQ_INSERT_TAIL(&conf->forward_addrs, fa, entry);
 		
 		}
+		| FORWARD THREAD		{
+#ifndef HAVE_PTHREAD
+			yyerror("forward thread not supported on this "
+			    "platform");
+			YYERROR;
+#endif
+			conf->opts |= FLOWD_OPT_FORWARD_THREAD;
+		}
 		| PIDFILE string		{
 			conf->pid_file = $2;
 		}
+		| STATS SOCKET string		{
+#ifndef HAVE_PTHREAD
+			yyerror("stats socket not supported on this "
+			    "platform");
+			free($3);
+			YYERROR;
+#endif
+			if (conf->stats_socket != NULL)
+				free(conf->stats_socket);
+			conf->stats_socket = $3;
+		}
+		| TEMPLATE CACHE string		{
+			if (conf->template_cache != NULL)
+				free(conf->template_cache);
+			conf->template_cache = $3;
+		}
+		| TEMPLATE CACHE EVERY number	{
+			if ($4 == 0 || $4 > LIMIT_TEMPLATE_CACHE_SECS) {
+				yyerror("template cache every must be between "
+				    "1 and %d seconds",
+				    LIMIT_TEMPLATE_CACHE_SECS);
+				YYERROR;
+			}
+			conf->template_cache_secs = $4;
+		}
+		| TEMPLATE CACHE AGE number	{
+			if ($4 == 0 || $4 > LIMIT_TEMPLATE_CACHE_AGE) {
+				yyerror("template cache age must be between "
+				    "1 and %d seconds",
+				    LIMIT_TEMPLATE_CACHE_AGE);
+				YYERROR;
+			}
+			conf->template_cache_age = $4;
+		}
+		| AGGREGATE		{
+			bzero(&conf->aggr, sizeof(conf->aggr));
+		} aggkeys aggopts
 		| STORE logspec		{ conf->store_mask |= $2; }
+		| STORE FORMAT STRING	{
+			if (strcasecmp($3, "v3") == 0)
+				conf->store_version = STORE_VER_MAJOR;
+			else if (strcasecmp($3, "v4") == 0)
+				conf->store_version = STORE_BLOCK_VER_MAJOR;
+			else {
+				yyerror("store format must be \"v3\" or "
+				    "\"v4\"");
+				free($3);
+				YYERROR;
+			}
+			free($3);
+		}
+		| RECEIVE BATCH number	{
+			if ($3 == 0 || $3 > MAX_RECV_BATCH) {
+				yyerror("receive batch must be between 1 "
+				    "and %d", MAX_RECV_BATCH);
+				YYERROR;
+			}
+			conf->recv_batch = $3;
+		}
+		| RECEIVE POOL number	{
+			if ($3 == 0 || $3 > MAX_PACKET_POOL) {
+				yyerror("receive pool must be between 1 "
+				    "and %d", MAX_PACKET_POOL);
+				YYERROR;
+			}
+			conf->packet_pool = $3;
+		}
+		| RECEIVE TIMESTAMP	{
+			conf->opts |= FLOWD_OPT_RECV_TIMESTAMP;
+		}
+		| WORKERS number	{
+#ifndef HAVE_PTHREAD
+			if ($2 > 1) {
+				yyerror("workers not supported on this "
+				    "platform");
+				YYERROR;
+			}
+#endif
+#ifndef SO_REUSEPORT
+			if ($2 > 1) {
+				yyerror("workers require SO_REUSEPORT");
+				YYERROR;
+			}
+#endif
+			if ($2 == 0 || $2 > MAX_WORKERS) {
+				yyerror("workers must be between 1 and %d",
+				    MAX_WORKERS);
+				YYERROR;
+			}
+			conf->workers = $2;
+		}
+		| MAX PEERS number	{
+			if ($3 == 0 || $3 > LIMIT_MAX_PEERS) {
+				yyerror("max peers must be between 1 and %d",
+				    LIMIT_MAX_PEERS);
+				YYERROR;
+			}
+			conf->max_peers = $3;
+		}
+		| MAX SOURCES number	{
+			if ($3 == 0 || $3 > LIMIT_MAX_SOURCES) {
+				yyerror("max sources must be between 1 and %d",
+				    LIMIT_MAX_SOURCES);
+				YYERROR;
+			}
+			conf->max_sources = $3;
+		}
+		| MAX TEMPLATES number	{
+			if ($3 == 0 || $3 > LIMIT_MAX_TEMPLATES) {
+				yyerror("max templates must be between 1 "
+				    "and %d", LIMIT_MAX_TEMPLATES);
+				YYERROR;
+			}
+			conf->max_templates = $3;
+		}
+		| MAX TEMPLATE LENGTH number	{
+			if ($4 == 0 || $4 > LIMIT_MAX_TEMPLATE_LEN) {
+				yyerror("max template length must be between "
+				    "1 and %d", LIMIT_MAX_TEMPLATE_LEN);
+				YYERROR;
+			}
+			conf->max_template_len = $4;
+		}
+		;
+
+aggkeys		: aggkey
+		| aggkeys aggkey
+		;
+
+aggkey		: AGENT			{ conf->aggr.key |= AGGR_KEY_AGENT; }
+		| SRC			{
+			conf->aggr.key |= AGGR_KEY_SRC_ADDR;
+			conf->aggr.src_len4 = 32;
+			conf->aggr.src_len6 = 128;
+		}
+		| SRC '/' number	{
+			if ($3 > 32) {
+				yyerror("aggregate IPv4 prefix length must "
+				    "be between 0 and 32");
+				YYERROR;
+			}
+			conf->aggr.key |= AGGR_KEY_SRC_ADDR;
+			conf->aggr.src_len4 = $3;
+			conf->aggr.src_len6 = 128;
+		}
+		| SRC '/' number '/' number	{
+			if ($3 > 32 || $5 > 128) {
+				yyerror("aggregate prefix lengths must be "
+				    "between 0 and 32 (IPv4) or 128 (IPv6)");
+				YYERROR;
+			}
+			conf->aggr.key |= AGGR_KEY_SRC_ADDR;
+			conf->aggr.src_len4 = $3;
+			conf->aggr.src_len6 = $5;
+		}
+		| DST			{
+			conf->aggr.key |= AGGR_KEY_DST_ADDR;
+			conf->aggr.dst_len4 = 32;
+			conf->aggr.dst_len6 = 128;
+		}
+		| DST '/' number	{
+			if ($3 > 32) {
+				yyerror("aggregate IPv4 prefix length must "
+				    "be between 0 and 32");
+				YYERROR;
+			}
+			conf->aggr.key |= AGGR_KEY_DST_ADDR;
+			conf->aggr.dst_len4 = $3;
+			conf->aggr.dst_len6 = 128;
+		}
+		| DST '/' number '/' number	{
+			if ($3 > 32 || $5 > 128) {
+				yyerror("aggregate prefix lengths must be "
+				    "between 0 and 32 (IPv4) or 128 (IPv6)");
+				YYERROR;
+			}
+			conf->aggr.key |= AGGR_KEY_DST_ADDR;
+			conf->aggr.dst_len4 = $3;
+			conf->aggr.dst_len6 = $5;
+		}
+		| SRC PORT		{ conf->aggr.key |= AGGR_KEY_SRC_PORT; }
+		| DST PORT		{ conf->aggr.key |= AGGR_KEY_DST_PORT; }
+		| PROTO			{ conf->aggr.key |= AGGR_KEY_PROTO; }
+		| TOS			{ conf->aggr.key |= AGGR_KEY_TOS; }
+		| IN_IFNDX		{ conf->aggr.key |= AGGR_KEY_IF_IN; }
+		| OUT_IFNDX		{ conf->aggr.key |= AGGR_KEY_IF_OUT; }
+		;
+
+aggopts		: /* empty */
+		| aggopts TIMEOUT number	{
+			if ($3 == 0 || $3 > LIMIT_AGGR_TIMEOUT) {
+				yyerror("aggregate timeout must be between 1 "
+				    "and %d seconds", LIMIT_AGGR_TIMEOUT);
+				YYERROR;
+			}
+			conf->aggr.timeout = $3;
+		}
+		| aggopts MAX number	{
+			if ($3 == 0 || $3 > LIMIT_AGGR_MAX) {
+				yyerror("aggregate max must be between 1 "
+				    "and %d", LIMIT_AGGR_MAX);
+				YYERROR;
+			}
+			conf->aggr.max = $3;
+		}
 		;
 
 logspec		: STRING	{
@@ -698,6 +1108,10 @@ quick		: /* empty */	{ $$ = 0; }
 		| QUICK		{ $$ = 1; }
 		;
 
+fwdfilter	: /* empty */	{ $$ = 0; }
+		| FILTERED	{ $$ = 1; }
+		;
+
 match_agent	: /* empty */			{ bzero(&$$, sizeof($$)); }
 		| AGENT not prefix		{
 			bzero(&$$, sizeof($$));
@@ -930,40 +1344,71 @@ lookup(char *s)
 	static const struct keywords keywords[] = {
 		{ "accept",		ACCEPT},
 		{ "after",		AFTER},
+		{ "age",		AGE},
 		{ "agent",		AGENT},
+		{ "aggregate",		AGGREGATE},
 		{ "all",		ALL},
 		{ "any",		ANY},
+		{ "batch",		BATCH},
 		{ "before",		BEFORE},
 		{ "bufsize",		BUFSIZE},
+		{ "cache",		CACHE},
+		{ "compress",		COMPRESS},
 		{ "date",		DATE},
 		{ "days",		DAYS},
 		{ "discard",		DISCARD},
 		{ "dst",		DST},
 		{ "equals",		EQUALS},
+		{ "every",		EVERY},
+		{ "filtered",		FILTERED},
 		{ "flow",		FLOW},
+		{ "flush",		FLUSH},
+		{ "format",		FORMAT},
 		{ "forward",	FORWARD},
 		{ "group",		GROUP},
 		{ "in_ifndx",		IN_IFNDX},
+		{ "index",		INDEX},
 		{ "inet",		INET},
 		{ "inet6",		INET6},
 		{ "join",		JOIN},
+		{ "length",		LENGTH},
+		{ "level",		LEVEL},
 		{ "listen",		LISTEN},
 		{ "logfile",		LOGFILE},
+		{ "logring",		LOGRING},
 		{ "logsock",		LOGSOCK},
 		{ "mask",		MASK},
+		{ "max",		MAX},
 		{ "on",			ON},
 		{ "out_ifndx",		OUT_IFNDX},
+		{ "output",		OUTPUT},
+		{ "peers",		PEERS},
 		{ "pidfile",		PIDFILE},
+		{ "pool",		POOL},
 		{ "port",		PORT},
+		{ "preallocate",	PREALLOCATE},
 		{ "proto",		PROTO},
+		{ "queue",		QUEUE},
 		{ "quick",		QUICK},
+		{ "receive",		RECEIVE},
+		{ "rotate",		ROTATE},
+		{ "socket",		SOCKET},
 		{ "source",		SOURCE},
+		{ "sources",		SOURCES},
 		{ "src",		SRC},
+		{ "stats",		STATS},
 		{ "store",		STORE},
+		{ "sync",		SYNC},
 		{ "tag",		TAG},
 		{ "tcp_flags",		TCP_FLAGS},
+		{ "template",		TEMPLATE},
+		{ "templates",		TEMPLATES},
+		{ "thread",		THREAD},
+		{ "timeout",		TIMEOUT},
+		{ "timestamp",		TIMESTAMP},
 		{ "to",			TO},
 		{ "tos",		TOS},
+		{ "workers",		WORKERS},
 	};
 	const struct keywords	*p;
 
@@ -1190,8 +1635,8 @@ parse_config(const char *path, FILE *f, struct flowd_config *mconf,
 	yyparse();
 
 	if (!filter_only && conf->log_file == NULL &&
-	    conf->log_socket == NULL) {
-		logit(LOG_ERR, "No log file or socket specified");
+	    conf->log_socket == NULL && conf->log_ring == NULL) {
+		logit(LOG_ERR, "No log file, socket or ring specified");
 		return (-1);
 	}
 	if (!filter_only && conf->pid_file == NULL && 
@@ -1204,6 +1649,68 @@ parse_config(const char *path, FILE *f, struct flowd_config *mconf,
 		logit(LOG_ERR, "No listening addresses specified");
 		return (-1);
 	}
+	if (!filter_only && conf->log_rotate != 0 &&
+	    (conf->log_file == NULL || strchr(conf->log_file, '%') == NULL)) {
+		logit(LOG_ERR, "logfile rotate requires a logfile name with "
+		    "strftime(3) conversions");
+		return (-1);
+	}
+	/* A datagram must fit in the socket's send buffer */
+	if (conf->log_socket_bufsiz > 0 &&
+	    conf->log_socket_batch > conf->log_socket_bufsiz)
+		conf->log_socket_batch = conf->log_socket_bufsiz;
+	if (conf->recv_batch == 0)
+		conf->recv_batch = DEFAULT_RECV_BATCH;
+	if (conf->packet_pool == 0)
+		conf->packet_pool = DEFAULT_PACKET_POOL;
+	if (conf->workers == 0)
+		conf->workers = 1;
+	if (conf->max_peers == 0)
+		conf->max_peers = DEFAULT_MAX_PEERS;
+	if (conf->max_sources == 0)
+		conf->max_sources = DEFAULT_MAX_SOURCES;
+	if (conf->max_templates == 0)
+		conf->max_templates = DEFAULT_MAX_TEMPLATES;
+	if (conf->max_template_len == 0)
+		conf->max_template_len = DEFAULT_MAX_TEMPLATE_LEN;
+	if (conf->output_queue_kb == 0)
+		conf->output_queue_kb = DEFAULT_OUTPUT_QUEUE_KB;
+	/* Leave room in the queue for the packet being decoded */
+	if (conf->output_flush_kb > conf->output_queue_kb / 2) {
+		logit(LOG_ERR, "output flush every kb must be at most half "
+		    "the output queue (%u KB)", conf->output_queue_kb);
+		return (-1);
+	}
+	if (conf->log_ring != NULL && conf->log_ring_size == 0)
+		conf->log_ring_size = DEFAULT_RING_SIZE;
+	if (conf->template_cache_secs == 0)
+		conf->template_cache_secs = DEFAULT_TEMPLATE_CACHE_SECS;
+	if (conf->template_cache_age == 0)
+		conf->template_cache_age = DEFAULT_TEMPLATE_CACHE_AGE;
+	if (conf->aggr.key != 0 && conf->aggr.timeout == 0)
+		conf->aggr.timeout = DEFAULT_AGGR_TIMEOUT;
+	if (conf->aggr.key != 0 && conf->aggr.max == 0)
+		conf->aggr.max = DEFAULT_AGGR_MAX;
+
+	/* Each worker gets its own socket in a SO_REUSEPORT group */
+	if (!filter_only && conf->workers > 1) {
+		struct listen_addr *la, *nla;
+		u_int i;
+
+		conf->opts |= FLOWD_OPT_REUSEPORT;
+		TAILQ_FOREACH(la, &conf->listen_addrs, entry) {
+			if (la->worker != 0)
+				continue;
+			for (i = conf->workers - 1; i > 0; i--) {
+				if ((nla = calloc(1, sizeof(*nla))) == NULL)
+					logerrx("listen_on: calloc");
+				*nla = *la;
+				nla->worker = i;
+				TAILQ_INSERT_AFTER(&conf->listen_addrs, la,
+				    nla, entry);
+			}
+		}
+	}
 	/* Free macros and check which have not been used. */
 	for (sym = TAILQ_FIRST(&symhead); sym != NULL; sym = next) {
 		next = TAILQ_NEXT(sym, entry);
@@ -1337,6 +1844,39 @@ parse_abstime(const char *s, struct tm *tp)
 	return 0;
 }
 
+/* Format the key of an "aggregate" line as it would be written */
+static void
+format_aggr_key(const struct aggr_params *p, char *buf, size_t len)
+{
+	char tmp[64];
+
+	*buf = '\0';
+	if (p->key & AGGR_KEY_AGENT)
+		strlcat(buf, " agent", len);
+	if (p->key & AGGR_KEY_SRC_ADDR) {
+		snprintf(tmp, sizeof(tmp), " src/%u/%u", p->src_len4,
+		    p->src_len6);
+		strlcat(buf, tmp, len);
+	}
+	if (p->key & AGGR_KEY_DST_ADDR) {
+		snprintf(tmp, sizeof(tmp), " dst/%u/%u", p->dst_len4,
+		    p->dst_len6);
+		strlcat(buf, tmp, len);
+	}
+	if (p->key & AGGR_KEY_SRC_PORT)
+		strlcat(buf, " src port", len);
+	if (p->key & AGGR_KEY_DST_PORT)
+		strlcat(buf, " dst port", len);
+	if (p->key & AGGR_KEY_PROTO)
+		strlcat(buf, " proto", len);
+	if (p->key & AGGR_KEY_TOS)
+		strlcat(buf, " tos", len);
+	if (p->key & AGGR_KEY_IF_IN)
+		strlcat(buf, " in_ifndx", len);
+	if (p->key & AGGR_KEY_IF_OUT)
+		strlcat(buf, " out_ifndx", len);
+}
+
 void
 dump_config(struct flowd_config *c, const char *prefix, int filter_only)
 {
@@ -1349,17 +1889,103 @@ dump_config(struct flowd_config *c, const char *prefix, int filter_only)
 			logit(LOG_DEBUG, "%s%slogfile \"%s\"",
 			    DCPR(prefix), c->log_file);
 		}
+		if (c->log_rotate != 0) {
+			logit(LOG_DEBUG, "%s%slogfile rotate every %u seconds",
+			    DCPR(prefix), c->log_rotate);
+		}
+		if (c->log_index_flows != 0) {
+			logit(LOG_DEBUG, "%s%slogfile index every %u flows",
+			    DCPR(prefix), c->log_index_flows);
+		}
+		if (c->log_index_secs != 0) {
+			logit(LOG_DEBUG, "%s%slogfile index every %u seconds",
+			    DCPR(prefix), c->log_index_secs);
+		}
+		if (c->log_compress != 0) {
+			logit(LOG_DEBUG, "%s%slogfile compress level %u",
+			    DCPR(prefix), c->log_compress);
+		}
+		if (c->log_prealloc_mb != 0) {
+			logit(LOG_DEBUG, "%s%slogfile preallocate %u",
+			    DCPR(prefix), c->log_prealloc_mb);
+		}
+		if (c->log_sync_mb != 0) {
+			logit(LOG_DEBUG, "%s%slogfile sync every %u mb",
+			    DCPR(prefix), c->log_sync_mb);
+		}
+		if (c->log_sync_ms != 0) {
+			logit(LOG_DEBUG, "%s%slogfile sync every %u ms",
+			    DCPR(prefix), c->log_sync_ms);
+		}
 		if (c->log_socket != NULL) {
 			logit(LOG_DEBUG, "%s%slogsock \"%s\"",
 			    DCPR(prefix), c->log_socket);
 		}
+		if (c->log_socket_batch != 0) {
+			logit(LOG_DEBUG, "%s%slogsock batch %zu",
+			    DCPR(prefix), c->log_socket_batch);
+		}
+		if (c->log_ring != NULL) {
+			logit(LOG_DEBUG, "%s%slogring \"%s\" bufsize %u",
+			    DCPR(prefix), c->log_ring, c->log_ring_size);
+		}
+		if (c->stats_socket != NULL) {
+			logit(LOG_DEBUG, "%s%sstats socket \"%s\"",
+			    DCPR(prefix), c->stats_socket);
+		}
+		if (c->template_cache != NULL) {
+			logit(LOG_DEBUG, "%s%stemplate cache \"%s\"",
+			    DCPR(prefix), c->template_cache);
+			logit(LOG_DEBUG, "%s%stemplate cache every %u",
+			    DCPR(prefix), c->template_cache_secs);
+			logit(LOG_DEBUG, "%s%stemplate cache age %u",
+			    DCPR(prefix), c->template_cache_age);
+		}
+		logit(LOG_DEBUG, "%s%soutput queue %u", DCPR(prefix),
+		    c->output_queue_kb);
+		if (c->output_flush_kb != 0) {
+			logit(LOG_DEBUG, "%s%soutput flush every %u kb",
+			    DCPR(prefix), c->output_flush_kb);
+		}
+		if (c->output_flush_ms != 0) {
+			logit(LOG_DEBUG, "%s%soutput flush every %u ms",
+			    DCPR(prefix), c->output_flush_ms);
+		}
 	}
 	logit(LOG_DEBUG, "%s%s# store mask %08x", DCPR(prefix), c->store_mask);
+	if (!filter_only && c->store_version != 0) {
+		logit(LOG_DEBUG, "%s%sstore format v%u", DCPR(prefix),
+		    c->store_version);
+	}
 	if (!filter_only) {
 		logit(LOG_DEBUG, "%s%s# opts %08x", DCPR(prefix), c->opts);
+		logit(LOG_DEBUG, "%s%sreceive batch %u", DCPR(prefix),
+		    c->recv_batch);
+		logit(LOG_DEBUG, "%s%sreceive pool %u", DCPR(prefix),
+		    c->packet_pool);
+		logit(LOG_DEBUG, "%s%sworkers %u", DCPR(prefix), c->workers);
+		logit(LOG_DEBUG, "%s%smax peers %u", DCPR(prefix),
+		    c->max_peers);
+		logit(LOG_DEBUG, "%s%smax sources %u", DCPR(prefix),
+		    c->max_sources);
+		logit(LOG_DEBUG, "%s%smax templates %u", DCPR(prefix),
+		    c->max_templates);
+		logit(LOG_DEBUG, "%s%smax template length %u", DCPR(prefix),
+		    c->max_template_len);
+		if (c->aggr.key != 0) {
+			char kbuf[256];
+
+			format_aggr_key(&c->aggr, kbuf, sizeof(kbuf));
+			logit(LOG_DEBUG, "%s%saggregate%s timeout %u max %u",
+			    DCPR(prefix), kbuf, c->aggr.timeout, c->aggr.max);
+		}
+		if (c->opts & FLOWD_OPT_RECV_TIMESTAMP)
+			logit(LOG_DEBUG, "%s%sreceive timestamp", DCPR(prefix));
 		TAILQ_FOREACH(la, &c->listen_addrs, entry) {
-			logit(LOG_DEBUG, "%s%slisten on [%s]:%d # fd = %d",
-			    DCPR(prefix), addr_ntop_buf(&la->addr), la->port, la->fd);
+			logit(LOG_DEBUG, "%s%slisten on [%s]:%d # fd = %d "
+			    "worker = %u", DCPR(prefix),
+			    addr_ntop_buf(&la->addr), la->port, la->fd,
+			    la->worker);
 		}
 		TAILQ_FOREACH(jg, &c->join_groups, entry) {
 			logit(LOG_DEBUG, "%s%sjoin group [%s]",
@@ -29,7 +29,6 @@
 #include <time.h>
 
 #include "sys-queue.h"
-#include "sys-tree.h"
 #include "flowd.h"
 #include "peer.h"
 
@@ -42,15 +41,80 @@ RCSID("$Id$");
 /* #define PEER_DEBUG_NF9 */
 
 
+/* Per-peer template hash tables start at this size and double as they fill */
+#define PEER_TEMPLATE_HASH_MIN_SIZE	16
+
+static u_int
+peer_template_hash(u_int32_t source_id, u_int16_t template_id, u_int size)
+{
+	u_int32_t h;
+
+	h = (source_id * 0x9e3779b1U) ^ template_id;
+	h ^= h >> 15;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+
+	return (h & (size - 1));
+}
+
 /* NetFlow v.9 specific function */
 
 static void
-peer_nf9_template_delete(struct peer_nf9_source *nf9src,
-    struct peer_nf9_template *template)
+peer_nf9_hash_insert(struct peer_state *peer, struct peer_nf9_template *t)
+{
+	struct peer_nf9_template **old = peer->nf9_hash, *next;
+	u_int i, h, old_size = peer->nf9_hash_size;
+
+	/* Grow the table to keep its chains short */
+	if (++peer->nf9_num_templates > peer->nf9_hash_size) {
+		peer->nf9_hash_size = old_size == 0 ?
+		    PEER_TEMPLATE_HASH_MIN_SIZE : old_size * 2;
+		if ((peer->nf9_hash = calloc(peer->nf9_hash_size,
+		    sizeof(*peer->nf9_hash))) == NULL)
+			logerrx("%s: calloc failed", __func__);
+		for (i = 0; i < old_size; i++) {
+			for (; old[i] != NULL; old[i] = next) {
+				next = old[i]->hnext;
+				h = peer_template_hash(old[i]->source_id,
+				    old[i]->template_id, peer->nf9_hash_size);
+				old[i]->hnext = peer->nf9_hash[h];
+				peer->nf9_hash[h] = old[i];
+			}
+		}
+		free(old);
+	}
+
+	h = peer_template_hash(t->source_id, t->template_id,
+	    peer->nf9_hash_size);
+	t->hnext = peer->nf9_hash[h];
+	peer->nf9_hash[h] = t;
+}
+
+static void
+peer_nf9_hash_remove(struct peer_state *peer, struct peer_nf9_template *t)
+{
+	struct peer_nf9_template **tp;
+
+	tp = &peer->nf9_hash[peer_template_hash(t->source_id,
+	    t->template_id, peer->nf9_hash_size)];
+	for (; *tp != t; tp = &(*tp)->hnext)
+		;
+	*tp = t->hnext;
+	peer->nf9_num_templates--;
+	if (peer->nf9_last == t)
+		peer->nf9_last = NULL;
+}
+
+static void
+peer_nf9_template_delete(struct peer_state *peer,
+    struct peer_nf9_source *nf9src, struct peer_nf9_template *template)
 {
 	TAILQ_REMOVE(&nf9src->templates, template, lp);
+	peer_nf9_hash_remove(peer, template);
 	if (template->records != NULL)
 		free(template->records);
+	if (template->prog.ops != NULL)
+		free(template->prog.ops);
 	free(template);
 	nf9src->num_templates--;
 }
@@ -61,7 +125,7 @@ static void peer_nf9_source_delete(struct peer_state *peer,
 	struct peer_nf9_template *nf9tmpl;
 
 	while ((nf9tmpl = TAILQ_FIRST(&nf9src->templates)) != NULL)
-		peer_nf9_template_delete(nf9src, nf9tmpl);
+		peer_nf9_template_delete(peer, nf9src, nf9tmpl);
 	peer->nf9_num_sources--;
 	TAILQ_REMOVE(&peer->nf9, nf9src, lp);
 	free(nf9src);
@@ -74,6 +138,9 @@ peer_nf9_delete(struct peer_state *peer)
 
 	while ((nf9src = TAILQ_FIRST(&peer->nf9)) != NULL)
 		peer_nf9_source_delete(peer, nf9src);
+	free(peer->nf9_hash);
+	peer->nf9_hash = NULL;
+	peer->nf9_hash_size = 0;
 }
 
 static struct peer_nf9_source *
@@ -88,43 +155,32 @@ peer_nf9_lookup_source(struct peer_state *peer, u_int32_t source_id)
 	return (NULL);
 }
 
-static struct peer_nf9_template *
-peer_nf9_lookup_template(struct peer_nf9_source *nf9src, u_int16_t template_id)
-{
-	struct peer_nf9_template *nf9tmpl;
-
-	TAILQ_FOREACH(nf9tmpl, &nf9src->templates, lp) {
-		if (nf9tmpl->template_id == template_id)
-			break;
-	}
-	if (nf9tmpl == NULL)
-		return (NULL);
-
-	return (nf9tmpl);
-}
-
-struct peer_nf9_template *peer_nf9_find_template(struct peer_state *peer,
+struct peer_nf9_template *
+peer_nf9_find_template(struct peer_state *peer,
     u_int32_t source_id, u_int16_t template_id)
 {
-	struct peer_nf9_source *nf9src;
 	struct peer_nf9_template *nf9tmpl;
 
-	nf9src = peer_nf9_lookup_source(peer, source_id);
+	/* Consecutive flowsets usually use the same template */
+	nf9tmpl = peer->nf9_last;
+	if (nf9tmpl != NULL && nf9tmpl->template_id == template_id &&
+	    nf9tmpl->source_id == source_id)
+		return (nf9tmpl);
 
-#ifdef PEER_DEBUG_NF9
-	logit(LOG_DEBUG, "%s: Lookup source 0x%08x for peer %s: %sFOUND",
-	    __func__, source_id, addr_ntop_buf(&peer->from),
-	    nf9src == NULL ? "NOT " : "");
-#endif
-
-	if (nf9src == NULL)
+	if (peer->nf9_hash_size == 0)
 		return (NULL);
-
-	nf9tmpl = peer_nf9_lookup_template(nf9src, template_id);
+	nf9tmpl = peer->nf9_hash[peer_template_hash(source_id, template_id,
+	    peer->nf9_hash_size)];
+	for (; nf9tmpl != NULL; nf9tmpl = nf9tmpl->hnext) {
+		if (nf9tmpl->template_id == template_id &&
+		    nf9tmpl->source_id == source_id)
+			break;
+	}
 
 #ifdef PEER_DEBUG_NF9
-	logit(LOG_DEBUG, "%s: Lookup template 0x%04x: %sFOUND", __func__,
-	    template_id, nf9tmpl == NULL ? "NOT " : "");
+	logit(LOG_DEBUG, "%s: Lookup template %s/0x%08x/0x%04x: %sFOUND",
+	    __func__, addr_ntop_buf(&peer->from), source_id, template_id,
+	    nf9tmpl == NULL ? "NOT " : "");
 #endif
 
 	if (nf9tmpl == NULL)
@@ -135,6 +191,7 @@ struct peer_nf9_template *peer_nf9_find_template(struct peer_state *peer,
 	    __func__, addr_ntop_buf(&peer->from), source_id, template_id,
 	    nf9tmpl->num_records, nf9tmpl->records);
 #endif
+	peer->nf9_last = nf9tmpl;
 	return (nf9tmpl);
 }
 
@@ -149,12 +206,10 @@ peer_nf9_template_update(struct peer_state *peer, u_int32_t source_id,
 	logit(LOG_DEBUG, "%s: Lookup template %s/0x%08x/0x%04x",
 	    __func__, addr_ntop_buf(&peer->from), template_id, source_id);
 #endif
-	nf9src = peer_nf9_lookup_source(peer, source_id);
-	if (nf9src == NULL)
-		return;
-	nf9tmpl = peer_nf9_lookup_template(nf9src, template_id);
+	nf9tmpl = peer_nf9_find_template(peer, source_id, template_id);
 	if (nf9tmpl == NULL)
 		return;
+	nf9src = nf9tmpl->source;
 
 #ifdef PEER_DEBUG_NF9
 	logit(LOG_DEBUG, "%s: found template", __func__);
@@ -226,13 +281,16 @@ peer_nf9_new_template(struct peer_state *peer, struct peers *peers,
 		    "peer %s/0x%08x", template_id, addr_ntop_buf(&peer->from),
 		    source_id);
 		/* XXX ratelimit errors */
-		peer_nf9_template_delete(nf9src, nf9tmpl)    ;
+		peer_nf9_template_delete(peer, nf9src, nf9tmpl)    ;
 	}
 
 	if ((nf9tmpl = calloc(1, sizeof(*nf9tmpl))) == NULL)
 		logerrx("%s: calloc failed", __func__);
 	nf9tmpl->template_id = template_id;
+	nf9tmpl->source_id = source_id;
+	nf9tmpl->source = nf9src;
 	TAILQ_INSERT_HEAD(&nf9src->templates, nf9tmpl, lp);
+	peer_nf9_hash_insert(peer, nf9tmpl);
 
 #ifdef PEER_DEBUG_NF9
 	logit(LOG_DEBUG, "%s: new template %s/0x%08x/0x%04x", __func__,
@@ -252,12 +310,61 @@ peer_nf9_new_template(struct peer_state *peer, struct peers *peers,
 /* NetFlow v.10 specific function */
 
 static void
-peer_nf10_template_delete(struct peer_nf10_source *nf10src,
-    struct peer_nf10_template *template)
+peer_nf10_hash_insert(struct peer_state *peer, struct peer_nf10_template *t)
+{
+	struct peer_nf10_template **old = peer->nf10_hash, *next;
+	u_int i, h, old_size = peer->nf10_hash_size;
+
+	/* Grow the table to keep its chains short */
+	if (++peer->nf10_num_templates > peer->nf10_hash_size) {
+		peer->nf10_hash_size = old_size == 0 ?
+		    PEER_TEMPLATE_HASH_MIN_SIZE : old_size * 2;
+		if ((peer->nf10_hash = calloc(peer->nf10_hash_size,
+		    sizeof(*peer->nf10_hash))) == NULL)
+			logerrx("%s: calloc failed", __func__);
+		for (i = 0; i < old_size; i++) {
+			for (; old[i] != NULL; old[i] = next) {
+				next = old[i]->hnext;
+				h = peer_template_hash(old[i]->source_id,
+				    old[i]->template_id, peer->nf10_hash_size);
+				old[i]->hnext = peer->nf10_hash[h];
+				peer->nf10_hash[h] = old[i];
+			}
+		}
+		free(old);
+	}
+
+	h = peer_template_hash(t->source_id, t->template_id,
+	    peer->nf10_hash_size);
+	t->hnext = peer->nf10_hash[h];
+	peer->nf10_hash[h] = t;
+}
+
+static void
+peer_nf10_hash_remove(struct peer_state *peer, struct peer_nf10_template *t)
+{
+	struct peer_nf10_template **tp;
+
+	tp = &peer->nf10_hash[peer_template_hash(t->source_id,
+	    t->template_id, peer->nf10_hash_size)];
+	for (; *tp != t; tp = &(*tp)->hnext)
+		;
+	*tp = t->hnext;
+	peer->nf10_num_templates--;
+	if (peer->nf10_last == t)
+		peer->nf10_last = NULL;
+}
+
+static void
+peer_nf10_template_delete(struct peer_state *peer,
+    struct peer_nf10_source *nf10src, struct peer_nf10_template *template)
 {
 	TAILQ_REMOVE(&nf10src->templates, template, lp);
+	peer_nf10_hash_remove(peer, template);
 	if (template->records != NULL)
 		free(template->records);
+	if (template->prog.ops != NULL)
+		free(template->prog.ops);
 	free(template);
 	nf10src->num_templates--;
 }
@@ -268,7 +375,7 @@ static void peer_nf10_source_delete(struct peer_state *peer,
 	struct peer_nf10_template *nf10tmpl;
 
 	while ((nf10tmpl = TAILQ_FIRST(&nf10src->templates)) != NULL)
-		peer_nf10_template_delete(nf10src, nf10tmpl);
+		peer_nf10_template_delete(peer, nf10src, nf10tmpl);
 	peer->nf10_num_sources--;
 	TAILQ_REMOVE(&peer->nf10, nf10src, lp);
 	free(nf10src);
@@ -281,6 +388,9 @@ peer_nf10_delete(struct peer_state *peer)
 
 	while ((nf10src = TAILQ_FIRST(&peer->nf10)) != NULL)
 		peer_nf10_source_delete(peer, nf10src);
+	free(peer->nf10_hash);
+	peer->nf10_hash = NULL;
+	peer->nf10_hash_size = 0;
 }
 
 static struct peer_nf10_source *
@@ -295,44 +405,32 @@ peer_nf10_lookup_source(struct peer_state *peer, u_int32_t source_id)
 	return (NULL);
 }
 
-static struct peer_nf10_template *
-peer_nf10_lookup_template(struct peer_nf10_source *nf10src, u_int16_t template_id)
-{
-	struct peer_nf10_template *nf10tmpl;
-
-	TAILQ_FOREACH(nf10tmpl, &nf10src->templates, lp) {
-		if (nf10tmpl->template_id == template_id)
-			break;
-	}
-	if (nf10tmpl == NULL)
-		return (NULL);
-
-	return (nf10tmpl);
-}
-
 struct peer_nf10_template *
 peer_nf10_find_template(struct peer_state *peer,
     u_int32_t source_id, u_int16_t template_id)
 {
-	struct peer_nf10_source *nf10src;
 	struct peer_nf10_template *nf10tmpl;
 
-	nf10src = peer_nf10_lookup_source(peer, source_id);
-
-#ifdef PEER_DEBUG_NF10
-	logit(LOG_DEBUG, "%s: Lookup source 0x%08x for peer %s: %sFOUND",
-	    __func__, source_id, addr_ntop_buf(&peer->from),
-	    nf10src == NULL ? "NOT " : "");
-#endif
+	/* Consecutive flowsets usually use the same template */
+	nf10tmpl = peer->nf10_last;
+	if (nf10tmpl != NULL && nf10tmpl->template_id == template_id &&
+	    nf10tmpl->source_id == source_id)
+		return (nf10tmpl);
 
-	if (nf10src == NULL)
+	if (peer->nf10_hash_size == 0)
 		return (NULL);
-
-	nf10tmpl = peer_nf10_lookup_template(nf10src, template_id);
+	nf10tmpl = peer->nf10_hash[peer_template_hash(source_id, template_id,
+	    peer->nf10_hash_size)];
+	for (; nf10tmpl != NULL; nf10tmpl = nf10tmpl->hnext) {
+		if (nf10tmpl->template_id == template_id &&
+		    nf10tmpl->source_id == source_id)
+			break;
+	}
 
 #ifdef PEER_DEBUG_NF10
-	logit(LOG_DEBUG, "%s: Lookup template 0x%04x: %sFOUND", __func__,
-	    template_id, nf10tmpl == NULL ? "NOT " : "");
+	logit(LOG_DEBUG, "%s: Lookup template %s/0x%08x/0x%04x: %sFOUND",
+	    __func__, addr_ntop_buf(&peer->from), source_id, template_id,
+	    nf10tmpl == NULL ? "NOT " : "");
 #endif
 
 	if (nf10tmpl == NULL)
@@ -343,6 +441,7 @@ peer_nf10_find_template(struct peer_state *peer,
 	    __func__, addr_ntop_buf(&peer->from), source_id, template_id,
 	    nf10tmpl->num_records, nf10tmpl->records);
 #endif
+	peer->nf10_last = nf10tmpl;
 	return (nf10tmpl);
 }
 
@@ -357,12 +456,10 @@ peer_nf10_template_update(struct peer_state *peer, u_int32_t source_id,
 	logit(LOG_DEBUG, "%s: Lookup template %s/0x%08x/0x%04x",
 	    __func__, addr_ntop_buf(&peer->from), template_id, source_id);
 #endif
-	nf10src = peer_nf10_lookup_source(peer, source_id);
-	if (nf10src == NULL)
-		return;
-	nf10tmpl = peer_nf10_lookup_template(nf10src, template_id);
+	nf10tmpl = peer_nf10_find_template(peer, source_id, template_id);
 	if (nf10tmpl == NULL)
 		return;
+	nf10src = nf10tmpl->source;
 
 #ifdef PEER_DEBUG_NF10
 	logit(LOG_DEBUG, "%s: found template", __func__);
@@ -434,13 +531,16 @@ peer_nf10_new_template(struct peer_state *peer, struct peers *peers,
 		    "peer %s/0x%08x", template_id, addr_ntop_buf(&peer->from),
 		    source_id);
 		/* XXX ratelimit errors */
-		peer_nf10_template_delete(nf10src, nf10tmpl)    ;
+		peer_nf10_template_delete(peer, nf10src, nf10tmpl)    ;
 	}
 
 	if ((nf10tmpl = calloc(1, sizeof(*nf10tmpl))) == NULL)
 		logerrx("%s: calloc failed", __func__);
 	nf10tmpl->template_id = template_id;
+	nf10tmpl->source_id = source_id;
+	nf10tmpl->source = nf10src;
 	TAILQ_INSERT_HEAD(&nf10src->templates, nf10tmpl, lp);
+	peer_nf10_hash_insert(peer, nf10tmpl);
 
 #ifdef PEER_DEBUG_NF10
 	logit(LOG_DEBUG, "%s: new template %s/0x%08x/0x%04x", __func__,
@@ -456,25 +556,224 @@ peer_nf10_new_template(struct peer_state *peer, struct peers *peers,
 	return (nf10tmpl);
 }
 
+/* Export sequence tracking */
+
+static void
+peer_seq_delete(struct peer_state *peer)
+{
+	struct peer_seq *ps;
+
+	while ((ps = TAILQ_FIRST(&peer->seqs)) != NULL) {
+		TAILQ_REMOVE(&peer->seqs, ps, lp);
+		free(ps);
+	}
+	peer->num_seqs = 0;
+}
+
+/* Find a source's sequence state, recycling the LRU one if it is new */
+static struct peer_seq *
+peer_seq_lookup(struct peers *peers, struct peer_state *peer,
+    u_int netflow_version, u_int32_t source_id)
+{
+	struct peer_seq *ps;
+
+	TAILQ_FOREACH(ps, &peer->seqs, lp) {
+		if (ps->version == netflow_version &&
+		    ps->source_id == source_id)
+			break;
+	}
+	if (ps != NULL) {
+		if (ps != TAILQ_FIRST(&peer->seqs)) {
+			TAILQ_REMOVE(&peer->seqs, ps, lp);
+			TAILQ_INSERT_HEAD(&peer->seqs, ps, lp);
+		}
+		return (ps);
+	}
+
+	if (peer->num_seqs > 0 && peer->num_seqs >= peers->max_sources) {
+		ps = TAILQ_LAST(&peer->seqs, peer_seq_list);
+		TAILQ_REMOVE(&peer->seqs, ps, lp);
+		bzero(ps, sizeof(*ps));
+	} else {
+		if ((ps = calloc(1, sizeof(*ps))) == NULL)
+			logerrx("%s: calloc failed", __func__);
+		peer->num_seqs++;
+	}
+	ps->version = netflow_version;
+	ps->source_id = source_id;
+	TAILQ_INSERT_HEAD(&peer->seqs, ps, lp);
+
+	return (ps);
+}
+
+/*
+ * Check the sequence number of a valid packet carrying count flows (or
+ * one packet, for v.9) against the one expected from its source. The
+ * counts are kept for the source, the peer and all peers together.
+ */
+void
+peer_sequence(struct peers *peers, struct peer_state *peer,
+    u_int netflow_version, u_int32_t source_id, u_int32_t sequence,
+    u_int count)
+{
+	struct peer_seq_counts *c[3];
+	struct peer_seq *ps;
+	u_int32_t ahead, behind;
+	u_int64_t n;
+	u_int i;
+
+	ps = peer_seq_lookup(peers, peer, netflow_version, source_id);
+	/* Resynchronise on the next packet if we can't tell what follows */
+	if (count == PEER_SEQ_UNKNOWN) {
+		ps->valid = 0;
+		return;
+	}
+	if (!ps->valid || sequence == ps->next) {
+		ps->valid = 1;
+		ps->next = sequence + count;
+		return;
+	}
+
+	c[0] = &ps->counts;
+	c[1] = &peer->seq;
+	c[2] = &peers->seq;
+	ahead = sequence - ps->next;
+	behind = ps->next - sequence;
+	if (ahead <= PEER_SEQ_GAP) {
+		for (i = 0; i < 3; i++) {
+			c[i]->lost += ahead;
+			c[i]->gaps++;
+		}
+	} else if (behind <= PEER_SEQ_LATE) {
+		/*
+		 * Assume that it is one we counted as lost when we skipped
+		 * it, which a duplicate won't be, and don't move back.
+		 */
+		n = count < ps->counts.lost ? count : ps->counts.lost;
+		for (i = 0; i < 3; i++) {
+			c[i]->lost -= n < c[i]->lost ? n : c[i]->lost;
+			c[i]->late++;
+		}
+		return;
+	} else {
+		logit(LOG_DEBUG, "netflow v.%u sequence reset from %s/0x%08x: "
+		    "expected %u got %u", netflow_version,
+		    addr_ntop_buf(&peer->from), source_id, ps->next, sequence);
+		for (i = 0; i < 3; i++)
+			c[i]->resets++;
+	}
+	ps->next = sequence + count;
+}
+
 /* General peer state housekeeping functions */
-static int
-peer_compare(struct peer_state *a, struct peer_state *b)
+
+/* Smallest peer hash table; it is kept at most half full */
+#define PEER_HASH_MIN_SIZE	64
+
+/* FNV-1a over the bits of an address that addr_cmp() looks at */
+static u_int32_t
+peer_hash_addr(const struct xaddr *addr)
+{
+	u_int32_t h = 2166136261U;
+	const u_int8_t *p;
+	size_t i, len;
+
+	switch (addr->af) {
+	case AF_INET:
+		len = 4;
+		break;
+	case AF_INET6:
+		len = 16;
+		break;
+	default:
+		len = 0;
+		break;
+	}
+	h = (h ^ addr->af) * 16777619U;
+	for (i = 0; i < len; i++)
+		h = (h ^ addr->addr8[i]) * 16777619U;
+	if (addr->af == AF_INET6) {
+		p = (const u_int8_t *)&addr->scope_id;
+		for (i = 0; i < sizeof(addr->scope_id); i++)
+			h = (h ^ p[i]) * 16777619U;
+	}
+
+	return (h);
+}
+
+static void
+peer_hash_insert(struct peers *peers, struct peer_state *peer)
 {
-	return (addr_cmp(&a->from, &b->from));
+	u_int i, mask = peers->peer_hash_size - 1;
+
+	for (i = peer->hash & mask; peers->peer_hash[i] != NULL;
+	    i = (i + 1) & mask)
+		;
+	peers->peer_hash[i] = peer;
 }
 
-/* Generate functions for peer state tree */
-SPLAY_PROTOTYPE(peer_tree, peer_state, tp, peer_compare);
-SPLAY_GENERATE(peer_tree, peer_state, tp, peer_compare);
+static void
+peer_hash_grow(struct peers *peers)
+{
+	struct peer_state **old = peers->peer_hash;
+	u_int i, old_size = peers->peer_hash_size;
+
+	peers->peer_hash_size = old_size == 0 ?
+	    PEER_HASH_MIN_SIZE : old_size * 2;
+	if ((peers->peer_hash = calloc(peers->peer_hash_size,
+	    sizeof(*peers->peer_hash))) == NULL)
+		logerrx("%s: calloc failed (%u)", __func__,
+		    peers->peer_hash_size);
+	for (i = 0; i < old_size; i++) {
+		if (old[i] != NULL)
+			peer_hash_insert(peers, old[i]);
+	}
+	free(old);
+}
 
+/* Remove a peer, shifting back any entries that probed past its slot */
 static void
-delete_peer(struct peers *peers, struct peer_state *peer)
+peer_hash_remove(struct peers *peers, struct peer_state *peer)
+{
+	struct peer_state *p;
+	u_int i, j, home, mask = peers->peer_hash_size - 1;
+
+	for (i = peer->hash & mask; peers->peer_hash[i] != peer;
+	    i = (i + 1) & mask)
+		;
+	for (j = i;;) {
+		j = (j + 1) & mask;
+		if ((p = peers->peer_hash[j]) == NULL)
+			break;
+		home = p->hash & mask;
+		/* Leave it if its home slot is cyclically within (i, j] */
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+		peers->peer_hash[i] = p;
+		i = j;
+	}
+	peers->peer_hash[i] = NULL;
+}
+
+static void
+free_peer(struct peer_state *peer)
 {
-	TAILQ_REMOVE(&peers->peer_list, peer, lp);
-	SPLAY_REMOVE(peer_tree, &peers->peer_tree, peer);
 	peer_nf9_delete(peer);
+	peer_nf10_delete(peer);
+	peer_seq_delete(peer);
 	free(peer);
+}
+
+static void
+delete_peer(struct peers *peers, struct peer_state *peer)
+{
+	TAILQ_REMOVE(&peers->peer_list, peer, lp);
+	peer_hash_remove(peers, peer);
 	peers->num_peers--;
+	if (peer->refs > 0)
+		peer->deleted = 1;
+	else
+		free_peer(peer);
 }
 
 struct peer_state *
@@ -507,14 +806,19 @@ new_peer(struct peers *peers, struct flowd_config *conf, struct xaddr *addr)
 	if ((peer = calloc(1, sizeof(*peer))) == NULL)
 		logerrx("%s: calloc failed", __func__);
 	memcpy(&peer->from, addr, sizeof(peer->from));
+	peer->hash = peer_hash_addr(addr);
 	TAILQ_INIT(&peer->nf9);
+	TAILQ_INIT(&peer->nf10);
+	TAILQ_INIT(&peer->seqs);
 
 #ifdef PEER_DEBUG
 	logit(LOG_DEBUG, "new peer %s", addr_ntop_buf(addr));
 #endif
 
 	TAILQ_INSERT_HEAD(&peers->peer_list, peer, lp);
-	SPLAY_INSERT(peer_tree, &peers->peer_tree, peer);
+	if (peers->num_peers * 2 > peers->peer_hash_size)
+		peer_hash_grow(peers);
+	peer_hash_insert(peers, peer);
 	gettimeofday(&peer->firstseen, NULL);
 
 	return (peer);
@@ -526,6 +830,14 @@ scrub_peers(struct flowd_config *conf, struct peers *peers)
 	struct peer_state *peer, *npeer;
 	struct allowed_device *ad;
 
+	/* Shed LRU peers if the limit has been lowered */
+	while (peers->num_peers > peers->max_peers) {
+		peer = TAILQ_LAST(&peers->peer_list, peer_list);
+		logit(LOG_WARNING, "delete peer %s (over max peers)",
+		    addr_ntop_buf(&peer->from));
+		delete_peer(peers, peer);
+	}
+
 	/* Check for address authorization */
 	if (TAILQ_FIRST(&conf->allowed_devices) == NULL)
 		return;
@@ -552,7 +864,7 @@ update_peer(struct peers *peers, struct peer_state *peer, u_int nflows,
     u_int netflow_version)
 {
 	/* Push peer to front of LRU queue, if it isn't there already */
-	if (peer != TAILQ_FIRST(&peers->peer_list)) {
+	if (!peer->deleted && peer != TAILQ_FIRST(&peers->peer_list)) {
 		TAILQ_REMOVE(&peers->peer_list, peer, lp);
 		TAILQ_INSERT_HEAD(&peers->peer_list, peer, lp);
 	}
@@ -568,12 +880,19 @@ update_peer(struct peers *peers, struct peer_state *peer, u_int nflows,
 struct peer_state *
 find_peer(struct peers *peers, struct xaddr *addr)
 {
-	struct peer_state tmp, *peer;
-
-	bzero(&tmp, sizeof(tmp));
-	memcpy(&tmp.from, addr, sizeof(tmp.from));
-
-	peer = SPLAY_FIND(peer_tree, &peers->peer_tree, &tmp);
+	struct peer_state *peer = NULL;
+	u_int i, mask = peers->peer_hash_size - 1;
+	u_int32_t hash;
+
+	if (peers->peer_hash_size != 0) {
+		hash = peer_hash_addr(addr);
+		for (i = hash & mask; (peer = peers->peer_hash[i]) != NULL;
+		    i = (i + 1) & mask) {
+			if (peer->hash == hash &&
+			    addr_cmp(&peer->from, addr) == 0)
+				break;
+		}
+	}
 #ifdef PEER_DEBUG
 	logit(LOG_DEBUG, "%s: found %s", __func__,
 	    peer == NULL ? "NONE" : addr_ntop_buf(addr));
@@ -582,16 +901,220 @@ find_peer(struct peers *peers, struct xaddr *addr)
 	return (peer);
 }
 
+/* Keep a peer alive while a packet from it is queued */
+void
+peer_hold(struct peer_state *peer)
+{
+	peer->refs++;
+}
+
+void
+peer_release(struct peer_state *peer)
+{
+	if (--peer->refs == 0 && peer->deleted)
+		free_peer(peer);
+}
+
+/* Template cache */
+
+static int
+peer_cache_put_template(FILE *f, struct peer_state *peer, u_int version,
+    u_int32_t source_id, u_int16_t template_id,
+    u_int num_records, time_t refreshed)
+{
+	struct peer_cache_template ct;
+
+	bzero(&ct, sizeof(ct));
+	switch (peer->from.af) {
+	case AF_INET:
+		ct.af = 4;
+		memcpy(ct.addr, &peer->from.v4, sizeof(peer->from.v4));
+		break;
+	case AF_INET6:
+		ct.af = 6;
+		memcpy(ct.addr, &peer->from.v6, sizeof(peer->from.v6));
+		break;
+	default:
+		return (0);
+	}
+	ct.netflow_version = version;
+	ct.source_id = htonl(source_id);
+	ct.template_id = htons(template_id);
+	ct.num_records = htons(num_records);
+	ct.refreshed = htonl(refreshed);
+
+	return (fwrite(&ct, sizeof(ct), 1, f) == 1 ? 1 : -1);
+}
+
+static int
+peer_cache_put_record(FILE *f, u_int type, u_int len)
+{
+	struct peer_cache_record cr;
+
+	cr.type = htons(type);
+	cr.len = htons(len);
+
+	return (fwrite(&cr, sizeof(cr), 1, f) == 1 ? 0 : -1);
+}
+
+int
+peer_cache_write_header(FILE *f)
+{
+	struct peer_cache_header hdr;
+
+	hdr.magic = htonl(PEER_CACHE_MAGIC);
+	hdr.version = htonl(PEER_CACHE_VERSION);
+	hdr.saved = htonl(time(NULL));
+
+	return (fwrite(&hdr, sizeof(hdr), 1, f) == 1 ? 0 : -1);
+}
+
+/*
+ * Write the templates of a worker's peers to the cache, returning the
+ * number written or -1 on error. Everything is written least recently
+ * used first, so loading it again leaves the lists in the same order.
+ */
+int
+peer_cache_write(FILE *f, struct peers *peers)
+{
+	struct peer_state *peer;
+	struct peer_nf9_source *nf9src;
+	struct peer_nf9_template *nf9tmpl;
+	struct peer_nf10_source *nf10src;
+	struct peer_nf10_template *nf10tmpl;
+	u_int i, n = 0;
+	int r;
+
+	TAILQ_FOREACH_REVERSE(peer, &peers->peer_list, peer_list, lp) {
+		TAILQ_FOREACH_REVERSE(nf9src, &peer->nf9, peer_nf9_list, lp) {
+			TAILQ_FOREACH_REVERSE(nf9tmpl, &nf9src->templates,
+			    peer_nf9_template_list, lp) {
+				if ((r = peer_cache_put_template(f, peer, 9,
+				    nf9tmpl->source_id,
+				    nf9tmpl->template_id, nf9tmpl->num_records,
+				    nf9tmpl->refreshed)) == -1)
+					return (-1);
+				if (r == 0)
+					continue;
+				for (i = 0; i < nf9tmpl->num_records; i++) {
+					if (peer_cache_put_record(f,
+					    nf9tmpl->records[i].type,
+					    nf9tmpl->records[i].len) == -1)
+						return (-1);
+				}
+				n++;
+			}
+		}
+		TAILQ_FOREACH_REVERSE(nf10src, &peer->nf10, peer_nf10_list,
+		    lp) {
+			TAILQ_FOREACH_REVERSE(nf10tmpl, &nf10src->templates,
+			    peer_nf10_template_list, lp) {
+				if ((r = peer_cache_put_template(f, peer, 10,
+				    nf10tmpl->source_id,
+				    nf10tmpl->template_id,
+				    nf10tmpl->num_records,
+				    nf10tmpl->refreshed)) == -1)
+					return (-1);
+				if (r == 0)
+					continue;
+				for (i = 0; i < nf10tmpl->num_records; i++) {
+					if (peer_cache_put_record(f,
+					    nf10tmpl->records[i].type,
+					    nf10tmpl->records[i].len) == -1)
+						return (-1);
+				}
+				n++;
+			}
+		}
+	}
+
+	return (n);
+}
+
+int
+peer_cache_read_header(FILE *f, struct peer_cache_header *hdr)
+{
+	if (fread(hdr, sizeof(*hdr), 1, f) != 1)
+		return (-1);
+	hdr->magic = ntohl(hdr->magic);
+	hdr->version = ntohl(hdr->version);
+	hdr->saved = ntohl(hdr->saved);
+	if (hdr->magic != PEER_CACHE_MAGIC ||
+	    hdr->version != PEER_CACHE_VERSION)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Read the next template from the cache. Returns 1 if one was read, 0 at
+ * the end of the file and -1 if it is bad. The caller must free the
+ * records of the entry.
+ */
+int
+peer_cache_read(FILE *f, struct peer_cache_entry *e)
+{
+	struct peer_cache_template ct;
+	struct peer_cache_record cr;
+	u_int i;
+
+	bzero(e, sizeof(*e));
+	if (fread(&ct, sizeof(ct), 1, f) != 1)
+		return (feof(f) && !ferror(f) ? 0 : -1);
+
+	switch (ct.af) {
+	case 4:
+		e->from.af = AF_INET;
+		memcpy(&e->from.v4, ct.addr, sizeof(e->from.v4));
+		break;
+	case 6:
+		e->from.af = AF_INET6;
+		memcpy(&e->from.v6, ct.addr, sizeof(e->from.v6));
+		break;
+	default:
+		return (-1);
+	}
+	if (ct.netflow_version != 9 && ct.netflow_version != 10)
+		return (-1);
+	e->netflow_version = ct.netflow_version;
+	e->source_id = ntohl(ct.source_id);
+	e->template_id = ntohs(ct.template_id);
+	e->num_records = ntohs(ct.num_records);
+	e->refreshed = ntohl(ct.refreshed);
+	if (e->num_records == 0)
+		return (-1);
+
+	if ((e->records = calloc(e->num_records, sizeof(*e->records))) == NULL)
+		logerrx("%s: calloc failed", __func__);
+	for (i = 0; i < e->num_records; i++) {
+		if (fread(&cr, sizeof(cr), 1, f) != 1) {
+			free(e->records);
+			e->records = NULL;
+			return (-1);
+		}
+		e->records[i].type = ntohs(cr.type);
+		e->records[i].len = ntohs(cr.len);
+	}
+
+	return (1);
+}
+
 void
 dump_peers(struct peers *peers)
 {
 	struct peer_state *peer;
+	struct peer_seq *ps;
 	u_int i;
 
 	logit(LOG_INFO, "Peer state: %u of %u in used, %u forced deletions",
 	    peers->num_peers, peers->max_peers, peers->num_forced);
+	logit(LOG_INFO, "Peer sequence: lost:%llu gaps:%llu late:%llu "
+	    "resets:%llu", (unsigned long long)peers->seq.lost,
+	    (unsigned long long)peers->seq.gaps,
+	    (unsigned long long)peers->seq.late,
+	    (unsigned long long)peers->seq.resets);
 	i = 0;
-	SPLAY_FOREACH(peer, peer_tree, &peers->peer_tree) {
+	TAILQ_FOREACH(peer, &peers->peer_list, lp) {
 		logit(LOG_INFO, "peer %u - %s: "
 		    "packets:%llu flows:%llu invalid:%llu no_template:%llu",
 		    i, addr_ntop_buf(&peer->from),
@@ -606,6 +1129,22 @@ dump_peers(struct peers *peers)
 		    iso_time(peer->lastvalid.tv_sec, 0),
 		    (u_int)(peer->lastvalid.tv_usec / 1000),
 		    peer->last_version);
+		logit(LOG_INFO, "peer %u - %s: sequence lost:%llu gaps:%llu "
+		    "late:%llu resets:%llu", i, addr_ntop_buf(&peer->from),
+		    (unsigned long long)peer->seq.lost,
+		    (unsigned long long)peer->seq.gaps,
+		    (unsigned long long)peer->seq.late,
+		    (unsigned long long)peer->seq.resets);
+		TAILQ_FOREACH(ps, &peer->seqs, lp) {
+			logit(LOG_INFO, "peer %u - %s: v.%u source 0x%08x "
+			    "sequence:%u lost:%llu gaps:%llu late:%llu "
+			    "resets:%llu", i, addr_ntop_buf(&peer->from),
+			    ps->version, ps->source_id, ps->next,
+			    (unsigned long long)ps->counts.lost,
+			    (unsigned long long)ps->counts.gaps,
+			    (unsigned long long)ps->counts.late,
+			    (unsigned long long)ps->counts.resets);
+		}
 		i++;
 	}
 #ifdef PEER_DEBUG_NF9
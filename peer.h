@@ -26,9 +26,9 @@
 #define _PEER_H
 
 #include <sys/types.h>
+#include <stdio.h>
 #include "flowd-common.h"
 #include "sys-queue.h"
-#include "sys-tree.h"
 #include "addr.h"
 
 /* NetFlow v.9 specific state */
@@ -52,6 +52,32 @@
  * XXX - share these structures with IPFIX in the future
  */
 
+/*
+ * Templates are compiled, when they arrive, into a flat list of copies
+ * from a data record into a struct store_flow_complete. Adjacent fields
+ * that are also adjacent in the flow are merged into a single copy.
+ */
+struct peer_decode_op {
+	u_int16_t src;		/* offset within the data record */
+	u_int16_t dst;		/* offset within the flow */
+	u_int16_t len;
+};
+
+/* Address family to set for each address field the template carries */
+#define PEER_DECODE_MAX_AF	3
+struct peer_decode_af {
+	u_int16_t dst;		/* offset of the xaddr af within the flow */
+	sa_family_t af;
+};
+
+struct peer_decode_prog {
+	u_int32_t fields;	/* STORE_FIELD_* provided by the template */
+	u_int num_ops;
+	struct peer_decode_op *ops;
+	u_int num_af;
+	struct peer_decode_af af[PEER_DECODE_MAX_AF];
+};
+
 /* A record in a NetFlow v.9 template record */
 struct peer_nf9_record {
 	u_int type;
@@ -61,10 +87,15 @@ struct peer_nf9_record {
 /* A NetFlow v.9 template record */
 struct peer_nf9_template {
 	TAILQ_ENTRY(peer_nf9_template) lp;
+	struct peer_nf9_template *hnext;	/* peer template hash chain */
+	struct peer_nf9_source *source;
+	u_int32_t source_id;
 	u_int16_t template_id;
 	u_int num_records;
 	u_int total_len;
 	struct peer_nf9_record *records;
+	struct peer_decode_prog prog;
+	time_t refreshed;		/* when last received */
 };
 TAILQ_HEAD(peer_nf9_template_list, peer_nf9_template);
 
@@ -86,10 +117,15 @@ struct peer_nf10_record {
 /* A NetFlow v.10 template record */
 struct peer_nf10_template {
 	TAILQ_ENTRY(peer_nf10_template) lp;
+	struct peer_nf10_template *hnext;	/* peer template hash chain */
+	struct peer_nf10_source *source;
+	u_int32_t source_id;
 	u_int16_t template_id;
 	u_int num_records;
 	u_int total_len;
 	struct peer_nf10_record *records;
+	struct peer_decode_prog prog;
+	time_t refreshed;		/* when last received */
 };
 TAILQ_HEAD(peer_nf10_template_list, peer_nf10_template);
 
@@ -102,41 +138,133 @@ struct peer_nf10_source {
 };
 TAILQ_HEAD(peer_nf10_list, peer_nf10_source);
 
+/* Export sequence tracking */
+
+/*
+ * Each version numbers its exports differently: v.5, v.7 and IPFIX count
+ * the flows sent before the packet, while v.9 counts the packets. So gaps
+ * are measured in flows, except for v.9 where they are in packets. They
+ * are tracked for each v.5 engine and each v.9/IPFIX source ID, at most
+ * max_sources of them per peer.
+ */
+#define PEER_SEQ_LATE		4096		/* late, rather than a reset */
+#define PEER_SEQ_GAP		(1 << 20)	/* lost, rather than a reset */
+#define PEER_SEQ_UNKNOWN	((u_int)-1)	/* count for a packet to skip */
+
+struct peer_seq_counts {
+	u_int64_t lost;		/* missing flows, or packets for v.9 */
+	u_int64_t gaps;		/* times the sequence skipped ahead */
+	u_int64_t late;		/* out of order or duplicated packets */
+	u_int64_t resets;	/* jumps too far to call either */
+};
+
+struct peer_seq {
+	TAILQ_ENTRY(peer_seq) lp;
+	u_int version;
+	u_int32_t source_id;	/* or v.5 engine type and id */
+	int valid;		/* next is known */
+	u_int32_t next;		/* sequence number expected next */
+	struct peer_seq_counts counts;
+};
+TAILQ_HEAD(peer_seq_list, peer_seq);
+
 /* General per-peer state */
 
 /*
  * Structure to hold per-peer state. NetFlow v.9 / IPFIX will require that we
  * hold state for each peer to retain templates. This peer state is stored in
- * a splay tree for quick access by sender address and in a deque so we can
- * do fast LRU deletions on overflow
+ * an open addressing hash table for quick access by sender address and in a
+ * deque so we can do fast LRU deletions on overflow.
+ *
+ * Queued packets hold a reference to their peer, so a peer deleted while it
+ * has packets awaiting processing is unlinked at once but only freed when
+ * the last of them is done.
  */
 struct peer_state {
-	SPLAY_ENTRY(peer_state) tp;
 	TAILQ_ENTRY(peer_state) lp;
 	struct xaddr from;
+	u_int32_t hash;
+	u_int refs;
+	int deleted;
 	u_int64_t npackets, nflows, ninvalid, no_template;
 	struct timeval firstseen, lastvalid;
 	u_int last_version;
 
+	/* Sequence numbers, by source */
+	struct peer_seq_list seqs;
+	u_int num_seqs;
+	struct peer_seq_counts seq;
+
 	/* NetFlow v.9 specific portions */
 	struct peer_nf9_list nf9;
 	u_int nf9_num_sources;
+	struct peer_nf9_template **nf9_hash;	/* by source and template id */
+	u_int nf9_hash_size, nf9_num_templates;
+	struct peer_nf9_template *nf9_last;	/* last template found */
 
 	/* NetFlow v.10 specific portions */
 	struct peer_nf10_list nf10;
 	u_int nf10_num_sources;
+	struct peer_nf10_template **nf10_hash;
+	u_int nf10_hash_size, nf10_num_templates;
+	struct peer_nf10_template *nf10_last;
 };
 
-/* Structures for top of peer state tree and head of list */
-SPLAY_HEAD(peer_tree, peer_state);
+/* Head of peer LRU list */
 TAILQ_HEAD(peer_list, peer_state);
 
 /* Peer stateholding structure */
 struct peers {
-	struct peer_tree peer_tree;
+	struct peer_state **peer_hash;	/* linear probing, power of 2 size */
+	u_int peer_hash_size;
 	struct peer_list peer_list;
 	u_int max_peers, max_templates, max_sources, max_template_len;
 	u_int num_peers, num_forced;
+	struct peer_seq_counts seq;	/* over every peer, even deleted */
+};
+
+/* Template cache */
+
+/*
+ * Templates may be saved to a file and loaded again when flowd restarts,
+ * so flows that arrive before their sources next send templates are not
+ * lost. The file is a header followed by one entry per template, each
+ * followed by its records, all in network byte order.
+ */
+#define PEER_CACHE_MAGIC	0x666c7463	/* "fltc" */
+#define PEER_CACHE_VERSION	1
+
+struct peer_cache_header {
+	u_int32_t magic;
+	u_int32_t version;
+	u_int32_t saved;	/* when it was written */
+} __packed;
+
+struct peer_cache_template {
+	u_int8_t af;		/* 4 or 6 */
+	u_int8_t netflow_version;
+	u_int16_t reserved;
+	u_int8_t addr[16];
+	u_int32_t source_id;
+	u_int16_t template_id;
+	u_int16_t num_records;
+	u_int32_t refreshed;
+} __packed;
+
+struct peer_cache_record {
+	u_int16_t type;
+	u_int16_t len;
+} __packed;
+
+/* A template as read from the cache; v.10 records are alike */
+struct peer_cache_entry {
+	struct xaddr from;
+	u_int netflow_version;
+	u_int32_t source_id;
+	u_int16_t template_id;
+	time_t refreshed;
+	u_int num_records;
+	struct peer_nf9_record *records;
 };
 
 /* Peer state handling functions */
@@ -146,7 +274,18 @@ void scrub_peers(struct flowd_config *conf, struct peers *peers);
 void update_peer(struct peers *peers, struct peer_state *peer, u_int nflows,
     u_int netflow_version);
 struct peer_state *find_peer(struct peers *peers, struct xaddr *addr);
+void peer_hold(struct peer_state *peer);
+void peer_release(struct peer_state *peer);
 void dump_peers(struct peers *peers);
+void peer_sequence(struct peers *peers, struct peer_state *peer,
+    u_int netflow_version, u_int32_t source_id, u_int32_t sequence,
+    u_int count);
+
+/* Template cache functions */
+int peer_cache_write_header(FILE *f);
+int peer_cache_write(FILE *f, struct peers *peers);
+int peer_cache_read_header(FILE *f, struct peer_cache_header *hdr);
+int peer_cache_read(FILE *f, struct peer_cache_entry *e);
 
 /* NetFlow v.9 state handling functions */
 struct peer_nf9_template *peer_nf9_find_template(struct peer_state *peer,
@@ -27,6 +27,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <syslog.h>
+#include <time.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <pwd.h>
@@ -44,12 +45,24 @@ RCSID("$Id$");
 #endif
 
 static sig_atomic_t child_exited = 0;
+static sig_atomic_t exit_signalled = 0;
 static pid_t child_pid = -1;
 static int monitor_to_child_sock = -1;
 
-#define C2M_MSG_OPEN_LOG	1	/* send: nothing   ret: fdpass */
+#define C2M_MSG_OPEN_LOG	1	/* send: log_request ret: fdpass */
 #define C2M_MSG_OPEN_SOCKET	2	/* send: nothing   ret: fdpass */
 #define C2M_MSG_RECONFIGURE	3	/* send: nothing   ret: conf+fdpass */
+#define C2M_MSG_OPEN_CACHE	4	/* send: write     ret: ok+fdpass */
+#define C2M_MSG_COMMIT_CACHE	5	/* send: nothing   ret: ok */
+#define C2M_MSG_OPEN_RING	6	/* send: replace   ret: fdpass */
+
+/* Which of the files named by the logfile template to open */
+struct log_request {
+	int64_t		bucket;		/* start of its time interval */
+	u_int32_t	tag;
+	u_int32_t	tagged;
+	u_int32_t	index;		/* its index rather than the log */
+};
 
 /* Utility functions */
 static char *
@@ -121,7 +134,7 @@ write_pid_file(const char *path)
 int
 open_sender(struct xaddr *addr, u_int16_t port, size_t bufsiz)
 {
-	int fd;
+	int fd, fl;
 	struct sockaddr_storage ss;
 	socklen_t slen = sizeof(ss);
 
@@ -135,6 +148,13 @@ open_sender(struct xaddr *addr, u_int16_t port, size_t bufsiz)
 		return (-1);
 	}
 
+	/* A relay that can't keep up loses packets, it doesn't stall us */
+	if ((fl = fcntl(fd, F_GETFL, 0)) == -1 ||
+	    fcntl(fd, F_SETFL, fl | O_NONBLOCK) == -1) {
+		logitm(LOG_ERR, "fcntl(%d, O_NONBLOCK)", fd);
+		return (-1);
+	}
+
 	if (connect(fd, (struct sockaddr *)&ss, slen) == -1) {
 		logitm(LOG_ERR, "connect");
 		return (-1);
@@ -146,9 +166,61 @@ open_sender(struct xaddr *addr, u_int16_t port, size_t bufsiz)
 	return (fd);
 }
 
+/* Path of the stats socket, removed by the monitor when it exits */
+static char *stats_socket_path = NULL;
+
+int
+open_stats_socket(const char *path)
+{
+	int fd;
+	struct sockaddr_un local;
+	socklen_t slen;
+
+	bzero(&local, sizeof(local));
+	if (strlcpy(local.sun_path, path,
+	    sizeof(local.sun_path)) >= sizeof(local.sun_path)) {
+		logit(LOG_ERR, "Stats socket path too long");
+		return (-1);
+	}
+	local.sun_family = AF_UNIX;
+	slen = offsetof(struct sockaddr_un, sun_path) + strlen(path) + 1;
+#ifdef SOCK_HAS_LEN 
+	local.sun_len = slen;
+#endif
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		logitm(LOG_ERR, "(%s): %s", __func__, "socket");
+		return (-1);
+	}
+
+	/* A socket left by an earlier flowd would make bind fail */
+	if (unlink(path) == -1 && errno != ENOENT) {
+		logitm(LOG_ERR, "unlink(\"%s\")", path);
+		close(fd);
+		return (-1);
+	}
+	if (bind(fd, (struct sockaddr *)&local, slen) == -1) {
+		logitm(LOG_ERR, "bind(\"%s\")", path);
+		close(fd);
+		return (-1);
+	}
+	if (chmod(path, 0600) == -1 || listen(fd, 8) == -1) {
+		logitm(LOG_ERR, "%s: chmod/listen", __func__);
+		close(fd);
+		unlink(path);
+		return (-1);
+	}
+	if ((stats_socket_path = strdup(path)) == NULL)
+		logerrx("%s: strdup", __func__);
+
+	logit(LOG_DEBUG, "Stats socket %s fd = %d", path, fd);
+
+	return (fd);
+}
+
 int
 open_listener(struct xaddr *addr, u_int16_t port, size_t bufsiz,
-    struct join_groups *groups)
+    u_int32_t opts, struct join_groups *groups)
 {
 	int fd, fl, i, orig;
 	struct sockaddr_storage ss;
@@ -178,6 +250,16 @@ open_listener(struct xaddr *addr, u_int16_t port, size_t bufsiz,
 		return (-1);
 	}
 
+#ifdef SO_REUSEPORT
+	/* Let each worker bind its own socket; the kernel spreads the load */
+	fl = 1;
+	if ((opts & FLOWD_OPT_REUSEPORT) &&
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &fl, sizeof(fl)) == -1) {
+		logitm(LOG_ERR, "setsockopt(SO_REUSEPORT)");
+		return (-1);
+	}
+#endif
+
 #ifdef IPV6_V6ONLY
 	/* Set v6-only for AF_INET6 sockets (no mapped address crap) */
 	fl = 1;
@@ -225,6 +307,21 @@ open_listener(struct xaddr *addr, u_int16_t port, size_t bufsiz,
 		}
 	}
 
+#ifdef SO_TIMESTAMP
+	/* Have the kernel timestamp datagrams so we needn't */
+	fl = 1;
+	if ((opts & FLOWD_OPT_RECV_TIMESTAMP) &&
+	    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMP, &fl, sizeof(fl)) == -1)
+		logitm(LOG_ERR, "setsockopt(SO_TIMESTAMP)");
+#endif
+
+#ifdef SO_RXQ_OVFL
+	/* Have the kernel tell us about datagrams it drops for want of room */
+	fl = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &fl, sizeof(fl)) == -1)
+		logitm(LOG_DEBUG, "setsockopt(SO_RXQ_OVFL)");
+#endif
+
 	/* Shrink send buffer, because we never use it */
 	fl = 1024;
 	logit(LOG_DEBUG, "Setting socket send buf to %d", fl);
@@ -274,6 +371,12 @@ replace_conf(struct flowd_config *conf, struct flowd_config *newconf)
 	if (conf->log_socket != NULL)
 		free(conf->log_socket);
 	free(conf->pid_file);
+	if (conf->stats_socket != NULL)
+		free(conf->stats_socket);
+	if (conf->template_cache != NULL)
+		free(conf->template_cache);
+	if (conf->log_ring != NULL)
+		free(conf->log_ring);
 	while ((la = TAILQ_FIRST(&conf->listen_addrs)) != NULL) {
 		if (la->fd != -1)
 			close(la->fd);
@@ -351,12 +454,27 @@ recv_config(int fd, struct flowd_config *conf)
 		logitm(LOG_ERR, "%s: read(conf.log_socket_bufsiz)", __func__);
 		return (-1);
 	}
+	if (atomicio(read, fd, &newconf.log_socket_batch,
+	    sizeof(newconf.log_socket_batch)) !=
+	    sizeof(newconf.log_socket_batch)) {
+		logitm(LOG_ERR, "%s: read(conf.log_socket_batch)", __func__);
+		return (-1);
+	}
+	if (newconf.log_socket_batch > LIMIT_LOGSOCK_BATCH) {
+		logit(LOG_ERR, "%s: silly log socket batch size: %zu",
+		    __func__, newconf.log_socket_batch);
+		return (-1);
+	}
 
 	if ((newconf.pid_file = privsep_read_string(fd, 0)) == NULL) {
 		logit(LOG_ERR, "%s: Couldn't read conf.pid_file", __func__);
 		return (-1);
 	}
 
+	newconf.stats_socket = privsep_read_string(fd, 1);
+	newconf.template_cache = privsep_read_string(fd, 1);
+	newconf.log_ring = privsep_read_string(fd, 1);
+
 	if (atomicio(read, fd, &newconf.store_mask,
 	    sizeof(newconf.store_mask)) != sizeof(newconf.store_mask)) {
 		logitm(LOG_ERR, "%s: read(conf.store_mask)", __func__);
@@ -369,6 +487,269 @@ recv_config(int fd, struct flowd_config *conf)
 		return (-1);
 	}
 
+	if (atomicio(read, fd, &newconf.recv_batch,
+	    sizeof(newconf.recv_batch)) != sizeof(newconf.recv_batch)) {
+		logitm(LOG_ERR, "%s: read(conf.recv_batch)", __func__);
+		return (-1);
+	}
+	if (newconf.recv_batch == 0 || newconf.recv_batch > MAX_RECV_BATCH) {
+		logit(LOG_ERR, "%s: silly receive batch: %u", __func__,
+		    newconf.recv_batch);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.packet_pool,
+	    sizeof(newconf.packet_pool)) != sizeof(newconf.packet_pool)) {
+		logitm(LOG_ERR, "%s: read(conf.packet_pool)", __func__);
+		return (-1);
+	}
+	if (newconf.packet_pool == 0 || newconf.packet_pool > MAX_PACKET_POOL) {
+		logit(LOG_ERR, "%s: silly packet pool size: %u", __func__,
+		    newconf.packet_pool);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.workers,
+	    sizeof(newconf.workers)) != sizeof(newconf.workers)) {
+		logitm(LOG_ERR, "%s: read(conf.workers)", __func__);
+		return (-1);
+	}
+	if (newconf.workers == 0 || newconf.workers > MAX_WORKERS) {
+		logit(LOG_ERR, "%s: silly number of workers: %u", __func__,
+		    newconf.workers);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.max_peers,
+	    sizeof(newconf.max_peers)) != sizeof(newconf.max_peers)) {
+		logitm(LOG_ERR, "%s: read(conf.max_peers)", __func__);
+		return (-1);
+	}
+	if (newconf.max_peers == 0 || newconf.max_peers > LIMIT_MAX_PEERS) {
+		logit(LOG_ERR, "%s: silly max peers: %u", __func__,
+		    newconf.max_peers);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.max_templates,
+	    sizeof(newconf.max_templates)) != sizeof(newconf.max_templates)) {
+		logitm(LOG_ERR, "%s: read(conf.max_templates)", __func__);
+		return (-1);
+	}
+	if (newconf.max_templates == 0 || newconf.max_templates > LIMIT_MAX_TEMPLATES) {
+		logit(LOG_ERR, "%s: silly max templates: %u", __func__,
+		    newconf.max_templates);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.max_template_len,
+	    sizeof(newconf.max_template_len)) != sizeof(newconf.max_template_len)) {
+		logitm(LOG_ERR, "%s: read(conf.max_template_len)", __func__);
+		return (-1);
+	}
+	if (newconf.max_template_len == 0 || newconf.max_template_len > LIMIT_MAX_TEMPLATE_LEN) {
+		logit(LOG_ERR, "%s: silly max template length: %u", __func__,
+		    newconf.max_template_len);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.max_sources,
+	    sizeof(newconf.max_sources)) != sizeof(newconf.max_sources)) {
+		logitm(LOG_ERR, "%s: read(conf.max_sources)", __func__);
+		return (-1);
+	}
+	if (newconf.max_sources == 0 || newconf.max_sources > LIMIT_MAX_SOURCES) {
+		logit(LOG_ERR, "%s: silly max sources: %u", __func__,
+		    newconf.max_sources);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.log_prealloc_mb,
+	    sizeof(newconf.log_prealloc_mb)) != sizeof(newconf.log_prealloc_mb)) {
+		logitm(LOG_ERR, "%s: read(conf.log_prealloc_mb)", __func__);
+		return (-1);
+	}
+	if (newconf.log_prealloc_mb > LIMIT_LOG_PREALLOCATE) {
+		logit(LOG_ERR, "%s: silly logfile preallocate: %u", __func__,
+		    newconf.log_prealloc_mb);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.log_sync_mb,
+	    sizeof(newconf.log_sync_mb)) != sizeof(newconf.log_sync_mb)) {
+		logitm(LOG_ERR, "%s: read(conf.log_sync_mb)", __func__);
+		return (-1);
+	}
+	if (newconf.log_sync_mb > LIMIT_LOG_SYNC_MB) {
+		logit(LOG_ERR, "%s: silly logfile sync mb: %u", __func__,
+		    newconf.log_sync_mb);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.log_sync_ms,
+	    sizeof(newconf.log_sync_ms)) != sizeof(newconf.log_sync_ms)) {
+		logitm(LOG_ERR, "%s: read(conf.log_sync_ms)", __func__);
+		return (-1);
+	}
+	if (newconf.log_sync_ms > LIMIT_LOG_SYNC_MS) {
+		logit(LOG_ERR, "%s: silly logfile sync ms: %u", __func__,
+		    newconf.log_sync_ms);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.log_rotate,
+	    sizeof(newconf.log_rotate)) != sizeof(newconf.log_rotate)) {
+		logitm(LOG_ERR, "%s: read(conf.log_rotate)", __func__);
+		return (-1);
+	}
+	if (newconf.log_rotate > LIMIT_LOG_ROTATE) {
+		logit(LOG_ERR, "%s: silly logfile rotate: %u", __func__,
+		    newconf.log_rotate);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.log_index_flows,
+	    sizeof(newconf.log_index_flows)) !=
+	    sizeof(newconf.log_index_flows)) {
+		logitm(LOG_ERR, "%s: read(conf.log_index_flows)", __func__);
+		return (-1);
+	}
+	if (newconf.log_index_flows > LIMIT_LOG_INDEX_FLOWS) {
+		logit(LOG_ERR, "%s: silly logfile index flows: %u", __func__,
+		    newconf.log_index_flows);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.log_index_secs,
+	    sizeof(newconf.log_index_secs)) !=
+	    sizeof(newconf.log_index_secs)) {
+		logitm(LOG_ERR, "%s: read(conf.log_index_secs)", __func__);
+		return (-1);
+	}
+	if (newconf.log_index_secs > LIMIT_LOG_INDEX_SECS) {
+		logit(LOG_ERR, "%s: silly logfile index seconds: %u", __func__,
+		    newconf.log_index_secs);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.store_version,
+	    sizeof(newconf.store_version)) != sizeof(newconf.store_version)) {
+		logitm(LOG_ERR, "%s: read(conf.store_version)", __func__);
+		return (-1);
+	}
+	if (newconf.store_version != 0 &&
+	    newconf.store_version != STORE_VER_MAJOR &&
+	    newconf.store_version != STORE_BLOCK_VER_MAJOR) {
+		logit(LOG_ERR, "%s: silly store format: %u", __func__,
+		    newconf.store_version);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.log_compress,
+	    sizeof(newconf.log_compress)) != sizeof(newconf.log_compress)) {
+		logitm(LOG_ERR, "%s: read(conf.log_compress)", __func__);
+		return (-1);
+	}
+	if (newconf.log_compress > LIMIT_LOG_COMPRESS) {
+		logit(LOG_ERR, "%s: silly logfile compression level: %u",
+		    __func__, newconf.log_compress);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.output_queue_kb,
+	    sizeof(newconf.output_queue_kb)) !=
+	    sizeof(newconf.output_queue_kb)) {
+		logitm(LOG_ERR, "%s: read(conf.output_queue_kb)", __func__);
+		return (-1);
+	}
+	if (newconf.output_queue_kb < MIN_OUTPUT_QUEUE_KB ||
+	    newconf.output_queue_kb > LIMIT_OUTPUT_QUEUE_KB) {
+		logit(LOG_ERR, "%s: silly output queue size: %u", __func__,
+		    newconf.output_queue_kb);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.output_flush_kb,
+	    sizeof(newconf.output_flush_kb)) !=
+	    sizeof(newconf.output_flush_kb)) {
+		logitm(LOG_ERR, "%s: read(conf.output_flush_kb)", __func__);
+		return (-1);
+	}
+	if (newconf.output_flush_kb > newconf.output_queue_kb / 2) {
+		logit(LOG_ERR, "%s: silly output flush kb: %u", __func__,
+		    newconf.output_flush_kb);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.output_flush_ms,
+	    sizeof(newconf.output_flush_ms)) !=
+	    sizeof(newconf.output_flush_ms)) {
+		logitm(LOG_ERR, "%s: read(conf.output_flush_ms)", __func__);
+		return (-1);
+	}
+	if (newconf.output_flush_ms > LIMIT_OUTPUT_FLUSH_MS) {
+		logit(LOG_ERR, "%s: silly output flush ms: %u", __func__,
+		    newconf.output_flush_ms);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.template_cache_secs,
+	    sizeof(newconf.template_cache_secs)) !=
+	    sizeof(newconf.template_cache_secs)) {
+		logitm(LOG_ERR, "%s: read(conf.template_cache_secs)",
+		    __func__);
+		return (-1);
+	}
+	if (newconf.template_cache_secs == 0 ||
+	    newconf.template_cache_secs > LIMIT_TEMPLATE_CACHE_SECS) {
+		logit(LOG_ERR, "%s: silly template cache interval: %u",
+		    __func__, newconf.template_cache_secs);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.template_cache_age,
+	    sizeof(newconf.template_cache_age)) !=
+	    sizeof(newconf.template_cache_age)) {
+		logitm(LOG_ERR, "%s: read(conf.template_cache_age)", __func__);
+		return (-1);
+	}
+	if (newconf.template_cache_age == 0 ||
+	    newconf.template_cache_age > LIMIT_TEMPLATE_CACHE_AGE) {
+		logit(LOG_ERR, "%s: silly template cache age: %u",
+		    __func__, newconf.template_cache_age);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.log_ring_size,
+	    sizeof(newconf.log_ring_size)) !=
+	    sizeof(newconf.log_ring_size)) {
+		logitm(LOG_ERR, "%s: read(conf.log_ring_size)", __func__);
+		return (-1);
+	}
+	if (newconf.log_ring != NULL &&
+	    (newconf.log_ring_size < MIN_RING_SIZE ||
+	    newconf.log_ring_size > LIMIT_RING_SIZE ||
+	    (newconf.log_ring_size & (newconf.log_ring_size - 1)) != 0)) {
+		logit(LOG_ERR, "%s: silly log ring size: %u",
+		    __func__, newconf.log_ring_size);
+		return (-1);
+	}
+
+	if (atomicio(read, fd, &newconf.aggr,
+	    sizeof(newconf.aggr)) != sizeof(newconf.aggr)) {
+		logitm(LOG_ERR, "%s: read(conf.aggr)", __func__);
+		return (-1);
+	}
+	if (newconf.aggr.key != 0 && (newconf.aggr.max == 0 ||
+	    newconf.aggr.max > LIMIT_AGGR_MAX ||
+	    newconf.aggr.timeout == 0 ||
+	    newconf.aggr.timeout > LIMIT_AGGR_TIMEOUT ||
+	    newconf.aggr.src_len4 > 32 || newconf.aggr.src_len6 > 128 ||
+	    newconf.aggr.dst_len4 > 32 || newconf.aggr.dst_len6 > 128)) {
+		logit(LOG_ERR, "%s: silly aggregation parameters", __func__);
+		return (-1);
+	}
+
 	/* Read Listen Addrs */
 	if (atomicio(read, fd, &n, sizeof(n)) != sizeof(n)) {
 		logitm(LOG_ERR, "%s: read(num listen_addrs)", __func__);
@@ -516,12 +897,34 @@ send_config(int fd, struct flowd_config *conf)
 		logitm(LOG_ERR, "%s: write(conf.log_socket_bufsiz)", __func__);
 		return (-1);
 	}
+	if (atomicio(vwrite, fd, &conf->log_socket_batch,
+	    sizeof(conf->log_socket_batch)) !=
+	    sizeof(conf->log_socket_batch)) {
+		logitm(LOG_ERR, "%s: write(conf.log_socket_batch)", __func__);
+		return (-1);
+	}
 
 	if (privsep_write_string(fd, conf->pid_file, 0) == -1) {
 		logit(LOG_ERR, "%s: Couldn't write conf.pid_file", __func__);
 		return (-1);
 	}
 
+	if (privsep_write_string(fd, conf->stats_socket, 1) == -1) {
+		logit(LOG_ERR, "%s: Couldn't write conf.stats_socket", __func__);
+		return (-1);
+	}
+
+	if (privsep_write_string(fd, conf->template_cache, 1) == -1) {
+		logit(LOG_ERR, "%s: Couldn't write conf.template_cache",
+		    __func__);
+		return (-1);
+	}
+
+	if (privsep_write_string(fd, conf->log_ring, 1) == -1) {
+		logit(LOG_ERR, "%s: Couldn't write conf.log_ring", __func__);
+		return (-1);
+	}
+
 	if (atomicio(vwrite, fd, &conf->store_mask,
 	    sizeof(conf->store_mask)) != sizeof(conf->store_mask)) {
 		logitm(LOG_ERR, "%s: write(conf.store_mask)", __func__);
@@ -534,6 +937,142 @@ send_config(int fd, struct flowd_config *conf)
 		return (-1);
 	}
 
+	if (atomicio(vwrite, fd, &conf->recv_batch,
+	    sizeof(conf->recv_batch)) != sizeof(conf->recv_batch)) {
+		logitm(LOG_ERR, "%s: write(conf.recv_batch)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->packet_pool,
+	    sizeof(conf->packet_pool)) != sizeof(conf->packet_pool)) {
+		logitm(LOG_ERR, "%s: write(conf.packet_pool)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->workers,
+	    sizeof(conf->workers)) != sizeof(conf->workers)) {
+		logitm(LOG_ERR, "%s: write(conf.workers)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->max_peers,
+	    sizeof(conf->max_peers)) != sizeof(conf->max_peers)) {
+		logitm(LOG_ERR, "%s: write(conf.max_peers)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->max_templates,
+	    sizeof(conf->max_templates)) != sizeof(conf->max_templates)) {
+		logitm(LOG_ERR, "%s: write(conf.max_templates)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->max_template_len,
+	    sizeof(conf->max_template_len)) != sizeof(conf->max_template_len)) {
+		logitm(LOG_ERR, "%s: write(conf.max_template_len)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->max_sources,
+	    sizeof(conf->max_sources)) != sizeof(conf->max_sources)) {
+		logitm(LOG_ERR, "%s: write(conf.max_sources)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->log_prealloc_mb,
+	    sizeof(conf->log_prealloc_mb)) != sizeof(conf->log_prealloc_mb)) {
+		logitm(LOG_ERR, "%s: write(conf.log_prealloc_mb)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->log_sync_mb,
+	    sizeof(conf->log_sync_mb)) != sizeof(conf->log_sync_mb)) {
+		logitm(LOG_ERR, "%s: write(conf.log_sync_mb)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->log_sync_ms,
+	    sizeof(conf->log_sync_ms)) != sizeof(conf->log_sync_ms)) {
+		logitm(LOG_ERR, "%s: write(conf.log_sync_ms)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->log_rotate,
+	    sizeof(conf->log_rotate)) != sizeof(conf->log_rotate)) {
+		logitm(LOG_ERR, "%s: write(conf.log_rotate)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->log_index_flows,
+	    sizeof(conf->log_index_flows)) != sizeof(conf->log_index_flows)) {
+		logitm(LOG_ERR, "%s: write(conf.log_index_flows)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->log_index_secs,
+	    sizeof(conf->log_index_secs)) != sizeof(conf->log_index_secs)) {
+		logitm(LOG_ERR, "%s: write(conf.log_index_secs)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->store_version,
+	    sizeof(conf->store_version)) != sizeof(conf->store_version)) {
+		logitm(LOG_ERR, "%s: write(conf.store_version)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->log_compress,
+	    sizeof(conf->log_compress)) != sizeof(conf->log_compress)) {
+		logitm(LOG_ERR, "%s: write(conf.log_compress)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->output_queue_kb,
+	    sizeof(conf->output_queue_kb)) != sizeof(conf->output_queue_kb)) {
+		logitm(LOG_ERR, "%s: write(conf.output_queue_kb)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->output_flush_kb,
+	    sizeof(conf->output_flush_kb)) != sizeof(conf->output_flush_kb)) {
+		logitm(LOG_ERR, "%s: write(conf.output_flush_kb)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->output_flush_ms,
+	    sizeof(conf->output_flush_ms)) != sizeof(conf->output_flush_ms)) {
+		logitm(LOG_ERR, "%s: write(conf.output_flush_ms)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->template_cache_secs,
+	    sizeof(conf->template_cache_secs)) !=
+	    sizeof(conf->template_cache_secs)) {
+		logitm(LOG_ERR, "%s: write(conf.template_cache_secs)",
+		    __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->template_cache_age,
+	    sizeof(conf->template_cache_age)) !=
+	    sizeof(conf->template_cache_age)) {
+		logitm(LOG_ERR, "%s: write(conf.template_cache_age)",
+		    __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->log_ring_size,
+	    sizeof(conf->log_ring_size)) != sizeof(conf->log_ring_size)) {
+		logitm(LOG_ERR, "%s: write(conf.log_ring_size)", __func__);
+		return (-1);
+	}
+
+	if (atomicio(vwrite, fd, &conf->aggr,
+	    sizeof(conf->aggr)) != sizeof(conf->aggr)) {
+		logitm(LOG_ERR, "%s: write(conf.aggr)", __func__);
+		return (-1);
+	}
+
 	/* Write Listen Addrs */
 	n = 0;
 	TAILQ_FOREACH(la, &conf->listen_addrs, entry)
@@ -684,7 +1223,9 @@ child_get_config(const char *path, struct flowd_config *conf)
 	FILE *cfg;
 	struct passwd *pw = NULL;
 	struct flowd_config newconf = {
-		NULL, NULL, 0, NULL, 0, 0,
+		NULL, NULL, 0, 0, NULL, NULL, NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		{ 0, 0, 0, 0, 0, 0, 0 },
 		TAILQ_HEAD_INITIALIZER(newconf.listen_addrs),
 		TAILQ_HEAD_INITIALIZER(newconf.forward_addrs),
 		TAILQ_HEAD_INITIALIZER(newconf.filter_list),
@@ -794,14 +1335,22 @@ read_config(const char *path, struct flowd_config *conf)
 
 /* Client functions */
 int
-client_open_log(int monitor_fd)
+client_open_log(int monitor_fd, time_t bucket, int tagged, u_int32_t tag,
+    int index)
 {
 	int fd = -1;
 	u_int msg = C2M_MSG_OPEN_LOG;
+	struct log_request req;
 
 	logit(LOG_DEBUG, "%s: entering", __func__);
 
-	if (atomicio(vwrite, monitor_fd, &msg, sizeof(msg)) != sizeof(msg)) {
+	memset(&req, 0, sizeof(req));
+	req.bucket = bucket;
+	req.tag = tag;
+	req.tagged = tagged != 0;
+	req.index = index != 0;
+	if (atomicio(vwrite, monitor_fd, &msg, sizeof(msg)) != sizeof(msg) ||
+	    atomicio(vwrite, monitor_fd, &req, sizeof(req)) != sizeof(req)) {
 		logitm(LOG_ERR, "%s: write", __func__);
 		return (-1);
 	}
@@ -829,6 +1378,69 @@ client_open_socket(int monitor_fd)
 	return (fd);
 }
 
+/* Open the flow ring, or replace it with an empty one */
+int
+client_open_ring(int monitor_fd, int replace)
+{
+	u_int msg = C2M_MSG_OPEN_RING, req = replace != 0;
+
+	logit(LOG_DEBUG, "%s: entering", __func__);
+
+	if (atomicio(vwrite, monitor_fd, &msg, sizeof(msg)) != sizeof(msg) ||
+	    atomicio(vwrite, monitor_fd, &req, sizeof(req)) != sizeof(req)) {
+		logitm(LOG_ERR, "%s: write", __func__);
+		return (-1);
+	}
+
+	return (receive_fd(monitor_fd));
+}
+
+/*
+ * Open the template cache for reading, or a new one for writing that
+ * replaces it when committed. Returns -1 if it can't be opened, which
+ * isn't fatal.
+ */
+int
+client_open_cache(int monitor_fd, int writing)
+{
+	u_int msg = C2M_MSG_OPEN_CACHE, req = writing != 0, ok;
+
+	logit(LOG_DEBUG, "%s: entering", __func__);
+
+	if (atomicio(vwrite, monitor_fd, &msg, sizeof(msg)) != sizeof(msg) ||
+	    atomicio(vwrite, monitor_fd, &req, sizeof(req)) != sizeof(req)) {
+		logitm(LOG_ERR, "%s: write", __func__);
+		return (-1);
+	}
+	if (atomicio(read, monitor_fd, &ok, sizeof(ok)) != sizeof(ok)) {
+		logitm(LOG_ERR, "%s: read(ok)", __func__);
+		return (-1);
+	}
+	if (!ok)
+		return (-1);
+
+	return (receive_fd(monitor_fd));
+}
+
+int
+client_commit_cache(int monitor_fd)
+{
+	u_int msg = C2M_MSG_COMMIT_CACHE, ok;
+
+	logit(LOG_DEBUG, "%s: entering", __func__);
+
+	if (atomicio(vwrite, monitor_fd, &msg, sizeof(msg)) != sizeof(msg)) {
+		logitm(LOG_ERR, "%s: write", __func__);
+		return (-1);
+	}
+	if (atomicio(read, monitor_fd, &ok, sizeof(ok)) != sizeof(ok)) {
+		logitm(LOG_ERR, "%s: read(ok)", __func__);
+		return (-1);
+	}
+
+	return (ok ? 0 : -1);
+}
+
 int
 client_reconfigure(int monitor_fd, struct flowd_config *conf)
 {
@@ -866,19 +1478,75 @@ client_reconfigure(int monitor_fd, struct flowd_config *conf)
 }
 
 /* Client answer functions */
+
+/* Expand the logfile template for a time interval and tag */
+static int
+log_path(struct flowd_config *conf, struct log_request *req, char *path,
+    size_t len)
+{
+	char tmpl[1024], tag[16];
+	const char *cp;
+	struct tm *tm;
+	time_t t;
+
+	/* The tag goes in first, so strftime(3) leaves it alone */
+	if ((cp = strstr(conf->log_file, LOGFILE_TAG_ESCAPE)) == NULL) {
+		if (strlcpy(tmpl, conf->log_file, sizeof(tmpl)) >= sizeof(tmpl))
+			goto toolong;
+	} else {
+		if (req->tagged)
+			snprintf(tag, sizeof(tag), "%u", req->tag);
+		else
+			strlcpy(tag, "untagged", sizeof(tag));
+		if (snprintf(tmpl, sizeof(tmpl), "%.*s%s%s",
+		    (int)(cp - conf->log_file), conf->log_file, tag,
+		    cp + strlen(LOGFILE_TAG_ESCAPE)) >= (int)sizeof(tmpl))
+			goto toolong;
+	}
+
+	/* Names are only dated when the log is rotated */
+	if (conf->log_rotate == 0) {
+		if (strlcpy(path, tmpl, len) >= len)
+			goto toolong;
+		return (0);
+	}
+	t = req->bucket;
+	if ((tm = localtime(&t)) == NULL || strftime(path, len, tmpl, tm) == 0)
+		goto toolong;
+	return (0);
+
+ toolong:
+	logit(LOG_ERR, "%s: logfile name too long", __func__);
+	return (-1);
+}
+
 static int
 answer_open_log(struct flowd_config *conf, int client_fd)
 {
+	struct log_request req;
+	char path[1024];
 	int fd;
 
 	logit(LOG_DEBUG, "%s: entering", __func__);
 
+	if (atomicio(read, client_fd, &req, sizeof(req)) != sizeof(req)) {
+		logitm(LOG_ERR, "%s: read(log_request)", __func__);
+		return (-1);
+	}
+
 	if (conf->log_file == NULL)
 		logerrx("%s: attempt to open NULL log", __func__);
+	if (log_path(conf, &req, path, sizeof(path)) == -1)
+		return (-1);
+	if (req.index && strlcat(path, STORE_INDEX_SUFFIX,
+	    sizeof(path)) >= sizeof(path)) {
+		logit(LOG_ERR, "%s: logfile name too long", __func__);
+		return (-1);
+	}
 
-	fd = open(conf->log_file, O_RDWR|O_APPEND|O_CREAT, 0600);
+	fd = open(path, O_RDWR|O_APPEND|O_CREAT, 0600);
 	if (fd == -1) {
-		logitm(LOG_ERR, "%s: open", __func__);
+		logitm(LOG_ERR, "%s: open(%s)", __func__, path);
 		return (-1);
 	}
 	if (send_fd(client_fd, fd) == -1)
@@ -940,6 +1608,112 @@ answer_open_socket(struct flowd_config *conf, int client_fd)
 	return (0);
 }
 
+static int
+answer_open_ring(struct flowd_config *conf, int client_fd)
+{
+	u_int req;
+	int fd;
+
+	logit(LOG_DEBUG, "%s: entering", __func__);
+
+	if (atomicio(read, client_fd, &req, sizeof(req)) != sizeof(req)) {
+		logitm(LOG_ERR, "%s: read(req)", __func__);
+		return (-1);
+	}
+
+	if (conf->log_ring == NULL)
+		logerrx("%s: attempt to open NULL log ring", __func__);
+	/* Consumers of the old one keep it until they see it is closed */
+	if (req && unlink(conf->log_ring) == -1 && errno != ENOENT) {
+		logitm(LOG_ERR, "%s: unlink(%s)", __func__, conf->log_ring);
+		return (-1);
+	}
+	if ((fd = open(conf->log_ring, O_RDWR|O_CREAT, 0600)) == -1) {
+		logitm(LOG_ERR, "%s: open(%s)", __func__, conf->log_ring);
+		return (-1);
+	}
+	if (send_fd(client_fd, fd) == -1)
+		return (-1);
+	close(fd);
+	return (0);
+}
+
+/* A new cache is written beside the old, then renamed over it */
+static int
+cache_new_path(struct flowd_config *conf, char *path, size_t len)
+{
+	if (snprintf(path, len, "%s.new", conf->template_cache) >= (int)len) {
+		logit(LOG_ERR, "%s: template cache name too long", __func__);
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+answer_open_cache(struct flowd_config *conf, int client_fd)
+{
+	char path[1024];
+	u_int req, ok;
+	int fd = -1;
+
+	logit(LOG_DEBUG, "%s: entering", __func__);
+
+	if (atomicio(read, client_fd, &req, sizeof(req)) != sizeof(req)) {
+		logitm(LOG_ERR, "%s: read(req)", __func__);
+		return (-1);
+	}
+
+	if (conf->template_cache == NULL)
+		logerrx("%s: attempt to open NULL template cache", __func__);
+	if (!req) {
+		/* There is none the first time */
+		if ((fd = open(conf->template_cache, O_RDONLY)) == -1 &&
+		    errno != ENOENT) {
+			logitm(LOG_WARNING, "%s: open(%s)", __func__,
+			    conf->template_cache);
+		}
+	} else if (cache_new_path(conf, path, sizeof(path)) == 0 &&
+	    (fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600)) == -1)
+		logitm(LOG_WARNING, "%s: open(%s)", __func__, path);
+
+	ok = fd != -1;
+	if (atomicio(vwrite, client_fd, &ok, sizeof(ok)) != sizeof(ok)) {
+		logitm(LOG_ERR, "%s: write(ok)", __func__);
+		return (-1);
+	}
+	if (!ok)
+		return (0);
+	if (send_fd(client_fd, fd) == -1)
+		return (-1);
+	close(fd);
+	return (0);
+}
+
+static int
+answer_commit_cache(struct flowd_config *conf, int client_fd)
+{
+	char path[1024];
+	u_int ok = 0;
+
+	logit(LOG_DEBUG, "%s: entering", __func__);
+
+	if (conf->template_cache == NULL)
+		logerrx("%s: attempt to commit NULL template cache", __func__);
+	if (cache_new_path(conf, path, sizeof(path)) == 0) {
+		if (rename(path, conf->template_cache) == -1) {
+			logitm(LOG_WARNING, "%s: rename(%s)", __func__,
+			    path);
+		} else
+			ok = 1;
+	}
+
+	if (atomicio(vwrite, client_fd, &ok, sizeof(ok)) != sizeof(ok)) {
+		logitm(LOG_ERR, "%s: write(ok)", __func__);
+		return (-1);
+	}
+	return (0);
+}
+
 static int
 answer_reconfigure(struct flowd_config *conf, int client_fd,
     const char *config_path)
@@ -969,7 +1743,7 @@ answer_reconfigure(struct flowd_config *conf, int client_fd,
 
 	TAILQ_FOREACH(la, &newconf.listen_addrs, entry) {
 		if ((la->fd = open_listener(&la->addr, la->port, la->bufsiz,
-		    &conf->join_groups)) == -1) {
+		    newconf.opts, &conf->join_groups)) == -1) {
 			logit(LOG_ERR, "Listener setup of [%s]:%d failed",
 			    addr_ntop_buf(&la->addr), la->port);
 			ok = 0;
@@ -1020,7 +1794,9 @@ answer_reconfigure(struct flowd_config *conf, int client_fd,
 static void
 sighand_exit(int signo)
 {
-	if (monitor_to_child_sock != -1)
+	/* The child may still need us to save state, unless asked twice */
+	if (monitor_to_child_sock != -1 &&
+	    (child_exited || child_pid <= 1 || exit_signalled++))
 		shutdown(monitor_to_child_sock, SHUT_RDWR);
 	if (!child_exited && child_pid > 1)
 		kill(child_pid, signo);
@@ -1079,6 +1855,24 @@ privsep_master(struct flowd_config *conf, const char *config_path)
 				exit(1);
 			}
 			break;
+		case C2M_MSG_OPEN_RING:
+			if (answer_open_ring(conf, monitor_to_child_sock)) {
+				unlink(conf->pid_file);
+				exit(1);
+			}
+			break;
+		case C2M_MSG_OPEN_CACHE:
+			if (answer_open_cache(conf, monitor_to_child_sock)) {
+				unlink(conf->pid_file);
+				exit(1);
+			}
+			break;
+		case C2M_MSG_COMMIT_CACHE:
+			if (answer_commit_cache(conf, monitor_to_child_sock)) {
+				unlink(conf->pid_file);
+				exit(1);
+			}
+			break;
 		default:
 			logit(LOG_ERR, "Unknown message %d", what);
 			break;
@@ -1101,6 +1895,8 @@ privsep_master(struct flowd_config *conf, const char *config_path)
 	}
 
 	unlink(conf->pid_file);
+	if (stats_socket_path != NULL)
+		unlink(stats_socket_path);
 	exit(r);
 }
 
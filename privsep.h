@@ -25,12 +25,17 @@
 
 /* privsep.c */
 void privsep_init(struct flowd_config *, int *, const char *);
-int client_open_log(int);
+int client_open_log(int, time_t, int, u_int32_t, int);
 int client_open_socket(int);
-int open_listener(struct xaddr *, u_int16_t, size_t, struct join_groups *);
+int open_listener(struct xaddr *, u_int16_t, size_t, u_int32_t,
+    struct join_groups *);
 int read_config(const char *, struct flowd_config *);
 int open_sender(struct xaddr *, u_int16_t, size_t);
+int open_stats_socket(const char *);
 int client_reconfigure(int, struct flowd_config *);
+int client_open_ring(int, int);
+int client_open_cache(int, int);
+int client_commit_cache(int);
 
 /* privsep_fdpass.c */
 int send_fd(int, int);
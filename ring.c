@@ -0,0 +1,381 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "flowd-common.h"
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "store.h"
+#include "ring.h"
+
+RCSID("$Id$");
+
+/* Stash error message and return */
+#define RFAILX(i, m) do {						\
+		if (ebuf != NULL && elen > 0)				\
+			snprintf(ebuf, elen, "%s: %s", __func__, m);	\
+		return (i);						\
+	} while (0)
+
+/* Stash error message, appending strerror into "ebuf" and return */
+#define RFAIL(i, m) do {						\
+		if (ebuf != NULL && elen > 0) {				\
+			snprintf(ebuf, elen, "%s: %s: %s", __func__, m,	\
+			    strerror(errno));				\
+		}							\
+		return (i);						\
+	} while (0)
+
+/*
+ * The writer publishes with a release store, after a full barrier between
+ * setting "reserve" and overwriting data; readers load "head" with acquire
+ * and fence before checking "reserve". Older compilers only have the
+ * __sync builtins, which are all full barriers.
+ */
+static u_int64_t
+ring_load(const volatile u_int64_t *p)
+{
+#ifdef __ATOMIC_ACQUIRE
+	return (__atomic_load_n(p, __ATOMIC_ACQUIRE));
+#else
+	u_int64_t v = *p;
+
+	__sync_synchronize();
+	return (v);
+#endif
+}
+
+static void
+ring_store(volatile u_int64_t *p, u_int64_t v)
+{
+#ifdef __ATOMIC_RELEASE
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+#else
+	__sync_synchronize();
+	*p = v;
+#endif
+}
+
+static void
+ring_fence(void)
+{
+#ifdef __ATOMIC_SEQ_CST
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+#else
+	__sync_synchronize();
+#endif
+}
+
+static int
+ring_header_valid(const struct ring_header *hdr, size_t file_len)
+{
+	return (hdr->magic == RING_MAGIC && hdr->version == RING_VERSION &&
+	    hdr->data_offset == RING_DATA_OFFSET &&
+	    hdr->size >= MIN_RING_SIZE && hdr->size <= LIMIT_RING_SIZE &&
+	    (hdr->size & (hdr->size - 1)) == 0 &&
+	    file_len == (size_t)hdr->data_offset + hdr->size);
+}
+
+/* Mark a ring that is to be replaced as finished with, if it is one */
+static void
+ring_close_stale(int fd, off_t len)
+{
+	struct ring_header *hdr;
+
+	if (len < (off_t)sizeof(*hdr))
+		return;
+	hdr = mmap(NULL, sizeof(*hdr), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		return;
+	if (hdr->magic == RING_MAGIC)
+		hdr->closed = 1;
+	munmap(hdr, sizeof(*hdr));
+}
+
+/*
+ * Map a ring for writing. One left by an earlier run with the same size is
+ * carried on with; if it is some other size, RING_ERR_SIZE is returned and
+ * the caller should replace the file with an empty one.
+ */
+int
+ring_writer_open(struct ring_writer *w, int fd, u_int32_t size, char *ebuf,
+    int elen)
+{
+	struct ring_header *hdr;
+	struct stat st;
+	size_t len = (size_t)RING_DATA_OFFSET + size;
+
+	bzero(w, sizeof(*w));
+	if (size < MIN_RING_SIZE || size > LIMIT_RING_SIZE ||
+	    (size & (size - 1)) != 0)
+		RFAILX(RING_ERR_SIZE, "bad ring size");
+	if (fstat(fd, &st) == -1)
+		RFAIL(RING_ERR_IO, "fstat");
+	if (st.st_size != 0 && st.st_size != (off_t)len) {
+		ring_close_stale(fd, st.st_size);
+		RFAILX(RING_ERR_SIZE, "ring has changed size");
+	}
+	if (st.st_size == 0 && ftruncate(fd, len) == -1)
+		RFAIL(RING_ERR_IO, "ftruncate");
+
+	hdr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		RFAIL(RING_ERR_IO, "mmap");
+
+	if (!ring_header_valid(hdr, len)) {
+		bzero(hdr, sizeof(*hdr));
+		hdr->size = size;
+		hdr->data_offset = RING_DATA_OFFSET;
+		hdr->version = RING_VERSION;
+		ring_fence();
+		hdr->magic = RING_MAGIC;
+	}
+	/* A write may have been cut short, but never beyond "reserve" */
+	if (hdr->reserve < hdr->head)
+		hdr->reserve = hdr->head;
+	hdr->closed = 0;
+
+	w->hdr = hdr;
+	w->data = (u_int8_t *)hdr + RING_DATA_OFFSET;
+	w->map_len = len;
+	w->size = size;
+	w->head = hdr->head;
+	w->flows = hdr->flows;
+
+	return (RING_ERR_OK);
+}
+
+/*
+ * Whole records from the start of buf that make up no more than max
+ * bytes, and how many there are.
+ */
+static size_t
+ring_span(const u_int8_t *buf, size_t len, size_t max, u_int *nflows)
+{
+	const struct store_flow *hdr;
+	size_t off, flen;
+
+	*nflows = 0;
+	for (off = 0; off + sizeof(*hdr) <= len; off += flen) {
+		hdr = (const struct store_flow *)(buf + off);
+		flen = sizeof(*hdr) + hdr->len_words * 4;
+		if (off + flen > len || off + flen > max)
+			break;
+		(*nflows)++;
+	}
+	return (off);
+}
+
+/*
+ * Copy a run of v3 records into the ring. At most half the ring is
+ * published at once, so readers see progress within a large run.
+ */
+void
+ring_write(struct ring_writer *w, const u_int8_t *buf, size_t len)
+{
+	const struct store_flow *hdr;
+	size_t off, room, n;
+	u_int nflows;
+
+	while (len >= sizeof(*hdr)) {
+		hdr = (const struct store_flow *)buf;
+		if (sizeof(*hdr) + hdr->len_words * 4 > len)
+			break;
+		off = w->head & (w->size - 1);
+		room = w->size - off;
+		n = ring_span(buf, len, MIN(room, w->size / 2), &nflows);
+		if (n == 0) {
+			/* The next record doesn't fit before the end */
+			ring_store(&w->hdr->reserve, w->head + room);
+			ring_fence();
+			w->data[off] = RING_PAD;
+			w->head += room;
+			ring_store(&w->hdr->head, w->head);
+			w->pads++;
+			continue;
+		}
+		ring_store(&w->hdr->reserve, w->head + n);
+		ring_fence();
+		memcpy(w->data + off, buf, n);
+		w->head += n;
+		w->flows += nflows;
+		ring_store(&w->hdr->flows, w->flows);
+		ring_store(&w->hdr->head, w->head);
+		w->writes++;
+		buf += n;
+		len -= n;
+	}
+}
+
+void
+ring_writer_close(struct ring_writer *w)
+{
+	if (w->hdr == NULL)
+		return;
+	ring_fence();
+	w->hdr->closed = 1;
+	munmap(w->hdr, w->map_len);
+	w->hdr = NULL;
+}
+
+/*
+ * The head and the count of flows before it. The two are only consistent
+ * when no write is in progress, which readers seldom have to wait for.
+ */
+static void
+ring_snapshot(const struct ring_header *hdr, u_int64_t *head, u_int64_t *flows)
+{
+	u_int tries;
+
+	for (tries = 0; tries < 1000; tries++) {
+		*head = ring_load(&hdr->head);
+		*flows = ring_load(&hdr->flows);
+		ring_fence();
+		if (ring_load(&hdr->reserve) == *head)
+			return;
+	}
+}
+
+/* Map a ring for reading, starting with the next flow to be written */
+int
+ring_reader_open(struct ring_reader *r, const char *path, char *ebuf, int elen)
+{
+	struct ring_header *hdr;
+	struct stat st;
+	int fd;
+
+	bzero(r, sizeof(*r));
+	if ((fd = open(path, O_RDONLY)) == -1)
+		RFAIL(RING_ERR_IO, "open");
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		RFAIL(RING_ERR_IO, "fstat");
+	}
+	if (st.st_size < RING_DATA_OFFSET + MIN_RING_SIZE ||
+	    st.st_size > RING_DATA_OFFSET + LIMIT_RING_SIZE) {
+		close(fd);
+		RFAILX(RING_ERR_BAD, "not a flow ring");
+	}
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+		RFAIL(RING_ERR_IO, "mmap");
+	if (!ring_header_valid(hdr, st.st_size)) {
+		munmap(hdr, st.st_size);
+		RFAILX(RING_ERR_BAD, "not a flow ring");
+	}
+
+	r->map = hdr;
+	r->hdr = hdr;
+	r->data = (const u_int8_t *)hdr + RING_DATA_OFFSET;
+	r->map_len = st.st_size;
+	r->size = hdr->size;
+	ring_snapshot(hdr, &r->cursor, &r->cursor_flows);
+
+	return (RING_ERR_OK);
+}
+
+/* Skip to the head after being overrun */
+static int
+ring_overrun(struct ring_reader *r)
+{
+	u_int64_t head, flows;
+
+	ring_snapshot(r->hdr, &head, &flows);
+	if (flows > r->cursor_flows)
+		r->lost += flows - r->cursor_flows;
+	r->overruns++;
+	r->cursor = head;
+	r->cursor_flows = flows;
+
+	return (RING_ERR_OVERRUN);
+}
+
+/*
+ * Copy as many whole records as have been written and will fit into buf,
+ * setting *got to their length. Returns RING_ERR_OVERRUN, and skips to the
+ * newest flow, if the reader has fallen so far behind that flows it had
+ * not read were overwritten; RING_ERR_CLOSED once flowd has closed the
+ * ring and everything in it has been read; and RING_ERR_SIZE if buf is
+ * too small for the next record. Otherwise RING_ERR_OK, with *got 0 if
+ * there was nothing new.
+ */
+int
+ring_read(struct ring_reader *r, u_int8_t *buf, size_t len, size_t *got)
+{
+	const struct store_flow *hdr;
+	u_int64_t head, pos;
+	size_t off, flen, n = 0;
+	u_int nflows = 0;
+
+	*got = 0;
+	head = ring_load(&r->hdr->head);
+	if (head == r->cursor)
+		return (r->hdr->closed ? RING_ERR_CLOSED : RING_ERR_OK);
+	if (head - r->cursor > r->size)
+		return (ring_overrun(r));
+
+	for (pos = r->cursor; pos < head;) {
+		off = pos & (r->size - 1);
+		if (r->data[off] == RING_PAD) {
+			pos += r->size - off;
+			continue;
+		}
+		hdr = (const struct store_flow *)(r->data + off);
+		flen = sizeof(*hdr) + hdr->len_words * 4;
+		/* Garbage, so it is being overwritten */
+		if (off + flen > r->size || pos + flen > head)
+			return (ring_overrun(r));
+		if (n + flen > len)
+			break;
+		memcpy(buf + n, hdr, flen);
+		n += flen;
+		pos += flen;
+		nflows++;
+	}
+
+	/* Was any of it overwritten while it was copied? */
+	ring_fence();
+	if (ring_load(&r->hdr->reserve) - r->cursor > r->size)
+		return (ring_overrun(r));
+	if (n == 0 && pos < head)
+		return (RING_ERR_SIZE);
+
+	r->cursor = pos;
+	r->cursor_flows += nflows;
+	r->flows += nflows;
+	*got = n;
+
+	return (RING_ERR_OK);
+}
+
+void
+ring_reader_close(struct ring_reader *r)
+{
+	if (r->hdr == NULL)
+		return;
+	munmap(r->map, r->map_len);
+	r->hdr = NULL;
+}
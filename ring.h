@@ -0,0 +1,108 @@
+/*	$Id$	*/
+
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Shared memory flow ring. flowd copies the flows it stores, as v3 log
+ * records, into a file that it maps shared; local consumers map the same
+ * file read-only and follow along, each with a cursor of its own. Nothing
+ * a consumer does is seen by flowd, which never waits: one that falls a
+ * ring's length behind is overrun, loses what it had not read and is told
+ * so.
+ *
+ * The ring is a header followed by a power-of-2 sized data area. "head"
+ * counts the bytes ever written; "reserve" is set to where a write will
+ * end before it starts, and "head" to the same once it is done. So a
+ * reader that has copied out the data after its cursor knows the copy is
+ * good if "reserve" is still within a ring of the cursor. A record never
+ * wraps; where one would, the rest of the ring is skipped, marked by a
+ * byte saying so where the record would have begun. A restarted flowd
+ * carries on from where the last left off, so consumers need not notice.
+ * The header is in host byte order, as the ring is only shared on one host.
+ */
+
+#ifndef _RING_H
+#define _RING_H
+
+#include <sys/types.h>
+#include "flowd-common.h"
+#include "store.h"
+
+#define RING_MAGIC		0x666c7267	/* "flrg" */
+#define RING_VERSION		1
+#define RING_DATA_OFFSET	4096		/* data begins a page in */
+#define RING_PAD		0xff		/* rest of the ring is unused */
+
+#define DEFAULT_RING_SIZE	(16*1024*1024)
+#define MIN_RING_SIZE		(64*1024)
+#define LIMIT_RING_SIZE		(1024*1024*1024)
+
+struct ring_header {
+	u_int32_t		magic;
+	u_int32_t		version;
+	u_int32_t		size;		/* of the data area */
+	u_int32_t		data_offset;	/* from the start of the file */
+	volatile u_int32_t	closed;		/* flowd has finished with it */
+	u_int32_t		reserved;
+	volatile u_int64_t	head;
+	volatile u_int64_t	reserve;
+	volatile u_int64_t	flows;		/* ever written */
+};
+
+/* Error codes for ring functions */
+#define RING_ERR_OK				0
+#define RING_ERR_CLOSED				-1
+#define RING_ERR_OVERRUN			-2
+#define RING_ERR_BAD				-3
+#define RING_ERR_SIZE				-4
+#define RING_ERR_IO				-5
+
+/* flowd's end */
+struct ring_writer {
+	struct ring_header	*hdr;		/* NULL when not open */
+	u_int8_t		*data;
+	size_t			map_len;
+	u_int32_t		size;
+	u_int64_t		head, flows;	/* as published */
+	u_int64_t		writes, pads;
+};
+
+int ring_writer_open(struct ring_writer *w, int fd, u_int32_t size,
+    char *ebuf, int elen);
+void ring_write(struct ring_writer *w, const u_int8_t *buf, size_t len);
+void ring_writer_close(struct ring_writer *w);
+
+/* A consumer */
+struct ring_reader {
+	void			*map;
+	const struct ring_header *hdr;
+	const u_int8_t		*data;
+	size_t			map_len;
+	u_int32_t		size;
+	u_int64_t		cursor;
+	u_int64_t		cursor_flows;	/* flows written before cursor */
+	u_int64_t		overruns;
+	u_int64_t		lost;		/* flows overrun */
+	u_int64_t		flows;		/* flows read */
+};
+
+int ring_reader_open(struct ring_reader *r, const char *path, char *ebuf,
+    int elen);
+int ring_read(struct ring_reader *r, u_int8_t *buf, size_t len, size_t *got);
+void ring_reader_close(struct ring_reader *r);
+
+#endif /* _RING_H */
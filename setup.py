@@ -23,6 +23,20 @@ DEFS = [
 	( 'PROGVER',		'"0.9.1"' ),
 ]
 
+def have_libz():
+	"""Whether libflowd was configured with zlib, for compressed logs"""
+	try:
+		f = open('flowd-config.h')
+	except IOError:
+		return False
+	try:
+		for line in f:
+			if line.startswith('#define HAVE_LIBZ'):
+				return True
+	finally:
+		f.close()
+	return False
+
 if __name__ == '__main__':
 	if sys.hexversion < 0x02030000:
 		print >> sys.stderr, "error: " + \
@@ -32,7 +46,7 @@ if __name__ == '__main__':
 	flowd = Extension('flowd',
 		sources = ['flowd_python.c'],
 		define_macros = DEFS,
-		libraries = ['flowd'],
+		libraries = ['flowd'] + (have_libz() and ['z'] or []),
 		library_dirs = ['.', '../..'])
 	setup(	name = "flowd",
 		version = "0.9.1",
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Histograms and output buffers for runtime statistics, see stats.h */
+
+#include "flowd-common.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "flowd.h"
+#include "stats.h"
+
+RCSID("$Id$");
+
+u_int64_t
+stats_now_ns(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+#endif
+	struct timeval tv;
+
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return ((u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+#endif
+	gettimeofday(&tv, NULL);
+	return ((u_int64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000);
+}
+
+/* Index of the highest bit set in v, which mustn't be zero */
+static u_int
+stats_msb(u_int64_t v)
+{
+#ifdef __GNUC__
+	return (63 - __builtin_clzll(v));
+#else
+	u_int n;
+
+	for (n = 0; v > 1; n++)
+		v >>= 1;
+	return (n);
+#endif
+}
+
+static u_int
+stats_hist_bucket(u_int64_t v)
+{
+	u_int msb;
+
+	if (v < STATS_HIST_SUB)
+		return (v);
+	msb = stats_msb(v);
+	return (STATS_HIST_SUB + (msb - STATS_HIST_SUB_BITS) * STATS_HIST_SUB +
+	    ((v >> (msb - STATS_HIST_SUB_BITS)) & (STATS_HIST_SUB - 1)));
+}
+
+/* Largest value that falls in bucket i */
+static u_int64_t
+stats_hist_upper(u_int i)
+{
+	u_int shift, sub;
+
+	if (i < STATS_HIST_SUB)
+		return (i);
+	shift = (i - STATS_HIST_SUB) / STATS_HIST_SUB;
+	sub = (i - STATS_HIST_SUB) % STATS_HIST_SUB;
+	return ((((u_int64_t)STATS_HIST_SUB + sub) << shift) +
+	    ((u_int64_t)1 << shift) - 1);
+}
+
+void
+stats_hist_add(struct stats_hist *h, u_int64_t v)
+{
+	h->count++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+	h->buckets[stats_hist_bucket(v)]++;
+}
+
+void
+stats_hist_merge(struct stats_hist *to, const struct stats_hist *from)
+{
+	u_int i;
+
+	to->count += from->count;
+	to->sum += from->sum;
+	if (from->max > to->max)
+		to->max = from->max;
+	for (i = 0; i < STATS_HIST_BUCKETS; i++)
+		to->buckets[i] += from->buckets[i];
+}
+
+/* Value below which a fraction q of those recorded fall, roughly */
+u_int64_t
+stats_hist_quantile(const struct stats_hist *h, double q)
+{
+	u_int64_t want, seen, upper;
+	u_int i;
+
+	if (h->count == 0)
+		return (0);
+	want = (u_int64_t)(q * h->count + 0.5);
+	if (want == 0)
+		want = 1;
+	for (i = seen = 0; i < STATS_HIST_BUCKETS; i++) {
+		if ((seen += h->buckets[i]) >= want)
+			break;
+	}
+	upper = i < STATS_HIST_BUCKETS ? stats_hist_upper(i) : h->max;
+	return (upper < h->max ? upper : h->max);
+}
+
+void
+stats_buf_printf(struct stats_buf *sb, const char *fmt, ...)
+{
+	va_list args;
+	size_t alloc;
+	char *tmp;
+	int n;
+
+	for (;;) {
+		va_start(args, fmt);
+		n = vsnprintf(sb->buf + sb->len, sb->alloc - sb->len, fmt, args);
+		va_end(args);
+		if (n < 0)
+			logerrx("%s: vsnprintf failed", __func__);
+		if (sb->buf != NULL && sb->len + n < sb->alloc)
+			break;
+		alloc = sb->alloc == 0 ? 8192 : sb->alloc * 2;
+		while (alloc <= sb->len + n)
+			alloc *= 2;
+		if ((tmp = realloc(sb->buf, alloc)) == NULL)
+			logerrx("%s: realloc of %zu failed", __func__, alloc);
+		sb->buf = tmp;
+		sb->alloc = alloc;
+	}
+	sb->len += n;
+}
+
+/* Append "name":{...}, with the buckets that have anything in them */
+void
+stats_buf_hist(struct stats_buf *sb, const char *name,
+    const struct stats_hist *h)
+{
+	const char *sep = "";
+	u_int i;
+
+	stats_buf_printf(sb, "\"%s\":{\"count\":%llu,\"sum\":%llu,"
+	    "\"max\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,"
+	    "\"p999\":%llu,\"buckets\":[", name,
+	    (unsigned long long)h->count, (unsigned long long)h->sum,
+	    (unsigned long long)h->max,
+	    (unsigned long long)stats_hist_quantile(h, 0.5),
+	    (unsigned long long)stats_hist_quantile(h, 0.9),
+	    (unsigned long long)stats_hist_quantile(h, 0.99),
+	    (unsigned long long)stats_hist_quantile(h, 0.999));
+	for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+		if (h->buckets[i] == 0)
+			continue;
+		stats_buf_printf(sb, "%s[%llu,%llu]", sep,
+		    (unsigned long long)stats_hist_upper(i),
+		    (unsigned long long)h->buckets[i]);
+		sep = ",";
+	}
+	stats_buf_printf(sb, "]}");
+}
+
+void
+stats_buf_free(struct stats_buf *sb)
+{
+	free(sb->buf);
+	sb->buf = NULL;
+	sb->len = sb->alloc = 0;
+}
@@ -0,0 +1,65 @@
+/*	$Id$	*/
+
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Runtime statistics: log-linear histograms, in the style of HdrHistogram,
+ * and the buffer that the stats socket's JSON is built up in. Histograms
+ * are only updated by the thread that owns them; readers merge them and
+ * accept that a snapshot taken while they change is slightly stale.
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <sys/types.h>
+#include "flowd-common.h"
+
+/*
+ * Each power of two is split into 2^STATS_HIST_SUB_BITS linear buckets,
+ * so a value is placed to within 25% of itself
+ */
+#define STATS_HIST_SUB_BITS	2
+#define STATS_HIST_SUB		(1 << STATS_HIST_SUB_BITS)
+#define STATS_HIST_BUCKETS	(64 * STATS_HIST_SUB)
+
+struct stats_hist {
+	u_int64_t		count;
+	u_int64_t		sum;
+	u_int64_t		max;
+	u_int64_t		buckets[STATS_HIST_BUCKETS];
+};
+
+/* A growing buffer; allocation failures are fatal */
+struct stats_buf {
+	char			*buf;
+	size_t			len;
+	size_t			alloc;
+};
+
+u_int64_t stats_now_ns(void);
+void stats_hist_add(struct stats_hist *h, u_int64_t v);
+void stats_hist_merge(struct stats_hist *to, const struct stats_hist *from);
+u_int64_t stats_hist_quantile(const struct stats_hist *h, double q);
+
+void stats_buf_printf(struct stats_buf *sb, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void stats_buf_hist(struct stats_buf *sb, const char *name,
+    const struct stats_hist *h);
+void stats_buf_free(struct stats_buf *sb);
+
+#endif /* _STATS_H */
@@ -17,7 +17,10 @@
 #include "flowd-common.h"
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
+#include <stddef.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -26,6 +29,9 @@
 #include <stdio.h>
 #include <time.h>
 #include <poll.h>
+#ifdef HAVE_LIBZ
+# include <zlib.h>
+#endif
 
 #include "store.h"
 #include "atomicio.h"
@@ -112,7 +118,15 @@ store_flow_deserialise(u_int8_t *buf, int len, struct store_flow_complete *f,
 	u_int32_t donefields, fields, crc;
 
 	bzero(f, sizeof(*f));
-	flowd_crc32_start(&crc);
+	/* Only those for the fields present are read, but gcc can't tell */
+	bzero(&aa4, sizeof(aa4));
+	bzero(&aa6, sizeof(aa6));
+	bzero(&sa4, sizeof(sa4));
+	bzero(&sa6, sizeof(sa6));
+	bzero(&da4, sizeof(da4));
+	bzero(&da6, sizeof(da6));
+	bzero(&ga4, sizeof(ga4));
+	bzero(&ga6, sizeof(ga6));
 
 	if (len < sizeof(f->hdr))
 		SFAILX(STORE_ERR_BUFFER_SIZE,
@@ -128,8 +142,6 @@ store_flow_deserialise(u_int8_t *buf, int len, struct store_flow_complete *f,
 		SFAILX(STORE_ERR_BUFFER_SIZE,
 		    "incomplete flow record supplied", 1);
 
-	flowd_crc32_update((u_char *)&f->hdr, sizeof(f->hdr), &crc);
-
 	donefields = fields = ntohl(f->hdr.fields);
 	offset = sizeof(f->hdr);
 
@@ -137,11 +149,6 @@ store_flow_deserialise(u_int8_t *buf, int len, struct store_flow_complete *f,
 		if (SHASFIELD(flag)) { \
 			memcpy(&dest, buf + offset, sizeof(dest)); \
 			offset += sizeof(dest); \
-			if (SHASFIELD(CRC32) && \
-			    STORE_FIELD_##flag != STORE_FIELD_CRC32) { \
-				flowd_crc32_update((u_char *)&dest, \
-				    sizeof(dest), &crc); \
-			} \
 			donefields &= ~STORE_FIELD_##flag; \
 		} } while (0)
 
@@ -177,6 +184,10 @@ store_flow_deserialise(u_int8_t *buf, int len, struct store_flow_complete *f,
 			SFAILX(-1, "Flow has unknown fields", 0);
 		}
 	}
+	/* The checksum covers everything before it, in one run */
+	crc = 0;
+	if (SHASFIELD(CRC32))
+		crc = flowd_crc32(buf, offset);
 	RFIELD(CRC32, f->crc32);
 
 	/* Sanity check and convert addresses */
@@ -246,6 +257,1079 @@ store_get_flow(int fd, struct store_flow_complete *f, char *ebuf, int elen)
 	    f, ebuf, elen));
 }
 
+/* Columnar blocks */
+
+#define SFC_COL(field, member, width) { STORE_FIELD_##field, \
+	offsetof(struct store_flow_complete, member), width }
+static const struct store_column {
+	u_int32_t	field;		/* set in flows with a value */
+	size_t		offset;		/* in struct store_flow_complete */
+	u_int16_t	width;
+} store_columns[STORE_NUM_COLUMNS] = {
+	{ 0, offsetof(struct store_flow_complete, hdr.fields), 4 },
+	SFC_COL(TAG,			tag.tag,		4),
+	SFC_COL(RECV_TIME,		recv_time.recv_sec,	4),
+	SFC_COL(RECV_TIME,		recv_time.recv_usec,	4),
+	SFC_COL(PROTO_FLAGS_TOS,	pft.tcp_flags,		1),
+	SFC_COL(PROTO_FLAGS_TOS,	pft.protocol,		1),
+	SFC_COL(PROTO_FLAGS_TOS,	pft.tos,		1),
+	SFC_COL(AGENT_ADDR4,		agent_addr.v4,		4),
+	SFC_COL(AGENT_ADDR6,		agent_addr.v6,		16),
+	SFC_COL(SRC_ADDR4,		src_addr.v4,		4),
+	SFC_COL(SRC_ADDR6,		src_addr.v6,		16),
+	SFC_COL(DST_ADDR4,		dst_addr.v4,		4),
+	SFC_COL(DST_ADDR6,		dst_addr.v6,		16),
+	SFC_COL(GATEWAY_ADDR4,		gateway_addr.v4,	4),
+	SFC_COL(GATEWAY_ADDR6,		gateway_addr.v6,	16),
+	SFC_COL(SRCDST_PORT,		ports.src_port,		2),
+	SFC_COL(SRCDST_PORT,		ports.dst_port,		2),
+	SFC_COL(PACKETS,		packets.flow_packets,	8),
+	SFC_COL(OCTETS,			octets.flow_octets,	8),
+	SFC_COL(IF_INDICES,		ifndx.if_index_in,	4),
+	SFC_COL(IF_INDICES,		ifndx.if_index_out,	4),
+	SFC_COL(AGENT_INFO,		ainfo.sys_uptime_ms,	4),
+	SFC_COL(AGENT_INFO,		ainfo.time_sec,		4),
+	SFC_COL(AGENT_INFO,		ainfo.time_nanosec,	4),
+	SFC_COL(AGENT_INFO,		ainfo.netflow_version,	2),
+	SFC_COL(FLOW_TIMES,		ftimes.flow_start,	4),
+	SFC_COL(FLOW_TIMES,		ftimes.flow_finish,	4),
+	SFC_COL(AS_INFO,		asinf.src_as,		4),
+	SFC_COL(AS_INFO,		asinf.dst_as,		4),
+	SFC_COL(AS_INFO,		asinf.src_mask,		1),
+	SFC_COL(AS_INFO,		asinf.dst_mask,		1),
+	SFC_COL(FLOW_ENGINE_INFO,	finf.engine_type,	2),
+	SFC_COL(FLOW_ENGINE_INFO,	finf.engine_id,		2),
+	SFC_COL(FLOW_ENGINE_INFO,	finf.flow_sequence,	4),
+	SFC_COL(FLOW_ENGINE_INFO,	finf.source_id,		4),
+};
+#undef SFC_COL
+
+int
+store_block_init(struct store_block *b, u_int32_t max_flows,
+    char *ebuf, int elen)
+{
+	bzero(b, sizeof(*b));
+	if (max_flows == 0 || max_flows > STORE_BLOCK_MAX_FLOWS)
+		SFAILX(STORE_ERR_INTERNAL, "silly block size", 1);
+	b->max_flows = max_flows;
+	return (STORE_ERR_OK);
+}
+
+/* Append a flow to a block, which must not already be full */
+int
+store_block_add(struct store_block *b, struct store_flow_complete *f,
+    char *ebuf, int elen)
+{
+	const struct store_column *col;
+	u_int32_t fields, nfields;
+	u_int8_t *v, *dst;
+	int i;
+
+	if (b->flows >= b->max_flows)
+		SFAILX(STORE_ERR_BUFFER_SIZE, "block is full", 1);
+	fields = ntohl(f->hdr.fields) & STORE_FIELD_ALL;
+	if ((SHASFIELD(AGENT_ADDR4) && SHASFIELD(AGENT_ADDR6)) ||
+	    (SHASFIELD(SRC_ADDR4) && SHASFIELD(SRC_ADDR6)) ||
+	    (SHASFIELD(DST_ADDR4) && SHASFIELD(DST_ADDR6)) ||
+	    (SHASFIELD(GATEWAY_ADDR4) && SHASFIELD(GATEWAY_ADDR6)))
+		SFAILX(STORE_ERR_FLOW_INVALID, "flow has both v4/v6 addrs", 1);
+	nfields = htonl(fields);
+
+	for (i = 0; i < STORE_NUM_COLUMNS; i++) {
+		col = &store_columns[i];
+		if (i == STORE_COL_FIELDS)
+			v = (u_int8_t *)&nfields;
+		else if ((fields & col->field) != 0)
+			v = (u_int8_t *)f + col->offset;
+		else
+			continue;
+		if (b->col[i] == NULL && (b->col[i] = malloc(b->max_flows *
+		    col->width)) == NULL)
+			SFAILX(STORE_ERR_INTERNAL, "malloc failed", 1);
+		dst = b->col[i] + b->count[i] * col->width;
+		memcpy(dst, v, col->width);
+		if (b->count[i] == 0 || memcmp(v, b->min[i], col->width) < 0)
+			memcpy(b->min[i], v, col->width);
+		if (b->count[i] == 0 || memcmp(v, b->max[i], col->width) > 0)
+			memcpy(b->max[i], v, col->width);
+		b->count[i]++;
+	}
+	b->fields |= fields;
+	b->flows++;
+	return (STORE_ERR_OK);
+}
+
+/*
+ * Serialise a block's flows, leaving the block empty for the next lot.
+ * The buffer belongs to the block and is valid until it is next called.
+ */
+int
+store_block_serialise(struct store_block *b, u_int8_t **buf, int *len,
+    char *ebuf, int elen)
+{
+	struct store_block_header hdr;
+	struct store_block_column dir;
+	size_t need, off, doff;
+	u_int8_t *tmp;
+	int i, ncols;
+
+	need = sizeof(hdr);
+	for (ncols = i = 0; i < STORE_NUM_COLUMNS; i++) {
+		if (b->count[i] == 0)
+			continue;
+		ncols++;
+		need += sizeof(dir) + b->count[i] * store_columns[i].width;
+	}
+	if (need > STORE_BLOCK_MAX_LEN)
+		SFAILX(STORE_ERR_BUFFER_SIZE, "block too large", 1);
+	if (need > b->out_len) {
+		if ((tmp = realloc(b->out, need)) == NULL)
+			SFAILX(STORE_ERR_INTERNAL, "realloc failed", 1);
+		b->out = tmp;
+		b->out_len = need;
+	}
+
+	bzero(&hdr, sizeof(hdr));
+	hdr.version = STORE_BLOCK_VERSION;
+	hdr.num_columns = htons(ncols);
+	hdr.len = htonl(need - sizeof(hdr));
+	hdr.flows = htonl(b->flows);
+	hdr.fields = htonl(b->fields);
+	if (b->count[STORE_COL_RECV_SEC] != 0) {
+		/* Already in network byte order */
+		memcpy(&hdr.first_sec, b->min[STORE_COL_RECV_SEC], 4);
+		memcpy(&hdr.last_sec, b->max[STORE_COL_RECV_SEC], 4);
+	}
+
+	off = sizeof(hdr);
+	doff = off + ncols * sizeof(dir);
+	for (i = 0; i < STORE_NUM_COLUMNS; i++) {
+		if (b->count[i] == 0)
+			continue;
+		bzero(&dir, sizeof(dir));
+		dir.id = htons(i);
+		dir.width = htons(store_columns[i].width);
+		dir.count = htonl(b->count[i]);
+		memcpy(dir.min, b->min[i], store_columns[i].width);
+		memcpy(dir.max, b->max[i], store_columns[i].width);
+		memcpy(b->out + off, &dir, sizeof(dir));
+		off += sizeof(dir);
+		memcpy(b->out + doff, b->col[i],
+		    b->count[i] * store_columns[i].width);
+		doff += b->count[i] * store_columns[i].width;
+		b->count[i] = 0;
+	}
+	hdr.crc32 = htonl(flowd_crc32(b->out + sizeof(hdr),
+	    need - sizeof(hdr)));
+	memcpy(b->out, &hdr, sizeof(hdr));
+
+	b->flows = 0;
+	b->fields = 0;
+	*buf = b->out;
+	*len = need;
+	return (STORE_ERR_OK);
+}
+
+void
+store_block_free(struct store_block *b)
+{
+	int i;
+
+	for (i = 0; i < STORE_NUM_COLUMNS; i++)
+		free(b->col[i]);
+	free(b->out);
+	bzero(b, sizeof(*b));
+}
+
+/*
+ * Decode the flows in a block. Only the columns for fields in want are
+ * read; the flows returned lack the others.
+ */
+int
+store_block_deserialise(u_int8_t *buf, int len, u_int32_t want,
+    struct store_flow_complete *flows, u_int32_t max_flows,
+    u_int32_t *nflows, char *ebuf, int elen)
+{
+	struct store_block_header hdr;
+	struct store_block_column dir;
+	struct store_flow_complete *f;
+	const struct store_column *col;
+	u_int8_t *data[STORE_NUM_COLUMNS], *p, *end;
+	u_int32_t count[STORE_NUM_COLUMNS], used[STORE_NUM_COLUMNS];
+	u_int32_t i, n, fields;
+	int cols[STORE_NUM_COLUMNS], ncols, j, id, allow_extra, flen;
+	u_int16_t width;
+
+	if (len < (int)sizeof(hdr))
+		SFAILX(STORE_ERR_BUFFER_SIZE, "supplied length is too small", 1);
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (STORE_VER_GET_MAJ(hdr.version) != STORE_BLOCK_VER_MAJOR)
+		SFAILX(STORE_ERR_UNSUP_VERSION, "Unsupported version", 0);
+	allow_extra = STORE_VER_GET_MIN(hdr.version) > STORE_BLOCK_VER_MINOR;
+	if ((u_int32_t)len - sizeof(hdr) < ntohl(hdr.len))
+		SFAILX(STORE_ERR_BUFFER_SIZE, "incomplete block supplied", 1);
+	p = buf + sizeof(hdr);
+	end = p + ntohl(hdr.len);
+	if (flowd_crc32(p, end - p) != ntohl(hdr.crc32))
+		SFAILX(STORE_ERR_CRC_MISMATCH, "Block checksum mismatch", 0);
+	if ((n = ntohl(hdr.flows)) > max_flows)
+		SFAILX(STORE_ERR_BUFFER_SIZE, "too many flows in block", 1);
+
+	/* Find each column's data, which follows the directory */
+	bzero(data, sizeof(data));
+	bzero(count, sizeof(count));
+	ncols = ntohs(hdr.num_columns);
+	if ((size_t)(end - p) < ncols * sizeof(dir))
+		SFAILX(STORE_ERR_CORRUPT, "Block directory truncated", 0);
+	p += ncols * sizeof(dir);
+	for (j = 0; j < ncols; j++) {
+		memcpy(&dir, buf + sizeof(hdr) + j * sizeof(dir), sizeof(dir));
+		id = ntohs(dir.id);
+		width = ntohs(dir.width);
+		if ((size_t)(end - p) < (size_t)ntohl(dir.count) * width)
+			SFAILX(STORE_ERR_CORRUPT, "Block column truncated", 0);
+		if (id >= STORE_NUM_COLUMNS) {
+			if (!allow_extra)
+				SFAILX(STORE_ERR_CORRUPT,
+				    "Block has unknown columns", 0);
+		} else if (width != store_columns[id].width ||
+		    data[id] != NULL)
+			SFAILX(STORE_ERR_CORRUPT, "Block column invalid", 0);
+		else {
+			data[id] = p;
+			count[id] = ntohl(dir.count);
+		}
+		p += (size_t)ntohl(dir.count) * width;
+	}
+	if (n > 0 && (data[STORE_COL_FIELDS] == NULL ||
+	    count[STORE_COL_FIELDS] != n))
+		SFAILX(STORE_ERR_CORRUPT, "Block has no field bitmaps", 0);
+
+	/* Only the wanted columns are touched */
+	for (ncols = 0, j = 1; j < STORE_NUM_COLUMNS; j++) {
+		if ((store_columns[j].field & want) != 0)
+			cols[ncols++] = j;
+	}
+	bzero(used, sizeof(used));
+	bzero(flows, n * sizeof(*flows));
+	for (i = 0; i < n; i++) {
+		f = &flows[i];
+		memcpy(&fields, data[STORE_COL_FIELDS] + i * 4, 4);
+		fields = ntohl(fields);
+		if ((fields & ~STORE_FIELD_ALL) != 0) {
+			if (!allow_extra)
+				SFAILX(STORE_ERR_CORRUPT,
+				    "Flow has unknown fields", 0);
+			fields &= STORE_FIELD_ALL;
+		}
+		fields &= want;
+		for (j = 0; j < ncols; j++) {
+			id = cols[j];
+			col = &store_columns[id];
+			if ((fields & col->field) == 0)
+				continue;
+			if (used[id] >= count[id])
+				SFAILX(STORE_ERR_CORRUPT,
+				    "Block column too short", 0);
+			memcpy((u_int8_t *)f + col->offset,
+			    data[id] + used[id] * col->width, col->width);
+			used[id]++;
+		}
+		if (SHASFIELD(AGENT_ADDR4))
+			f->agent_addr.af = AF_INET;
+		if (SHASFIELD(AGENT_ADDR6))
+			f->agent_addr.af = AF_INET6;
+		if (SHASFIELD(SRC_ADDR4))
+			f->src_addr.af = AF_INET;
+		if (SHASFIELD(SRC_ADDR6))
+			f->src_addr.af = AF_INET6;
+		if (SHASFIELD(DST_ADDR4))
+			f->dst_addr.af = AF_INET;
+		if (SHASFIELD(DST_ADDR6))
+			f->dst_addr.af = AF_INET6;
+		if (SHASFIELD(GATEWAY_ADDR4))
+			f->gateway_addr.af = AF_INET;
+		if (SHASFIELD(GATEWAY_ADDR6))
+			f->gateway_addr.af = AF_INET6;
+		f->hdr.version = STORE_VERSION;
+		f->hdr.fields = htonl(fields);
+		if ((flen = store_calc_flow_len(&f->hdr)) == -1)
+			SFAILX(STORE_ERR_CORRUPT, "Flow has invalid fields", 0);
+		f->hdr.len_words = flen / 4;
+	}
+	for (j = 0; j < ncols; j++) {
+		if (used[cols[j]] != count[cols[j]])
+			SFAILX(STORE_ERR_CORRUPT, "Block column too long", 0);
+	}
+
+	*nflows = n;
+	return (STORE_ERR_OK);
+}
+
+/* Compressed frames */
+
+/* Bytes of a unit needed to find its length */
+static size_t
+store_unit_hdr_len(u_int8_t version)
+{
+	switch (STORE_VER_GET_MAJ(version)) {
+	case STORE_BLOCK_VER_MAJOR:
+		return (sizeof(struct store_block_header));
+	case STORE_FRAME_VER_MAJOR:
+		return (sizeof(struct store_frame_header));
+	default:
+		return (sizeof(struct store_flow));
+	}
+}
+
+/* Length of a v3 record, v4 block or v5 frame, from its start */
+static int
+store_unit_len(const u_int8_t *p, size_t *need, char *ebuf, int elen)
+{
+	struct store_block_header bhdr;
+	struct store_frame_header fhdr;
+
+	switch (STORE_VER_GET_MAJ(*p)) {
+	case STORE_BLOCK_VER_MAJOR:
+		memcpy(&bhdr, p, sizeof(bhdr));
+		if (ntohl(bhdr.len) > STORE_BLOCK_MAX_LEN)
+			SFAILX(STORE_ERR_CORRUPT, "Block is too large", 0);
+		*need = sizeof(bhdr) + ntohl(bhdr.len);
+		break;
+	case STORE_FRAME_VER_MAJOR:
+		memcpy(&fhdr, p, sizeof(fhdr));
+		if (ntohl(fhdr.len) > STORE_FRAME_MAX_LEN)
+			SFAILX(STORE_ERR_CORRUPT, "Frame is too large", 0);
+		*need = sizeof(fhdr) + ntohl(fhdr.len);
+		break;
+	default:
+		*need = sizeof(struct store_flow) +
+		    ((const struct store_flow *)p)->len_words * 4;
+		break;
+	}
+	return (STORE_ERR_OK);
+}
+
+int
+store_frame_init(struct store_frame *fr, int level, char *ebuf, int elen)
+{
+	bzero(fr, sizeof(*fr));
+#ifdef HAVE_LIBZ
+	if (level < 1 || level > 9)
+		SFAILX(STORE_ERR_INTERNAL, "silly compression level", 1);
+	fr->level = level;
+	return (STORE_ERR_OK);
+#else
+	SFAILX(STORE_ERR_INTERNAL, "compression is not supported", 1);
+#endif
+}
+
+/*
+ * Append serialised v3 records and v4 blocks to a frame, noting how many
+ * flows they hold and when they were received
+ */
+int
+store_frame_add(struct store_frame *fr, const u_int8_t *buf, int len,
+    char *ebuf, int elen)
+{
+	struct store_block_header bhdr;
+	u_int32_t flows, first, last;
+	size_t need, alloc;
+	u_int8_t *tmp;
+	int off, r, timed;
+
+	if (fr->raw_len + len > STORE_FRAME_MAX_LEN)
+		SFAILX(STORE_ERR_BUFFER_SIZE, "frame is full", 1);
+	for (off = 0; off < len; off += need) {
+		if ((size_t)(len - off) < store_unit_hdr_len(buf[off]))
+			SFAILX(STORE_ERR_FLOW_INVALID, "truncated flow", 1);
+		if ((r = store_unit_len(buf + off, &need,
+		    ebuf, elen)) != STORE_ERR_OK)
+			return (r);
+		if (need > (size_t)(len - off))
+			SFAILX(STORE_ERR_FLOW_INVALID, "truncated flow", 1);
+		switch (STORE_VER_GET_MAJ(buf[off])) {
+		case STORE_FRAME_VER_MAJOR:
+			SFAILX(STORE_ERR_FLOW_INVALID, "nested frame", 1);
+		case STORE_BLOCK_VER_MAJOR:
+			memcpy(&bhdr, buf + off, sizeof(bhdr));
+			flows = ntohl(bhdr.flows);
+			first = ntohl(bhdr.first_sec);
+			last = ntohl(bhdr.last_sec);
+			timed = flows != 0 &&
+			    (ntohl(bhdr.fields) & STORE_FIELD_RECV_TIME) != 0;
+			break;
+		default:
+			flows = 1;
+			timed = store_raw_recv_time(buf + off, &first);
+			last = first;
+			break;
+		}
+		if (timed && (!fr->timed || first < fr->first_sec))
+			fr->first_sec = first;
+		if (timed && (!fr->timed || last > fr->last_sec))
+			fr->last_sec = last;
+		fr->timed |= timed;
+		fr->flows += flows;
+	}
+
+	if (fr->raw_len + len > fr->raw_alloc) {
+		alloc = fr->raw_alloc == 0 ? STORE_FRAME_SIZE : fr->raw_alloc;
+		while (alloc < fr->raw_len + len)
+			alloc *= 2;
+		if ((tmp = realloc(fr->raw, alloc)) == NULL)
+			SFAILX(STORE_ERR_INTERNAL, "realloc failed", 1);
+		fr->raw = tmp;
+		fr->raw_alloc = alloc;
+	}
+	memcpy(fr->raw + fr->raw_len, buf, len);
+	fr->raw_len += len;
+	return (STORE_ERR_OK);
+}
+
+/*
+ * Compress a frame's contents, leaving the frame empty for the next lot.
+ * The buffer belongs to the frame and is valid until it is next called.
+ */
+int
+store_frame_serialise(struct store_frame *fr, u_int8_t **buf, int *len,
+    char *ebuf, int elen)
+{
+#ifdef HAVE_LIBZ
+	struct store_frame_header hdr;
+	uLongf clen;
+	size_t need;
+	u_int8_t *tmp;
+
+	clen = compressBound(fr->raw_len);
+	need = sizeof(hdr) + clen;
+	if (need > fr->out_len) {
+		if ((tmp = realloc(fr->out, need)) == NULL)
+			SFAILX(STORE_ERR_INTERNAL, "realloc failed", 1);
+		fr->out = tmp;
+		fr->out_len = need;
+	}
+	if (compress2(fr->out + sizeof(hdr), &clen, fr->raw, fr->raw_len,
+	    fr->level) != Z_OK)
+		SFAILX(STORE_ERR_INTERNAL, "compress2 failed", 1);
+	if (clen > STORE_FRAME_MAX_LEN)
+		SFAILX(STORE_ERR_BUFFER_SIZE, "frame too large", 1);
+
+	bzero(&hdr, sizeof(hdr));
+	hdr.version = STORE_FRAME_VERSION;
+	hdr.method = STORE_FRAME_ZLIB;
+	hdr.flags = fr->timed ? STORE_FRAME_F_TIMED : 0;
+	hdr.len = htonl(clen);
+	hdr.raw_len = htonl(fr->raw_len);
+	hdr.flows = htonl(fr->flows);
+	hdr.first_sec = htonl(fr->first_sec);
+	hdr.last_sec = htonl(fr->last_sec);
+	hdr.crc32 = htonl(flowd_crc32(fr->out + sizeof(hdr), clen));
+	memcpy(fr->out, &hdr, sizeof(hdr));
+
+	fr->raw_len = 0;
+	fr->flows = fr->first_sec = fr->last_sec = 0;
+	fr->timed = 0;
+	*buf = fr->out;
+	*len = sizeof(hdr) + clen;
+	return (STORE_ERR_OK);
+#else
+	SFAILX(STORE_ERR_INTERNAL, "compression is not supported", 1);
+#endif
+}
+
+void
+store_frame_free(struct store_frame *fr)
+{
+	free(fr->raw);
+	free(fr->out);
+	bzero(fr, sizeof(*fr));
+}
+
+/* Decompress a frame's contents into out, which must be large enough */
+int
+store_frame_decompress(const u_int8_t *buf, int len, u_int8_t *out,
+    size_t out_len, char *ebuf, int elen)
+{
+	struct store_frame_header hdr;
+#ifdef HAVE_LIBZ
+	uLongf dlen;
+#endif
+
+	if (len < (int)sizeof(hdr))
+		SFAILX(STORE_ERR_BUFFER_SIZE, "supplied length is too small", 1);
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (STORE_VER_GET_MAJ(hdr.version) != STORE_FRAME_VER_MAJOR)
+		SFAILX(STORE_ERR_UNSUP_VERSION, "Unsupported version", 0);
+	if ((u_int32_t)len - sizeof(hdr) < ntohl(hdr.len))
+		SFAILX(STORE_ERR_BUFFER_SIZE, "incomplete frame supplied", 1);
+	if (ntohl(hdr.raw_len) > out_len)
+		SFAILX(STORE_ERR_BUFFER_SIZE, "output buffer too small", 1);
+	if (flowd_crc32(buf + sizeof(hdr), ntohl(hdr.len)) != ntohl(hdr.crc32))
+		SFAILX(STORE_ERR_CRC_MISMATCH, "Frame checksum mismatch", 0);
+	if (hdr.method != STORE_FRAME_ZLIB)
+		SFAILX(STORE_ERR_UNSUP_VERSION,
+		    "Unsupported frame compression", 0);
+#ifdef HAVE_LIBZ
+	dlen = ntohl(hdr.raw_len);
+	if (uncompress(out, &dlen, buf + sizeof(hdr),
+	    ntohl(hdr.len)) != Z_OK || dlen != ntohl(hdr.raw_len))
+		SFAILX(STORE_ERR_CORRUPT, "Frame decompression failed", 0);
+	return (STORE_ERR_OK);
+#else
+	SFAILX(STORE_ERR_UNSUP_VERSION,
+	    "Compressed frames are not supported", 0);
+#endif
+}
+
+/* Map all of a log file, replacing any shorter map made before it grew */
+static int
+store_iter_map(struct store_iter *it, char *ebuf, int elen)
+{
+	struct stat sb;
+	u_int8_t *map;
+	off_t pos;
+
+	if (fstat(it->fd, &sb) == -1)
+		SFAIL(STORE_ERR_IO, "fstat", 0);
+	if (!S_ISREG(sb.st_mode) || sb.st_size == 0 ||
+	    (size_t)sb.st_size <= it->map_len ||
+	    (off_t)(size_t)sb.st_size != sb.st_size)
+		return (STORE_ERR_OK);
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, it->fd, 0);
+	if (map == MAP_FAILED)
+		return (STORE_ERR_OK);
+#ifdef MADV_SEQUENTIAL
+	madvise(map, sb.st_size, MADV_SEQUENTIAL);
+#endif
+	pos = it->map == NULL ? it->offset : it->data - it->map;
+	if (it->map != NULL)
+		munmap(it->map, it->map_len);
+	it->map = map;
+	it->map_len = sb.st_size;
+	if (pos > (off_t)it->map_len)
+		pos = it->map_len;
+	it->data = it->map + pos;
+	it->avail = it->map_len - pos;
+	it->offset = pos;
+	return (STORE_ERR_OK);
+}
+
+/* Have at least need bytes available, unless the log ends first */
+static int
+store_iter_fill(struct store_iter *it, size_t need, char *ebuf, int elen)
+{
+	u_int8_t *buf;
+	ssize_t r;
+
+	if (it->map != NULL)
+		return (store_iter_map(it, ebuf, elen));
+
+	if (it->data != it->buf) {
+		memmove(it->buf, it->data, it->avail);
+		it->data = it->buf;
+	}
+	/* Blocks may be larger than a chunk */
+	if (need > it->buf_len) {
+		if ((buf = realloc(it->buf, need)) == NULL)
+			SFAILX(STORE_ERR_INTERNAL, "realloc failed", 0);
+		it->buf = it->data = buf;
+		it->buf_len = need;
+	}
+	while (it->avail < need) {
+		r = read(it->fd, it->buf + it->avail,
+		    it->buf_len - it->avail);
+		if (r == -1 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (r == -1)
+			SFAIL(STORE_ERR_IO, "read flow", 0);
+		if (r == 0)
+			break;
+		it->avail += r;
+	}
+	return (STORE_ERR_OK);
+}
+
+/*
+ * Start reading flows from a log at the file descriptor's current offset.
+ * The descriptor is not closed by store_iter_close().
+ */
+int
+store_iter_open(struct store_iter *it, int fd, char *ebuf, int elen)
+{
+	int r;
+
+	bzero(it, sizeof(*it));
+	it->fd = fd;
+	it->end = -1;
+	it->want = STORE_FIELD_ALL;
+	if ((it->offset = lseek(fd, 0, SEEK_CUR)) == -1)
+		it->offset = 0;
+	if ((r = store_iter_map(it, ebuf, elen)) != STORE_ERR_OK)
+		return (r);
+	if (it->map != NULL)
+		return (STORE_ERR_OK);
+	if ((it->buf = malloc(STORE_ITER_CHUNK)) == NULL)
+		SFAILX(STORE_ERR_INTERNAL, "malloc failed", 0);
+	it->buf_len = STORE_ITER_CHUNK;
+	it->data = it->buf;
+	return (STORE_ERR_OK);
+}
+
+/* Read only the flows from start up to end (-1 for no limit) */
+int
+store_iter_seek(struct store_iter *it, off_t start, off_t end,
+    char *ebuf, int elen)
+{
+	int r;
+
+	it->end = end;
+	it->blk_num = it->blk_next = 0;
+	it->frm_avail = 0;
+	if (it->map != NULL && start > (off_t)it->map_len &&
+	    (r = store_iter_map(it, ebuf, elen)) != STORE_ERR_OK)
+		return (r);
+	if (it->map != NULL && start <= (off_t)it->map_len) {
+		it->data = it->map + start;
+		it->avail = it->map_len - start;
+		it->offset = start;
+		return (STORE_ERR_OK);
+	}
+	if (it->map != NULL) {
+		munmap(it->map, it->map_len);
+		it->map = NULL;
+		it->map_len = 0;
+	}
+	if (lseek(it->fd, start, SEEK_SET) == -1)
+		SFAIL(STORE_ERR_IO_SEEK, "lseek", 0);
+	it->offset = start;
+	it->avail = 0;
+	if (it->buf == NULL) {
+		if ((it->buf = malloc(STORE_ITER_CHUNK)) == NULL)
+			SFAILX(STORE_ERR_INTERNAL, "malloc failed", 0);
+		it->buf_len = STORE_ITER_CHUNK;
+	}
+	it->data = it->buf;
+	return (STORE_ERR_OK);
+}
+
+/*
+ * Decode only the columns for fields of the v4 blocks read from now on,
+ * and if timed skip those and any v5 frames without receive times in
+ * [from_sec, to_sec] unread. v3 records are returned regardless.
+ */
+void
+store_iter_want(struct store_iter *it, u_int32_t fields, int timed,
+    u_int32_t from_sec, u_int32_t to_sec)
+{
+	it->want = fields;
+	it->timed = timed;
+	it->from_sec = from_sec;
+	it->to_sec = to_sec;
+}
+
+/*
+ * Have fn decide from each v4 block's header and column directory whether
+ * to decode it, for example when a filter would discard all its flows
+ */
+void
+store_iter_filter(struct store_iter *it,
+    int (*fn)(void *, const struct store_block_header *,
+    const struct store_block_column *, u_int), void *arg)
+{
+	it->blk_filter = fn;
+	it->blk_filter_arg = arg;
+}
+
+/* Read the next v3 record, v4 block or v5 frame as it is stored */
+static int
+store_iter_read(struct store_iter *it, u_int8_t **rec, int *len,
+    char *ebuf, int elen)
+{
+	size_t need;
+	int r;
+
+	if (it->end != -1 && it->offset >= it->end)
+		SFAILX(STORE_ERR_EOF, "EOF reading flow header", 0);
+	if (it->avail < sizeof(struct store_flow) && (r = store_iter_fill(it,
+	    sizeof(struct store_flow), ebuf, elen)) != STORE_ERR_OK)
+		return (r);
+	if (it->avail < sizeof(struct store_flow))
+		SFAILX(STORE_ERR_EOF, "EOF reading flow header", 0);
+	need = store_unit_hdr_len(*it->data);
+	if (it->avail < need &&
+	    (r = store_iter_fill(it, need, ebuf, elen)) != STORE_ERR_OK)
+		return (r);
+	if (it->avail < need)
+		SFAILX(STORE_ERR_EOF, "EOF reading flow header", 0);
+	if ((r = store_unit_len(it->data, &need, ebuf, elen)) != STORE_ERR_OK)
+		return (r);
+	if (it->avail < need &&
+	    (r = store_iter_fill(it, need, ebuf, elen)) != STORE_ERR_OK)
+		return (r);
+	if (it->avail < need)
+		SFAILX(STORE_ERR_EOF, "EOF reading flow data", 0);
+
+	*rec = it->data;
+	*len = need;
+	it->data += need;
+	it->avail -= need;
+	it->offset += need;
+	return (STORE_ERR_OK);
+}
+
+/* Decompress a frame for reading its contents, unless it can be skipped */
+static int
+store_iter_frame(struct store_iter *it, u_int8_t *rec, int len,
+    char *ebuf, int elen)
+{
+	struct store_frame_header fhdr;
+	u_int8_t *tmp;
+	size_t raw_len;
+	int r;
+
+	memcpy(&fhdr, rec, sizeof(fhdr));
+	if (it->timed && ((fhdr.flags & STORE_FRAME_F_TIMED) == 0 ||
+	    ntohl(fhdr.last_sec) < it->from_sec ||
+	    ntohl(fhdr.first_sec) > it->to_sec)) {
+		it->frames_skipped++;
+		return (STORE_ERR_OK);
+	}
+	if ((raw_len = ntohl(fhdr.raw_len)) > STORE_FRAME_MAX_LEN)
+		SFAILX(STORE_ERR_CORRUPT, "Frame is too large", 0);
+	if (raw_len > it->frm_alloc) {
+		if ((tmp = realloc(it->frm_buf, raw_len)) == NULL)
+			SFAILX(STORE_ERR_INTERNAL, "realloc failed", 0);
+		it->frm_buf = tmp;
+		it->frm_alloc = raw_len;
+	}
+	if ((r = store_frame_decompress(rec, len, it->frm_buf, it->frm_alloc,
+	    ebuf, elen)) != STORE_ERR_OK)
+		return (r);
+	it->frames++;
+	it->frm_data = it->frm_buf;
+	it->frm_avail = raw_len;
+	return (STORE_ERR_OK);
+}
+
+/*
+ * Return the next v3 record or v4 block, as it is stored, reading those
+ * in frames in turn
+ */
+static int
+store_iter_unit(struct store_iter *it, u_int8_t **rec, int *len,
+    char *ebuf, int elen)
+{
+	size_t need;
+	int r;
+
+	while (it->frm_avail == 0) {
+		if ((r = store_iter_read(it, rec, len,
+		    ebuf, elen)) != STORE_ERR_OK)
+			return (r);
+		if (STORE_VER_GET_MAJ(**rec) != STORE_FRAME_VER_MAJOR)
+			return (STORE_ERR_OK);
+		if ((r = store_iter_frame(it, *rec, *len,
+		    ebuf, elen)) != STORE_ERR_OK)
+			return (r);
+	}
+
+	if (it->frm_avail < store_unit_hdr_len(*it->frm_data) ||
+	    STORE_VER_GET_MAJ(*it->frm_data) == STORE_FRAME_VER_MAJOR)
+		SFAILX(STORE_ERR_CORRUPT, "Frame holds an invalid flow", 0);
+	if ((r = store_unit_len(it->frm_data, &need,
+	    ebuf, elen)) != STORE_ERR_OK)
+		return (r);
+	if (need > it->frm_avail)
+		SFAILX(STORE_ERR_CORRUPT, "Frame holds a truncated flow", 0);
+	*rec = it->frm_data;
+	*len = need;
+	it->frm_data += need;
+	it->frm_avail -= need;
+	return (STORE_ERR_OK);
+}
+
+/* Decode a block's flows for handing out, unless it can be skipped */
+static int
+store_iter_block(struct store_iter *it, u_int8_t *rec, int len,
+    char *ebuf, int elen)
+{
+	struct store_block_header bhdr;
+	struct store_flow_complete *tmp;
+	u_int32_t n;
+	u_int ncols;
+
+	memcpy(&bhdr, rec, sizeof(bhdr));
+	if (it->timed && ((ntohl(bhdr.fields) & STORE_FIELD_RECV_TIME) == 0 ||
+	    ntohl(bhdr.last_sec) < it->from_sec ||
+	    ntohl(bhdr.first_sec) > it->to_sec)) {
+		it->blocks_skipped++;
+		return (STORE_ERR_OK);
+	}
+	/* A directory that doesn't fit is left for the decoder to report */
+	ncols = ntohs(bhdr.num_columns);
+	if (it->blk_filter != NULL && (size_t)len >= sizeof(bhdr) +
+	    ncols * sizeof(struct store_block_column) &&
+	    !it->blk_filter(it->blk_filter_arg, &bhdr,
+	    (struct store_block_column *)(rec + sizeof(bhdr)), ncols)) {
+		it->blocks_skipped++;
+		return (STORE_ERR_OK);
+	}
+	if ((n = ntohl(bhdr.flows)) > STORE_BLOCK_MAX_FLOWS)
+		SFAILX(STORE_ERR_CORRUPT, "Block has too many flows", 0);
+	if (n > it->blk_alloc) {
+		if ((tmp = realloc(it->blk_flows, n * sizeof(*tmp))) == NULL)
+			SFAILX(STORE_ERR_INTERNAL, "realloc failed", 0);
+		it->blk_flows = tmp;
+		it->blk_alloc = n;
+	}
+	it->blocks++;
+	it->blk_next = 0;
+	return (store_block_deserialise(rec, len, it->want, it->blk_flows,
+	    it->blk_alloc, &it->blk_num, ebuf, elen));
+}
+
+/*
+ * Fetch the next flow: either as a v3 record in rec, or decoded from a
+ * block in f
+ */
+static int
+store_iter_get(struct store_iter *it, u_int8_t **rec, int *len,
+    struct store_flow_complete **f, char *ebuf, int elen)
+{
+	int r;
+
+	for (;;) {
+		if (it->blk_next < it->blk_num) {
+			*f = &it->blk_flows[it->blk_next++];
+			return (STORE_ERR_OK);
+		}
+		it->blk_num = it->blk_next = 0;
+		if ((r = store_iter_unit(it, rec, len,
+		    ebuf, elen)) != STORE_ERR_OK)
+			return (r);
+		if (STORE_VER_GET_MAJ(**rec) != STORE_BLOCK_VER_MAJOR) {
+			*f = NULL;
+			return (STORE_ERR_OK);
+		}
+		if ((r = store_iter_block(it, *rec, *len,
+		    ebuf, elen)) != STORE_ERR_OK)
+			return (r);
+	}
+}
+
+/*
+ * Return the next flow record as it is stored, a header and fields in
+ * network byte order, without deserialising it. Flows in v4 blocks are
+ * returned as v3 records. The record is only valid until the next call.
+ */
+int
+store_iter_next_raw(struct store_iter *it, u_int8_t **rec, int *len,
+    char *ebuf, int elen)
+{
+	struct store_flow_complete *f;
+	int r;
+
+	if ((r = store_iter_get(it, rec, len, &f, ebuf, elen)) != STORE_ERR_OK)
+		return (r);
+	if (f == NULL)
+		return (STORE_ERR_OK);
+	if ((r = store_flow_serialise(f, it->blk_rec, sizeof(it->blk_rec),
+	    len, ebuf, elen)) != STORE_ERR_OK)
+		return (r);
+	*rec = it->blk_rec;
+	return (STORE_ERR_OK);
+}
+
+int
+store_iter_next(struct store_iter *it, struct store_flow_complete *f,
+    char *ebuf, int elen)
+{
+	struct store_flow_complete *bf;
+	u_int8_t *rec;
+	int r, len;
+
+	if ((r = store_iter_get(it, &rec, &len, &bf,
+	    ebuf, elen)) != STORE_ERR_OK)
+		return (r);
+	if (bf != NULL) {
+		memcpy(f, bf, sizeof(*f));
+		return (STORE_ERR_OK);
+	}
+	return (store_flow_deserialise(rec, len, f, ebuf, elen));
+}
+
+void
+store_iter_close(struct store_iter *it)
+{
+	if (it->map != NULL)
+		munmap(it->map, it->map_len);
+	free(it->buf);
+	free(it->blk_flows);
+	free(it->frm_buf);
+	bzero(it, sizeof(*it));
+	it->fd = -1;
+}
+
+/* Fetch the receive time from a raw record, returns 0 if it has none */
+int
+store_raw_recv_time(const u_int8_t *rec, u_int32_t *recv_sec)
+{
+	struct store_flow hdr;
+	u_int32_t fields;
+
+	memcpy(&hdr, rec, sizeof(hdr));
+	fields = ntohl(hdr.fields);
+	if ((fields & STORE_FIELD_RECV_TIME) == 0)
+		return (0);
+	/* It follows the tag, the only field that may come before it */
+	memcpy(recv_sec, rec + sizeof(hdr) + ((fields & STORE_FIELD_TAG) ?
+	    sizeof(struct store_flow_TAG) : 0), sizeof(*recv_sec));
+	*recv_sec = ntohl(*recv_sec);
+	return (1);
+}
+
+/* Check an index's header, returning the number of whole entries after it */
+static int
+store_index_open(int idx_fd, off_t *nents, char *ebuf, int elen)
+{
+	struct store_index_header hdr;
+	struct stat sb;
+	int r;
+
+	if ((r = atomicio(read, idx_fd, &hdr, sizeof(hdr))) == -1)
+		SFAIL(STORE_ERR_IO, "read index header", 0);
+	if (r < sizeof(hdr))
+		SFAILX(STORE_ERR_EOF, "EOF reading index header", 0);
+	if (ntohl(hdr.magic) != STORE_INDEX_MAGIC)
+		SFAILX(STORE_ERR_BAD_MAGIC, "Bad index magic", 0);
+	if (ntohl(hdr.version) != STORE_INDEX_VERSION)
+		SFAILX(STORE_ERR_UNSUP_VERSION, "Unsupported index version", 0);
+
+	if (fstat(idx_fd, &sb) == -1)
+		SFAIL(STORE_ERR_IO, "fstat index", 0);
+
+	/* A partly written last entry is ignored */
+	*nents = (sb.st_size - sizeof(hdr)) / sizeof(struct store_index_entry);
+	return (STORE_ERR_OK);
+}
+
+/*
+ * Use a log's index to find the part of it, [*start, *end), that holds
+ * every flow received between from_sec and to_sec inclusive. Flows past
+ * the last index entry may be from any time after those before them, so
+ * they are included unless to_sec rules them out. Entries beyond
+ * log_size (e.g. after a failed write was backed out) are ignored.
+ */
+int
+store_index_find(int idx_fd, off_t log_size, u_int32_t from_sec,
+    u_int32_t to_sec, off_t *start, off_t *end, char *ebuf, int elen)
+{
+	struct store_index_entry ents[256];
+	u_int64_t offset, len, tail;
+	u_int32_t first, last, tail_first;
+	off_t left;
+	int r, i, n, found = 0;
+
+	if ((r = store_index_open(idx_fd, &left, ebuf, elen)) != STORE_ERR_OK)
+		return (r);
+
+	tail = 0;
+	tail_first = 0;
+	*start = *end = 0;
+	while (left > 0) {
+		n = left < (off_t)(sizeof(ents) / sizeof(*ents)) ?
+		    left : (off_t)(sizeof(ents) / sizeof(*ents));
+		r = atomicio(read, idx_fd, ents, n * sizeof(*ents));
+		if (r == -1)
+			SFAIL(STORE_ERR_IO, "read index", 0);
+		if (r != (int)(n * sizeof(*ents)))
+			SFAILX(STORE_ERR_EOF, "EOF reading index", 0);
+		left -= n;
+		for (i = 0; i < n; i++) {
+			offset = store_ntohll(ents[i].offset);
+			len = store_ntohll(ents[i].len);
+			first = ntohl(ents[i].first_sec);
+			last = ntohl(ents[i].last_sec);
+			if (offset != tail || offset + len > (u_int64_t)log_size)
+				goto done;
+			tail = offset + len;
+			tail_first = first;
+			if (first > to_sec || last < from_sec)
+				continue;
+			if (!found)
+				*start = offset;
+			*end = tail;
+			found = 1;
+		}
+	}
+ done:
+	if ((u_int64_t)log_size > tail && (tail == 0 || tail_first <= to_sec)) {
+		if (!found)
+			*start = tail;
+		*end = log_size;
+	} else if (!found)
+		*start = *end = tail;
+
+	return (STORE_ERR_OK);
+}
+
+/*
+ * Offsets at which a log may be split to read its parts independently:
+ * the start of each indexed run of flows, then the end of the log. The
+ * array returned in *marks is to be freed by the caller.
+ */
+int
+store_index_marks(int idx_fd, off_t log_size, off_t **marks, int *nmarks,
+    char *ebuf, int elen)
+{
+	struct store_index_entry ents[256];
+	u_int64_t offset, len, tail;
+	off_t left, *m;
+	int r, i, n, nm;
+
+	*marks = NULL;
+	*nmarks = 0;
+	if ((r = store_index_open(idx_fd, &left, ebuf, elen)) != STORE_ERR_OK)
+		return (r);
+	if ((m = calloc(left + 2, sizeof(*m))) == NULL)
+		SFAILX(STORE_ERR_INTERNAL, "calloc failed", 0);
+
+	tail = 0;
+	nm = 0;
+	while (left > 0) {
+		n = left < (off_t)(sizeof(ents) / sizeof(*ents)) ?
+		    left : (off_t)(sizeof(ents) / sizeof(*ents));
+		r = atomicio(read, idx_fd, ents, n * sizeof(*ents));
+		if (r == -1) {
+			free(m);
+			SFAIL(STORE_ERR_IO, "read index", 0);
+		}
+		if (r != (int)(n * sizeof(*ents))) {
+			free(m);
+			SFAILX(STORE_ERR_EOF, "EOF reading index", 0);
+		}
+		left -= n;
+		for (i = 0; i < n; i++) {
+			offset = store_ntohll(ents[i].offset);
+			len = store_ntohll(ents[i].len);
+			if (offset != tail || offset + len > (u_int64_t)log_size)
+				goto done;
+			m[nm++] = offset;
+			tail = offset + len;
+		}
+	}
+ done:
+	/* Anything past the last good entry is read as one part */
+	if ((u_int64_t)log_size > tail)
+		m[nm++] = tail;
+	m[nm++] = log_size;
+	*marks = m;
+	*nmarks = nm;
+
+	return (STORE_ERR_OK);
+}
+
 int
 store_read_flow(FILE *f, struct store_flow_complete *flow, char *ebuf, int elen)
 {
@@ -289,6 +1373,16 @@ store_flow_serialise(struct store_flow_complete *f, u_int8_t *buf, int buflen,
 	u_int32_t fields, crc;
 	int len, offset;
 
+	/* As in store_flow_deserialise() */
+	bzero(&aa4, sizeof(aa4));
+	bzero(&aa6, sizeof(aa6));
+	bzero(&sa4, sizeof(sa4));
+	bzero(&sa6, sizeof(sa6));
+	bzero(&da4, sizeof(da4));
+	bzero(&da6, sizeof(da6));
+	bzero(&gwa4, sizeof(gwa4));
+	bzero(&gwa6, sizeof(gwa6));
+
 	f->hdr.version = STORE_VERSION;
 	fields = ntohl(f->hdr.fields);
 
@@ -403,18 +1497,10 @@ store_flow_serialise(struct store_flow_complete *f, u_int8_t *buf, int buflen,
 	memcpy(buf, &f->hdr, sizeof(f->hdr));
 	offset = sizeof(f->hdr);
 
-	flowd_crc32_start(&crc);
-	flowd_crc32_update((u_char *)&f->hdr, sizeof(f->hdr), &crc);
-
 #define WFIELD(spec, what) do {						\
 	if (SHASFIELD(spec)) {						\
 		memcpy(buf + offset, &(what), sizeof(what));		\
 		offset += sizeof(what);					\
-		if (SHASFIELD(spec) && 					\
-		    (STORE_FIELD_##spec != STORE_FIELD_CRC32)) {	\
-			flowd_crc32_update((u_char *)&(what),		\
-			    sizeof(what), &crc);			\
-		}							\
 	}  } while (0)
 
 	WFIELD(TAG, f->tag);
@@ -436,8 +1522,11 @@ store_flow_serialise(struct store_flow_complete *f, u_int8_t *buf, int buflen,
 	WFIELD(FLOW_TIMES, f->ftimes);
 	WFIELD(AS_INFO, f->asinf);
 	WFIELD(FLOW_ENGINE_INFO, f->finf);
-	if (fields & (STORE_FIELD_CRC32))
+	if (fields & (STORE_FIELD_CRC32)) {
+		/* Over the header and fields already written */
+		crc = flowd_crc32(buf, offset);
 		f->crc32.crc32 = htonl(crc);
+	}
 	WFIELD(CRC32, f->crc32);
 #undef WFIELD
 
@@ -486,6 +1575,44 @@ store_put_buf(int fd, char *buf, int len, char *ebuf, int elen)
 	/* NOTREACHED */
 }
 
+/*
+ * As store_put_buf(), but the caller tracks the end of the file in
+ * "offset" instead of it being found with lseek() on every write. An
+ * offset of -1 means fd is a pipe or socket, which can't be backed out.
+ */
+int
+store_put_buf_at(int fd, char *buf, int len, off_t *offset, char *ebuf,
+    int elen)
+{
+	int r, saved_errno;
+
+	r = atomicio(vwrite, fd, buf, len);
+	saved_errno = errno;
+
+	if (r == len) {
+		if (*offset != -1)
+			*offset += len;
+		return (STORE_ERR_OK);
+	}
+
+	if (*offset == -1)
+		SFAIL(STORE_ERR_CORRUPT, "corrupting failure on pipe", 1);
+
+	/* Cut off the partial write, so we don't corrupt flow store */
+	if (ftruncate(fd, *offset) == -1)
+		SFAIL(STORE_ERR_CORRUPT, "corrupting failure on ftruncate", 1);
+	if (lseek(fd, *offset, SEEK_SET) == -1)
+		SFAIL(STORE_ERR_CORRUPT, "corrupting failure on lseek", 1);
+
+	/* Partial flow record has been removed, return with orig. error */
+	errno = saved_errno;
+	if (r == -1)
+		SFAIL(STORE_ERR_IO, "write flow", 0);
+	else
+		SFAILX(STORE_ERR_EOF, "EOF on write flow", 0);
+	/* NOTREACHED */
+}
+
 int
 store_flow_serialise_masked(struct store_flow_complete *f, u_int32_t mask,
     u_int8_t *buf, int buflen, int *flowlen, char *ebuf, int elen)
@@ -543,31 +1670,39 @@ store_write_flow(FILE *f, struct store_flow_complete *flow, u_int32_t fieldmask,
 	return (STORE_ERR_OK);
 }
 
+/* Reentrant iso_time(), formatting into buf */
 const char *
-iso_time(time_t t, int utc_flag)
+iso_time_r(time_t t, int utc_flag, char *buf, size_t len)
 {
-	struct tm *tm;
-	static char buf[128];
+	struct tm tm;
 
 	if (utc_flag)
-		tm = gmtime(&t);
+		gmtime_r(&t, &tm);
 	else
-		tm = localtime(&t);
+		localtime_r(&t, &tm);
 
-	strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", tm);
+	strftime(buf, len, "%Y-%m-%dT%H:%M:%S", &tm);
 
 	return (buf);
 }
 
+const char *
+iso_time(time_t t, int utc_flag)
+{
+	static char buf[128];
+
+	return (iso_time_r(t, utc_flag, buf, sizeof(buf)));
+}
+
 #define MINUTE		(60)
 #define HOUR		(MINUTE * 60)
 #define DAY		(HOUR * 24)
 #define WEEK		(DAY * 7)
 #define YEAR		(WEEK * 52)
+/* Reentrant interval_time(), formatting into buf */
 const char *
-interval_time(time_t t)
+interval_time_r(time_t t, char *buf, size_t len)
 {
-	static char buf[128];
 	char tmp[128];
 	u_long r;
 	int unit_div[] = { YEAR, WEEK, DAY, HOUR, MINUTE, 1, -1 };
@@ -579,16 +1714,24 @@ interval_time(time_t t)
 	for (i = 0; unit_div[i] != -1; i++) {
 		if ((r = t / unit_div[i]) != 0 || unit_div[i] == 1) {
 			snprintf(tmp, sizeof(tmp), "%lu%c", r, unit_sym[i]);
-			strlcat(buf, tmp, sizeof(buf));
+			strlcat(buf, tmp, len);
 			t %= unit_div[i];
 		}
 	}
 	return (buf);
 }
 
+const char *
+interval_time(time_t t)
+{
+	static char buf[128];
+
+	return (interval_time_r(t, buf, sizeof(buf)));
+}
+
 /*
- * Some helper functions for store_format_flow() and store_swab_flow(), 
- * so we can switch between host and network byte order easily.
+ * Some helper functions for store_swab_flow(), so we can switch between
+ * host and network byte order easily.
  */
 static u_int64_t
 store_swp_ntoh64(u_int64_t v)
@@ -626,222 +1769,692 @@ store_swp_hton16(u_int16_t v)
 	return htons(v);
 }
 
-static u_int64_t
-store_swp_fake64(u_int64_t v)
+/*
+ * Fast output formatting. Values are converted by hand and appended at a
+ * cursor without per-field bounds checks, as no line can be longer than
+ * STORE_FMT_LINE_MAX.
+ */
+
+/* Columns for CSV and JSON lines, in their default order */
+#define FC_TAG			0
+#define FC_RECV_TIME		1
+#define FC_RECV_SEC		2
+#define FC_RECV_USEC		3
+#define FC_PROTO		4
+#define FC_TCP_FLAGS		5
+#define FC_TOS			6
+#define FC_AGENT		7
+#define FC_SRC			8
+#define FC_SRC_PORT		9
+#define FC_DST			10
+#define FC_DST_PORT		11
+#define FC_GATEWAY		12
+#define FC_PACKETS		13
+#define FC_OCTETS		14
+#define FC_IN_IF		15
+#define FC_OUT_IF		16
+#define FC_SYS_UPTIME_MS	17
+#define FC_TIME_SEC		18
+#define FC_TIME_NANOSEC		19
+#define FC_NETFLOW_VER		20
+#define FC_FLOW_START		21
+#define FC_FLOW_FINISH		22
+#define FC_SRC_AS		23
+#define FC_DST_AS		24
+#define FC_SRC_MASK		25
+#define FC_DST_MASK		26
+#define FC_ENGINE_TYPE		27
+#define FC_ENGINE_ID		28
+#define FC_SEQ			29
+#define FC_SOURCE		30
+#define FC_CRC32		31
+#define FC_NUM			32
+
+static const struct {
+	const char	*name;
+	u_int32_t	field;
+} store_fmt_columns[FC_NUM] = {
+	{ "tag",		STORE_FIELD_TAG },
+	{ "recv_time",		STORE_FIELD_RECV_TIME },
+	{ "recv_sec",		STORE_FIELD_RECV_TIME },
+	{ "recv_usec",		STORE_FIELD_RECV_TIME },
+	{ "proto",		STORE_FIELD_PROTO_FLAGS_TOS },
+	{ "tcp_flags",		STORE_FIELD_PROTO_FLAGS_TOS },
+	{ "tos",		STORE_FIELD_PROTO_FLAGS_TOS },
+	{ "agent",		STORE_FIELD_AGENT_ADDR },
+	{ "src",		STORE_FIELD_SRC_ADDR },
+	{ "src_port",		STORE_FIELD_SRCDST_PORT },
+	{ "dst",		STORE_FIELD_DST_ADDR },
+	{ "dst_port",		STORE_FIELD_SRCDST_PORT },
+	{ "gateway",		STORE_FIELD_GATEWAY_ADDR },
+	{ "packets",		STORE_FIELD_PACKETS },
+	{ "octets",		STORE_FIELD_OCTETS },
+	{ "in_if",		STORE_FIELD_IF_INDICES },
+	{ "out_if",		STORE_FIELD_IF_INDICES },
+	{ "sys_uptime_ms",	STORE_FIELD_AGENT_INFO },
+	{ "time_sec",		STORE_FIELD_AGENT_INFO },
+	{ "time_nanosec",	STORE_FIELD_AGENT_INFO },
+	{ "netflow_ver",	STORE_FIELD_AGENT_INFO },
+	{ "flow_start",		STORE_FIELD_FLOW_TIMES },
+	{ "flow_finish",	STORE_FIELD_FLOW_TIMES },
+	{ "src_as",		STORE_FIELD_AS_INFO },
+	{ "dst_as",		STORE_FIELD_AS_INFO },
+	{ "src_mask",		STORE_FIELD_AS_INFO },
+	{ "dst_mask",		STORE_FIELD_AS_INFO },
+	{ "engine_type",	STORE_FIELD_FLOW_ENGINE_INFO },
+	{ "engine_id",		STORE_FIELD_FLOW_ENGINE_INFO },
+	{ "seq",		STORE_FIELD_FLOW_ENGINE_INFO },
+	{ "source",		STORE_FIELD_FLOW_ENGINE_INFO },
+	{ "crc32",		STORE_FIELD_CRC32 },
+};
+
+/* The columns of flow-tools' CSV export, as read by flow-import */
+static const u_int8_t store_fmt_flowtools[] = {
+	FC_TIME_SEC, FC_TIME_NANOSEC, FC_SYS_UPTIME_MS, FC_AGENT,
+	FC_PACKETS, FC_OCTETS, FC_FLOW_START, FC_FLOW_FINISH,
+	FC_ENGINE_TYPE, FC_ENGINE_ID, FC_SRC, FC_DST, FC_GATEWAY,
+	FC_IN_IF, FC_OUT_IF, FC_SRC_PORT, FC_DST_PORT, FC_PROTO, FC_TOS,
+	FC_TCP_FLAGS, FC_SRC_MASK, FC_DST_MASK, FC_SRC_AS, FC_DST_AS,
+};
+#define FLOWTOOLS_HEADER "#:unix_secs,unix_nsecs,sysuptime,exaddr," \
+	"dpkts,doctets,first,last,engine_type,engine_id," \
+	"srcaddr,dstaddr,nexthop,input,output,srcport," \
+	"dstport,prot,tos,tcp_flags,src_mask,dst_mask," \
+	"src_as,dst_as\n"
+
+static const char store_fmt_digits[] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+#define FMT_LIT(p, s) do {						\
+		memcpy((p), (s), sizeof(s) - 1);			\
+		(p) += sizeof(s) - 1;					\
+	} while (0)
+
+/* Decimal v, padded with zeroes to at least width digits */
+static char *
+fmt_u32(char *p, u_int32_t v, u_int width)
 {
-	return v;
+	char tmp[16], *t = tmp + sizeof(tmp);
+	u_int i;
+
+	while (v >= 100) {
+		i = (v % 100) * 2;
+		v /= 100;
+		*--t = store_fmt_digits[i + 1];
+		*--t = store_fmt_digits[i];
+	}
+	if (v >= 10) {
+		*--t = store_fmt_digits[v * 2 + 1];
+		*--t = store_fmt_digits[v * 2];
+	} else
+		*--t = '0' + v;
+	while ((u_int)(tmp + sizeof(tmp) - t) < width)
+		*--t = '0';
+	memcpy(p, t, tmp + sizeof(tmp) - t);
+	return (p + (tmp + sizeof(tmp) - t));
 }
 
-static u_int32_t
-store_swp_fake32(u_int32_t v)
+static char *
+fmt_u64(char *p, u_int64_t v)
 {
-	return v;
+	u_int64_t hi;
+
+	if (v <= 0xffffffff)
+		return (fmt_u32(p, v, 0));
+	/* At most eleven digits above the low nine */
+	hi = v / 1000000000;
+	if (hi <= 0xffffffff)
+		p = fmt_u32(p, hi, 0);
+	else {
+		p = fmt_u32(p, hi / 1000000000, 0);
+		p = fmt_u32(p, hi % 1000000000, 9);
+	}
+	return (fmt_u32(p, v % 1000000000, 9));
 }
 
-static u_int16_t
-store_swp_fake16(u_int16_t v)
+static char *
+fmt_i32(char *p, u_int32_t v)
 {
-	return v;
+	if ((int32_t)v >= 0)
+		return (fmt_u32(p, v, 0));
+	*p++ = '-';
+	return (fmt_u32(p, -(int64_t)(int32_t)v, 0));
 }
 
+/* Lower case hex, padded with zeroes to width digits */
+static char *
+fmt_hex(char *p, u_int32_t v, u_int width)
+{
+	static const char hex[] = "0123456789abcdef";
+	char tmp[8], *t = tmp + sizeof(tmp);
+
+	do {
+		*--t = hex[v & 0xf];
+		v >>= 4;
+	} while (v != 0);
+	while ((u_int)(tmp + sizeof(tmp) - t) < width)
+		*--t = '0';
+	memcpy(p, t, tmp + sizeof(tmp) - t);
+	return (p + (tmp + sizeof(tmp) - t));
+}
 
-void
-store_format_flow(struct store_flow_complete *flow, char *buf, size_t len,
-    int utc_flag, u_int32_t display_mask, int hostorder)
+/* An address as text; nothing if its family is unknown */
+static char *
+fmt_addr(char *p, const struct xaddr *a)
 {
-	char tmp[256];
-	u_int32_t fields;
-	u_int64_t (*fmt_ntoh64)(u_int64_t) = store_swp_ntoh64;
-	u_int32_t (*fmt_ntoh32)(u_int32_t) = store_swp_ntoh32;
-	u_int16_t (*fmt_ntoh16)(u_int16_t) = store_swp_ntoh16;
+	const u_int8_t *b = a->addr8;
 
-	if (hostorder) {
-		fmt_ntoh64 = store_swp_fake64;
-		fmt_ntoh32 = store_swp_fake32;
-		fmt_ntoh16 = store_swp_fake16;
+	switch (a->af) {
+	case AF_INET:
+		p = fmt_u32(p, b[0], 0);
+		*p++ = '.';
+		p = fmt_u32(p, b[1], 0);
+		*p++ = '.';
+		p = fmt_u32(p, b[2], 0);
+		*p++ = '.';
+		return (fmt_u32(p, b[3], 0));
+	case AF_INET6:
+		if (addr_ntop(a, p, INET6_ADDRSTRLEN + 16) == -1)
+			return (p);
+		return (p + strlen(p));
+	default:
+		return (p);
 	}
+}
 
-	*buf = '\0';
+/* As iso_time(), converting each second only once */
+static char *
+fmt_time(char *p, struct store_fmt_time *cache, u_int32_t sec, int utc_flag)
+{
+	struct tm tm;
+	time_t t;
+	char *s;
+
+	if (!cache->valid || cache->sec != sec) {
+		t = sec;
+		if (utc_flag)
+			gmtime_r(&t, &tm);
+		else
+			localtime_r(&t, &tm);
+		s = fmt_u32(cache->str, tm.tm_year + 1900, 4);
+		*s++ = '-';
+		s = fmt_u32(s, tm.tm_mon + 1, 2);
+		*s++ = '-';
+		s = fmt_u32(s, tm.tm_mday, 2);
+		*s++ = 'T';
+		s = fmt_u32(s, tm.tm_hour, 2);
+		*s++ = ':';
+		s = fmt_u32(s, tm.tm_min, 2);
+		*s++ = ':';
+		s = fmt_u32(s, tm.tm_sec, 2);
+		*s = '\0';
+		cache->sec = sec;
+		cache->valid = 1;
+	}
+	for (s = cache->str; *s != '\0';)
+		*p++ = *s++;
+	return (p);
+}
 
-	fields = fmt_ntoh32(flow->hdr.fields) & display_mask;
+/* As interval_time() */
+static char *
+fmt_interval(char *p, u_int32_t t)
+{
+	static const u_int32_t unit_div[] = { YEAR, WEEK, DAY, HOUR, MINUTE, 1 };
+	static const char unit_sym[] = { 'y', 'w', 'd', 'h', 'm', 's' };
+	u_int32_t r;
+	u_int i;
 
-	strlcat(buf, "FLOW ", len);
+	for (i = 0; i < sizeof(unit_div) / sizeof(*unit_div); i++) {
+		if ((r = t / unit_div[i]) != 0 || unit_div[i] == 1) {
+			p = fmt_u32(p, r, 0);
+			*p++ = unit_sym[i];
+			t %= unit_div[i];
+		}
+	}
+	return (p);
+}
+
+/* Seconds and milliseconds of a millisecond time, as interval_time() */
+static char *
+fmt_ms(char *p, u_int32_t ms)
+{
+	p = fmt_interval(p, ms / 1000);
+	*p++ = '.';
+	return (fmt_u32(p, ms % 1000, 3));
+}
 
+int
+store_fmt_init(struct store_fmt *fmt, int type, const char *columns,
+    int utc_flag, u_int32_t mask, char *ebuf, int elen)
+{
+	char name[64];
+	const char *cp, *ep;
+	size_t len;
+	u_int i;
+
+	bzero(fmt, sizeof(*fmt));
+	fmt->type = type;
+	fmt->utc = utc_flag;
+	fmt->mask = mask;
+	switch (type) {
+	case STORE_FMT_TEXT:
+	case STORE_FMT_RAW:
+		return (STORE_ERR_OK);
+	case STORE_FMT_FLOWTOOLS:
+		/* Every column is written, whether the flow has it or not */
+		fmt->mask = STORE_FIELD_ALL;
+		fmt->ncols = sizeof(store_fmt_flowtools);
+		memcpy(fmt->cols, store_fmt_flowtools, fmt->ncols);
+		return (STORE_ERR_OK);
+	case STORE_FMT_CSV:
+	case STORE_FMT_JSON:
+		break;
+	default:
+		SFAILX(STORE_ERR_INTERNAL, "Unknown output format", 1);
+	}
+
+	if (columns == NULL) {
+		for (i = 0; i < FC_NUM; i++)
+			fmt->cols[fmt->ncols++] = i;
+		return (STORE_ERR_OK);
+	}
+	for (cp = columns; *cp != '\0'; cp = *ep == '\0' ? ep : ep + 1) {
+		if ((ep = strchr(cp, ',')) == NULL)
+			ep = cp + strlen(cp);
+		if ((len = ep - cp) >= sizeof(name))
+			SFAILX(STORE_ERR_INTERNAL, "Unknown column", 0);
+		memcpy(name, cp, len);
+		name[len] = '\0';
+		for (i = 0; i < FC_NUM; i++) {
+			if (strcmp(name, store_fmt_columns[i].name) == 0)
+				break;
+		}
+		if (i == FC_NUM) {
+			if (ebuf != NULL && elen > 0)
+				snprintf(ebuf, elen, "Unknown column \"%s\"",
+				    name);
+			return (STORE_ERR_INTERNAL);
+		}
+		if (fmt->ncols >= STORE_FMT_MAX_COLS)
+			SFAILX(STORE_ERR_INTERNAL, "Too many columns", 0);
+		fmt->cols[fmt->ncols++] = i;
+	}
+	if (fmt->ncols == 0)
+		SFAILX(STORE_ERR_INTERNAL, "No columns", 0);
+	return (STORE_ERR_OK);
+}
+
+/* The flow fields that the format shows */
+u_int32_t
+store_fmt_fields(const struct store_fmt *fmt)
+{
+	u_int32_t fields = 0;
+	u_int i;
+
+	if (fmt->type == STORE_FMT_TEXT || fmt->type == STORE_FMT_RAW)
+		return (fmt->mask);
+	for (i = 0; i < fmt->ncols; i++)
+		fields |= store_fmt_columns[fmt->cols[i]].field;
+	return (fields & fmt->mask);
+}
+
+/* The line that starts the output, if the format has one */
+size_t
+store_fmt_header(const struct store_fmt *fmt, char *buf, size_t len)
+{
+	size_t n, l;
+	u_int i;
+
+	if (fmt->type == STORE_FMT_FLOWTOOLS) {
+		if (strlcpy(buf, FLOWTOOLS_HEADER, len) >= len)
+			return (0);
+		return (strlen(buf));
+	}
+	if (fmt->type != STORE_FMT_CSV)
+		return (0);
+	for (n = 0, i = 0; i < fmt->ncols; i++) {
+		l = strlen(store_fmt_columns[fmt->cols[i]].name);
+		if (n + l + 2 > len)
+			return (0);
+		if (i > 0)
+			buf[n++] = ',';
+		memcpy(buf + n, store_fmt_columns[fmt->cols[i]].name, l);
+		n += l;
+	}
+	buf[n++] = '\n';
+	return (n);
+}
+
+/* A column's value; quote is set for strings that JSON must quote */
+static char *
+fmt_column(struct store_fmt *fmt, char *p, const struct store_flow_complete *f,
+    u_int col, int quote)
+{
+	struct xaddr addr;
+
+	switch (col) {
+	case FC_TAG:
+		return (fmt_u32(p, ntohl(f->tag.tag), 0));
+	case FC_RECV_TIME:
+		if (quote)
+			*p++ = '"';
+		p = fmt_time(p, &fmt->times[0], ntohl(f->recv_time.recv_sec),
+		    fmt->utc);
+		*p++ = '.';
+		p = fmt_u32(p, ntohl(f->recv_time.recv_usec), 6);
+		if (quote)
+			*p++ = '"';
+		return (p);
+	case FC_RECV_SEC:
+		return (fmt_u32(p, ntohl(f->recv_time.recv_sec), 0));
+	case FC_RECV_USEC:
+		return (fmt_u32(p, ntohl(f->recv_time.recv_usec), 0));
+	case FC_PROTO:
+		return (fmt_u32(p, f->pft.protocol, 0));
+	case FC_TCP_FLAGS:
+		return (fmt_u32(p, f->pft.tcp_flags, 0));
+	case FC_TOS:
+		return (fmt_u32(p, f->pft.tos, 0));
+	case FC_AGENT:
+	case FC_SRC:
+	case FC_DST:
+	case FC_GATEWAY:
+		if (quote)
+			*p++ = '"';
+		addr = col == FC_AGENT ? f->agent_addr :
+		    col == FC_SRC ? f->src_addr : col == FC_DST ?
+		    f->dst_addr : f->gateway_addr;
+		p = fmt_addr(p, &addr);
+		if (quote)
+			*p++ = '"';
+		return (p);
+	case FC_SRC_PORT:
+		return (fmt_u32(p, ntohs(f->ports.src_port), 0));
+	case FC_DST_PORT:
+		return (fmt_u32(p, ntohs(f->ports.dst_port), 0));
+	case FC_PACKETS:
+		return (fmt_u64(p, store_ntohll(f->packets.flow_packets)));
+	case FC_OCTETS:
+		return (fmt_u64(p, store_ntohll(f->octets.flow_octets)));
+	case FC_IN_IF:
+		return (fmt_u32(p, ntohl(f->ifndx.if_index_in), 0));
+	case FC_OUT_IF:
+		return (fmt_u32(p, ntohl(f->ifndx.if_index_out), 0));
+	case FC_SYS_UPTIME_MS:
+		return (fmt_u32(p, ntohl(f->ainfo.sys_uptime_ms), 0));
+	case FC_TIME_SEC:
+		return (fmt_u32(p, ntohl(f->ainfo.time_sec), 0));
+	case FC_TIME_NANOSEC:
+		return (fmt_u32(p, ntohl(f->ainfo.time_nanosec), 0));
+	case FC_NETFLOW_VER:
+		return (fmt_u32(p, ntohs(f->ainfo.netflow_version), 0));
+	case FC_FLOW_START:
+		return (fmt_u32(p, ntohl(f->ftimes.flow_start), 0));
+	case FC_FLOW_FINISH:
+		return (fmt_u32(p, ntohl(f->ftimes.flow_finish), 0));
+	case FC_SRC_AS:
+		return (fmt_u32(p, ntohl(f->asinf.src_as), 0));
+	case FC_DST_AS:
+		return (fmt_u32(p, ntohl(f->asinf.dst_as), 0));
+	case FC_SRC_MASK:
+		return (fmt_u32(p, f->asinf.src_mask, 0));
+	case FC_DST_MASK:
+		return (fmt_u32(p, f->asinf.dst_mask, 0));
+	case FC_ENGINE_TYPE:
+		return (fmt_u32(p, ntohs(f->finf.engine_type), 0));
+	case FC_ENGINE_ID:
+		return (fmt_u32(p, ntohs(f->finf.engine_id), 0));
+	case FC_SEQ:
+		return (fmt_u32(p, ntohl(f->finf.flow_sequence), 0));
+	case FC_SOURCE:
+		return (fmt_u32(p, ntohl(f->finf.source_id), 0));
+	case FC_CRC32:
+		return (fmt_u32(p, ntohl(f->crc32.crc32), 0));
+	default:
+		return (p);
+	}
+}
+
+/* The brief or verbose text of store_format_flow() */
+static char *
+fmt_text(struct store_fmt *fmt, char *p, const struct store_flow_complete *flow)
+{
+	struct xaddr addr;
+	u_int32_t fields;
+
+	fields = ntohl(flow->hdr.fields) & fmt->mask;
+
+	FMT_LIT(p, "FLOW ");
 	if (SHASFIELD(TAG)) {
-		snprintf(tmp, sizeof(tmp), "tag %u ", fmt_ntoh32(flow->tag.tag));
-		strlcat(buf, tmp, len);
+		FMT_LIT(p, "tag ");
+		p = fmt_u32(p, ntohl(flow->tag.tag), 0);
+		*p++ = ' ';
 	}
 	if (SHASFIELD(RECV_TIME)) {
-		snprintf(tmp, sizeof(tmp), "recv_time %s.%05d ",
-		    iso_time(fmt_ntoh32(flow->recv_time.recv_sec), utc_flag),
-		    fmt_ntoh32(flow->recv_time.recv_usec));
-		strlcat(buf, tmp, len);
+		FMT_LIT(p, "recv_time ");
+		p = fmt_time(p, &fmt->times[0], ntohl(flow->recv_time.recv_sec),
+		    fmt->utc);
+		*p++ = '.';
+		p = fmt_u32(p, ntohl(flow->recv_time.recv_usec), 5);
+		*p++ = ' ';
 	}
 	if (SHASFIELD(PROTO_FLAGS_TOS)) {
-		snprintf(tmp, sizeof(tmp), "proto %d ", flow->pft.protocol);
-		strlcat(buf, tmp, len);
-		snprintf(tmp, sizeof(tmp), "tcpflags %02x ",
-		    flow->pft.tcp_flags);
-		strlcat(buf, tmp, len);
-		snprintf(tmp, sizeof(tmp), "tos %02x " , flow->pft.tos);
-		strlcat(buf, tmp, len);
-	}
-	if (SHASFIELD(AGENT_ADDR4) || SHASFIELD(AGENT_ADDR6)) {
-		snprintf(tmp, sizeof(tmp), "agent [%s] ",
-		    addr_ntop_buf(&flow->agent_addr));
-		strlcat(buf, tmp, len);
-	}
-	if (SHASFIELD(SRC_ADDR4) || SHASFIELD(SRC_ADDR6)) {
-		snprintf(tmp, sizeof(tmp), "src [%s]",
-		    addr_ntop_buf(&flow->src_addr));
-		strlcat(buf, tmp, len);
+		FMT_LIT(p, "proto ");
+		p = fmt_u32(p, flow->pft.protocol, 0);
+		FMT_LIT(p, " tcpflags ");
+		p = fmt_hex(p, flow->pft.tcp_flags, 2);
+		FMT_LIT(p, " tos ");
+		p = fmt_hex(p, flow->pft.tos, 2);
+		*p++ = ' ';
+	}
+	if (fields & STORE_FIELD_AGENT_ADDR) {
+		FMT_LIT(p, "agent [");
+		addr = flow->agent_addr;
+		p = fmt_addr(p, &addr);
+		FMT_LIT(p, "] ");
+	}
+	if (fields & STORE_FIELD_SRC_ADDR) {
+		FMT_LIT(p, "src [");
+		addr = flow->src_addr;
+		p = fmt_addr(p, &addr);
+		*p++ = ']';
 		if (SHASFIELD(SRCDST_PORT)) {
-			snprintf(tmp, sizeof(tmp), ":%d",
-			    fmt_ntoh16(flow->ports.src_port));
-			strlcat(buf, tmp, len);
+			*p++ = ':';
+			p = fmt_u32(p, ntohs(flow->ports.src_port), 0);
 		}
-		strlcat(buf, " ", len);
+		*p++ = ' ';
 	}
-	if (SHASFIELD(DST_ADDR4) || SHASFIELD(DST_ADDR6)) {
-		snprintf(tmp, sizeof(tmp), "dst [%s]",
-		    addr_ntop_buf(&flow->dst_addr));
-		strlcat(buf, tmp, len);
+	if (fields & STORE_FIELD_DST_ADDR) {
+		FMT_LIT(p, "dst [");
+		addr = flow->dst_addr;
+		p = fmt_addr(p, &addr);
+		*p++ = ']';
 		if (SHASFIELD(SRCDST_PORT)) {
-			snprintf(tmp, sizeof(tmp), ":%d",
-			    fmt_ntoh16(flow->ports.dst_port));
-			strlcat(buf, tmp, len);
+			*p++ = ':';
+			p = fmt_u32(p, ntohs(flow->ports.dst_port), 0);
 		}
-		strlcat(buf, " ", len);
+		*p++ = ' ';
 	}
-	if (SHASFIELD(GATEWAY_ADDR4) || SHASFIELD(GATEWAY_ADDR6)) {
-		snprintf(tmp, sizeof(tmp), "gateway [%s] ",
-		    addr_ntop_buf(&flow->gateway_addr));
-		strlcat(buf, tmp, len);
+	if (fields & STORE_FIELD_GATEWAY_ADDR) {
+		FMT_LIT(p, "gateway [");
+		addr = flow->gateway_addr;
+		p = fmt_addr(p, &addr);
+		FMT_LIT(p, "] ");
 	}
 	if (SHASFIELD(PACKETS)) {
-		snprintf(tmp, sizeof(tmp), "packets %llu ",
-		    fmt_ntoh64(flow->packets.flow_packets));
-		strlcat(buf, tmp, len);
+		FMT_LIT(p, "packets ");
+		p = fmt_u64(p, store_ntohll(flow->packets.flow_packets));
+		*p++ = ' ';
 	}
 	if (SHASFIELD(OCTETS)) {
-		snprintf(tmp, sizeof(tmp), "octets %llu ",
-		    fmt_ntoh64(flow->octets.flow_octets));
-		strlcat(buf, tmp, len);
+		FMT_LIT(p, "octets ");
+		p = fmt_u64(p, store_ntohll(flow->octets.flow_octets));
+		*p++ = ' ';
 	}
 	if (SHASFIELD(IF_INDICES)) {
-		snprintf(tmp, sizeof(tmp), "in_if %d out_if %d ",
-			fmt_ntoh32(flow->ifndx.if_index_in),
-			fmt_ntoh32(flow->ifndx.if_index_out));
-		strlcat(buf, tmp, len);
+		FMT_LIT(p, "in_if ");
+		p = fmt_i32(p, ntohl(flow->ifndx.if_index_in));
+		FMT_LIT(p, " out_if ");
+		p = fmt_i32(p, ntohl(flow->ifndx.if_index_out));
+		*p++ = ' ';
 	}
 	if (SHASFIELD(AGENT_INFO)) {
-		snprintf(tmp, sizeof(tmp), "sys_uptime_ms %s.%03u ",
-		    interval_time(fmt_ntoh32(flow->ainfo.sys_uptime_ms) / 1000),
-		    fmt_ntoh32(flow->ainfo.sys_uptime_ms) % 1000);
-		strlcat(buf, tmp, len);
-		snprintf(tmp, sizeof(tmp), "time_sec %s ",
-		    iso_time(fmt_ntoh32(flow->ainfo.time_sec), utc_flag));
-		strlcat(buf, tmp, len);
-		snprintf(tmp, sizeof(tmp), "time_nanosec %lu netflow ver %u ",
-		    (u_long)fmt_ntoh32(flow->ainfo.time_nanosec),
-		    fmt_ntoh16(flow->ainfo.netflow_version));
-		strlcat(buf, tmp, len);
+		FMT_LIT(p, "sys_uptime_ms ");
+		p = fmt_ms(p, ntohl(flow->ainfo.sys_uptime_ms));
+		FMT_LIT(p, " time_sec ");
+		p = fmt_time(p, &fmt->times[1], ntohl(flow->ainfo.time_sec),
+		    fmt->utc);
+		FMT_LIT(p, " time_nanosec ");
+		p = fmt_u32(p, ntohl(flow->ainfo.time_nanosec), 0);
+		FMT_LIT(p, " netflow ver ");
+		p = fmt_u32(p, ntohs(flow->ainfo.netflow_version), 0);
+		*p++ = ' ';
 	}
 	if (SHASFIELD(FLOW_TIMES)) {
-		snprintf(tmp, sizeof(tmp), "flow_start %s.%03u ",
-		    interval_time(fmt_ntoh32(flow->ftimes.flow_start) / 1000),
-		    fmt_ntoh32(flow->ftimes.flow_start) % 1000);
-		strlcat(buf, tmp, len);
-		snprintf(tmp, sizeof(tmp), "flow_finish %s.%03u ",
-		    interval_time(fmt_ntoh32(flow->ftimes.flow_finish) / 1000),
-		    fmt_ntoh32(flow->ftimes.flow_finish) % 1000);
-		strlcat(buf, tmp, len);
+		FMT_LIT(p, "flow_start ");
+		p = fmt_ms(p, ntohl(flow->ftimes.flow_start));
+		FMT_LIT(p, " flow_finish ");
+		p = fmt_ms(p, ntohl(flow->ftimes.flow_finish));
+		*p++ = ' ';
 	}
 	if (SHASFIELD(AS_INFO)) {
-		snprintf(tmp, sizeof(tmp), "src_AS %u src_masklen %u ",
-		    fmt_ntoh32(flow->asinf.src_as), flow->asinf.src_mask);
-		strlcat(buf, tmp, len);
-		snprintf(tmp, sizeof(tmp), "dst_AS %u dst_masklen %u ",
-		    fmt_ntoh32(flow->asinf.dst_as), flow->asinf.dst_mask);
-		strlcat(buf, tmp, len);
+		FMT_LIT(p, "src_AS ");
+		p = fmt_u32(p, ntohl(flow->asinf.src_as), 0);
+		FMT_LIT(p, " src_masklen ");
+		p = fmt_u32(p, flow->asinf.src_mask, 0);
+		FMT_LIT(p, " dst_AS ");
+		p = fmt_u32(p, ntohl(flow->asinf.dst_as), 0);
+		FMT_LIT(p, " dst_masklen ");
+		p = fmt_u32(p, flow->asinf.dst_mask, 0);
+		*p++ = ' ';
 	}
 	if (SHASFIELD(FLOW_ENGINE_INFO)) {
-		snprintf(tmp, sizeof(tmp),
-		    "engine_type %u engine_id %u seq %lu source %lu ",
-		    fmt_ntoh16(flow->finf.engine_type), 
-		    fmt_ntoh16(flow->finf.engine_id),
-		    (u_long)fmt_ntoh32(flow->finf.flow_sequence), 
-		    (u_long)fmt_ntoh32(flow->finf.source_id));
-		strlcat(buf, tmp, len);
+		FMT_LIT(p, "engine_type ");
+		p = fmt_u32(p, ntohs(flow->finf.engine_type), 0);
+		FMT_LIT(p, " engine_id ");
+		p = fmt_u32(p, ntohs(flow->finf.engine_id), 0);
+		FMT_LIT(p, " seq ");
+		p = fmt_u32(p, ntohl(flow->finf.flow_sequence), 0);
+		FMT_LIT(p, " source ");
+		p = fmt_u32(p, ntohl(flow->finf.source_id), 0);
+		*p++ = ' ';
 	}
 	if (SHASFIELD(CRC32)) {
-		snprintf(tmp, sizeof(tmp), "crc32 %08x ",
-		    fmt_ntoh32(flow->crc32.crc32));
-		strlcat(buf, tmp, len);
+		FMT_LIT(p, "crc32 ");
+		p = fmt_hex(p, ntohl(flow->crc32.crc32), 8);
+		*p++ = ' ';
 	}
+	return (p);
 }
 
-void
-store_format_flow_flowtools_csv(struct store_flow_complete *flow, char *buf,
-    size_t len, int utc_flag, u_int32_t display_mask, int hostorder)
+/*
+ * Append a flow, in network byte order, to buf as a line in the format
+ * (or as a v3 record, if raw). Returns the number of bytes written, or
+ * 0 if a raw flow couldn't be serialised. buf must have room for
+ * STORE_FMT_LINE_MAX bytes; it is not NUL terminated.
+ */
+size_t
+store_fmt_flow(struct store_fmt *fmt, struct store_flow_complete *flow,
+    char *buf)
 {
-	char tmp[256];
 	u_int32_t fields;
-	u_int64_t (*fmt_ntoh64)(u_int64_t) = store_swp_ntoh64;
-	u_int32_t (*fmt_ntoh32)(u_int32_t) = store_swp_ntoh32;
-	u_int16_t (*fmt_ntoh16)(u_int16_t) = store_swp_ntoh16;
-
-	if (hostorder) {
-		fmt_ntoh64 = store_swp_fake64;
-		fmt_ntoh32 = store_swp_fake32;
-		fmt_ntoh16 = store_swp_fake16;
+	char *p = buf;
+	u_int i, col;
+	int len;
+
+	switch (fmt->type) {
+	case STORE_FMT_RAW:
+		if (store_flow_serialise_masked(flow, fmt->mask, (u_int8_t *)buf,
+		    STORE_FMT_LINE_MAX, &len, NULL, 0) != STORE_ERR_OK)
+			return (0);
+		return (len);
+	case STORE_FMT_TEXT:
+		p = fmt_text(fmt, p, flow);
+		break;
+	case STORE_FMT_CSV:
+	case STORE_FMT_FLOWTOOLS:
+		fields = ntohl(flow->hdr.fields) & fmt->mask;
+		if (fmt->type == STORE_FMT_FLOWTOOLS)
+			fields = STORE_FIELD_ALL;
+		for (i = 0; i < fmt->ncols; i++) {
+			if (i > 0)
+				*p++ = ',';
+			col = fmt->cols[i];
+			if (fields & store_fmt_columns[col].field)
+				p = fmt_column(fmt, p, flow, col, 0);
+		}
+		break;
+	case STORE_FMT_JSON:
+		fields = ntohl(flow->hdr.fields) & fmt->mask;
+		*p++ = '{';
+		for (i = 0; i < fmt->ncols; i++) {
+			col = fmt->cols[i];
+			if ((fields & store_fmt_columns[col].field) == 0)
+				continue;
+			if (p != buf + 1)
+				*p++ = ',';
+			*p++ = '"';
+			len = strlen(store_fmt_columns[col].name);
+			memcpy(p, store_fmt_columns[col].name, len);
+			p += len;
+			*p++ = '"';
+			*p++ = ':';
+			p = fmt_column(fmt, p, flow, col, 1);
+		}
+		*p++ = '}';
+		break;
 	}
+	*p++ = '\n';
+	return (p - buf);
+}
 
-	*buf = '\0';
+/* Convert a flow to network byte order, if it isn't already */
+static void
+store_fmt_netorder(struct store_flow_complete *flow,
+    struct store_flow_complete *tmp, int hostorder)
+{
+	memcpy(tmp, flow, sizeof(*tmp));
+	if (hostorder)
+		store_swab_flow(tmp, 1);
+}
 
-	fields = fmt_ntoh32(flow->hdr.fields) & display_mask;
-
-	snprintf(tmp, sizeof(tmp), "%u,%u,%u,%s,%llu,%llu,%u,%u,%u,%u,",
-		fmt_ntoh32(flow->ainfo.time_sec),	// unix_secs
-		fmt_ntoh32(flow->ainfo.time_nanosec),	// unix_nsecs
-		fmt_ntoh32(flow->ainfo.sys_uptime_ms),	// sysuptime
-		addr_ntop_buf(&flow->agent_addr),	// exaddr
-		fmt_ntoh64(flow->packets.flow_packets),	// dpkts
-		fmt_ntoh64(flow->octets.flow_octets),	// doctets
-		fmt_ntoh32(flow->ftimes.flow_start),	// first
-		fmt_ntoh32(flow->ftimes.flow_finish),	// last
-		fmt_ntoh16(flow->finf.engine_type),	// engine_type
-		fmt_ntoh16(flow->finf.engine_id)	// engine_id
-	);
-	strlcat(buf, tmp, len);
-
-	// srcaddr
-	snprintf(tmp, sizeof(tmp), "%s,", addr_ntop_buf(&flow->src_addr));
-	strlcat(buf, tmp, len);
-
-	// dstaddr
-	snprintf(tmp, sizeof(tmp), "%s,", addr_ntop_buf(&flow->dst_addr));
-	strlcat(buf, tmp, len);
-
-	// nexthop
-	snprintf(tmp, sizeof(tmp), "%s,", addr_ntop_buf(&flow->gateway_addr));
-	strlcat(buf, tmp, len);
-
-	// input
-	snprintf(tmp, sizeof(tmp), "%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u",
-		fmt_ntoh32(flow->ifndx.if_index_in),	// input
-		fmt_ntoh32(flow->ifndx.if_index_out),	// output
-		fmt_ntoh16(flow->ports.src_port),	// srcport
-		fmt_ntoh16(flow->ports.dst_port),	// dstport
-		flow->pft.protocol,			// prot
-		flow->pft.tos,				// tos
-		flow->pft.tcp_flags,			// tcp_flags
-		flow->asinf.src_mask,			// src_mask
-		flow->asinf.dst_mask,			// dst_mask
-		fmt_ntoh32(flow->asinf.src_as),		// src_as
-		fmt_ntoh32(flow->asinf.dst_as)		// dst_as
-	);
-	strlcat(buf, tmp, len);
+void
+store_format_flow(struct store_flow_complete *flow, char *buf, size_t len,
+    int utc_flag, u_int32_t display_mask, int hostorder)
+{
+	struct store_flow_complete tmp;
+	struct store_fmt fmt;
+	char line[STORE_FMT_LINE_MAX];
+	size_t n;
+
+	store_fmt_netorder(flow, &tmp, hostorder);
+	store_fmt_init(&fmt, STORE_FMT_TEXT, NULL, utc_flag, display_mask,
+	    NULL, 0);
+	n = store_fmt_flow(&fmt, &tmp, line);
+	line[n - 1] = '\0';
+	strlcpy(buf, line, len);
+}
+
+void
+store_format_flow_flowtools_csv(struct store_flow_complete *flow, char *buf,
+    size_t len, int utc_flag, u_int32_t display_mask, int hostorder)
+{
+	struct store_flow_complete tmp;
+	struct store_fmt fmt;
+	char line[STORE_FMT_LINE_MAX];
+	size_t n;
+
+	store_fmt_netorder(flow, &tmp, hostorder);
+	store_fmt_init(&fmt, STORE_FMT_FLOWTOOLS, NULL, utc_flag, display_mask,
+	    NULL, 0);
+	n = store_fmt_flow(&fmt, &tmp, line);
+	line[n - 1] = '\0';
+	strlcpy(buf, line, len);
 }
 
 void
@@ -243,6 +243,172 @@ struct store_flow_complete {
 	struct store_flow_CRC32			crc32;
 } __packed;
 
+/*
+ * Sparse index, kept alongside a log as "<log>" STORE_INDEX_SUFFIX.
+ * Following the header, each entry covers a run of the log's flows and
+ * records the range of their receive times (or write times, if not
+ * stored). Entries are in log order; an entry for a stretch of the log
+ * that was written unindexed has first_sec 0 and last_sec 0xffffffff.
+ * All fields are in network byte order.
+ */
+#define STORE_INDEX_SUFFIX			".idx"
+#define STORE_INDEX_MAGIC			0x464c4958 /* "FLIX" */
+#define STORE_INDEX_VERSION			1
+
+struct store_index_header {
+	u_int32_t		magic;
+	u_int32_t		version;
+} __packed;
+
+struct store_index_entry {
+	u_int64_t		offset;		/* of the first flow */
+	u_int64_t		len;		/* bytes of flows covered */
+	u_int32_t		flows;
+	u_int32_t		first_sec;
+	u_int32_t		last_sec;
+	u_int32_t		reserved;
+} __packed;
+
+/*
+ * Columnar block format (store v4). A log may hold v3 flow records and v4
+ * blocks in any mix; each begins with its version byte. A block holds
+ * up to STORE_BLOCK_MAX_FLOWS flows, stored as a column per flow field.
+ * The header is followed by a directory of the columns present and then
+ * by their data, in directory order. The first column is always
+ * STORE_COL_FIELDS, giving each flow's field bitmap; every other column
+ * has one value for each flow with its field, in flow order. Values,
+ * minima and maxima are stored as in the v3 record, so in network byte
+ * order and comparable with memcmp(). A per-flow CRC32 field is kept in
+ * the bitmap but the checksum itself, covering the block after its
+ * header, is in the header. All header fields are in network byte order.
+ */
+#define STORE_BLOCK_VER_MAJOR			4
+#define STORE_BLOCK_VER_MINOR			0
+#define STORE_BLOCK_VERSION \
+	STORE_MKVER(STORE_BLOCK_VER_MAJOR, STORE_BLOCK_VER_MINOR)
+#define STORE_BLOCK_FLOWS			4096	/* default */
+#define STORE_BLOCK_MAX_FLOWS			65536
+#define STORE_BLOCK_MAX_LEN			(16 * 1024 * 1024)
+
+struct store_block_header {
+	u_int8_t		version;
+	u_int8_t		reserved;
+	u_int16_t		num_columns;
+	u_int32_t		len;		/* of the block after this */
+	u_int32_t		flows;
+	u_int32_t		fields;		/* of any of its flows */
+	u_int32_t		first_sec;	/* range of receive times */
+	u_int32_t		last_sec;
+	u_int32_t		crc32;
+} __packed;
+
+struct store_block_column {
+	u_int16_t		id;
+	u_int16_t		width;		/* bytes per value */
+	u_int32_t		count;		/* values stored */
+	u_int8_t		min[16];	/* zero padded */
+	u_int8_t		max[16];
+} __packed;
+
+/* Column ids */
+#define STORE_COL_FIELDS			0
+#define STORE_COL_TAG				1
+#define STORE_COL_RECV_SEC			2
+#define STORE_COL_RECV_USEC			3
+#define STORE_COL_TCP_FLAGS			4
+#define STORE_COL_PROTOCOL			5
+#define STORE_COL_TOS				6
+#define STORE_COL_AGENT_ADDR4			7
+#define STORE_COL_AGENT_ADDR6			8
+#define STORE_COL_SRC_ADDR4			9
+#define STORE_COL_SRC_ADDR6			10
+#define STORE_COL_DST_ADDR4			11
+#define STORE_COL_DST_ADDR6			12
+#define STORE_COL_GATEWAY_ADDR4			13
+#define STORE_COL_GATEWAY_ADDR6			14
+#define STORE_COL_SRC_PORT			15
+#define STORE_COL_DST_PORT			16
+#define STORE_COL_PACKETS			17
+#define STORE_COL_OCTETS			18
+#define STORE_COL_IF_INDEX_IN			19
+#define STORE_COL_IF_INDEX_OUT			20
+#define STORE_COL_SYS_UPTIME_MS			21
+#define STORE_COL_TIME_SEC			22
+#define STORE_COL_TIME_NANOSEC			23
+#define STORE_COL_NETFLOW_VERSION		24
+#define STORE_COL_FLOW_START			25
+#define STORE_COL_FLOW_FINISH			26
+#define STORE_COL_SRC_AS			27
+#define STORE_COL_DST_AS			28
+#define STORE_COL_SRC_MASK			29
+#define STORE_COL_DST_MASK			30
+#define STORE_COL_ENGINE_TYPE			31
+#define STORE_COL_ENGINE_ID			32
+#define STORE_COL_FLOW_SEQUENCE			33
+#define STORE_COL_SOURCE_ID			34
+#define STORE_NUM_COLUMNS			35
+
+/* A block being built */
+struct store_block {
+	u_int32_t		flows;
+	u_int32_t		max_flows;
+	u_int32_t		fields;
+	u_int8_t		*col[STORE_NUM_COLUMNS];
+	u_int32_t		count[STORE_NUM_COLUMNS];
+	u_int8_t		min[STORE_NUM_COLUMNS][16];
+	u_int8_t		max[STORE_NUM_COLUMNS][16];
+	u_int8_t		*out;		/* serialised block */
+	size_t			out_len;
+};
+
+/*
+ * Compressed frame (store v5). A frame is a run of v3 records and v4
+ * blocks, compressed as a unit, and may appear anywhere in a log that
+ * either of those may. Frames are written whole, so a log can be split
+ * at any frame boundary (e.g. at an index entry) and read from there.
+ * The header gives the number of flows in the frame and the range of
+ * receive times of those that have one, so a reader can pass over it
+ * without decompressing it. The CRC32 covers the compressed data. All
+ * header fields are in network byte order.
+ */
+#define STORE_FRAME_VER_MAJOR			5
+#define STORE_FRAME_VER_MINOR			0
+#define STORE_FRAME_VERSION \
+	STORE_MKVER(STORE_FRAME_VER_MAJOR, STORE_FRAME_VER_MINOR)
+#define STORE_FRAME_SIZE			(1024 * 1024) /* default */
+#define STORE_FRAME_MAX_LEN			(16 * 1024 * 1024)
+
+#define STORE_FRAME_ZLIB			1	/* methods */
+
+#define STORE_FRAME_F_TIMED			1	/* flags */
+
+struct store_frame_header {
+	u_int8_t		version;
+	u_int8_t		method;
+	u_int8_t		flags;
+	u_int8_t		reserved;
+	u_int32_t		len;		/* of the frame after this */
+	u_int32_t		raw_len;	/* when decompressed */
+	u_int32_t		flows;
+	u_int32_t		first_sec;	/* if STORE_FRAME_F_TIMED */
+	u_int32_t		last_sec;
+	u_int32_t		crc32;
+} __packed;
+
+/* A frame being built */
+struct store_frame {
+	int			level;		/* of compression */
+	u_int8_t		*raw;		/* uncompressed contents */
+	size_t			raw_len;
+	size_t			raw_alloc;
+	u_int32_t		flows;
+	u_int32_t		first_sec;
+	u_int32_t		last_sec;
+	int			timed;
+	u_int8_t		*out;		/* serialised frame */
+	size_t			out_len;
+};
+
 /* Error codes for store log functions */
 #define STORE_ERR_OK				0x00
 #define STORE_ERR_EOF				0x01
@@ -258,10 +424,75 @@ struct store_flow_complete {
 
 /* file descriptor oriented interface (tries to back out on failure */
 int store_put_buf(int fd, char *buf, int len, char *ebuf, int elen);
+int store_put_buf_at(int fd, char *buf, int len, off_t *offset, char *ebuf,
+    int elen);
 int store_get_flow(int fd, struct store_flow_complete *f, char *ebuf, int elen);
 int store_put_flow(int fd, struct store_flow_complete *flow,
     u_int32_t fieldmask, char *ebuf, int elen);
 
+/*
+ * Sequential log reader. A regular file is mapped, anything else is read
+ * in large chunks, so reading a flow seldom costs a system call.
+ */
+#define STORE_ITER_CHUNK			(256 * 1024)
+
+struct store_iter {
+	int			fd;
+	u_int8_t		*map;		/* whole file, or NULL */
+	size_t			map_len;
+	u_int8_t		*buf;		/* otherwise, chunk buffer */
+	size_t			buf_len;
+	u_int8_t		*data;		/* unread data in either */
+	size_t			avail;
+	off_t			offset;		/* of data in the file */
+	off_t			end;		/* stop reading here, or -1 */
+	/* v4 blocks are decoded whole and their flows handed out in turn */
+	struct store_flow_complete *blk_flows;
+	u_int32_t		blk_alloc;
+	u_int32_t		blk_num;
+	u_int32_t		blk_next;
+	u_int8_t		blk_rec[512];	/* a flow as a v3 record */
+	u_int32_t		want;		/* fields to decode */
+	int			timed;		/* skip blocks out of range */
+	u_int32_t		from_sec;
+	u_int32_t		to_sec;
+	u_int64_t		blocks;		/* blocks decoded */
+	u_int64_t		blocks_skipped;
+	/* Blocks for which this returns 0 are skipped too */
+	int			(*blk_filter)(void *,
+				    const struct store_block_header *,
+				    const struct store_block_column *, u_int);
+	void			*blk_filter_arg;
+	/* v5 frames are decompressed whole and their contents read in turn */
+	u_int8_t		*frm_buf;
+	size_t			frm_alloc;
+	u_int8_t		*frm_data;	/* unread contents */
+	size_t			frm_avail;
+	u_int64_t		frames;		/* frames decompressed */
+	u_int64_t		frames_skipped;
+};
+
+int store_iter_open(struct store_iter *it, int fd, char *ebuf, int elen);
+int store_iter_seek(struct store_iter *it, off_t start, off_t end,
+    char *ebuf, int elen);
+int store_iter_next_raw(struct store_iter *it, u_int8_t **rec, int *len,
+    char *ebuf, int elen);
+int store_iter_next(struct store_iter *it, struct store_flow_complete *f,
+    char *ebuf, int elen);
+void store_iter_want(struct store_iter *it, u_int32_t fields, int timed,
+    u_int32_t from_sec, u_int32_t to_sec);
+void store_iter_filter(struct store_iter *it,
+    int (*fn)(void *, const struct store_block_header *,
+    const struct store_block_column *, u_int), void *arg);
+void store_iter_close(struct store_iter *it);
+int store_raw_recv_time(const u_int8_t *rec, u_int32_t *recv_sec);
+
+/* Sparse index lookup */
+int store_index_find(int idx_fd, off_t log_size, u_int32_t from_sec,
+    u_int32_t to_sec, off_t *start, off_t *end, char *ebuf, int elen);
+int store_index_marks(int idx_fd, off_t log_size, off_t **marks, int *nmarks,
+    char *ebuf, int elen);
+
 /* Simple FILE* oriented interface, doesn't backout on failure */
 int store_read_flow(FILE *f, struct store_flow_complete *flow, char *ebuf,
     int elen);
@@ -277,6 +508,28 @@ int store_flow_serialise_masked(struct store_flow_complete *f, u_int32_t mask,
     u_int8_t *buf, int buflen, int *flowlen, char *ebuf, int elen);
 int store_calc_flow_len(struct store_flow *hdr);
 
+/* Columnar blocks */
+int store_block_init(struct store_block *b, u_int32_t max_flows,
+    char *ebuf, int elen);
+int store_block_add(struct store_block *b, struct store_flow_complete *f,
+    char *ebuf, int elen);
+int store_block_serialise(struct store_block *b, u_int8_t **buf, int *len,
+    char *ebuf, int elen);
+void store_block_free(struct store_block *b);
+int store_block_deserialise(u_int8_t *buf, int len, u_int32_t want,
+    struct store_flow_complete *flows, u_int32_t max_flows,
+    u_int32_t *nflows, char *ebuf, int elen);
+
+/* Compressed frames */
+int store_frame_init(struct store_frame *fr, int level, char *ebuf, int elen);
+int store_frame_add(struct store_frame *fr, const u_int8_t *buf, int len,
+    char *ebuf, int elen);
+int store_frame_serialise(struct store_frame *fr, u_int8_t **buf, int *len,
+    char *ebuf, int elen);
+void store_frame_free(struct store_frame *fr);
+int store_frame_decompress(const u_int8_t *buf, int len, u_int8_t *out,
+    size_t out_len, char *ebuf, int elen);
+
 /* Formatting and conversion */
 void store_format_flow(struct store_flow_complete *flow, char *buf,
     size_t len, int utc_flag, u_int32_t display_mask, int hostorder);
@@ -285,9 +538,49 @@ void store_format_flow_flowtools_csv(struct store_flow_complete *flow,
     int hostorder);
 void store_swab_flow(struct store_flow_complete *flow, int to_net);
 
+/*
+ * Output formatting for bulk conversion. A line is appended directly to
+ * caller's buffer, which must have STORE_FMT_LINE_MAX bytes free; the
+ * text for receive and agent times is kept from one flow to the next, so
+ * each second is only converted once. Columns, for CSV and JSON lines,
+ * are chosen by name.
+ */
+#define STORE_FMT_TEXT				0	/* store_format_flow */
+#define STORE_FMT_CSV				1
+#define STORE_FMT_JSON				2
+#define STORE_FMT_FLOWTOOLS			3	/* flow-import CSV */
+#define STORE_FMT_RAW				4	/* v3 records */
+
+#define STORE_FMT_MAX_COLS			64
+#define STORE_FMT_LINE_MAX			8192
+
+struct store_fmt_time {
+	u_int32_t		sec;
+	int			valid;
+	char			str[24];	/* YYYY-MM-DDTHH:MM:SS */
+};
+
+struct store_fmt {
+	int			type;
+	int			utc;
+	u_int32_t		mask;		/* fields shown, or stored */
+	u_int			ncols;
+	u_int8_t		cols[STORE_FMT_MAX_COLS];
+	struct store_fmt_time	times[2];	/* recv_time, time_sec */
+};
+
+int store_fmt_init(struct store_fmt *fmt, int type, const char *columns,
+    int utc_flag, u_int32_t mask, char *ebuf, int elen);
+u_int32_t store_fmt_fields(const struct store_fmt *fmt);
+size_t store_fmt_header(const struct store_fmt *fmt, char *buf, size_t len);
+size_t store_fmt_flow(struct store_fmt *fmt, struct store_flow_complete *flow,
+    char *buf);
+
 /* Utility functions */
 const char *iso_time(time_t t, int utc_flag);
 const char *interval_time(time_t t);
+const char *iso_time_r(time_t t, int utc_flag, char *buf, size_t len);
+const char *interval_time_r(time_t t, char *buf, size_t len);
 u_int64_t store_ntohll(u_int64_t v);
 u_int64_t store_htonll(u_int64_t v);
 
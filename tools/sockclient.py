@@ -72,9 +72,10 @@ def main():
 	s.bind(args[0])
 	try:
 		while 1:
-			flowrec = s.recv(1024)
-			flow = flowd.Flow(blob = flowrec)
-			print flow.format(mask = mask, utc = utc)
+			# Datagrams may carry several flows ("logsock batch")
+			flowrecs = s.recv(65536)
+			for flow in flowd.Flows(blob = flowrecs):
+				print flow.format(mask = mask, utc = utc)
 	except:
 		os.unlink(args[0])
 		raise
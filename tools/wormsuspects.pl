@@ -30,7 +30,6 @@ use warnings;
 use Flowd;
 
 my $TOP = 10;
-my $DOT_PER = 1000;
 
 $| = 1;
 
@@ -48,26 +47,23 @@ my $i = 0;
 foreach my $ffile (@ARGV) {
 	my $log = Flowd->new($ffile);
 	
-	printf STDERR "LOGFILE %s started at %s\n",
-	    $ffile, Flowd::iso_time($log->{start_time}, 0);
-	
-	while (my $flow = $log->read_flow()) {
-		my $src = $flow->{src_addr};
-		my $proto = $flow->{protocol};
-		my $port = $flow->{dst_port};
+	printf STDERR "LOGFILE %s\n", $ffile;
+
+	# Count the flows for each tuple in the C library
+	my $groups = $log->sum_by([ "src_addr", "protocol", "dst_port" ]);
+	foreach my $group (keys %$groups) {
+		my ($src, $proto, $port) = split(/\|/, $group);
+		my $n = $groups->{$group}->[0];
 		my $src_id;
 
-		die "Need source address" unless defined $src;
+		die "Need source address" if $src eq "";
 		$src_id = "$src";
-		$src_id .= "|X:$proto" if defined $proto && $proto != 0;		
-		$src_id .= "|Y:$port" if defined $port && $port != 0;
+		$src_id .= "|X:$proto" if $proto != 0;
+		$src_id .= "|Y:$port" if $port != 0;
 		$top{$src_id} = 0 if not defined $top{$src_id};
-		$top{$src_id}++;
-		$i++;
-		print STDERR "." if $i and ($i % $DOT_PER) == 0;
-		print STDERR "\n" if $i and ($i % ($DOT_PER * 50)) == 0;
+		$top{$src_id} += $n;
+		$i += $n;
 	}
-	print STDERR "\n";
 	$log->finish();
 }
 